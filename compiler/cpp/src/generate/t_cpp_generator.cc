@@ -168,11 +168,13 @@ class t_cpp_generator : public t_oop_generator {
   std::string function_signature(t_function* tfunction, std::string prefix="", bool name_params=true);
   std::string argument_list(t_struct* tstruct, bool name_params=true);
   std::string type_to_enum(t_type* ttype);
+  std::string array_type_name(t_type* ttype);
   std::string local_reflection_name(const char*, t_type* ttype, bool external=false);
 
   // These handles checking gen_dense_ and checking for duplicates.
-  void generate_local_reflection(std::ofstream& out, t_type* ttype, bool is_definition);
+  void generate_local_reflection(std::ofstream& out, t_type* ttype, bool is_definition, bool is_static=false);
   void generate_local_reflection_pointer(std::ofstream& out, t_type* ttype);
+  void generate_service_helper_reflection(t_struct* tstruct);
 
   bool is_complex_type(t_type* ttype) {
     ttype = get_true_type(ttype);
@@ -835,7 +837,8 @@ void t_cpp_generator::generate_struct_fingerprint(ofstream& out,
  */
 void t_cpp_generator::generate_local_reflection(std::ofstream& out,
                                                 t_type* ttype,
-                                                bool is_definition) {
+                                                bool is_definition,
+                                                bool is_static) {
   if (!gen_dense_) {
     return;
   }
@@ -850,15 +853,16 @@ void t_cpp_generator::generate_local_reflection(std::ofstream& out,
   if (ttype->get_program() != NULL && ttype->get_program() != program_) {
     return;
   }
+  string stat = is_static ? "static " : "";
 
   // Do dependencies.
   if (ttype->is_list()) {
-    generate_local_reflection(out, ((t_list*)ttype)->get_elem_type(), is_definition);
+    generate_local_reflection(out, ((t_list*)ttype)->get_elem_type(), is_definition, is_static);
   } else if (ttype->is_set()) {
-    generate_local_reflection(out, ((t_set*)ttype)->get_elem_type(), is_definition);
+    generate_local_reflection(out, ((t_set*)ttype)->get_elem_type(), is_definition, is_static);
   } else if (ttype->is_map()) {
-    generate_local_reflection(out, ((t_map*)ttype)->get_key_type(), is_definition);
-    generate_local_reflection(out, ((t_map*)ttype)->get_val_type(), is_definition);
+    generate_local_reflection(out, ((t_map*)ttype)->get_key_type(), is_definition, is_static);
+    generate_local_reflection(out, ((t_map*)ttype)->get_val_type(), is_definition, is_static);
   } else if (ttype->is_struct() || ttype->is_xception()) {
     // Hacky hacky.  For efficiency and convenience, we need a dummy "T_STOP"
     // type at the end of our typespec array.  Unfortunately, there is no
@@ -868,14 +872,14 @@ void t_cpp_generator::generate_local_reflection(std::ofstream& out,
     const vector<t_field*>& members = ((t_struct*)ttype)->get_members();
     vector<t_field*>::const_iterator m_iter;
     for (m_iter = members.begin(); m_iter != members.end(); ++m_iter) {
-      generate_local_reflection(out, (**m_iter).get_type(), is_definition);
+      generate_local_reflection(out, (**m_iter).get_type(), is_definition, is_static);
     }
-    generate_local_reflection(out, g_type_void, is_definition);
+    generate_local_reflection(out, g_type_void, is_definition, is_static);
 
     // For definitions of structures, do the arrays of metas and field specs also.
     if (is_definition) {
       out <<
-        indent() << "facebook::thrift::reflection::local::FieldMeta" << endl <<
+        indent() << stat << "facebook::thrift::reflection::local::FieldMeta" << endl <<
         indent() << local_reflection_name("metas", ttype) <<"[] = {" << endl;
       indent_up();
       for (m_iter = members.begin(); m_iter != members.end(); ++m_iter) {
@@ -888,7 +892,7 @@ void t_cpp_generator::generate_local_reflection(std::ofstream& out,
       indent_down();
 
       out <<
-        indent() << "facebook::thrift::reflection::local::TypeSpec*" << endl <<
+        indent() << stat << "facebook::thrift::reflection::local::TypeSpec*" << endl <<
         indent() << local_reflection_name("specs", ttype) <<"[] = {" << endl;
       indent_up();
       for (m_iter = members.begin(); m_iter != members.end(); ++m_iter) {
@@ -904,7 +908,7 @@ void t_cpp_generator::generate_local_reflection(std::ofstream& out,
 
   out <<
     indent() << "// " << ttype->get_fingerprint_material() << endl <<
-    indent() << (is_definition ? "" : "extern ") <<
+    indent() << (is_definition ? stat : "extern ") <<
       "facebook::thrift::reflection::local::TypeSpec" << endl <<
       local_reflection_name("typespec", ttype) <<
       (is_definition ? "(" : ";") << endl;
@@ -962,6 +966,20 @@ void t_cpp_generator::generate_local_reflection_pointer(std::ofstream& out,
     endl << endl;
 }
 
+/**
+ * Writes the fingerprint, local reflection and reflection pointer of one of
+ * a service's argument or result structures into the service's
+ * implementation file.
+ */
+void t_cpp_generator::generate_service_helper_reflection(t_struct* tstruct) {
+  if (!gen_dense_) {
+    return;
+  }
+  generate_struct_fingerprint(f_service_, tstruct, true);
+  generate_local_reflection(f_service_, tstruct, true, true);
+  generate_local_reflection_pointer(f_service_, tstruct);
+}
+
 /**
  * Makes a helper function to gen a struct reader.
  *
@@ -1278,7 +1296,17 @@ void t_cpp_generator::generate_service(t_service* tservice) {
   f_service_ <<
     "#include \"" << get_include_prefix(*get_program()) << svcname << ".h\"" <<
     endl <<
-    endl <<
+    endl;
+
+  // The argument and result structures get local reflection too, so that
+  // TDenseProtocol can be used for RPC.
+  if (gen_dense_) {
+    f_service_ <<
+      "#include <TReflectionLocal.h>" << endl <<
+      endl;
+  }
+
+  f_service_ <<
     ns_open_ << endl <<
     endl;
 
@@ -1313,24 +1341,38 @@ void t_cpp_generator::generate_service(t_service* tservice) {
  * @param tservice The service to generate a header definition for
  */
 void t_cpp_generator::generate_service_helpers(t_service* tservice) {
+  // Local reflection that only the helpers need is defined static in this
+  // service's file, so every service starts out knowing only what the
+  // types file defines.
+  std::set<std::string> types_reflected = reflected_fingerprints_;
+
   vector<t_function*> functions = tservice->get_functions();
   vector<t_function*>::iterator f_iter;
   for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
     t_struct* ts = (*f_iter)->get_arglist();
     string name_orig = ts->get_name();
 
+    // The compiler only fingerprints named types up front
+    if (gen_dense_) {
+      ts->generate_fingerprint();
+    }
+
     ts->set_name(tservice->get_name() + "_" + (*f_iter)->get_name() + "_args");
     generate_struct_definition(f_header_, ts, false);
+    generate_service_helper_reflection(ts);
     generate_struct_reader(f_service_, ts);
     generate_struct_writer(f_service_, ts);
     ts->set_name(tservice->get_name() + "_" + (*f_iter)->get_name() + "_pargs");
     generate_struct_definition(f_header_, ts, false, true, false, true);
+    generate_service_helper_reflection(ts);
     generate_struct_writer(f_service_, ts, true);
     ts->set_name(name_orig);
 
     generate_function_helpers(tservice, *f_iter);
   }
 
+  reflected_fingerprints_ = types_reflected;
+
   if (gen_reflection_limited_) {
     generate_service_limited_reflector(tservice);
   }
@@ -1715,6 +1757,11 @@ void t_cpp_generator::generate_service_client(t_service* tservice) {
         indent() << "args." << (*fld_iter)->get_name() << " = &" << (*fld_iter)->get_name() << ";" << endl;
     }
 
+    if (gen_dense_) {
+      f_service_ <<
+        indent() << "oprot_->setTypeSpec(" << argsname << "::local_reflection);" << endl;
+    }
+
     f_service_ <<
       indent() << "args.write(oprot_);" << endl <<
       endl <<
@@ -1778,6 +1825,11 @@ void t_cpp_generator::generate_service_client(t_service* tservice) {
           indent() << "result.success = &_return;" << endl;
       }
 
+      if (gen_dense_) {
+        f_service_ <<
+          indent() << "iprot_->setTypeSpec(" << resultname << "::local_reflection);" << endl;
+      }
+
       f_service_ <<
         indent() << "result.read(iprot_);" << endl <<
         indent() << "iprot_->readMessageEnd();" << endl <<
@@ -2009,12 +2061,18 @@ void t_cpp_generator::generate_function_helpers(t_service* tservice,
     result.append(*f_iter);
   }
 
+  if (gen_dense_) {
+    result.generate_fingerprint();
+  }
+
   generate_struct_definition(f_header_, &result, false);
+  generate_service_helper_reflection(&result);
   generate_struct_reader(f_service_, &result);
   generate_struct_result_writer(f_service_, &result);
 
   result.set_name(tservice->get_name() + "_" + tfunction->get_name() + "_presult");
   generate_struct_definition(f_header_, &result, false, true, true, false);
+  generate_service_helper_reflection(&result);
   generate_struct_reader(f_service_, &result, true);
 
 }
@@ -2037,7 +2095,12 @@ void t_cpp_generator::generate_process_function(t_service* tservice,
   string resultname = tservice->get_name() + "_" + tfunction->get_name() + "_result";
 
   f_service_ <<
-    indent() << argsname << " args;" << endl <<
+    indent() << argsname << " args;" << endl;
+  if (gen_dense_) {
+    f_service_ <<
+      indent() << "iprot->setTypeSpec(" << argsname << "::local_reflection);" << endl;
+  }
+  f_service_ <<
     indent() << "args.read(iprot);" << endl <<
     indent() << "iprot->readMessageEnd();" << endl <<
     indent() << "iprot->getTransport()->readEnd();" << endl <<
@@ -2140,7 +2203,12 @@ void t_cpp_generator::generate_process_function(t_service* tservice,
   // Serialize the result into a struct
   f_service_ <<
     endl <<
-    indent() << "oprot->writeMessageBegin(\"" << tfunction->get_name() << "\", facebook::thrift::protocol::T_REPLY, seqid);" << endl <<
+    indent() << "oprot->writeMessageBegin(\"" << tfunction->get_name() << "\", facebook::thrift::protocol::T_REPLY, seqid);" << endl;
+  if (gen_dense_) {
+    f_service_ <<
+      indent() << "oprot->setTypeSpec(" << resultname << "::local_reflection);" << endl;
+  }
+  f_service_ <<
     indent() << "result.write(oprot);" << endl <<
     indent() << "oprot->writeMessageEnd();" << endl <<
     indent() << "oprot->getTransport()->flush();" << endl <<
@@ -2523,11 +2591,24 @@ void t_cpp_generator::generate_deserialize_container(ofstream& out,
   }
 
 
-  // For loop iterates over elements
-  string i = tmp("_i");
-  out <<
-    indent() << "uint32_t " << i << ";" << endl <<
-    indent() << "for (" << i << " = 0; " << i << " < " << size << "; ++" << i << ")" << endl;
+  // Vectors of fixed width types are read in one go
+  string array_type = "";
+  if (ttype->is_list() && !use_push) {
+    array_type = array_type_name(((t_list*)ttype)->get_elem_type());
+  }
+
+  if (array_type != "") {
+    out <<
+      indent() << "if (" << size << " > 0) {" << endl <<
+      indent() << "  xfer += iprot->read" << array_type << "Array(&" <<
+                   prefix << "[0], " << size << ");" << endl <<
+      indent() << "}" << endl;
+  } else {
+    // For loop iterates over elements
+    string i = tmp("_i");
+    out <<
+      indent() << "uint32_t " << i << ";" << endl <<
+      indent() << "for (" << i << " = 0; " << i << " < " << size << "; ++" << i << ")" << endl;
 
     scope_up(out);
 
@@ -2540,6 +2621,7 @@ void t_cpp_generator::generate_deserialize_container(ofstream& out,
     }
 
     scope_down(out);
+  }
 
   // Read container end
   if (ttype->is_map()) {
@@ -2724,19 +2806,33 @@ void t_cpp_generator::generate_serialize_container(ofstream& out,
       prefix << ".size());" << endl;
   }
 
-  string iter = tmp("_iter");
-  out <<
-    indent() << type_name(ttype) << "::const_iterator " << iter << ";" << endl <<
-    indent() << "for (" << iter << " = " << prefix  << ".begin(); " << iter << " != " << prefix << ".end(); ++" << iter << ")" << endl;
-  scope_up(out);
-    if (ttype->is_map()) {
-      generate_serialize_map_element(out, (t_map*)ttype, iter);
-    } else if (ttype->is_set()) {
-      generate_serialize_set_element(out, (t_set*)ttype, iter);
-    } else if (ttype->is_list()) {
-      generate_serialize_list_element(out, (t_list*)ttype, iter);
-    }
-  scope_down(out);
+  // Vectors of fixed width types are written in one go
+  string array_type = "";
+  if (ttype->is_list() && !((t_container*)ttype)->has_cpp_name()) {
+    array_type = array_type_name(((t_list*)ttype)->get_elem_type());
+  }
+
+  if (array_type != "") {
+    out <<
+      indent() << "if (!" << prefix << ".empty()) {" << endl <<
+      indent() << "  xfer += oprot->write" << array_type << "Array(&" <<
+                   prefix << "[0], " << prefix << ".size());" << endl <<
+      indent() << "}" << endl;
+  } else {
+    string iter = tmp("_iter");
+    out <<
+      indent() << type_name(ttype) << "::const_iterator " << iter << ";" << endl <<
+      indent() << "for (" << iter << " = " << prefix  << ".begin(); " << iter << " != " << prefix << ".end(); ++" << iter << ")" << endl;
+    scope_up(out);
+      if (ttype->is_map()) {
+        generate_serialize_map_element(out, (t_map*)ttype, iter);
+      } else if (ttype->is_set()) {
+        generate_serialize_set_element(out, (t_set*)ttype, iter);
+      } else if (ttype->is_list()) {
+        generate_serialize_list_element(out, (t_list*)ttype, iter);
+      }
+    scope_down(out);
+  }
 
   if (ttype->is_map()) {
     indent(out) <<
@@ -3111,6 +3207,32 @@ string t_cpp_generator::type_to_enum(t_type* type) {
   throw "INVALID TYPE IN type_to_enum: " + type->get_name();
 }
 
+/**
+ * Returns the name TProtocol uses in its bulk functions for lists of this
+ * element type, as in readI32Array, or "" if there are none for it.
+ */
+string t_cpp_generator::array_type_name(t_type* ttype) {
+  ttype = get_true_type(ttype);
+
+  if (!ttype->is_base_type()) {
+    return "";
+  }
+  switch (((t_base_type*)ttype)->get_base()) {
+  case t_base_type::TYPE_BYTE:
+    return "Byte";
+  case t_base_type::TYPE_I16:
+    return "I16";
+  case t_base_type::TYPE_I32:
+    return "I32";
+  case t_base_type::TYPE_I64:
+    return "I64";
+  case t_base_type::TYPE_DOUBLE:
+    return "Double";
+  default:
+    return "";
+  }
+}
+
 /**
  * Returns the symbol name of the local reflection of a type.
  */
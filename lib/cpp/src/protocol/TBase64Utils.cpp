@@ -6,8 +6,19 @@
 
 #include "TBase64Utils.h"
 
+#include <string.h>
 #include <boost/static_assert.hpp>
 
+// The vector kernels are compiled for their instruction sets function by
+// function and picked at run time, so the library itself still runs on any
+// x86 CPU.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define THRIFT_BASE64_X86 1
+#include <immintrin.h>
+#endif
+
 using std::string;
 
 namespace facebook { namespace thrift { namespace protocol {
@@ -63,4 +74,329 @@ void base64_decode(uint8_t *buf, uint32_t len) {
 }
 
 
+// Bulk encoding and decoding.  The vector kernels only do whole blocks, and
+// return how much input they got through; the scalar code finishes off.
+// They produce exactly what the scalar code would, and a block holding a
+// character that isn't base64 is left for the scalar code to decode the way
+// it always has.
+
+static uint32_t encodeScalar(const uint8_t *in, uint32_t len, uint8_t *buf) {
+  uint8_t *out = buf;
+  while (len >= 3) {
+    base64_encode(in, 3, out);
+    in += 3;
+    len -= 3;
+    out += 4;
+  }
+  if (len) {
+    base64_encode(in, len, out);
+    out += len + 1;
+  }
+  return out - buf;
+}
+
+// in and out may be the same buffer, since each group is read before the
+// bytes it decodes to are written
+static uint32_t decodeScalar(const uint8_t *in, uint32_t len, uint8_t *out) {
+  uint8_t *start = out;
+  uint8_t b[4];
+  while (len >= 4) {
+    memcpy(b, in, 4);
+    base64_decode(b, 4);
+    memcpy(out, b, 3);
+    in += 4;
+    len -= 4;
+    out += 3;
+  }
+  // A single leftover character doesn't make a byte
+  if (len > 1) {
+    memcpy(b, in, len);
+    base64_decode(b, len);
+    memcpy(out, b, len - 1);
+    out += len - 1;
+  }
+  return out - start;
+}
+
+static uint32_t encodeBlocksScalar(const uint8_t *, uint32_t, uint8_t *) {
+  return 0;
+}
+
+static uint32_t decodeBlocksScalar(const uint8_t *, uint32_t, uint8_t *) {
+  return 0;
+}
+
+#ifdef THRIFT_BASE64_X86
+
+// Spreads each 3 bytes of the first 12 over 4 bytes, 6 bits in each, and
+// turns those into base64 characters
+__attribute__((target("ssse3")))
+static inline __m128i encode128(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                               _mm_set1_epi32(0x04000040));
+  __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                               _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(hi, lo);
+
+  // Map 0-25, 26-51, each of 52-61, 62 and 63 to a slot of offsets, and add
+  // the one for each index to it
+  __m128i slot = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  slot = _mm_or_si128(slot, _mm_and_si128(
+    _mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+  const __m128i offsets = _mm_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, slot), indices);
+}
+
+__attribute__((target("ssse3")))
+static uint32_t encodeBlocksSSSE3(const uint8_t *in, uint32_t len, uint8_t *buf) {
+  uint32_t done = 0;
+  // Each step loads 16 bytes and encodes 12 of them
+  while (len - done >= 16) {
+    __m128i chars = encode128(_mm_loadu_si128((const __m128i *)(in + done)));
+    _mm_storeu_si128((__m128i *)(buf + done / 3 * 4), chars);
+    done += 12;
+  }
+  return done;
+}
+
+// Decodes 16 characters into the first 12 bytes of out, or returns false if
+// any of them isn't base64
+__attribute__((target("ssse3")))
+static inline bool decode128(__m128i in, __m128i *out) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+  __m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+  __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                               _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  if (_mm_movemask_epi8(valid) != 0xFFFF) {
+    return false;
+  }
+
+  __m128i shift = _mm_or_si128(
+    _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                 _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+    _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                 _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+                              _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+  __m128i values = _mm_add_epi8(in, shift);
+
+  // Join the 6 bit values pairwise into 12 bits, then into 24, and pick the
+  // 3 bytes of each 32 bit word out in big endian order
+  __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  *out = _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                               14, 13, 12, -1, -1, -1, -1));
+  return true;
+}
+
+// out may be in, to decode in place: the 4 spare bytes of each store land
+// on characters that have already been decoded
+__attribute__((target("ssse3")))
+static uint32_t decodeBlocksSSSE3(const uint8_t *in, uint32_t len, uint8_t *out) {
+  uint32_t done = 0;
+  while (len - done >= 16) {
+    __m128i bytes;
+    if (!decode128(_mm_loadu_si128((const __m128i *)(in + done)), &bytes)) {
+      break;
+    }
+    _mm_storeu_si128((__m128i *)(out + done / 4 * 3), bytes);
+    done += 16;
+  }
+  return done;
+}
+
+// The same as encode128() on each 128 bit lane
+__attribute__((target("avx2")))
+static inline __m256i encode256(__m256i in) {
+  in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m256i hi = _mm256_mulhi_epu16(
+    _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+    _mm256_set1_epi32(0x04000040));
+  __m256i lo = _mm256_mullo_epi16(
+    _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+    _mm256_set1_epi32(0x01000010));
+  __m256i indices = _mm256_or_si256(hi, lo);
+
+  __m256i slot = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+  slot = _mm256_or_si256(slot, _mm256_and_si256(
+    _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+  const __m256i offsets = _mm256_setr_epi8(
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, slot), indices);
+}
+
+__attribute__((target("avx2")))
+static uint32_t encodeBlocksAVX2(const uint8_t *in, uint32_t len, uint8_t *buf) {
+  uint32_t done = 0;
+  // Each step encodes 24 bytes, 12 per lane, loading 4 beyond them
+  while (len - done >= 28) {
+    const uint8_t *p = in + done;
+    __m256i bytes = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+      _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+    _mm256_storeu_si256((__m256i *)(buf + done / 3 * 4), encode256(bytes));
+    done += 24;
+  }
+  return encodeBlocksSSSE3(in + done, len - done, buf + done / 3 * 4) + done;
+}
+
+// The same as decode128() on 32 characters, with the 24 bytes they decode
+// to gathered at the start of out
+__attribute__((target("avx2")))
+static inline bool decode256(__m256i in, __m256i *out) {
+  __m256i upper = _mm256_and_si256(
+    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+  __m256i lower = _mm256_and_si256(
+    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+  __m256i digit = _mm256_and_si256(
+    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+    _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+  __m256i plus = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('+'));
+  __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+  __m256i valid = _mm256_or_si256(
+    _mm256_or_si256(upper, lower),
+    _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+  if (_mm256_movemask_epi8(valid) != -1) {
+    return false;
+  }
+
+  __m256i shift = _mm256_or_si256(
+    _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                    _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+    _mm256_or_si256(
+      _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+      _mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+                      _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+  __m256i values = _mm256_add_epi8(in, shift);
+
+  __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+  __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+  __m256i bytes = _mm256_shuffle_epi8(words, _mm256_setr_epi8(
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  *out = _mm256_permutevar8x32_epi32(bytes,
+                                     _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+  return true;
+}
+
+__attribute__((target("avx2")))
+static uint32_t decodeBlocksAVX2(const uint8_t *in, uint32_t len, uint8_t *out) {
+  uint32_t done = 0;
+  while (len - done >= 32) {
+    __m256i bytes;
+    if (!decode256(_mm256_loadu_si256((const __m256i *)(in + done)), &bytes)) {
+      return done;
+    }
+    _mm256_storeu_si256((__m256i *)(out + done / 4 * 3), bytes);
+    done += 32;
+  }
+  return decodeBlocksSSSE3(in + done, len - done, out + done / 4 * 3) + done;
+}
+
+#endif // THRIFT_BASE64_X86
+
+namespace {
+
+struct Base64Impl {
+  const char* name;
+  uint32_t (*encodeBlocks)(const uint8_t *in, uint32_t len, uint8_t *buf);
+  uint32_t (*decodeBlocks)(const uint8_t *in, uint32_t len, uint8_t *out);
+};
+
+Base64Impl chooseBase64Impl() {
+  Base64Impl impl = { "scalar", encodeBlocksScalar, decodeBlocksScalar };
+#ifdef THRIFT_BASE64_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    Base64Impl avx2 = { "avx2", encodeBlocksAVX2, decodeBlocksAVX2 };
+    impl = avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    Base64Impl ssse3 = { "ssse3", encodeBlocksSSSE3, decodeBlocksSSSE3 };
+    impl = ssse3;
+  }
+#endif
+  return impl;
+}
+
+const Base64Impl& base64Impl() {
+  static const Base64Impl impl = chooseBase64Impl();
+  return impl;
+}
+
+}
+
+uint32_t base64_encode_bulk(const uint8_t *in, uint32_t len, uint8_t *buf) {
+  uint32_t done = base64Impl().encodeBlocks(in, len, buf);
+  uint32_t chars = done / 3 * 4;
+  return chars + encodeScalar(in + done, len - done, buf + chars);
+}
+
+uint32_t base64_decode_bulk(uint8_t *buf, uint32_t len) {
+  uint32_t done = base64Impl().decodeBlocks(buf, len, buf);
+  uint32_t bytes = done / 4 * 3;
+  return bytes + decodeScalar(buf + done, len - done, buf + bytes);
+}
+
+const char* base64_implementation() {
+  return base64Impl().name;
+}
+
+
+uint32_t TBase64Encoder::write(const uint8_t* buf, uint32_t len) {
+  uint32_t result = 0;
+  // Complete the group left over from last time first
+  if (pendingLen_ > 0) {
+    while (pendingLen_ < 3 && len > 0) {
+      pending_[pendingLen_++] = *buf++;
+      --len;
+    }
+    if (pendingLen_ < 3) {
+      return 0;
+    }
+    base64_encode(pending_, 3, out_);
+    trans_->write(out_, 4);
+    result += 4;
+    pendingLen_ = 0;
+  }
+  while (len >= 3) {
+    uint32_t chunk = (len < CHUNK_BYTES ? len - len % 3 : CHUNK_BYTES);
+    uint32_t chars = base64_encode_bulk(buf, chunk, out_);
+    trans_->write(out_, chars);
+    result += chars;
+    buf += chunk;
+    len -= chunk;
+  }
+  memcpy(pending_, buf, len);
+  pendingLen_ = len;
+  return result;
+}
+
+uint32_t TBase64Encoder::finish() {
+  if (pendingLen_ == 0) {
+    return 0;
+  }
+  base64_encode(pending_, pendingLen_, out_);
+  trans_->write(out_, pendingLen_ + 1);
+  uint32_t result = pendingLen_ + 1;
+  pendingLen_ = 0;
+  return result;
+}
+
+
 }}} // facebook::thrift::protocol
@@ -8,6 +8,7 @@
 #define _THRIFT_PROTOCOL_TBASE64UTILS_H_
 
 #include <string>
+#include <transport/TTransport.h>
 
 namespace facebook { namespace thrift { namespace protocol {
 
@@ -23,6 +24,55 @@ void base64_encode(const uint8_t *in, uint32_t len, uint8_t *buf);
 // no '=' padding should be included in the input
 void base64_decode(uint8_t *buf, uint32_t len);
 
+// The number of characters base64_encode_bulk() produces for len bytes
+inline uint32_t base64_encoded_size(uint32_t len) {
+  return (len / 3) * 4 + (len % 3 ? len % 3 + 1 : 0);
+}
+
+// Encodes len bytes of in into buf, which must have room for
+// base64_encoded_size(len) characters and may not overlap in.  The output
+// is what calling base64_encode() on each 3 bytes in turn would produce,
+// also without padding.  Returns the number of characters written.
+uint32_t base64_encode_bulk(const uint8_t *in, uint32_t len, uint8_t *buf);
+
+// Decodes the len base64 characters in buf in place, the way calling
+// base64_decode() on each 4 characters in turn would, and returns the
+// number of bytes decoded.  A single character left over at the end is
+// ignored.
+uint32_t base64_decode_bulk(uint8_t *buf, uint32_t len);
+
+// Which implementation the bulk functions use on this CPU: "avx2",
+// "ssse3" or "scalar"
+const char* base64_implementation();
+
+/**
+ * Base64-encodes a stream of bytes handed over in pieces of any size, and
+ * writes the characters to a transport a few kilobytes at a time.  Bytes
+ * that don't make up a whole 3 byte group are held until the next write()
+ * or finish().  Like base64_encode(), it does not pad.
+ */
+class TBase64Encoder {
+ public:
+  TBase64Encoder(transport::TTransport* trans) :
+    trans_(trans),
+    pendingLen_(0) {}
+
+  // Encodes len bytes of buf, and returns how many characters were written
+  uint32_t write(const uint8_t* buf, uint32_t len);
+
+  // Writes out any bytes held back, and returns how many characters that was
+  uint32_t finish();
+
+ private:
+  // Bytes in, per transport write
+  static const uint32_t CHUNK_BYTES = 3072;
+
+  transport::TTransport* trans_;
+  uint8_t pending_[3];
+  uint32_t pendingLen_;
+  uint8_t out_[CHUNK_BYTES / 3 * 4];
+};
+
 }}} // facebook::thrift::protocol
 
 #endif // #define _THRIFT_PROTOCOL_TBASE64UTILS_H_
@@ -8,7 +8,10 @@
 #define _THRIFT_PROTOCOL_TBINARYPROTOCOL_H_ 1
 
 #include "TProtocol.h"
+#include <transport/TTransportUtils.h>
 
+#include <cstring>
+#include <typeinfo>
 #include <boost/shared_ptr.hpp>
 
 namespace facebook { namespace thrift { namespace protocol {
@@ -17,43 +20,42 @@ namespace facebook { namespace thrift { namespace protocol {
  * The default binary protocol for thrift. Writes all data in a very basic
  * binary format, essentially just spitting out the raw bytes.
  *
+ * The protocol is templated on the transport it talks to.  When that is a
+ * concrete class such as TMemoryBuffer, reads and writes call it directly
+ * instead of through the TTransport vtable, so its inline fast paths end
+ * up in the protocol's own code.  The transport object must then be of
+ * exactly that class, not a subclass of it.  TBinaryProtocol itself is the
+ * instantiation for plain TTransport.
+ *
  * @author Mark Slee <mcslee@facebook.com>
  */
-class TBinaryProtocol : public TProtocol {
+template <class Transport_>
+class TBinaryProtocolT : public TProtocol {
  protected:
   static const int32_t VERSION_MASK = 0xffff0000;
   static const int32_t VERSION_1 = 0x80010000;
   // VERSION_2 (0x80020000)  is taken by TDenseProtocol.
 
  public:
-  TBinaryProtocol(boost::shared_ptr<TTransport> trans) :
+  TBinaryProtocolT(boost::shared_ptr<Transport_> trans) :
     TProtocol(trans),
+    trans_(trans.get()),
     string_limit_(0),
     container_limit_(0),
     strict_read_(false),
-    strict_write_(true),
-    string_buf_(NULL),
-    string_buf_size_(0) {}
-
-  TBinaryProtocol(boost::shared_ptr<TTransport> trans,
-                  int32_t string_limit,
-                  int32_t container_limit,
-                  bool strict_read,
-                  bool strict_write) :
+    strict_write_(true) {}
+
+  TBinaryProtocolT(boost::shared_ptr<Transport_> trans,
+                   int32_t string_limit,
+                   int32_t container_limit,
+                   bool strict_read,
+                   bool strict_write) :
     TProtocol(trans),
+    trans_(trans.get()),
     string_limit_(string_limit),
     container_limit_(container_limit),
     strict_read_(strict_read),
-    strict_write_(strict_write),
-    string_buf_(NULL),
-    string_buf_size_(0) {}
-
-  ~TBinaryProtocol() {
-    if (string_buf_ != NULL) {
-      std::free(string_buf_);
-      string_buf_size_ = 0;
-    }
-  }
+    strict_write_(strict_write) {}
 
   void setStringSizeLimit(int32_t string_limit) {
     string_limit_ = string_limit;
@@ -123,6 +125,16 @@ class TBinaryProtocol : public TProtocol {
 
   uint32_t writeBinary(const std::string& str);
 
+  uint32_t writeByteArray(const int8_t* arr, const uint32_t size);
+
+  uint32_t writeI16Array(const int16_t* arr, const uint32_t size);
+
+  uint32_t writeI32Array(const int32_t* arr, const uint32_t size);
+
+  uint32_t writeI64Array(const int64_t* arr, const uint32_t size);
+
+  uint32_t writeDoubleArray(const double* arr, const uint32_t size);
+
   /**
    * Reading functions
    */
@@ -176,9 +188,89 @@ class TBinaryProtocol : public TProtocol {
 
   uint32_t readBinary(std::string& str);
 
+  uint32_t readByteArray(int8_t* arr, const uint32_t size);
+
+  uint32_t readI16Array(int16_t* arr, const uint32_t size);
+
+  uint32_t readI32Array(int32_t* arr, const uint32_t size);
+
+  uint32_t readI64Array(int64_t* arr, const uint32_t size);
+
+  uint32_t readDoubleArray(double* arr, const uint32_t size);
+
+  /**
+   * Skips values by their lengths rather than reading them: strings are
+   * consumed straight out of the transport, and containers of fixed width
+   * elements are passed over in one go.
+   */
+  uint32_t skip(TType type);
+
  protected:
   uint32_t readStringBody(std::string& str, int32_t sz);
 
+  // Moves past len bytes without copying them when the transport can lend
+  // them out
+  void skipBytes(uint32_t len);
+
+  // Skips size elements of width bytes each
+  uint32_t skipElements(uint32_t size, uint32_t width);
+
+  // The size on the wire of a fixed width type, or 0 if it isn't one
+  static uint32_t fixedWidth(TType type) {
+    switch (type) {
+    case T_BOOL:
+    case T_BYTE:
+      return 1;
+    case T_I16:
+      return 2;
+    case T_I32:
+      return 4;
+    case T_I64:
+    case T_DOUBLE:
+      return 8;
+    default:
+      return 0;
+    }
+  }
+
+  // Bulk versions of the fixed width types, Bits_ is the unsigned integer
+  // of the same width
+  template <typename Value_, typename Bits_>
+  uint32_t writeArray(const Value_* arr, uint32_t size);
+  template <typename Value_, typename Bits_>
+  uint32_t readArray(Value_* arr, uint32_t size);
+
+  void writeBytes(const uint8_t* buf, uint32_t len) {
+    transport::TTransportDirect<Transport_>::write(trans_, buf, len);
+  }
+
+  void readBytes(uint8_t* buf, uint32_t len) {
+    transport::TTransportDirect<Transport_>::readAll(trans_, buf, len);
+  }
+
+  /**
+   * Reads a fixed width value in wire byte order.  It is copied straight
+   * out of the transport's buffer when that holds all of it, and only
+   * goes through readAll() when the value straddles a refill.
+   */
+  template <typename Value_>
+  void readFixed(Value_& value) {
+    uint8_t buf[sizeof(Value_)];
+    uint32_t len = sizeof(Value_);
+    const uint8_t* data =
+      transport::TTransportDirect<Transport_>::borrow(trans_, buf, &len);
+    if (data != NULL) {
+      std::memcpy(&value, data, sizeof(Value_));
+      transport::TTransportDirect<Transport_>::consume(trans_, sizeof(Value_));
+    } else {
+      readBytes(buf, sizeof(Value_));
+      std::memcpy(&value, buf, sizeof(Value_));
+    }
+  }
+
+  // Same object as TProtocol::trans_, with its real type
+  Transport_* trans_;
+
   int32_t string_limit_;
   int32_t container_limit_;
 
@@ -186,15 +278,13 @@ class TBinaryProtocol : public TProtocol {
   bool strict_read_;
   bool strict_write_;
 
-  // Buffer for reading strings, save for the lifetime of the protocol to
-  // avoid memory churn allocating memory on every string read
-  uint8_t* string_buf_;
-  int32_t string_buf_size_;
-
 };
 
+typedef TBinaryProtocolT<TTransport> TBinaryProtocol;
+
 /**
- * Constructs binary protocol handlers
+ * Constructs binary protocol handlers.  Transports the protocol has a
+ * specialization for get it; everything else gets TBinaryProtocol.
  */
 class TBinaryProtocolFactory : public TProtocolFactory {
  public:
@@ -226,10 +316,25 @@ class TBinaryProtocolFactory : public TProtocolFactory {
   }
 
   boost::shared_ptr<TProtocol> getProtocol(boost::shared_ptr<TTransport> trans) {
-    return boost::shared_ptr<TProtocol>(new TBinaryProtocol(trans, string_limit_, container_limit_, strict_read_, strict_write_));
+    // Only an exact match will do, a subclass may override what the
+    // specialization would call directly
+    const std::type_info& type = typeid(*trans);
+    if (type == typeid(transport::TMemoryBuffer)) {
+      return makeProtocol(boost::static_pointer_cast<transport::TMemoryBuffer>(trans));
+    } else if (type == typeid(transport::TFramedTransport)) {
+      return makeProtocol(boost::static_pointer_cast<transport::TFramedTransport>(trans));
+    } else if (type == typeid(transport::TBufferedTransport)) {
+      return makeProtocol(boost::static_pointer_cast<transport::TBufferedTransport>(trans));
+    }
+    return makeProtocol(trans);
   }
 
  private:
+  template <class Transport_>
+  boost::shared_ptr<TProtocol> makeProtocol(boost::shared_ptr<Transport_> trans) {
+    return boost::shared_ptr<TProtocol>(new TBinaryProtocolT<Transport_>(trans, string_limit_, container_limit_, strict_read_, strict_write_));
+  }
+
   int32_t string_limit_;
   int32_t container_limit_;
   bool strict_read_;
@@ -239,4 +344,6 @@ class TBinaryProtocolFactory : public TProtocolFactory {
 
 }}} // facebook::thrift::protocol
 
+#include "TBinaryProtocol.tcc"
+
 #endif // #ifndef _THRIFT_PROTOCOL_TBINARYPROTOCOL_H_
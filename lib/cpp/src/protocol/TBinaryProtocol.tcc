@@ -0,0 +1,731 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#ifndef _THRIFT_PROTOCOL_TBINARYPROTOCOL_TCC_
+#define _THRIFT_PROTOCOL_TBINARYPROTOCOL_TCC_ 1
+
+#include "TBinaryProtocol.h"
+#include "TVarint.h"
+
+#include <algorithm>
+#include <limits>
+#include <boost/static_assert.hpp>
+
+// Use this to get around strict aliasing rules.
+// For example, uint64_t i = bitwise_cast<uint64_t>(returns_double());
+// The most obvious implementation is to just cast a pointer,
+// but that doesn't work.
+// For a pretty in-depth explanation of the problem, see
+// http://www.cellperformance.com/mike_acton/2006/06/ (...)
+// understanding_strict_aliasing.html
+template <typename To, typename From>
+static inline To bitwise_cast(From from) {
+  BOOST_STATIC_ASSERT(sizeof(From) == sizeof(To));
+
+  // BAD!!!  These are all broken with -O2.
+  //return *reinterpret_cast<To*>(&from);  // BAD!!!
+  //return *static_cast<To*>(static_cast<void*>(&from));  // BAD!!!
+  //return *(To*)(void*)&from;  // BAD!!!
+
+  // Super clean and paritally blessed by section 3.9 of the standard.
+  //unsigned char c[sizeof(from)];
+  //memcpy(c, &from, sizeof(from));
+  //To to;
+  //memcpy(&to, c, sizeof(c));
+  //return to;
+
+  // Slightly more questionable.
+  // Same code emitted by GCC.
+  //To to;
+  //memcpy(&to, &from, sizeof(from));
+  //return to;
+
+  // Technically undefined, but almost universally supported,
+  // and the most efficient implementation.
+  union {
+    From f;
+    To t;
+  } u;
+  u.f = from;
+  return u.t;
+}
+
+
+namespace facebook { namespace thrift { namespace protocol {
+
+// Network byte order by width, for the array functions.  Each is its own
+// inverse.
+static inline uint16_t byteSwap(uint16_t n) {
+  return htons(n);
+}
+
+static inline uint32_t byteSwap(uint32_t n) {
+  return htonl(n);
+}
+
+static inline uint64_t byteSwap(uint64_t n) {
+  return htonll(n);
+}
+
+/**
+ * Arrays are converted a chunk at a time into a buffer on the stack, and
+ * each chunk goes to the transport in a single write.  A plain loop over
+ * the elements like this is one the compiler can vectorize.
+ */
+template <class Transport_>
+template <typename Value_, typename Bits_>
+uint32_t TBinaryProtocolT<Transport_>::writeArray(const Value_* arr, uint32_t size) {
+  BOOST_STATIC_ASSERT(sizeof(Value_) == sizeof(Bits_));
+#if __BYTE_ORDER == __BIG_ENDIAN
+  writeBytes((const uint8_t*)arr, size * sizeof(Value_));
+#else
+  static const uint32_t CHUNK = 4096 / sizeof(Bits_);
+  Bits_ chunk[CHUNK];
+  const uint8_t* in = (const uint8_t*)arr;
+  for (uint32_t done = 0; done < size; ) {
+    uint32_t n = std::min(size - done, CHUNK);
+    for (uint32_t i = 0; i < n; ++i) {
+      Bits_ bits;
+      std::memcpy(&bits, in + (done + i) * sizeof(Bits_), sizeof(Bits_));
+      chunk[i] = byteSwap(bits);
+    }
+    writeBytes((const uint8_t*)chunk, n * sizeof(Bits_));
+    done += n;
+  }
+#endif
+  return size * sizeof(Value_);
+}
+
+/**
+ * Arrays are read straight into place in one go and converted there.
+ */
+template <class Transport_>
+template <typename Value_, typename Bits_>
+uint32_t TBinaryProtocolT<Transport_>::readArray(Value_* arr, uint32_t size) {
+  BOOST_STATIC_ASSERT(sizeof(Value_) == sizeof(Bits_));
+  if (size > std::numeric_limits<uint32_t>::max() / sizeof(Value_)) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  uint8_t* out = (uint8_t*)arr;
+  readBytes(out, size * sizeof(Value_));
+#if __BYTE_ORDER != __BIG_ENDIAN
+  for (uint32_t i = 0; i < size; ++i) {
+    Bits_ bits;
+    std::memcpy(&bits, out + i * sizeof(Bits_), sizeof(Bits_));
+    bits = byteSwap(bits);
+    std::memcpy(out + i * sizeof(Bits_), &bits, sizeof(Bits_));
+  }
+#endif
+  return size * sizeof(Value_);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeMessageBegin(const std::string& name,
+                                            const TMessageType messageType,
+                                            const int32_t seqid) {
+  if (strict_write_) {
+    int32_t version = (VERSION_1) | ((int32_t)messageType);
+    uint32_t wsize = 0;
+    wsize += writeI32(version);
+    wsize += writeString(name);
+    wsize += writeI32(seqid);
+    return wsize;
+  } else {
+    uint32_t wsize = 0;
+    wsize += writeString(name);
+    wsize += writeByte((int8_t)messageType);
+    wsize += writeI32(seqid);
+    return wsize;
+  }
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeMessageEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeStructBegin(const std::string& name) {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeStructEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeFieldBegin(const std::string& name,
+                                          const TType fieldType,
+                                          const int16_t fieldId) {
+  uint32_t wsize = 0;
+  wsize += writeByte((int8_t)fieldType);
+  wsize += writeI16(fieldId);
+  return wsize;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeFieldEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeFieldStop() {
+  return
+    writeByte((int8_t)T_STOP);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeMapBegin(const TType keyType,
+                                        const TType valType,
+                                        const uint32_t size) {
+  uint32_t wsize = 0;
+  wsize += writeByte((int8_t)keyType);
+  wsize += writeByte((int8_t)valType);
+  wsize += writeI32((int32_t)size);
+  return wsize;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeMapEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeListBegin(const TType elemType,
+                                         const uint32_t size) {
+  uint32_t wsize = 0;
+  wsize += writeByte((int8_t) elemType);
+  wsize += writeI32((int32_t)size);
+  return wsize;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeListEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeSetBegin(const TType elemType,
+                                        const uint32_t size) {
+  uint32_t wsize = 0;
+  wsize += writeByte((int8_t)elemType);
+  wsize += writeI32((int32_t)size);
+  return wsize;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeSetEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeBool(const bool value) {
+  uint8_t tmp =  value ? 1 : 0;
+  writeBytes(&tmp, 1);
+  return 1;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeByte(const int8_t byte) {
+  writeBytes((uint8_t*)&byte, 1);
+  return 1;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeI16(const int16_t i16) {
+  int16_t net = (int16_t)htons(i16);
+  writeBytes((uint8_t*)&net, 2);
+  return 2;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeI32(const int32_t i32) {
+  int32_t net = (int32_t)htonl(i32);
+  writeBytes((uint8_t*)&net, 4);
+  return 4;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeI64(const int64_t i64) {
+  int64_t net = (int64_t)htonll(i64);
+  writeBytes((uint8_t*)&net, 8);
+  return 8;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeDouble(const double dub) {
+  BOOST_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+
+  uint64_t bits = bitwise_cast<uint64_t>(dub);
+  bits = htonll(bits);
+  writeBytes((uint8_t*)&bits, 8);
+  return 8;
+}
+
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeString(const std::string& str) {
+  uint32_t size = str.size();
+  uint32_t result = writeI32((int32_t)size);
+  if (size > 0) {
+    writeBytes((uint8_t*)str.data(), size);
+  }
+  return result + size;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeBinary(const std::string& str) {
+  return TBinaryProtocolT<Transport_>::writeString(str);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeByteArray(const int8_t* arr,
+                                                      const uint32_t size) {
+  writeBytes((const uint8_t*)arr, size);
+  return size;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeI16Array(const int16_t* arr,
+                                                     const uint32_t size) {
+  return writeArray<int16_t, uint16_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeI32Array(const int32_t* arr,
+                                                     const uint32_t size) {
+  return writeArray<int32_t, uint32_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeI64Array(const int64_t* arr,
+                                                     const uint32_t size) {
+  return writeArray<int64_t, uint64_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::writeDoubleArray(const double* arr,
+                                                        const uint32_t size) {
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+  return writeArray<double, uint64_t>(arr, size);
+}
+
+/**
+ * Reading functions
+ */
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readMessageBegin(std::string& name,
+                                           TMessageType& messageType,
+                                           int32_t& seqid) {
+  uint32_t result = 0;
+  int32_t sz;
+  result += readI32(sz);
+
+  if (sz < 0) {
+    // Check for correct version number
+    int32_t version = sz & VERSION_MASK;
+    if (version != VERSION_1) {
+      throw TProtocolException(TProtocolException::BAD_VERSION, "Bad version identifier");
+    }
+    messageType = (TMessageType)(sz & 0x000000ff);
+    result += readString(name);
+    result += readI32(seqid);
+  } else {
+    if (strict_read_) {
+      throw TProtocolException(TProtocolException::BAD_VERSION, "No version identifier... old protocol client in strict mode?");
+    } else {
+      // Handle pre-versioned input
+      int8_t type;
+      result += readStringBody(name, sz);
+      result += readByte(type);
+      messageType = (TMessageType)type;
+      result += readI32(seqid);
+    }
+  }
+  return result;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readMessageEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readStructBegin(std::string& name) {
+  name = "";
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readStructEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readFieldBegin(std::string& name,
+                                         TType& fieldType,
+                                         int16_t& fieldId) {
+  // The type and id are usually both buffered, take them in one go
+  uint8_t buf[1];
+  uint32_t len;
+  const uint8_t* data = borrowBuffered(trans_, buf, &len);
+  if (data != NULL && (len >= 3 || data[0] == T_STOP)) {
+    fieldType = (TType)data[0];
+    if (fieldType == T_STOP) {
+      fieldId = 0;
+      transport::TTransportDirect<Transport_>::consume(trans_, 1);
+      return 1;
+    }
+    int16_t id;
+    std::memcpy(&id, data + 1, 2);
+    fieldId = (int16_t)ntohs(id);
+    transport::TTransportDirect<Transport_>::consume(trans_, 3);
+    return 3;
+  }
+
+  uint32_t result = 0;
+  int8_t type;
+  result += readByte(type);
+  fieldType = (TType)type;
+  if (fieldType == T_STOP) {
+    fieldId = 0;
+    return result;
+  }
+  result += readI16(fieldId);
+  return result;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readFieldEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readMapBegin(TType& keyType,
+                                       TType& valType,
+                                       uint32_t& size) {
+  int8_t k, v;
+  uint32_t result = 0;
+  int32_t sizei;
+  result += readByte(k);
+  keyType = (TType)k;
+  result += readByte(v);
+  valType = (TType)v;
+  result += readI32(sizei);
+  if (sizei < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  } else if (container_limit_ && sizei > container_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  size = (uint32_t)sizei;
+  return result;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readMapEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readListBegin(TType& elemType,
+                                        uint32_t& size) {
+  int8_t e;
+  uint32_t result = 0;
+  int32_t sizei;
+  result += readByte(e);
+  elemType = (TType)e;
+  result += readI32(sizei);
+  if (sizei < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  } else if (container_limit_ && sizei > container_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  size = (uint32_t)sizei;
+  return result;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readListEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readSetBegin(TType& elemType,
+                                       uint32_t& size) {
+  int8_t e;
+  uint32_t result = 0;
+  int32_t sizei;
+  result += readByte(e);
+  elemType = (TType)e;
+  result += readI32(sizei);
+  if (sizei < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  } else if (container_limit_ && sizei > container_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  size = (uint32_t)sizei;
+  return result;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readSetEnd() {
+  return 0;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readBool(bool& value) {
+  int8_t b;
+  readFixed(b);
+  value = b != 0;
+  return 1;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readByte(int8_t& byte) {
+  readFixed(byte);
+  return 1;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readI16(int16_t& i16) {
+  readFixed(i16);
+  i16 = (int16_t)ntohs(i16);
+  return 2;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readI32(int32_t& i32) {
+  readFixed(i32);
+  i32 = (int32_t)ntohl(i32);
+  return 4;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readI64(int64_t& i64) {
+  readFixed(i64);
+  i64 = (int64_t)ntohll(i64);
+  return 8;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readDouble(double& dub) {
+  BOOST_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+
+  uint64_t bits;
+  readFixed(bits);
+  bits = ntohll(bits);
+  dub = bitwise_cast<double>(bits);
+  return 8;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readString(std::string& str) {
+  uint32_t result;
+  int32_t size;
+  result = readI32(size);
+  return result + readStringBody(str, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readBinary(std::string& str) {
+  return TBinaryProtocolT<Transport_>::readString(str);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readByteArray(int8_t* arr,
+                                                     const uint32_t size) {
+  readBytes((uint8_t*)arr, size);
+  return size;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readI16Array(int16_t* arr,
+                                                    const uint32_t size) {
+  return readArray<int16_t, uint16_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readI32Array(int32_t* arr,
+                                                    const uint32_t size) {
+  return readArray<int32_t, uint32_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readI64Array(int64_t* arr,
+                                                    const uint32_t size) {
+  return readArray<int64_t, uint64_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readDoubleArray(double* arr,
+                                                       const uint32_t size) {
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+  return readArray<double, uint64_t>(arr, size);
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::readStringBody(std::string& str, int32_t size) {
+  uint32_t result = 0;
+
+  // Catch error cases
+  if (size < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  }
+  if (string_limit_ > 0 && size > string_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+
+  // Catch empty string case
+  if (size == 0) {
+    str = "";
+    return result;
+  }
+
+  // Copy it out of the transport's buffer if it is all there, otherwise
+  // read it straight into the string's own storage.  Either way the bytes
+  // are copied once.
+  uint32_t len = (uint32_t)size;
+  const uint8_t* data =
+    transport::TTransportDirect<Transport_>::borrow(trans_, NULL, &len);
+  if (data != NULL) {
+    str.assign((const char*)data, size);
+    transport::TTransportDirect<Transport_>::consume(trans_, size);
+  } else {
+    str.resize(size);
+    readBytes((uint8_t*)&str[0], size);
+  }
+  return (uint32_t)size;
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::skip(TType type) {
+  uint32_t width = fixedWidth(type);
+  if (width > 0) {
+    skipBytes(width);
+    return width;
+  }
+
+  uint32_t result = 0;
+  switch (type) {
+  case T_STRING:
+    {
+      int32_t size;
+      result += readI32(size);
+      if (size < 0) {
+        throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+      }
+      if (string_limit_ > 0 && size > string_limit_) {
+        throw TProtocolException(TProtocolException::SIZE_LIMIT);
+      }
+      skipBytes((uint32_t)size);
+      return result + (uint32_t)size;
+    }
+  case T_STRUCT:
+    {
+      std::string name;
+      int16_t fid;
+      TType ftype;
+      result += readStructBegin(name);
+      while (true) {
+        result += readFieldBegin(name, ftype, fid);
+        if (ftype == T_STOP) {
+          break;
+        }
+        result += skip(ftype);
+        result += readFieldEnd();
+      }
+      result += readStructEnd();
+      return result;
+    }
+  case T_MAP:
+    {
+      TType keyType;
+      TType valType;
+      uint32_t size;
+      result += readMapBegin(keyType, valType, size);
+      uint32_t keyWidth = fixedWidth(keyType);
+      uint32_t valWidth = fixedWidth(valType);
+      if (keyWidth > 0 && valWidth > 0) {
+        result += skipElements(size, keyWidth + valWidth);
+      } else {
+        for (uint32_t i = 0; i < size; i++) {
+          result += skip(keyType);
+          result += skip(valType);
+        }
+      }
+      result += readMapEnd();
+      return result;
+    }
+  case T_SET:
+  case T_LIST:
+    {
+      TType elemType;
+      uint32_t size;
+      if (type == T_SET) {
+        result += readSetBegin(elemType, size);
+      } else {
+        result += readListBegin(elemType, size);
+      }
+      width = fixedWidth(elemType);
+      if (width > 0) {
+        result += skipElements(size, width);
+      } else {
+        for (uint32_t i = 0; i < size; i++) {
+          result += skip(elemType);
+        }
+      }
+      if (type == T_SET) {
+        result += readSetEnd();
+      } else {
+        result += readListEnd();
+      }
+      return result;
+    }
+  default:
+    return 0;
+  }
+}
+
+template <class Transport_>
+uint32_t TBinaryProtocolT<Transport_>::skipElements(uint32_t size,
+                                                   uint32_t width) {
+  if (size > std::numeric_limits<uint32_t>::max() / width) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  skipBytes(size * width);
+  return size * width;
+}
+
+template <class Transport_>
+void TBinaryProtocolT<Transport_>::skipBytes(uint32_t len) {
+  while (len > 0) {
+    // Take whatever is buffered, up to what we need
+    uint32_t avail = 1;
+    const uint8_t* data =
+      transport::TTransportDirect<Transport_>::borrow(trans_, NULL, &avail);
+    if (data == NULL) {
+      // The transport won't lend, read the rest a chunk at a time
+      uint8_t scratch[1024];
+      while (len > 0) {
+        uint32_t chunk = std::min(len, (uint32_t)sizeof(scratch));
+        readBytes(scratch, chunk);
+        len -= chunk;
+      }
+      return;
+    }
+    uint32_t chunk = std::min(len, avail);
+    transport::TTransportDirect<Transport_>::consume(trans_, chunk);
+    len -= chunk;
+  }
+}
+
+}}} // facebook::thrift::protocol
+
+#endif // #ifndef _THRIFT_PROTOCOL_TBINARYPROTOCOL_TCC_
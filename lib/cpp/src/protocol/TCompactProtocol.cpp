@@ -0,0 +1,549 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#include "TCompactProtocol.h"
+#include "TVarint.h"
+
+#include <algorithm>
+#include <limits>
+#include <boost/static_assert.hpp>
+
+using std::string;
+
+namespace facebook { namespace thrift { namespace protocol {
+
+/**
+ * Writing functions
+ */
+
+uint32_t TCompactProtocol::writeMessageBegin(const std::string& name,
+                                             const TMessageType messageType,
+                                             const int32_t seqid) {
+  uint8_t header[2];
+  header[0] = (uint8_t)PROTOCOL_ID;
+  header[1] = (uint8_t)((VERSION_N & VERSION_MASK) |
+                        ((((int32_t)messageType) << TYPE_SHIFT_AMOUNT) & TYPE_MASK));
+  trans_->write(header, 2);
+
+  uint32_t wsize = 2;
+  wsize += writeVarint32((uint32_t)seqid);
+  wsize += writeString(name);
+  return wsize;
+}
+
+uint32_t TCompactProtocol::writeMessageEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeStructBegin(const string& name) {
+  lastField_.push(lastFieldId_);
+  lastFieldId_ = 0;
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeStructEnd() {
+  lastFieldId_ = lastField_.top();
+  lastField_.pop();
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeFieldBegin(const string& name,
+                                           const TType fieldType,
+                                           const int16_t fieldId) {
+  if (fieldType == T_BOOL) {
+    // The header goes out with the value, in writeBool()
+    boolFieldPending_ = true;
+    boolFieldId_ = fieldId;
+    return 0;
+  }
+  return writeFieldBeginInternal(fieldType, fieldId, -1);
+}
+
+uint32_t TCompactProtocol::writeFieldBeginInternal(const TType fieldType,
+                                                   const int16_t fieldId,
+                                                   int8_t typeOverride) {
+  int8_t typeToWrite = (typeOverride == -1) ? getCompactType(fieldType) : typeOverride;
+
+  uint32_t wsize;
+  if (fieldId > lastFieldId_ && fieldId - lastFieldId_ <= 15) {
+    // Delta and type share a byte
+    uint8_t b = (uint8_t)(((fieldId - lastFieldId_) << 4) | typeToWrite);
+    trans_->write(&b, 1);
+    wsize = 1;
+  } else {
+    uint8_t b = (uint8_t)typeToWrite;
+    trans_->write(&b, 1);
+    wsize = 1 + writeI16(fieldId);
+  }
+
+  lastFieldId_ = fieldId;
+  return wsize;
+}
+
+uint32_t TCompactProtocol::writeFieldEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeFieldStop() {
+  uint8_t b = CT_STOP;
+  trans_->write(&b, 1);
+  return 1;
+}
+
+uint32_t TCompactProtocol::writeMapBegin(const TType keyType,
+                                         const TType valType,
+                                         const uint32_t size) {
+  if (size == 0) {
+    // No point saying what type nothing is
+    uint8_t b = 0;
+    trans_->write(&b, 1);
+    return 1;
+  }
+  uint32_t wsize = writeVarint32(size);
+  uint8_t b = (uint8_t)((getCompactType(keyType) << 4) | getCompactType(valType));
+  trans_->write(&b, 1);
+  return wsize + 1;
+}
+
+uint32_t TCompactProtocol::writeMapEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeListBegin(const TType elemType,
+                                          const uint32_t size) {
+  return writeCollectionBegin(elemType, size);
+}
+
+uint32_t TCompactProtocol::writeListEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeSetBegin(const TType elemType,
+                                         const uint32_t size) {
+  return writeCollectionBegin(elemType, size);
+}
+
+uint32_t TCompactProtocol::writeSetEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::writeCollectionBegin(const TType elemType,
+                                                uint32_t size) {
+  if (size < 15) {
+    uint8_t b = (uint8_t)((size << 4) | getCompactType(elemType));
+    trans_->write(&b, 1);
+    return 1;
+  }
+  uint8_t b = (uint8_t)(0xf0 | getCompactType(elemType));
+  trans_->write(&b, 1);
+  return 1 + writeVarint32(size);
+}
+
+uint32_t TCompactProtocol::writeBool(const bool value) {
+  int8_t type = value ? CT_BOOLEAN_TRUE : CT_BOOLEAN_FALSE;
+  if (boolFieldPending_) {
+    boolFieldPending_ = false;
+    return writeFieldBeginInternal(T_BOOL, boolFieldId_, type);
+  }
+
+  // Not a field, so a container element
+  uint8_t b = (uint8_t)type;
+  trans_->write(&b, 1);
+  return 1;
+}
+
+uint32_t TCompactProtocol::writeByte(const int8_t byte) {
+  trans_->write((uint8_t*)&byte, 1);
+  return 1;
+}
+
+uint32_t TCompactProtocol::writeI16(const int16_t i16) {
+  return writeVarint32(i32ToZigzag(i16));
+}
+
+uint32_t TCompactProtocol::writeI32(const int32_t i32) {
+  return writeVarint32(i32ToZigzag(i32));
+}
+
+uint32_t TCompactProtocol::writeI64(const int64_t i64) {
+  return writeVarint64(i64ToZigzag(i64));
+}
+
+uint32_t TCompactProtocol::writeDouble(const double dub) {
+  BOOST_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+
+  // Little-endian, unlike everything in TBinaryProtocol
+  uint64_t bits;
+  memcpy(&bits, &dub, 8);
+  uint8_t buf[8];
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = (uint8_t)(bits >> (8 * i));
+  }
+  trans_->write(buf, 8);
+  return 8;
+}
+
+uint32_t TCompactProtocol::writeString(const string& str) {
+  uint32_t size = str.size();
+  uint32_t wsize = writeVarint32(size);
+  if (size > 0) {
+    trans_->write((uint8_t*)str.data(), size);
+  }
+  return wsize + size;
+}
+
+uint32_t TCompactProtocol::writeBinary(const string& str) {
+  return TCompactProtocol::writeString(str);
+}
+
+uint32_t TCompactProtocol::writeVarint32(uint32_t n) {
+  uint8_t buf[5];
+  uint32_t wsize = 0;
+  while (n > 0x7f) {
+    buf[wsize++] = (uint8_t)((n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  buf[wsize++] = (uint8_t)n;
+  trans_->write(buf, wsize);
+  return wsize;
+}
+
+uint32_t TCompactProtocol::writeVarint64(uint64_t n) {
+  uint8_t buf[10];
+  uint32_t wsize = 0;
+  while (n > 0x7f) {
+    buf[wsize++] = (uint8_t)((n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  buf[wsize++] = (uint8_t)n;
+  trans_->write(buf, wsize);
+  return wsize;
+}
+
+/**
+ * Reading functions
+ */
+
+uint32_t TCompactProtocol::readMessageBegin(std::string& name,
+                                            TMessageType& messageType,
+                                            int32_t& seqid) {
+  uint32_t rsize = 0;
+  int8_t protocolId;
+  int8_t versionAndType;
+
+  rsize += readByte(protocolId);
+  if (protocolId != PROTOCOL_ID) {
+    throw TProtocolException(TProtocolException::BAD_VERSION, "Bad protocol identifier");
+  }
+
+  rsize += readByte(versionAndType);
+  if ((versionAndType & VERSION_MASK) != VERSION_N) {
+    throw TProtocolException(TProtocolException::BAD_VERSION, "Bad protocol version");
+  }
+  messageType = (TMessageType)((versionAndType >> TYPE_SHIFT_AMOUNT) & 0x07);
+
+  rsize += readVarint32(seqid);
+  rsize += readString(name);
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readMessageEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::readStructBegin(string& name) {
+  name = "";
+  lastField_.push(lastFieldId_);
+  lastFieldId_ = 0;
+  return 0;
+}
+
+uint32_t TCompactProtocol::readStructEnd() {
+  lastFieldId_ = lastField_.top();
+  lastField_.pop();
+  return 0;
+}
+
+uint32_t TCompactProtocol::readFieldBegin(string& name,
+                                          TType& fieldType,
+                                          int16_t& fieldId) {
+  uint32_t rsize = 0;
+  int8_t byte;
+
+  rsize += readByte(byte);
+  int8_t type = (byte & 0x0f);
+
+  if (type == CT_STOP) {
+    fieldType = T_STOP;
+    fieldId = 0;
+    return rsize;
+  }
+
+  // A zero delta means the full id follows
+  int16_t modifier = (int16_t)(((uint8_t)byte & 0xf0) >> 4);
+  if (modifier == 0) {
+    rsize += readI16(fieldId);
+  } else {
+    fieldId = (int16_t)(lastFieldId_ + modifier);
+  }
+  fieldType = getTType(type);
+
+  if (type == CT_BOOLEAN_TRUE || type == CT_BOOLEAN_FALSE) {
+    boolValuePending_ = true;
+    boolValue_ = (type == CT_BOOLEAN_TRUE);
+  }
+
+  lastFieldId_ = fieldId;
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readFieldEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::readMapBegin(TType& keyType,
+                                        TType& valType,
+                                        uint32_t& size) {
+  uint32_t rsize = 0;
+  int8_t kvType = 0;
+  int32_t msize = 0;
+
+  rsize += readVarint32(msize);
+  if (msize != 0) {
+    rsize += readByte(kvType);
+  }
+  checkContainerSize(msize);
+
+  keyType = getTType((int8_t)((uint8_t)kvType >> 4));
+  valType = getTType((int8_t)((uint8_t)kvType & 0xf));
+  size = (uint32_t)msize;
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readMapEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::readListBegin(TType& elemType,
+                                         uint32_t& size) {
+  return readCollectionBegin(elemType, size);
+}
+
+uint32_t TCompactProtocol::readListEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::readSetBegin(TType& elemType,
+                                        uint32_t& size) {
+  return readCollectionBegin(elemType, size);
+}
+
+uint32_t TCompactProtocol::readSetEnd() {
+  return 0;
+}
+
+uint32_t TCompactProtocol::readCollectionBegin(TType& elemType,
+                                               uint32_t& size) {
+  int8_t sizeAndType;
+  uint32_t rsize = 0;
+  int32_t lsize;
+
+  rsize += readByte(sizeAndType);
+
+  // Fifteen or more elements put the size in a varint of its own
+  lsize = ((uint8_t)sizeAndType >> 4) & 0x0f;
+  if (lsize == 15) {
+    rsize += readVarint32(lsize);
+  }
+  checkContainerSize(lsize);
+
+  elemType = getTType((int8_t)(sizeAndType & 0x0f));
+  size = (uint32_t)lsize;
+  return rsize;
+}
+
+void TCompactProtocol::checkContainerSize(int32_t size) {
+  if (size < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  } else if (container_limit_ && size > container_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+}
+
+uint32_t TCompactProtocol::readBool(bool& value) {
+  if (boolValuePending_) {
+    // Already came with the field header
+    value = boolValue_;
+    boolValuePending_ = false;
+    return 0;
+  }
+
+  int8_t val;
+  readByte(val);
+  value = (val == CT_BOOLEAN_TRUE);
+  return 1;
+}
+
+uint32_t TCompactProtocol::readByte(int8_t& byte) {
+  uint8_t b[1];
+  trans_->readAll(b, 1);
+  byte = *(int8_t*)b;
+  return 1;
+}
+
+uint32_t TCompactProtocol::readI16(int16_t& i16) {
+  int32_t value;
+  uint32_t rsize = readVarint32(value);
+  i16 = (int16_t)zigzagToI32((uint32_t)value);
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readI32(int32_t& i32) {
+  int32_t value;
+  uint32_t rsize = readVarint32(value);
+  i32 = zigzagToI32((uint32_t)value);
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readI64(int64_t& i64) {
+  int64_t value;
+  uint32_t rsize = readVarint64(value);
+  i64 = zigzagToI64((uint64_t)value);
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readDouble(double& dub) {
+  BOOST_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+
+  uint8_t b[8];
+  trans_->readAll(b, 8);
+  uint64_t bits = 0;
+  for (int i = 7; i >= 0; --i) {
+    bits = (bits << 8) | b[i];
+  }
+  memcpy(&dub, &bits, 8);
+  return 8;
+}
+
+uint32_t TCompactProtocol::readString(string& str) {
+  int32_t rsize = 0;
+  int32_t size;
+
+  rsize += readVarint32(size);
+
+  // Catch error cases
+  if (size < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  }
+  if (string_limit_ > 0 && size > string_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+
+  // Catch empty string case
+  if (size == 0) {
+    str = "";
+    return rsize;
+  }
+
+  // Copy it out of the transport's buffer if it is all there, otherwise
+  // read it straight into the string's own storage
+  uint32_t len = (uint32_t)size;
+  const uint8_t* data = trans_->borrow(NULL, &len);
+  if (data != NULL) {
+    str.assign((const char*)data, size);
+    trans_->consume(size);
+  } else {
+    str.resize(size);
+    trans_->readAll((uint8_t*)&str[0], size);
+  }
+
+  return rsize + (uint32_t)size;
+}
+
+uint32_t TCompactProtocol::readBinary(string& str) {
+  return TCompactProtocol::readString(str);
+}
+
+uint32_t TCompactProtocol::readVarint32(int32_t& i32) {
+  int64_t val;
+  uint32_t rsize = readVarint64(val);
+  i32 = (int32_t)val;
+  return rsize;
+}
+
+uint32_t TCompactProtocol::readVarint64(int64_t& i64) {
+  uint64_t val;
+  uint32_t rsize = readVarint<VARINT_LSB_FIRST>(trans_, val);
+  i64 = (int64_t)val;
+  return rsize;
+}
+
+int8_t TCompactProtocol::getCompactType(const TType ttype) {
+  switch (ttype) {
+    case T_STOP:
+      return CT_STOP;
+    case T_BOOL:
+      return CT_BOOLEAN_TRUE;
+    case T_BYTE:
+      return CT_BYTE;
+    case T_I16:
+      return CT_I16;
+    case T_I32:
+      return CT_I32;
+    case T_I64:
+      return CT_I64;
+    case T_DOUBLE:
+      return CT_DOUBLE;
+    case T_STRING:
+      return CT_BINARY;
+    case T_LIST:
+      return CT_LIST;
+    case T_SET:
+      return CT_SET;
+    case T_MAP:
+      return CT_MAP;
+    case T_STRUCT:
+      return CT_STRUCT;
+    default:
+      throw TProtocolException(TProtocolException::INVALID_DATA, "Type cannot be encoded by TCompactProtocol");
+  }
+}
+
+TType TCompactProtocol::getTType(int8_t type) {
+  switch (type) {
+    case CT_STOP:
+      return T_STOP;
+    case CT_BOOLEAN_FALSE:
+    case CT_BOOLEAN_TRUE:
+      return T_BOOL;
+    case CT_BYTE:
+      return T_BYTE;
+    case CT_I16:
+      return T_I16;
+    case CT_I32:
+      return T_I32;
+    case CT_I64:
+      return T_I64;
+    case CT_DOUBLE:
+      return T_DOUBLE;
+    case CT_BINARY:
+      return T_STRING;
+    case CT_LIST:
+      return T_LIST;
+    case CT_SET:
+      return T_SET;
+    case CT_MAP:
+      return T_MAP;
+    case CT_STRUCT:
+      return T_STRUCT;
+    default:
+      throw TProtocolException(TProtocolException::INVALID_DATA, "Unknown compact type");
+  }
+}
+
+}}} // facebook::thrift::protocol
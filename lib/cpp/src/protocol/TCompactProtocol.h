@@ -0,0 +1,284 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#ifndef _THRIFT_PROTOCOL_TCOMPACTPROTOCOL_H_
+#define _THRIFT_PROTOCOL_TCOMPACTPROTOCOL_H_ 1
+
+#include "TProtocol.h"
+
+#include <stack>
+#include <boost/shared_ptr.hpp>
+
+namespace facebook { namespace thrift { namespace protocol {
+
+/**
+ * A compact binary protocol for payloads that are mostly small integers
+ * and sparsely populated structs.
+ *
+ * - Integers are ULEB128 varints.  Signed values are zigzag encoded first,
+ *   so that small negative numbers stay short too.
+ * - A field header is a single byte when the field id is at most 15 more
+ *   than the previous one: the id delta goes in the high nibble and the
+ *   type in the low nibble.  Otherwise the byte is followed by the full
+ *   id as a zigzag varint.
+ * - Bool fields carry their value in the type nibble of the field header,
+ *   so they take no space of their own.
+ * - List and set headers with fewer than 15 elements are one byte.
+ *
+ * Unlike TDenseProtocol it needs no type information from the generated
+ * code, and handles RPC messages as well as standalone structures.
+ */
+class TCompactProtocol : public TProtocol {
+ protected:
+  static const int8_t PROTOCOL_ID = (int8_t)0x82;
+  static const int8_t VERSION_N = 1;
+  static const int8_t VERSION_MASK = 0x1f;
+  static const int8_t TYPE_MASK = (int8_t)0xe0;
+  static const int32_t TYPE_SHIFT_AMOUNT = 5;
+
+  /**
+   * Type codes on the wire.  Bools are never written as a type of their
+   * own; the two codes say which value a bool field has.
+   */
+  enum Types {
+    CT_STOP          = 0x00,
+    CT_BOOLEAN_TRUE  = 0x01,
+    CT_BOOLEAN_FALSE = 0x02,
+    CT_BYTE          = 0x03,
+    CT_I16           = 0x04,
+    CT_I32           = 0x05,
+    CT_I64           = 0x06,
+    CT_DOUBLE        = 0x07,
+    CT_BINARY        = 0x08,
+    CT_LIST          = 0x09,
+    CT_SET           = 0x0A,
+    CT_MAP           = 0x0B,
+    CT_STRUCT        = 0x0C
+  };
+
+ public:
+  TCompactProtocol(boost::shared_ptr<TTransport> trans) :
+    TProtocol(trans),
+    lastFieldId_(0),
+    string_limit_(0),
+    container_limit_(0) {
+    resetState();
+  }
+
+  TCompactProtocol(boost::shared_ptr<TTransport> trans,
+                   int32_t string_limit,
+                   int32_t container_limit) :
+    TProtocol(trans),
+    lastFieldId_(0),
+    string_limit_(string_limit),
+    container_limit_(container_limit) {
+    resetState();
+  }
+
+  void setStringSizeLimit(int32_t string_limit) {
+    string_limit_ = string_limit;
+  }
+
+  void setContainerSizeLimit(int32_t container_limit) {
+    container_limit_ = container_limit;
+  }
+
+  /**
+   * Writing functions.
+   */
+
+  virtual uint32_t writeMessageBegin(const std::string& name,
+                                     const TMessageType messageType,
+                                     const int32_t seqid);
+
+  virtual uint32_t writeMessageEnd();
+
+  uint32_t writeStructBegin(const std::string& name);
+
+  uint32_t writeStructEnd();
+
+  uint32_t writeFieldBegin(const std::string& name,
+                           const TType fieldType,
+                           const int16_t fieldId);
+
+  uint32_t writeFieldEnd();
+
+  uint32_t writeFieldStop();
+
+  uint32_t writeMapBegin(const TType keyType,
+                         const TType valType,
+                         const uint32_t size);
+
+  uint32_t writeMapEnd();
+
+  uint32_t writeListBegin(const TType elemType,
+                          const uint32_t size);
+
+  uint32_t writeListEnd();
+
+  uint32_t writeSetBegin(const TType elemType,
+                         const uint32_t size);
+
+  uint32_t writeSetEnd();
+
+  uint32_t writeBool(const bool value);
+
+  uint32_t writeByte(const int8_t byte);
+
+  uint32_t writeI16(const int16_t i16);
+
+  uint32_t writeI32(const int32_t i32);
+
+  uint32_t writeI64(const int64_t i64);
+
+  uint32_t writeDouble(const double dub);
+
+  uint32_t writeString(const std::string& str);
+
+  uint32_t writeBinary(const std::string& str);
+
+  /**
+   * Reading functions
+   */
+
+  uint32_t readMessageBegin(std::string& name,
+                            TMessageType& messageType,
+                            int32_t& seqid);
+
+  uint32_t readMessageEnd();
+
+  uint32_t readStructBegin(std::string& name);
+
+  uint32_t readStructEnd();
+
+  uint32_t readFieldBegin(std::string& name,
+                          TType& fieldType,
+                          int16_t& fieldId);
+
+  uint32_t readFieldEnd();
+
+  uint32_t readMapBegin(TType& keyType,
+                        TType& valType,
+                        uint32_t& size);
+
+  uint32_t readMapEnd();
+
+  uint32_t readListBegin(TType& elemType,
+                         uint32_t& size);
+
+  uint32_t readListEnd();
+
+  uint32_t readSetBegin(TType& elemType,
+                        uint32_t& size);
+
+  uint32_t readSetEnd();
+
+  uint32_t readBool(bool& value);
+
+  uint32_t readByte(int8_t& byte);
+
+  uint32_t readI16(int16_t& i16);
+
+  uint32_t readI32(int32_t& i32);
+
+  uint32_t readI64(int64_t& i64);
+
+  uint32_t readDouble(double& dub);
+
+  uint32_t readString(std::string& str);
+
+  uint32_t readBinary(std::string& str);
+
+ protected:
+  void resetState() {
+    boolFieldPending_ = false;
+    boolValuePending_ = false;
+  }
+
+  uint32_t writeFieldBeginInternal(const TType fieldType,
+                                   const int16_t fieldId,
+                                   int8_t typeOverride);
+  uint32_t writeCollectionBegin(const TType elemType, uint32_t size);
+  uint32_t writeVarint32(uint32_t n);
+  uint32_t writeVarint64(uint64_t n);
+
+  uint32_t readVarint32(int32_t& i32);
+  uint32_t readVarint64(int64_t& i64);
+  uint32_t readCollectionBegin(TType& elemType, uint32_t& size);
+  void checkContainerSize(int32_t size);
+
+  static uint32_t i32ToZigzag(const int32_t n) {
+    return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+  }
+
+  static uint64_t i64ToZigzag(const int64_t n) {
+    return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+  }
+
+  static int32_t zigzagToI32(uint32_t n) {
+    return (n >> 1) ^ -(int32_t)(n & 1);
+  }
+
+  static int64_t zigzagToI64(uint64_t n) {
+    return (n >> 1) ^ -(int64_t)(n & 1);
+  }
+
+  static int8_t getCompactType(const TType ttype);
+  static TType getTType(int8_t type);
+
+  // Id of the last field written or read in the current struct, and
+  // those of the structs it is nested in
+  int16_t lastFieldId_;
+  std::stack<int16_t> lastField_;
+
+  // writeFieldBegin() for a bool waits for writeBool() to supply the value
+  bool boolFieldPending_;
+  int16_t boolFieldId_;
+
+  // readFieldBegin() for a bool already knows its value
+  bool boolValuePending_;
+  bool boolValue_;
+
+  int32_t string_limit_;
+  int32_t container_limit_;
+};
+
+/**
+ * Constructs compact protocol handlers
+ */
+class TCompactProtocolFactory : public TProtocolFactory {
+ public:
+  TCompactProtocolFactory() :
+    string_limit_(0),
+    container_limit_(0) {}
+
+  TCompactProtocolFactory(int32_t string_limit, int32_t container_limit) :
+    string_limit_(string_limit),
+    container_limit_(container_limit) {}
+
+  virtual ~TCompactProtocolFactory() {}
+
+  void setStringSizeLimit(int32_t string_limit) {
+    string_limit_ = string_limit;
+  }
+
+  void setContainerSizeLimit(int32_t container_limit) {
+    container_limit_ = container_limit;
+  }
+
+  boost::shared_ptr<TProtocol> getProtocol(boost::shared_ptr<TTransport> trans) {
+    return boost::shared_ptr<TProtocol>(new TCompactProtocol(trans, string_limit_, container_limit_));
+  }
+
+ private:
+  int32_t string_limit_;
+  int32_t container_limit_;
+
+};
+
+}}} // facebook::thrift::protocol
+
+#endif // #ifndef _THRIFT_PROTOCOL_TCOMPACTPROTOCOL_H_
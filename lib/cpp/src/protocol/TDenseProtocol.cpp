@@ -72,12 +72,20 @@ We use the following strategies for maintaining this invariant:
 
 Optional fields are a little tricky also.  We write a zero byte if they are
 absent and prefix them with an 0x01 byte if they are present
+
+For RPC, the message header is the version and message type, the name and
+the sequence id, written the same way as structures write them.  Starting a
+message forgets the previous TypeSpec, and the generated code sets the one
+for the arguments or result before reading or writing them.  Exceptions are
+always TApplicationExceptions, so for T_EXCEPTION messages we use our own
+TypeSpec for them without being told.
 */
 
 #define __STDC_LIMIT_MACROS
 #include <stdint.h>
 #include "TDenseProtocol.h"
 #include "TReflectionLocal.h"
+#include "TVarint.h"
 
 // Leaving this on for now.  Disabling it will turn off asserts, which should
 // give a performance boost.  When we have *really* thorough test cases,
@@ -94,6 +102,7 @@ absent and prefix them with an 0x01 byte if they are present
 #else
 #define NDEBUG
 #endif
+#include <algorithm>
 #include <cassert>
 
 using std::string;
@@ -109,6 +118,28 @@ namespace facebook { namespace thrift { namespace protocol {
 const int TDenseProtocol::FP_PREFIX_LEN =
   facebook::thrift::reflection::local::FP_PREFIX_LEN;
 
+// Local reflection for TApplicationException, as the compiler would generate
+// it for struct { 1: string message, 2: i32 type }.
+static TDenseProtocol::TypeSpec tapp_string(T_STRING);
+static TDenseProtocol::TypeSpec tapp_i32(T_I32);
+static TDenseProtocol::TypeSpec tapp_stop(T_STOP);
+static facebook::thrift::reflection::local::FieldMeta tapp_metas[] = {
+  { 1, false },
+  { 2, false },
+  { 0, false }
+};
+static TDenseProtocol::TypeSpec* tapp_specs[] = {
+  &tapp_string,
+  &tapp_i32,
+  &tapp_stop,
+};
+static const uint8_t tapp_fingerprint[] = {0xEE,0xBC,0x91,0x5C};
+static TDenseProtocol::TypeSpec tapp_typespec(
+  T_STRUCT,
+  tapp_fingerprint,
+  tapp_metas,
+  tapp_specs);
+
 // Top TypeSpec.  TypeSpec of the structure being encoded.
 #define TTS  (ts_stack_.back())  // type = TypeSpec*
 // InDeX.  Index into TTS of the current/next field to encode.
@@ -177,47 +208,12 @@ inline void TDenseProtocol::stateTransition() {
  */
 
 inline uint32_t TDenseProtocol::vlqRead(uint64_t& vlq) {
-  uint32_t used = 0;
-  uint64_t val = 0;
-  uint8_t buf[10];  // 64 bits / (7 bits/byte) = 10 bytes.
-  uint32_t buf_size = sizeof(buf);
-  const uint8_t* borrowed = trans_->borrow(buf, &buf_size);
-
-  // Fast path.  TODO(dreiss): Make it faster.
-  if (borrowed != NULL) {
-    while (true) {
-      uint8_t byte = borrowed[used];
-      used++;
-      val = (val << 7) | (byte & 0x7f);
-      if (!(byte & 0x80)) {
-        vlq = val;
-        trans_->consume(used);
-        return used;
-      }
-      // Have to check for invalid data so we don't crash.
-      if (UNLIKELY(used == sizeof(buf))) {
-        resetState();
-        throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
-      }
-    }
-  }
-
-  // Slow path.
-  else {
-    while (true) {
-      uint8_t byte;
-      used += trans_->readAll(&byte, 1);
-      val = (val << 7) | (byte & 0x7f);
-      if (!(byte & 0x80)) {
-        vlq = val;
-        return used;
-      }
-      // Might as well check for invalid data on the slow path too.
-      if (UNLIKELY(used >= sizeof(buf))) {
-        resetState();
-        throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
-      }
-    }
+  try {
+    return readVarint<VARINT_MSB_FIRST>(trans_, vlq);
+  } catch (TProtocolException&) {
+    // Over-long quantity.
+    resetState();
+    throw;
   }
 }
 
@@ -250,10 +246,23 @@ inline uint32_t TDenseProtocol::vlqWrite(uint64_t vlq) {
  * Writing functions.
  */
 
+/**
+ * Starts the state over for the structure that goes with a message,
+ * which is a TApplicationException for T_EXCEPTION messages, and otherwise
+ * whatever the generated code says it is.
+ */
+void TDenseProtocol::beginMessage(const TMessageType messageType) {
+  if (standalone_) {
+    throw TApplicationException("Standalone TDenseProtocol doesn't work with messages.");
+  }
+  resetState();
+  type_spec_ = (messageType == T_EXCEPTION) ? &tapp_typespec : NULL;
+}
+
 uint32_t TDenseProtocol::writeMessageBegin(const std::string& name,
                                            const TMessageType messageType,
                                            const int32_t seqid) {
-  throw TApplicationException("TDenseProtocol doesn't work with messages (yet).");
+  beginMessage(messageType);
 
   int32_t version = (VERSION_2) | ((int32_t)messageType);
   uint32_t wsize = 0;
@@ -273,8 +282,6 @@ uint32_t TDenseProtocol::writeStructBegin(const string& name) {
   // The TypeSpec stack should be empty if this is the top-level read/write.
   // If it is, we push the TypeSpec passed to the constructor.
   if (ts_stack_.empty()) {
-    assert(standalone_);
-
     if (type_spec_ == NULL) {
       resetState();
       throw TApplicationException("TDenseProtocol: No type specified.");
@@ -468,7 +475,9 @@ uint32_t TDenseProtocol::subWriteString(const std::string& str) {
 uint32_t TDenseProtocol::readMessageBegin(std::string& name,
                                           TMessageType& messageType,
                                           int32_t& seqid) {
-  throw TApplicationException("TDenseProtocol doesn't work with messages (yet).");
+  if (standalone_) {
+    throw TApplicationException("Standalone TDenseProtocol doesn't work with messages.");
+  }
 
   uint32_t xfer = 0;
   int32_t sz;
@@ -483,6 +492,7 @@ uint32_t TDenseProtocol::readMessageBegin(std::string& name,
     messageType = (TMessageType)(sz & 0x000000ff);
     xfer += subReadString(name);
     xfer += subReadI32(seqid);
+    beginMessage(messageType);
   } else {
     throw TProtocolException(TProtocolException::BAD_VERSION, "No version identifier... old protocol client in strict mode?");
   }
@@ -497,8 +507,6 @@ uint32_t TDenseProtocol::readStructBegin(string& name) {
   uint32_t xfer = 0;
 
   if (ts_stack_.empty()) {
-    assert(standalone_);
-
     if (type_spec_ == NULL) {
       resetState();
       throw TApplicationException("TDenseProtocol: No type specified.");
@@ -506,10 +514,20 @@ uint32_t TDenseProtocol::readStructBegin(string& name) {
       assert(type_spec_->ttype == T_STRUCT);
       ts_stack_.push_back(type_spec_);
 
-      // Check the fingerprint prefix.
+      // Check the fingerprint prefix, in place if it is buffered.
       uint8_t buf[FP_PREFIX_LEN];
-      xfer += trans_->read(buf, FP_PREFIX_LEN);
-      if (std::memcmp(buf, type_spec_->fp_prefix, FP_PREFIX_LEN) != 0) {
+      uint32_t len = FP_PREFIX_LEN;
+      const uint8_t* fp = trans_->borrow(buf, &len);
+      bool match;
+      if (fp != NULL) {
+        match = std::memcmp(fp, type_spec_->fp_prefix, FP_PREFIX_LEN) == 0;
+        trans_->consume(FP_PREFIX_LEN);
+        xfer += FP_PREFIX_LEN;
+      } else {
+        xfer += trans_->readAll(buf, FP_PREFIX_LEN);
+        match = std::memcmp(buf, type_spec_->fp_prefix, FP_PREFIX_LEN) == 0;
+      }
+      if (!match) {
         resetState();
         throw TProtocolException(TProtocolException::INVALID_DATA,
             "Fingerprint in data does not match type_spec.");
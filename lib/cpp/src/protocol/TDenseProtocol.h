@@ -22,13 +22,20 @@ namespace facebook { namespace thrift { namespace protocol {
  * There are two types of dense protocol instances.  Standalone instances
  * are not used for RPC and just encoded and decode structures of
  * a predetermined type.  Non-standalone instances are used for RPC.
- * Currently, only standalone instances exist.
  *
  * To use a standalone dense protocol object, you must set the type_spec
  * property (either in the constructor, or with setTypeSpec) to the local
  * reflection TypeSpec of the structures you will write to (or read from) the
  * protocol instance.
  *
+ * Non-standalone instances (pass standalone = false, or use
+ * TDenseProtocolFactory) read and write messages.  Code generated with
+ * -dense sets the TypeSpec of each argument and result structure after the
+ * message begins, and TApplicationExceptions look after themselves.  Since
+ * nothing in the data says what a structure holds, a message for a method
+ * the other side doesn't know can't be skipped; reading it throws, and the
+ * server closes the connection instead of answering UNKNOWN_METHOD.
+ *
  * BEST PRACTICES:
  * - Never use optional for primitives or containers.
  * - Only use optional for structures if they are very big and very rarely set.
@@ -57,15 +64,17 @@ class TDenseProtocol : public TBinaryProtocol {
   /**
    * @param tran       The transport to use.
    * @param type_spec  The TypeSpec of the structures using this protocol.
+   * @param standalone False to use this instance for RPC.
    */
   TDenseProtocol(boost::shared_ptr<TTransport> trans,
-                 TypeSpec* type_spec = NULL) :
+                 TypeSpec* type_spec = NULL,
+                 bool standalone = true) :
     TBinaryProtocol(trans),
     type_spec_(type_spec),
-    standalone_(true)
+    standalone_(standalone)
   {}
 
-  void setTypeSpec(TypeSpec* type_spec) {
+  virtual void setTypeSpec(TypeSpec* type_spec) {
     type_spec_ = type_spec;
   }
   TypeSpec* getTypeSpec() {
@@ -128,6 +137,32 @@ class TDenseProtocol : public TBinaryProtocol {
 
   virtual uint32_t writeBinary(const std::string& str);
 
+  /*
+   * Every element is a state transition and most are variable length, so
+   * lists go element by element rather than in bulk like the binary
+   * protocol does them.
+   */
+
+  uint32_t writeByteArray(const int8_t* arr, const uint32_t size) {
+    return TProtocol::writeByteArray(arr, size);
+  }
+
+  uint32_t writeI16Array(const int16_t* arr, const uint32_t size) {
+    return TProtocol::writeI16Array(arr, size);
+  }
+
+  uint32_t writeI32Array(const int32_t* arr, const uint32_t size) {
+    return TProtocol::writeI32Array(arr, size);
+  }
+
+  uint32_t writeI64Array(const int64_t* arr, const uint32_t size) {
+    return TProtocol::writeI64Array(arr, size);
+  }
+
+  uint32_t writeDoubleArray(const double* arr, const uint32_t size) {
+    return TProtocol::writeDoubleArray(arr, size);
+  }
+
 
   /*
    * Helper writing functions (don't do state transitions).
@@ -193,6 +228,34 @@ class TDenseProtocol : public TBinaryProtocol {
 
   uint32_t readBinary(std::string& str);
 
+  uint32_t readByteArray(int8_t* arr, const uint32_t size) {
+    return TProtocol::readByteArray(arr, size);
+  }
+
+  uint32_t readI16Array(int16_t* arr, const uint32_t size) {
+    return TProtocol::readI16Array(arr, size);
+  }
+
+  uint32_t readI32Array(int32_t* arr, const uint32_t size) {
+    return TProtocol::readI32Array(arr, size);
+  }
+
+  uint32_t readI64Array(int64_t* arr, const uint32_t size) {
+    return TProtocol::readI64Array(arr, size);
+  }
+
+  uint32_t readDoubleArray(double* arr, const uint32_t size) {
+    return TProtocol::readDoubleArray(arr, size);
+  }
+
+  /*
+   * Skipping needs the state transitions too, so it reads each value
+   * rather than using the binary protocol's length arithmetic.
+   */
+  uint32_t skip(TType type) {
+    return TProtocol::skip(type);
+  }
+
   /*
    * Helper reading functions (don't do state transitions).
    */
@@ -216,6 +279,9 @@ class TDenseProtocol : public TBinaryProtocol {
   inline uint32_t vlqRead(uint64_t& vlq);
   inline uint32_t vlqWrite(uint64_t vlq);
 
+  // Picks the TypeSpec of the structure that follows a message header.
+  void beginMessage(const TMessageType messageType);
+
   // Called before throwing an exception to make the object reusable.
   void resetState() {
     ts_stack_.clear();
@@ -223,8 +289,8 @@ class TDenseProtocol : public TBinaryProtocol {
     mkv_stack_.clear();
   }
 
-  // TypeSpec of the top-level structure to write,
-  // for standalone protocol objects.
+  // TypeSpec of the top-level structure to write.  Fixed for standalone
+  // protocol objects, set per structure for RPC.
   TypeSpec* type_spec_;
 
   std::vector<TypeSpec*> ts_stack_;   // TypeSpec stack.
@@ -236,6 +302,20 @@ class TDenseProtocol : public TBinaryProtocol {
   bool standalone_;
 };
 
+/**
+ * Constructs non-standalone dense protocol objects, for RPC.
+ */
+class TDenseProtocolFactory : public TProtocolFactory {
+ public:
+  TDenseProtocolFactory() {}
+
+  virtual ~TDenseProtocolFactory() {}
+
+  boost::shared_ptr<TProtocol> getProtocol(boost::shared_ptr<TTransport> trans) {
+    return boost::shared_ptr<TProtocol>(new TDenseProtocol(trans, NULL, false));
+  }
+};
+
 }}} // facebook::thrift::protocol
 
 #endif // #ifndef _THRIFT_PROTOCOL_TDENSEPROTOCOL_H_
@@ -6,10 +6,18 @@
 
 #include "TJSONProtocol.h"
 
+#include <errno.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits>
 #include "TBase64Utils.h"
 #include <transport/TTransportException.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace facebook::thrift::transport;
 
 namespace facebook { namespace thrift { namespace protocol {
@@ -224,150 +232,241 @@ static bool isJSONNumeric(uint8_t ch) {
   return false;
 }
 
-
-/**
- * Class to serve as base JSON context and as base class for other context
- * implementations
- */
-class TJSONContext {
-
- public:
-
-  TJSONContext() {};
-
-  virtual ~TJSONContext() {};
-
-  /**
-   * Write context data to the transport. Default is to do nothing.
-   */
-  virtual uint32_t write(TTransport &trans) {
-    return 0;
-  };
-
-  /**
-   * Read context data from the transport. Default is to do nothing.
-   */
-  virtual uint32_t read(TJSONProtocol::LookaheadReader &reader) {
-    return 0;
-  };
-
-  /**
-   * Return true if numbers need to be escaped as strings in this context.
-   * Default behavior is to return false.
-   */
-  virtual bool escapeNum() {
-    return false;
+// Return the first character in [p, end) that writeJSONChar() would escape,
+// i.e. a control character, '"' or '\\', or end if there is none.
+static const uint8_t* findJSONEscape(const uint8_t* p, const uint8_t* end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8(kJSONStringDelimiter);
+  const __m128i backslash = _mm_set1_epi8(kJSONBackslash);
+  const __m128i control = _mm_set1_epi8(0x1F);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    // Unsigned ch <= 0x1F exactly when max(ch, 0x1F) == 0x1F
+    __m128i hits = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                   _mm_cmpeq_epi8(chunk, backslash)),
+      _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
   }
-};
-
-// Context class for object member key-value pairs
-class JSONPairContext : public TJSONContext {
-
-public:
-
-  JSONPairContext() :
-    first_(true),
-    colon_(true) {
+#endif
+  while (p != end && *p >= 0x20 &&
+         *p != kJSONStringDelimiter && *p != kJSONBackslash) {
+    ++p;
   }
-
-  uint32_t write(TTransport &trans) {
-    if (first_) {
-      first_ = false;
-      colon_ = true;
-      return 0;
-    }
-    else {
-      trans.write(colon_ ? &kJSONPairSeparator : &kJSONElemSeparator, 1);
-      colon_ = !colon_;
-      return 1;
+  return p;
+}
+
+// Return the first '"' or '\\' in [p, end), the only characters that end a
+// run of literal characters in a JSON string being read, or end if there is
+// none.
+static const uint8_t* findJSONStringSpecial(const uint8_t* p,
+                                            const uint8_t* end) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8(kJSONStringDelimiter);
+  const __m128i backslash = _mm_set1_epi8(kJSONBackslash);
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                   _mm_cmpeq_epi8(chunk, backslash)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
     }
+    p += 16;
   }
-
-  uint32_t read(TJSONProtocol::LookaheadReader &reader) {
-    if (first_) {
-      first_ = false;
-      colon_ = true;
-      return 0;
-    }
-    else {
-      uint8_t ch = (colon_ ? kJSONPairSeparator : kJSONElemSeparator);
-      colon_ = !colon_;
-      return readSyntaxChar(reader, ch);
+#endif
+  while (p != end && *p != kJSONStringDelimiter && *p != kJSONBackslash) {
+    ++p;
+  }
+  return p;
+}
+
+// Write num in decimal into the end of the buffer that finishes at end, and
+// return where it starts.  The buffer must have room for 20 characters.
+static char* formatJSONInteger(int64_t num, char* end) {
+  uint64_t mag = (num < 0 ? 0 - (uint64_t)num : (uint64_t)num);
+  char* p = end;
+  do {
+    *--p = '0' + (char)(mag % 10);
+    mag /= 10;
+  } while (mag != 0);
+  if (num < 0) {
+    *--p = '-';
+  }
+  return p;
+}
+
+// Write num the way an ostream with a precision of 17 would, into buf, which
+// must hold at least 32 characters, and return the length.  The caller deals
+// with NaN and the infinities.
+static uint32_t formatJSONDouble(double num, char* buf) {
+  // Whole numbers of up to 17 digits print as integers, which needs neither
+  // snprintf nor any rounding
+  if (num == floor(num) && fabs(num) < 1e17) {
+    char tmp[24];
+    char* end = tmp + sizeof(tmp);
+    char* start = formatJSONInteger((int64_t)num, end);
+    if (num == 0 && signbit(num)) {
+      *--start = '-';
     }
+    memcpy(buf, start, end - start);
+    return end - start;
   }
+  return snprintf(buf, 32, "%.17g", num);
+}
 
-  // Numbers must be turned into strings if they are the key part of a pair
-  virtual bool escapeNum() {
-    return colon_;
+// Store the integer with magnitude mag, negated if neg, into num, and return
+// false if it does not fit.  Unsigned types take negative numbers modulo
+// their range, which is how negative seqids come back through uint64_t.
+template <typename NumberType>
+static bool narrowJSONInteger(bool neg, uint64_t mag, NumberType& num) {
+  uint64_t max = (uint64_t)std::numeric_limits<NumberType>::max();
+  if (std::numeric_limits<NumberType>::is_signed && neg) {
+    ++max;
   }
+  if (mag > max) {
+    return false;
+  }
+  num = (NumberType)(neg ? 0 - mag : mag);
+  return true;
+}
 
-  private:
-
-    bool first_;
-    bool colon_;
-};
-
-// Context class for lists
-class JSONListContext : public TJSONContext {
-
-public:
-
-  JSONListContext() :
-    first_(true) {
+static bool narrowJSONInteger(bool neg, uint64_t mag, bool& num) {
+  if (mag > 1 || (neg && mag != 0)) {
+    return false;
   }
+  num = (mag != 0);
+  return true;
+}
 
-  uint32_t write(TTransport &trans) {
-    if (first_) {
-      first_ = false;
-      return 0;
-    }
-    else {
-      trans.write(&kJSONElemSeparator, 1);
-      return 1;
+// Parse str, an optional sign and one or more decimal digits, into num.
+// Return false if it is anything else or does not fit.
+template <typename NumberType>
+static bool parseJSONInteger(const std::string& str, NumberType& num) {
+  const char* p = str.data();
+  const char* end = p + str.length();
+  bool neg = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    neg = (*p++ == '-');
+  }
+  if (p == end) {
+    return false;
+  }
+  uint64_t mag = 0;
+  for (; p != end; ++p) {
+    uint32_t digit = (uint8_t)*p - '0';
+    if (digit > 9 ||
+        mag > (std::numeric_limits<uint64_t>::max() - digit) / 10) {
+      return false;
     }
+    mag = mag * 10 + digit;
   }
+  return narrowJSONInteger(neg, mag, num);
+}
 
-  uint32_t read(TJSONProtocol::LookaheadReader &reader) {
-    if (first_) {
-      first_ = false;
-      return 0;
-    }
-    else {
-      return readSyntaxChar(reader, kJSONElemSeparator);
+// Parse str, which must consist of JSON numeric characters only, into num.
+// Return false if it is not a number or is too large for a double.
+static bool parseJSONDouble(const std::string& str, double& num) {
+  if (str.empty()) {
+    return false;
+  }
+  for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+    if (!isJSONNumeric(*it)) {
+      return false;
     }
   }
-
-  private:
-    bool first_;
-};
+  const char* start = str.c_str();
+  char* end;
+  errno = 0;
+  num = strtod(start, &end);
+  if (end != start + str.length()) {
+    return false;
+  }
+  return !(errno == ERANGE && fabs(num) == HUGE_VAL);
+}
 
 
 TJSONProtocol::TJSONProtocol(boost::shared_ptr<TTransport> ptrans) :
   TProtocol(ptrans),
-  context_(new TJSONContext()),
+  depth_(0),
   reader_(*ptrans) {
+  context_.type = JSONContext::BASE;
+  context_.first = true;
+  context_.colon = true;
 }
 
 TJSONProtocol::~TJSONProtocol() {}
 
-void TJSONProtocol::pushContext(boost::shared_ptr<TJSONContext> c) {
-  contexts_.push(context_);
-  context_ = c;
+void TJSONProtocol::pushContext(JSONContext::Type type) {
+  if (depth_ < INLINE_CONTEXTS) {
+    contexts_[depth_] = context_;
+  } else {
+    deepContexts_.push_back(context_);
+  }
+  ++depth_;
+  context_.type = type;
+  context_.first = true;
+  context_.colon = true;
 }
 
 void TJSONProtocol::popContext() {
-  context_ = contexts_.top();
-  contexts_.pop();
+  --depth_;
+  if (depth_ < INLINE_CONTEXTS) {
+    context_ = contexts_[depth_];
+  } else {
+    context_ = deepContexts_.back();
+    deepContexts_.pop_back();
+  }
+}
+
+// Write the separator the current context needs before the next value
+uint32_t TJSONProtocol::writeContext() {
+  if (context_.type == JSONContext::BASE) {
+    return 0;
+  }
+  if (context_.first) {
+    context_.first = false;
+    context_.colon = true;
+    return 0;
+  }
+  if (context_.type == JSONContext::PAIR) {
+    trans_->write(context_.colon ? &kJSONPairSeparator : &kJSONElemSeparator, 1);
+    context_.colon = !context_.colon;
+  } else {
+    trans_->write(&kJSONElemSeparator, 1);
+  }
+  return 1;
+}
+
+// Read the separator the current context needs before the next value
+uint32_t TJSONProtocol::readContext() {
+  if (context_.type == JSONContext::BASE) {
+    return 0;
+  }
+  if (context_.first) {
+    context_.first = false;
+    context_.colon = true;
+    return 0;
+  }
+  if (context_.type == JSONContext::PAIR) {
+    uint8_t ch = (context_.colon ? kJSONPairSeparator : kJSONElemSeparator);
+    context_.colon = !context_.colon;
+    return readSyntaxChar(reader_, ch);
+  }
+  return readSyntaxChar(reader_, kJSONElemSeparator);
 }
 
 // Write the character ch as a JSON escape sequence ("\u00xx")
 uint32_t TJSONProtocol::writeJSONEscapeChar(uint8_t ch) {
-  trans_->write((const uint8_t *)kJSONEscapePrefix.c_str(),
-                kJSONEscapePrefix.length());
-  uint8_t outCh = hexChar(ch >> 4);
-  trans_->write(&outCh, 1);
-  outCh = hexChar(ch);
-  trans_->write(&outCh, 1);
+  uint8_t buf[6];
+  memcpy(buf, kJSONEscapePrefix.data(), 4);
+  buf[4] = hexChar(ch >> 4);
+  buf[5] = hexChar(ch);
+  trans_->write(buf, 6);
   return 6;
 }
 
@@ -375,8 +474,8 @@ uint32_t TJSONProtocol::writeJSONEscapeChar(uint8_t ch) {
 uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
   if (ch >= 0x30) {
     if (ch == kJSONBackslash) { // Only special character >= 0x30 is '\'
-      trans_->write(&kJSONBackslash, 1);
-      trans_->write(&kJSONBackslash, 1);
+      uint8_t buf[2] = { kJSONBackslash, kJSONBackslash };
+      trans_->write(buf, 2);
       return 2;
     }
     else {
@@ -392,8 +491,8 @@ uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
       return 1;
     }
     else if (outCh > 1) {
-      trans_->write(&kJSONBackslash, 1);
-      trans_->write(&outCh, 1);
+      uint8_t buf[2] = { kJSONBackslash, outCh };
+      trans_->write(buf, 2);
       return 2;
     }
     else {
@@ -403,15 +502,24 @@ uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
 }
 
 // Write out the contents of the string str as a JSON string, escaping
-// characters as appropriate.
+// characters as appropriate.  Runs of characters that need no escaping are
+// written in one go.
 uint32_t TJSONProtocol::writeJSONString(const std::string &str) {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
-  std::string::const_iterator iter(str.begin());
-  std::string::const_iterator end(str.end());
-  while (iter != end) {
-    result += writeJSONChar(*iter++);
+  const uint8_t* p = (const uint8_t*)str.data();
+  const uint8_t* end = p + str.length();
+  while (p != end) {
+    const uint8_t* escape = findJSONEscape(p, end);
+    if (escape != p) {
+      trans_->write(p, escape - p);
+      result += escape - p;
+      p = escape;
+    }
+    if (p != end) {
+      result += writeJSONChar(*p++);
+    }
   }
   trans_->write(&kJSONStringDelimiter, 1);
   return result;
@@ -420,94 +528,74 @@ uint32_t TJSONProtocol::writeJSONString(const std::string &str) {
 // Write out the contents of the string as JSON string, base64-encoding
 // the string's contents, and escaping as appropriate
 uint32_t TJSONProtocol::writeJSONBase64(const std::string &str) {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
-  uint8_t b[4];
-  const uint8_t *bytes = (const uint8_t *)str.c_str();
-  uint32_t len = str.length();
-  while (len >= 3) {
-    // Encode 3 bytes at a time
-    base64_encode(bytes, 3, b);
-    trans_->write(b, 4);
-    result += 4;
-    bytes += 3;
-    len -=3;
-  }
-  if (len) { // Handle remainder
-    base64_encode(bytes, len, b);
-    trans_->write(b, len + 1);
-    result += len + 1;
-  }
+  TBase64Encoder encoder(trans_);
+  result += encoder.write((const uint8_t *)str.data(), str.length());
+  result += encoder.finish();
   trans_->write(&kJSONStringDelimiter, 1);
   return result;
 }
 
 // Convert the given integer type to a JSON number, or a string
 // if the context requires it (eg: key in a map pair).
-template <typename NumberType>
-uint32_t TJSONProtocol::writeJSONInteger(NumberType num) {
-  uint32_t result = context_->write(*trans_);
-  std::string val(boost::lexical_cast<std::string>(num));
-  bool escapeNum = context_->escapeNum();
+uint32_t TJSONProtocol::writeJSONInteger(int64_t num) {
+  uint32_t result = writeContext();
+  // Room for a sign, 19 digits and the quotes
+  char buf[24];
+  char* end = buf + sizeof(buf);
+  bool escapeNum = contextEscapeNum();
   if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+    *--end = kJSONStringDelimiter;
   }
-  trans_->write((const uint8_t *)val.c_str(), val.length());
-  result += val.length();
+  char* start = formatJSONInteger(num, end);
   if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+    *--start = kJSONStringDelimiter;
+    ++end;
   }
-  return result;
+  trans_->write((const uint8_t *)start, end - start);
+  return result + (end - start);
 }
 
 // Convert the given double to a JSON string, which is either the number,
 // "NaN" or "Infinity" or "-Infinity".
 uint32_t TJSONProtocol::writeJSONDouble(double num) {
-  uint32_t result = context_->write(*trans_);
-  std::string val(boost::lexical_cast<std::string>(num));
-
-  // Normalize output of boost::lexical_cast for NaNs and Infinities
+  uint32_t result = writeContext();
+  // An opening quote, the number and room for snprintf's terminator
+  char buf[34];
+  uint32_t len;
   bool special = false;
-  switch (val[0]) {
-  case 'N':
-  case 'n':
-    val = kThriftNan;
+  if (isnan(num)) {
+    len = kThriftNan.length();
+    memcpy(buf + 1, kThriftNan.data(), len);
     special = true;
-    break;
-  case 'I':
-  case 'i':
-    val = kThriftInfinity;
+  }
+  else if (isinf(num)) {
+    const std::string& val = (num > 0 ? kThriftInfinity
+                                      : kThriftNegativeInfinity);
+    len = val.length();
+    memcpy(buf + 1, val.data(), len);
     special = true;
-    break;
-  case '-':
-    if ((val[1] == 'I') || (val[1] == 'i')) {
-      val = kThriftNegativeInfinity;
-      special = true;
-    }
-    break;
   }
-
-  bool escapeNum = special || context_->escapeNum();
-  if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+  else {
+    len = formatJSONDouble(num, buf + 1);
   }
-  trans_->write((const uint8_t *)val.c_str(), val.length());
-  result += val.length();
-  if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+
+  uint8_t* start = (uint8_t*)buf + 1;
+  if (special || contextEscapeNum()) {
+    *--start = kJSONStringDelimiter;
+    start[++len] = kJSONStringDelimiter;
+    ++len;
   }
-  return result;
+  trans_->write(start, len);
+  return result + len;
 }
 
 uint32_t TJSONProtocol::writeJSONObjectStart() {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   trans_->write(&kJSONObjectStart, 1);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONPairContext()));
+  pushContext(JSONContext::PAIR);
   return result + 1;
 }
 
@@ -518,9 +606,9 @@ uint32_t TJSONProtocol::writeJSONObjectEnd() {
 }
 
 uint32_t TJSONProtocol::writeJSONArrayStart() {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   trans_->write(&kJSONArrayStart, 1);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONListContext()));
+  pushContext(JSONContext::LIST);
   return result + 1;
 }
 
@@ -614,9 +702,7 @@ uint32_t TJSONProtocol::writeBool(const bool value) {
 }
 
 uint32_t TJSONProtocol::writeByte(const int8_t byte) {
-  // writeByte() must be handled specially becuase boost::lexical cast sees
-  // int8_t as a text type instead of an integer type
-  return writeJSONInteger((int16_t)byte);
+  return writeJSONInteger(byte);
 }
 
 uint32_t TJSONProtocol::writeI16(const int16_t i16) {
@@ -664,13 +750,26 @@ uint32_t TJSONProtocol::readJSONEscapeChar(uint8_t *out) {
   return 4;
 }
 
-// Decodes a JSON string, including unescaping, and returns the string via str
+// Decodes a JSON string, including unescaping, and returns the string via str.
+// Runs of literal characters are copied straight out of the transport when
+// it lets us borrow them.
 uint32_t TJSONProtocol::readJSONString(std::string &str, bool skipContext) {
-  uint32_t result = (skipContext ? 0 : context_->read(reader_));
+  uint32_t result = (skipContext ? 0 : readContext());
   result += readJSONSyntaxChar(kJSONStringDelimiter);
   uint8_t ch;
   str.clear();
   while (true) {
+    uint32_t len = 1;
+    const uint8_t* buf = reader_.borrow(&len);
+    if (buf != NULL) {
+      uint32_t run = findJSONStringSpecial(buf, buf + len) - buf;
+      str.append((const char*)buf, run);
+      reader_.consume(run);
+      result += run;
+      if (run == len) {
+        continue;
+      }
+    }
     ch = reader_.read();
     ++result;
     if (ch == kJSONStringDelimiter) {
@@ -699,22 +798,11 @@ uint32_t TJSONProtocol::readJSONString(std::string &str, bool skipContext) {
 
 // Reads a block of base64 characters, decoding it, and returns via str
 uint32_t TJSONProtocol::readJSONBase64(std::string &str) {
-  std::string tmp;
-  uint32_t result = readJSONString(tmp);
-  uint8_t *b = (uint8_t *)tmp.c_str();
-  uint32_t len = tmp.length();
-  str.clear();
-  while (len >= 4) {
-    base64_decode(b, 4);
-    str.append((const char *)b, 3);
-    b += 4;
-    len -= 4;
-  }
-  // Don't decode if we hit the end or got a single leftover byte (invalid
-  // base64 but legal for skip of regular string type)
-  if (len > 1) {
-    base64_decode(b, len);
-    str.append((const char *)b, len - 1);
+  uint32_t result = readJSONString(str);
+  // Decode in place.  A single leftover byte (invalid base64 but legal for
+  // skip of regular string type) is dropped.
+  if (!str.empty()) {
+    str.resize(base64_decode_bulk((uint8_t *)&str[0], str.length()));
   }
   return result;
 }
@@ -724,6 +812,20 @@ uint32_t TJSONProtocol::readJSONBase64(std::string &str) {
 uint32_t TJSONProtocol::readJSONNumericChars(std::string &str) {
   uint32_t result = 0;
   str.clear();
+  uint32_t len = 1;
+  const uint8_t* buf = reader_.borrow(&len);
+  if (buf != NULL) {
+    uint32_t run = 0;
+    while (run < len && isJSONNumeric(buf[run])) {
+      ++run;
+    }
+    str.append((const char*)buf, run);
+    reader_.consume(run);
+    result += run;
+    if (run < len) {
+      return result;
+    }
+  }
   while (true) {
     uint8_t ch = reader_.peek();
     if (!isJSONNumeric(ch)) {
@@ -740,21 +842,17 @@ uint32_t TJSONProtocol::readJSONNumericChars(std::string &str) {
 // returning them via num
 template <typename NumberType>
 uint32_t TJSONProtocol::readJSONInteger(NumberType &num) {
-  uint32_t result = context_->read(reader_);
-  if (context_->escapeNum()) {
+  uint32_t result = readContext();
+  if (contextEscapeNum()) {
     result += readJSONSyntaxChar(kJSONStringDelimiter);
   }
   std::string str;
   result += readJSONNumericChars(str);
-  try {
-    num = boost::lexical_cast<NumberType>(str);
-  }
-  catch (boost::bad_lexical_cast e) {
-    throw new TProtocolException(TProtocolException::INVALID_DATA,
-                                 "Expected numeric value; got \"" + str +
-                                  "\"");
+  if (!parseJSONInteger(str, num)) {
+    throw TProtocolException(TProtocolException::INVALID_DATA,
+                             "Expected numeric value; got \"" + str + "\"");
   }
-  if (context_->escapeNum()) {
+  if (contextEscapeNum()) {
     result += readJSONSyntaxChar(kJSONStringDelimiter);
   }
   return result;
@@ -762,7 +860,7 @@ uint32_t TJSONProtocol::readJSONInteger(NumberType &num) {
 
 // Reads a JSON number or string and interprets it as a double.
 uint32_t TJSONProtocol::readJSONDouble(double &num) {
-  uint32_t result = context_->read(reader_);
+  uint32_t result = readContext();
   std::string str;
   if (reader_.peek() == kJSONStringDelimiter) {
     result += readJSONString(str, true);
@@ -777,43 +875,37 @@ uint32_t TJSONProtocol::readJSONDouble(double &num) {
       num = -HUGE_VAL;
     }
     else {
-      if (!context_->escapeNum()) {
+      if (!contextEscapeNum()) {
         // Throw exception -- we should not be in a string in this case
-        throw new TProtocolException(TProtocolException::INVALID_DATA,
-                                     "Numeric data unexpectedly quoted");
+        throw TProtocolException(TProtocolException::INVALID_DATA,
+                                 "Numeric data unexpectedly quoted");
       }
-      try {
-        num = boost::lexical_cast<double>(str);
-      }
-      catch (boost::bad_lexical_cast e) {
-        throw new TProtocolException(TProtocolException::INVALID_DATA,
-                                     "Expected numeric value; got \"" + str +
-                                     "\"");
+      if (!parseJSONDouble(str, num)) {
+        throw TProtocolException(TProtocolException::INVALID_DATA,
+                                 "Expected numeric value; got \"" + str +
+                                 "\"");
       }
     }
   }
   else {
-    if (context_->escapeNum()) {
+    if (contextEscapeNum()) {
       // This will throw - we should have had a quote if escapeNum == true
       readJSONSyntaxChar(kJSONStringDelimiter);
     }
     result += readJSONNumericChars(str);
-    try {
-      num = boost::lexical_cast<double>(str);
-    }
-    catch (boost::bad_lexical_cast e) {
-      throw new TProtocolException(TProtocolException::INVALID_DATA,
-                                   "Expected numeric value; got \"" + str +
-                                   "\"");
+    if (!parseJSONDouble(str, num)) {
+      throw TProtocolException(TProtocolException::INVALID_DATA,
+                               "Expected numeric value; got \"" + str +
+                               "\"");
     }
   }
   return result;
 }
 
 uint32_t TJSONProtocol::readJSONObjectStart() {
-  uint32_t result = context_->read(reader_);
+  uint32_t result = readContext();
   result += readJSONSyntaxChar(kJSONObjectStart);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONPairContext()));
+  pushContext(JSONContext::PAIR);
   return result;
 }
 
@@ -824,9 +916,9 @@ uint32_t TJSONProtocol::readJSONObjectEnd() {
 }
 
 uint32_t TJSONProtocol::readJSONArrayStart() {
-  uint32_t result = context_->read(reader_);
+  uint32_t result = readContext();
   result += readJSONSyntaxChar(kJSONArrayStart);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONListContext()));
+  pushContext(JSONContext::LIST);
   return result;
 }
 
@@ -947,10 +1039,9 @@ uint32_t TJSONProtocol::readBool(bool& value) {
   return readJSONInteger(value);
 }
 
-// readByte() must be handled properly becuase boost::lexical cast sees int8_t
-// as a text type instead of an integer type
+// readByte() reads an i16 so that bytes written as unsigned values still fit
 uint32_t TJSONProtocol::readByte(int8_t& byte) {
-  int16_t tmp = (int16_t) byte;
+  int16_t tmp = 0;
   uint32_t result =  readJSONInteger(tmp);
   assert(tmp < 256);
   byte = (int8_t)tmp;
@@ -10,13 +10,10 @@
 #include "TProtocol.h"
 #include <transport/TTransportUtils.h>
 
-#include <stack>
+#include <vector>
 
 namespace facebook { namespace thrift { namespace protocol {
 
-// Forward declaration
-class TJSONContext;
-
 /**
  * JSON protocol for Thrift.
  *
@@ -68,11 +65,11 @@ class TJSONContext;
  * More discussion of the double handling is probably warranted. The aim of
  * the current implementation is to match as closely as possible the behavior
  * of Java's Double.toString(), which has no precision loss.  Implementors in
- * other languages should strive to achieve that where possible. I have not
- * yet verified whether boost:lexical_cast, which is doing that work for me in
- * C++, loses any precision, but I am leaving this as a future improvement. I
- * may try to provide a C component for this, so that other languages could
- * bind to the same underlying implementation for maximum consistency.
+ * other languages should strive to achieve that where possible. C++ writes
+ * doubles with 17 significant digits, the way boost::lexical_cast used to,
+ * which always reads back as the same double but is not always the shortest
+ * string that would.  Shorter output would change the bytes we produce, so
+ * it is left as a future improvement.
  *
  * Note further that JavaScript itself is not capable of representing
  * floating point infinities -- presumably when we have a JavaScript Thrift
@@ -90,10 +87,35 @@ class TJSONProtocol : public TProtocol {
 
  private:
 
-  void pushContext(boost::shared_ptr<TJSONContext> c);
+  /**
+   * Where we are in the JSON: what separator, if any, comes before the next
+   * value, and whether numbers have to be quoted there.
+   */
+  struct JSONContext {
+    enum Type {
+      BASE,  // Top level, nothing to separate
+      PAIR,  // Object, alternating between keys and values
+      LIST   // Array
+    };
+
+    uint8_t type;
+    bool first;
+    bool colon;
+  };
+
+  void pushContext(JSONContext::Type type);
 
   void popContext();
 
+  uint32_t writeContext();
+
+  uint32_t readContext();
+
+  bool contextEscapeNum() const {
+    // Numbers must be turned into strings if they are the key part of a pair
+    return context_.type == JSONContext::PAIR && context_.colon;
+  }
+
   uint32_t writeJSONEscapeChar(uint8_t ch);
 
   uint32_t writeJSONChar(uint8_t ch);
@@ -102,8 +124,7 @@ class TJSONProtocol : public TProtocol {
 
   uint32_t writeJSONBase64(const std::string &str);
 
-  template <typename NumberType>
-  uint32_t writeJSONInteger(NumberType num);
+  uint32_t writeJSONInteger(int64_t num);
 
   uint32_t writeJSONDouble(double num);
 
@@ -273,6 +294,19 @@ class TJSONProtocol : public TProtocol {
       return data_;
     }
 
+    // Borrows at least *len bytes straight from the transport, or returns
+    // NULL if it can't, or if there is a peeked character to read first
+    const uint8_t* borrow(uint32_t* len) {
+      if (hasData_) {
+        return NULL;
+      }
+      return trans_->borrow(NULL, len);
+    }
+
+    void consume(uint32_t len) {
+      trans_->consume(len);
+    }
+
    private:
     TTransport *trans_;
     bool hasData_;
@@ -281,8 +315,14 @@ class TJSONProtocol : public TProtocol {
 
  private:
 
-  std::stack<boost::shared_ptr<TJSONContext> > contexts_;
-  boost::shared_ptr<TJSONContext> context_;
+  // The contexts we are nested in are kept in place up to this depth, and
+  // only anything deeper goes to the heap
+  static const uint32_t INLINE_CONTEXTS = 64;
+
+  JSONContext context_;
+  JSONContext contexts_[INLINE_CONTEXTS];
+  std::vector<JSONContext> deepContexts_;
+  uint32_t depth_;
   LookaheadReader reader_;
 };
 
@@ -161,6 +161,53 @@ class TProtocol {
 
   virtual uint32_t writeBinary(const std::string& str) = 0;
 
+  /**
+   * Write the elements of a list of a primitive type, between
+   * writeListBegin() and writeListEnd().  These write them one at a time;
+   * protocols with a fixed width encoding override them to write the lot
+   * at once.
+   */
+
+  virtual uint32_t writeByteArray(const int8_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += writeByte(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t writeI16Array(const int16_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += writeI16(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t writeI32Array(const int32_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += writeI32(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t writeI64Array(const int64_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += writeI64(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t writeDoubleArray(const double* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += writeDouble(arr[i]);
+    }
+    return xfer;
+  }
+
   /**
    * Reading functions
    */
@@ -214,9 +261,58 @@ class TProtocol {
   virtual uint32_t readBinary(std::string& str) = 0;
 
   /**
-   * Method to arbitrarily skip over data.
+   * Read the elements of a list of a primitive type into an array that
+   * already has room for size of them, between readListBegin() and
+   * readListEnd().
    */
-  uint32_t skip(TType type) {
+
+  virtual uint32_t readByteArray(int8_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += readByte(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t readI16Array(int16_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += readI16(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t readI32Array(int32_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += readI32(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t readI64Array(int64_t* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += readI64(arr[i]);
+    }
+    return xfer;
+  }
+
+  virtual uint32_t readDoubleArray(double* arr, const uint32_t size) {
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+      xfer += readDouble(arr[i]);
+    }
+    return xfer;
+  }
+
+  /**
+   * Method to arbitrarily skip over data.  This version reads every value
+   * into a temporary; protocols that can tell how long a value is without
+   * decoding it override it.  Proxies can skip(T_STRUCT) to get past a
+   * whole struct they don't need to look at.
+   */
+  virtual uint32_t skip(TType type) {
     switch (type) {
     case T_BOOL:
       {
@@ -314,6 +410,14 @@ class TProtocol {
     }
   }
 
+  /**
+   * Tells the protocol the local reflection of the next top-level structure
+   * it reads or writes.  Only protocols that leave field ids and types out
+   * of the data, like TDenseProtocol, need it; the others ignore it.  Code
+   * generated with -dense calls it before every RPC argument and result.
+   */
+  virtual void setTypeSpec(reflection::local::TypeSpec* type_spec) {}
+
   inline boost::shared_ptr<TTransport> getTransport() {
     return ptrans_;
   }
@@ -0,0 +1,131 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#ifndef _THRIFT_PROTOCOL_TVARINT_H_
+#define _THRIFT_PROTOCOL_TVARINT_H_ 1
+
+#include "TProtocol.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace facebook { namespace thrift { namespace protocol {
+
+/**
+ * Borrows whatever the transport has buffered, asking for a single byte.
+ * Buffered transports hand back everything they hold anyway, so the caller
+ * usually gets plenty to decode from in place.  Asking for more would make
+ * the transport block for it, and a short value that is the very last
+ * thing in the input (a small varint, a T_STOP) would then wait for bytes
+ * that never come.  Callers have to check *len before looking past the
+ * first byte.  Returns NULL if the transport cannot borrow.
+ */
+template <class Transport_>
+inline const uint8_t* borrowBuffered(Transport_* trans, uint8_t buf[1],
+                                     uint32_t* len) {
+  *len = 1;
+  return transport::TTransportDirect<Transport_>::borrow(trans, buf, len);
+}
+
+/**
+ * Which end of a varint the first byte holds: the low seven bits
+ * (TCompactProtocol) or the high ones (TDenseProtocol).
+ */
+enum TVarintOrder {
+  VARINT_LSB_FIRST,
+  VARINT_MSB_FIRST
+};
+
+/**
+ * Reads a base-128 varint of at most ten bytes, the last with its top bit
+ * clear.  Decodes straight from the transport's buffer when the whole
+ * varint is there, and otherwise reads a byte at a time.
+ *
+ * @return the number of bytes read
+ * @throws TProtocolException if ten bytes go by without the varint ending
+ */
+template <TVarintOrder Order_, class Transport_>
+inline uint32_t readVarint(Transport_* trans, uint64_t& value) {
+  uint32_t used = 0;
+  uint64_t val = 0;
+  int shift = 0;
+  const uint32_t MAX_BYTES = 10;  // 64 bits / (7 bits/byte)
+
+  uint8_t buf[1];
+  uint32_t buf_size;
+  const uint8_t* borrowed = borrowBuffered(trans, buf, &buf_size);
+
+  // Fast path, the whole varint is in the borrowed bytes.
+  if (borrowed != NULL) {
+#ifdef __GNUC__
+    // With eight bytes in hand, find the last byte of the varint and gather
+    // its seven bit groups a word at a time.  Only varints longer than
+    // eight bytes (negative numbers) go through the loop below.
+    if (Order_ == VARINT_MSB_FIRST && buf_size >= 8) {
+      uint64_t word;
+      std::memcpy(&word, borrowed, 8);
+      word = ntohll(word);  // First byte in the top eight bits.
+      uint64_t ends = ~word & 0x8080808080808080ULL;
+      if (ends != 0) {
+        used = __builtin_clzll(ends) / 8 + 1;
+        word >>= (8 - used) * 8;
+        word = ((word & 0x7f007f007f007f00ULL) >> 1) | (word & 0x007f007f007f007fULL);
+        word = ((word & 0x3fff00003fff0000ULL) >> 2) | (word & 0x00003fff00003fffULL);
+        word = ((word & 0x0fffffff00000000ULL) >> 4) | (word & 0x000000000fffffffULL);
+        value = word;
+        transport::TTransportDirect<Transport_>::consume(trans, used);
+        return used;
+      }
+    }
+#endif
+    uint32_t avail = std::min(buf_size, MAX_BYTES);
+    while (used < avail) {
+      uint8_t byte = borrowed[used];
+      used++;
+      if (Order_ == VARINT_MSB_FIRST) {
+        val = (val << 7) | (byte & 0x7f);
+      } else {
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+      }
+      if (!(byte & 0x80)) {
+        value = val;
+        transport::TTransportDirect<Transport_>::consume(trans, used);
+        return used;
+      }
+    }
+    if (used == MAX_BYTES) {
+      throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
+    }
+    // It runs past the end of the buffer, start over on the slow path.
+    used = 0;
+    val = 0;
+    shift = 0;
+  }
+
+  // Slow path.
+  while (true) {
+    uint8_t byte;
+    used += transport::TTransportDirect<Transport_>::readAll(trans, &byte, 1);
+    if (Order_ == VARINT_MSB_FIRST) {
+      val = (val << 7) | (byte & 0x7f);
+    } else {
+      val |= (uint64_t)(byte & 0x7f) << shift;
+      shift += 7;
+    }
+    if (!(byte & 0x80)) {
+      value = val;
+      return used;
+    }
+    if (used >= MAX_BYTES) {
+      throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
+    }
+  }
+}
+
+}}} // facebook::thrift::protocol
+
+#endif // #ifndef _THRIFT_PROTOCOL_TVARINT_H_
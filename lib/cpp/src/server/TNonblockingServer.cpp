@@ -5,8 +5,12 @@
 // http://developers.facebook.com/thrift/
 
 #include "TNonblockingServer.h"
+#include <concurrency/PosixThreadFactory.h>
+#include <concurrency/Exception.h>
+#include <concurrency/Util.h>
 
 #include <iostream>
+#include <algorithm>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -14,59 +18,469 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 namespace facebook { namespace thrift { namespace server {
 
 using namespace facebook::thrift::protocol;
 using namespace facebook::thrift::transport;
+using namespace facebook::thrift::concurrency;
 using namespace std;
 
+/**
+ * Answers the request on in with a TApplicationException carrying message,
+ * the way a processor answers a method it doesn't know.
+ */
+static void replyOverloaded(TProtocol* in, TProtocol* out,
+                            const string& message) {
+  string fname;
+  TMessageType mtype;
+  int32_t seqid;
+  in->readMessageBegin(fname, mtype, seqid);
+  in->skip(T_STRUCT);
+  in->readMessageEnd();
+  in->getTransport()->readEnd();
+
+  TApplicationException x(TApplicationException::UNKNOWN, message);
+  out->writeMessageBegin(fname, T_EXCEPTION, seqid);
+  x.write(out);
+  out->writeMessageEnd();
+  out->getTransport()->flush();
+  out->getTransport()->writeEnd();
+}
+
+/**
+ * One of a connection's pipelined requests, with transports of its own so
+ * that several can be processed at once.  Kept by the connection for reuse.
+ */
+struct TConnection::Request {
+  // The frame, taken over from the connection's read buffer
+  uint8_t* buffer;
+  uint32_t bufferSize;
+
+  // Bytes that count as in flight until the task comes back
+  uint32_t inFlightBytes;
+
+  // Capacity of output as last counted by the server
+  uint32_t writeBufferCounted;
+
+  // Close rather than answer once the task comes back
+  bool closeConnection;
+
+  // Next in the connection's list of finished requests
+  Request* nextFinished;
+
+  boost::shared_ptr<TMemoryBuffer> input;
+  boost::shared_ptr<TMemoryBuffer> output;
+  boost::shared_ptr<TTransport> factoryInput;
+  boost::shared_ptr<TTransport> factoryOutput;
+  boost::shared_ptr<TProtocol> inputProtocol;
+  boost::shared_ptr<TProtocol> outputProtocol;
+
+  void releaseBuffer(TNonblockingServer* server) {
+    if (buffer != NULL) {
+      server->getBufferPool()->release(buffer, bufferSize);
+      server->addReadBufferBytes(-(int64_t)bufferSize);
+      buffer = NULL;
+      bufferSize = 0;
+    }
+  }
+
+  void countOutput(TNonblockingServer* server) {
+    uint32_t size = output->getBufferSize();
+    server->addWriteBufferBytes((int64_t)size - writeBufferCounted);
+    writeBufferCounted = size;
+  }
+};
+
 class TConnection::Task: public Runnable {
  public:
   Task(boost::shared_ptr<TProcessor> processor,
        boost::shared_ptr<TProtocol> input,
        boost::shared_ptr<TProtocol> output,
-       int taskHandle) :
+       TConnection* connection,
+       Request* request = NULL) :
     processor_(processor),
     input_(input),
     output_(output),
-    taskHandle_(taskHandle) {}
+    connection_(connection),
+    request_(request),
+    queued_(Util::currentTime()) {}
 
   void run() {
-    try {
-      while (processor_->process(input_, output_)) {
-        if (!input_->getTransport()->peek()) {
-          break;
+    TNonblockingServer* server = connection_->server_;
+    int64_t expireTime = server->getTaskExpireTime();
+    if (expireTime > 0 && Util::currentTime() - queued_ > expireTime) {
+      server->addTaskExpired();
+      expire(server);
+    } else {
+      try {
+        while (processor_->process(input_, output_)) {
+          if (!input_->getTransport()->peek()) {
+            break;
+          }
         }
+      } catch (TTransportException& ttx) {
+        cerr << "TNonblockingServer client died: " << ttx.what() << endl;
+      } catch (TException& x) {
+        cerr << "TNonblockingServer exception: " << x.what() << endl;
+      } catch (...) {
+        cerr << "TNonblockingServer uncaught exception." << endl;
       }
-    } catch (TTransportException& ttx) {
-      cerr << "TNonblockingServer client died: " << ttx.what() << endl;
-    } catch (TException& x) {
-      cerr << "TNonblockingServer exception: " << x.what() << endl;
-    } catch (...) {
-      cerr << "TNonblockingServer uncaught exception." << endl;
     }
 
-    // Signal completion back to the libevent thread via a socketpair
-    int8_t b = 0;
-    if (-1 == send(taskHandle_, &b, sizeof(int8_t), 0)) {
-      GlobalOutput("TNonblockingServer::Task: send");
-    }
-    if (-1 == ::close(taskHandle_)) {
-      GlobalOutput("TNonblockingServer::Task: close, possible resource leak");
+    // Signal completion back to the libevent thread
+    if (request_ != NULL) {
+      connection_->requestFinished(request_);
+    } else {
+      connection_->ioThread_->taskCompleted(connection_);
     }
   }
 
  private:
+  // Sheds a task that waited too long for a worker
+  void expire(TNonblockingServer* server) {
+    if (server->getOverloadAction() == TNonblockingServer::OVERLOAD_REPLY) {
+      try {
+        replyOverloaded(input_.get(), output_.get(),
+                        "TNonblockingServer overloaded: task expired");
+        return;
+      } catch (TException& x) {
+        cerr << "TNonblockingServer exception: " << x.what() << endl;
+      }
+    }
+    if (request_ != NULL) {
+      request_->closeConnection = true;
+    } else {
+      connection_->closeAfterTask_ = true;
+    }
+  }
+
   boost::shared_ptr<TProcessor> processor_;
   boost::shared_ptr<TProtocol> input_;
   boost::shared_ptr<TProtocol> output_;
-  int taskHandle_;
+  TConnection* connection_;
+
+  // The pipelined request this is, or NULL
+  Request* request_;
+
+  // When the task was queued, in milliseconds
+  int64_t queued_;
 };
 
-void TConnection::init(int socket, short eventFlags, TNonblockingServer* s) {
+TConnection::TConnection(int socket, short eventFlags,
+                         TNonblockingIOThread* ioThread) {
+  server_ = ioThread->getServer();
+
+  readBuffer_ = server_->getBufferPool()->acquire(READ_BUFFER_SIZE, &readBufferSize_);
+  server_->addReadBufferBytes(readBufferSize_);
+
+  // Allocate input and output tranpsorts
+  // these only need to be allocated once per TConnection (they don't need to be
+  // reallocated on init() call)
+  inputTransport_ = boost::shared_ptr<TMemoryBuffer>(new TMemoryBuffer(readBuffer_, readBufferSize_));
+  outputTransport_ = boost::shared_ptr<TMemoryBuffer>(new TMemoryBuffer());
+  writeBufferCounted_ = 0;
+  countWriteBuffer();
+
+  init(socket, eventFlags, ioThread);
+}
+
+TConnection::~TConnection() {
+  server_->getBufferPool()->release(readBuffer_, readBufferSize_);
+  server_->addReadBufferBytes(-(int64_t)readBufferSize_);
+  server_->addWriteBufferBytes(-(int64_t)writeBufferCounted_);
+
+  while (!spareRequests_.empty()) {
+    Request* request = spareRequests_.top();
+    spareRequests_.pop();
+    server_->addWriteBufferBytes(-(int64_t)request->writeBufferCounted);
+    delete request;
+  }
+}
+
+void TConnection::resizeReadBuffer(uint32_t len) {
+  uint32_t size;
+  uint8_t* buffer = server_->getBufferPool()->acquire(len, &size);
+  memcpy(buffer, readBuffer_, std::min(readBufferPos_, size));
+
+  server_->getBufferPool()->release(readBuffer_, readBufferSize_);
+  server_->addReadBufferBytes((int64_t)size - readBufferSize_);
+  readBuffer_ = buffer;
+  readBufferSize_ = size;
+}
+
+void TConnection::countWriteBuffer() {
+  uint32_t size = outputTransport_->getBufferSize();
+  server_->addWriteBufferBytes((int64_t)size - writeBufferCounted_);
+  writeBufferCounted_ = size;
+}
+
+void TConnection::shrinkBuffers(uint32_t readLimit, uint32_t writeLimit) {
+  if (readBufferSize_ > readLimit && readBufferSize_ > READ_BUFFER_SIZE) {
+    readBufferPos_ = 0;
+    resizeReadBuffer(READ_BUFFER_SIZE);
+  }
+
+  if (outputTransport_->getBufferSize() > writeLimit &&
+      outputTransport_->getBufferSize() > TMemoryBuffer::defaultSize) {
+    // Swapping keeps the object the output protocol writes through
+    TMemoryBuffer fresh;
+    outputTransport_->swap(fresh);
+    countWriteBuffer();
+  }
+}
+
+bool TConnection::shedRequest(const std::string& reason,
+                              TProtocol* input, TProtocol* output) {
+  if (server_->getOverloadAction() == TNonblockingServer::OVERLOAD_REPLY) {
+    try {
+      replyOverloaded(input, output, "TNonblockingServer overloaded: " + reason);
+      return true;
+    } catch (TException& x) {
+      // Nothing to do but close, e.g. if the request can't be skipped
+      fprintf(stderr, "TConnection::shedRequest() %s\n", x.what());
+    }
+  }
+  close();
+  return false;
+}
+
+TConnection::Request* TConnection::newRequest() {
+  Request* request;
+  if (spareRequests_.empty()) {
+    request = new Request();
+    request->input = boost::shared_ptr<TMemoryBuffer>(new TMemoryBuffer());
+    request->output = boost::shared_ptr<TMemoryBuffer>(new TMemoryBuffer());
+    request->countOutput(server_);
+    request->factoryInput = server_->getInputTransportFactory()->getTransport(request->input);
+    request->factoryOutput = server_->getOutputTransportFactory()->getTransport(request->output);
+    request->inputProtocol = server_->getInputProtocolFactory()->getProtocol(request->factoryInput);
+    request->outputProtocol = server_->getOutputProtocolFactory()->getProtocol(request->factoryOutput);
+  } else {
+    request = spareRequests_.top();
+    spareRequests_.pop();
+  }
+  request->inFlightBytes = 0;
+  request->closeConnection = false;
+  request->nextFinished = NULL;
+  return request;
+}
+
+void TConnection::recycleRequest(Request* request) {
+  request->releaseBuffer(server_);
+
+  // Idle until reused, so don't sit on a big response buffer
+  if (request->output->getBufferSize() > server_->getIdleWriteBufferLimit() &&
+      request->output->getBufferSize() > TMemoryBuffer::defaultSize) {
+    TMemoryBuffer fresh;
+    request->output->swap(fresh);
+  }
+  request->output->resetBuffer();
+  request->countOutput(server_);
+
+  spareRequests_.push(request);
+}
+
+void TConnection::dispatchRequest() {
+  std::string reason;
+
+  // The request takes the read buffer with the frame in it, and reading
+  // goes on in a fresh one
+  uint32_t size;
+  uint8_t* buffer;
+  try {
+    buffer = server_->getBufferPool()->acquire(READ_BUFFER_SIZE, &size);
+  } catch (TTransportException& ttx) {
+    GlobalOutput("TConnection::dispatchRequest() out of memory");
+    close();
+    return;
+  }
+  server_->addReadBufferBytes(size);
+
+  Request* request = newRequest();
+  request->buffer = readBuffer_;
+  request->bufferSize = readBufferSize_;
+  request->input->resetBuffer(readBuffer_, readBufferPos_);
+  readBuffer_ = buffer;
+  readBufferSize_ = size;
+
+  if (server_->getFrameResponses()) {
+    // Room for the frame size, which startResponse() fills in
+    uint8_t frameSize[4] = { 0, 0, 0, 0 };
+    request->output->write(frameSize, sizeof(frameSize));
+  }
+  ++requestsInFlight_;
+
+  bool admitted = server_->admitRequest(readBufferPos_, reason);
+  if (admitted) {
+    request->inFlightBytes = readBufferPos_;
+    ++requestsRunning_;
+    boost::shared_ptr<Runnable> task =
+      boost::shared_ptr<Runnable>(new Task(server_->getProcessor(),
+                                           request->inputProtocol,
+                                           request->outputProtocol,
+                                           this,
+                                           request));
+    // Once added, the request belongs to the worker until it hands it back
+    if (!server_->addTask(task)) {
+      --requestsRunning_;
+      server_->releaseRequest(request->inFlightBytes);
+      request->inFlightBytes = 0;
+      reason = "too many pending tasks";
+      admitted = false;
+    }
+  }
+
+  if (!admitted) {
+    // Keep track of the request, since shedding it may close the connection
+    responses_.push_back(request);
+    bool answered = shedRequest(reason, request->inputProtocol.get(),
+                                request->outputProtocol.get());
+    if (!answered) {
+      return;
+    }
+    responses_.pop_back();
+    request->releaseBuffer(server_);
+    request->countOutput(server_);
+    queueResponse(request);
+  }
+
+  // On to the next frame
+  readBufferPos_ = 0;
+  readWant_ = 4;
+  appState_ = APP_READ_FRAME_SIZE;
+  setPipelinedFlags();
+}
+
+void TConnection::requestFinished(Request* request) {
+  Request* head;
+  do {
+    head = finished_;
+    request->nextFinished = head;
+  } while (!__sync_bool_compare_and_swap(&finished_, head, request));
+
+  // As with the IO thread's list, only the push that finds this one empty
+  // needs to wake the loop
+  if (head == NULL) {
+    ioThread_->taskCompleted(this);
+  }
+}
+
+void TConnection::finishRequests() {
+  Request* list = __sync_lock_test_and_set(&finished_, (Request*)NULL);
+
+  // Answer them in the order they finished
+  Request* ordered = NULL;
+  while (list != NULL) {
+    Request* next = list->nextFinished;
+    list->nextFinished = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  bool closeNow = false;
+  while (ordered != NULL) {
+    Request* request = ordered;
+    ordered = request->nextFinished;
+    request->nextFinished = NULL;
+
+    --requestsRunning_;
+    server_->releaseRequest(request->inFlightBytes);
+    request->inFlightBytes = 0;
+    request->releaseBuffer(server_);
+    request->countOutput(server_);
+
+    closeNow = closeNow || request->closeConnection;
+    if (closing_ || closeNow) {
+      recycleRequest(request);
+      --requestsInFlight_;
+    } else {
+      queueResponse(request);
+    }
+  }
+
+  if (closing_) {
+    // The last of them lets the connection go
+    if (requestsRunning_ == 0) {
+      finishClose();
+    }
+  } else if (closeNow) {
+    close();
+  } else {
+    setPipelinedFlags();
+  }
+}
+
+void TConnection::queueResponse(Request* request) {
+  // Async calls have nothing to answer
+  uint32_t frameBytes = server_->getFrameResponses() ? 4 : 0;
+  if (request->output->available() <= frameBytes) {
+    recycleRequest(request);
+    --requestsInFlight_;
+    return;
+  }
+
+  responses_.push_back(request);
+  if (responses_.size() == 1) {
+    startResponse();
+  }
+}
+
+void TConnection::startResponse() {
+  responses_.front()->output->getBuffer(&writeBuffer_, &writeBufferSize_);
+  writeBufferPos_ = 0;
+
+  if (server_->getFrameResponses()) {
+    int32_t frameSize = (int32_t)htonl(writeBufferSize_ - 4);
+    memcpy(writeBuffer_, &frameSize, sizeof(frameSize));
+  }
+}
+
+bool TConnection::writeResponses() {
+  int flags = 0;
+  #ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+  #endif // ifdef MSG_NOSIGNAL
+
+  while (!responses_.empty()) {
+    int left = writeBufferSize_ - writeBufferPos_;
+    int sent = send(socket_, writeBuffer_ + writeBufferPos_, left, flags);
+
+    if (sent <= 0) {
+      // Blocking errors are okay, just move on
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno != EPIPE) {
+        GlobalOutput("TConnection::writeResponses() send -1");
+      }
+      close();
+      return false;
+    }
+
+    writeBufferPos_ += sent;
+    if (sent < left) {
+      // The socket is full
+      break;
+    }
+
+    recycleRequest(responses_.front());
+    responses_.pop_front();
+    --requestsInFlight_;
+    if (!responses_.empty()) {
+      startResponse();
+    }
+  }
+
+  setPipelinedFlags();
+  return true;
+}
+
+void TConnection::init(int socket, short eventFlags, TNonblockingIOThread* ioThread) {
   socket_ = socket;
-  server_ = s;
+  server_ = ioThread->getServer();
+  ioThread_ = ioThread;
   appState_ = APP_INIT;
   eventFlags_ = 0;
 
@@ -80,18 +494,27 @@ void TConnection::init(int socket, short eventFlags, TNonblockingServer* s) {
   socketState_ = SOCKET_RECV;
   appState_ = APP_INIT;
 
-  taskHandle_ = -1;
+  nextCompleted_ = NULL;
+  inFlightBytes_ = 0;
+  closeAfterTask_ = false;
+
+  pipelined_ = server_->isThreadPoolProcessing() &&
+    server_->getMaxPipelinedRequests() > 1;
+  requestsInFlight_ = 0;
+  requestsRunning_ = 0;
+  finished_ = NULL;
+  closing_ = false;
 
   // Set flags, which also registers the event
   setFlags(eventFlags);
 
   // get input/transports
-  factoryInputTransport_ = s->getInputTransportFactory()->getTransport(inputTransport_);
-  factoryOutputTransport_ = s->getOutputTransportFactory()->getTransport(outputTransport_);
+  factoryInputTransport_ = server_->getInputTransportFactory()->getTransport(inputTransport_);
+  factoryOutputTransport_ = server_->getOutputTransportFactory()->getTransport(outputTransport_);
 
   // Create protocol
-  inputProtocol_ = s->getInputProtocolFactory()->getProtocol(factoryInputTransport_);
-  outputProtocol_ = s->getOutputProtocolFactory()->getProtocol(factoryOutputTransport_);
+  inputProtocol_ = server_->getInputProtocolFactory()->getProtocol(factoryInputTransport_);
+  outputProtocol_ = server_->getOutputProtocolFactory()->getProtocol(factoryOutputTransport_);
 }
 
 void TConnection::workSocket() {
@@ -103,14 +526,12 @@ void TConnection::workSocket() {
     // It is an error to be in this state if we already have all the data
     assert(readBufferPos_ < readWant_);
 
-    // Double the buffer size until it is big enough
+    // Get a buffer from the pool that is big enough
     if (readWant_ > readBufferSize_) {
-      while (readWant_ > readBufferSize_) {
-        readBufferSize_ *= 2;
-      }
-      readBuffer_ = (uint8_t*)std::realloc(readBuffer_, readBufferSize_);
-      if (readBuffer_ == NULL) {
-        GlobalOutput("TConnection::workSocket() realloc");
+      try {
+        resizeReadBuffer(readWant_);
+      } catch (TTransportException& ttx) {
+        GlobalOutput("TConnection::workSocket() out of memory");
         close();
         return;
       }
@@ -204,59 +625,73 @@ void TConnection::workSocket() {
  * another. This means that it has finished writing the data that it needed
  * to, or finished receiving the data that it needed to.
  */
+void TConnection::workPipelined(short which) {
+  if ((which & EV_WRITE) && !writeResponses()) {
+    return;
+  }
+
+  // Reading may have just been turned off, by a request that came in
+  if ((which & EV_READ) &&
+      requestsInFlight_ < server_->getMaxPipelinedRequests()) {
+    workSocket();
+  }
+}
+
 void TConnection::transition() {
 
   int sz = 0;
+  std::string reason;
 
   // Switch upon the state that we are currently in and move to a new state
   switch (appState_) {
 
   case APP_READ_REQUEST:
+    if (pipelined_) {
+      dispatchRequest();
+      return;
+    }
+
     // We are done reading the request, package the read buffer into transport
     // and get back some data from the dispatch function
     inputTransport_->resetBuffer(readBuffer_, readBufferPos_);
     outputTransport_->resetBuffer();
 
-    if (server_->isThreadPoolProcessing()) {
+    if (!server_->admitRequest(readBufferPos_, reason)) {
+      // Fall through with the exception to send, unless we closed
+      if (!shedRequest(reason, inputProtocol_.get(), outputProtocol_.get())) {
+        return;
+      }
+    } else if (server_->isThreadPoolProcessing()) {
+      inFlightBytes_ = readBufferPos_;
+
       // We are setting up a Task to do this work and we will wait on it
-      int sv[2];
-      if (-1 == socketpair(AF_LOCAL, SOCK_STREAM, 0, sv)) {
-        GlobalOutput("TConnection::socketpair() failed");
-        // Now we will fall through to the APP_WAIT_TASK block with no response
-      } else {
-        // Create task and dispatch to the thread manager
-        boost::shared_ptr<Runnable> task =
-          boost::shared_ptr<Runnable>(new Task(server_->getProcessor(),
-                                               inputProtocol_,
-                                               outputProtocol_,
-                                               sv[1]));
-        // The application is now waiting on the task to finish
-        appState_ = APP_WAIT_TASK;
-
-        // Create an event to be notified when the task finishes
-        event_set(&taskEvent_,
-                  taskHandle_ = sv[0],
-                  EV_READ,
-                  TConnection::taskHandler,
-                  this);
-
-        // Attach to the base
-        event_base_set(server_->getEventBase(), &taskEvent_);
-
-        // Add the event and start up the server
-        if (-1 == event_add(&taskEvent_, 0)) {
-          GlobalOutput("TNonblockingServer::serve(): coult not event_add");
-          return;
-        }
-        server_->addTask(task);
+      boost::shared_ptr<Runnable> task =
+        boost::shared_ptr<Runnable>(new Task(server_->getProcessor(),
+                                             inputProtocol_,
+                                             outputProtocol_,
+                                             this));
+      // The application is now waiting on the task to finish, which the IO
+      // thread hears about through its completion queue
+      appState_ = APP_WAIT_TASK;
+
+      // Set this connection idle so that libevent doesn't process more
+      // data on it while we're still waiting for the threadmanager to
+      // finish this task
+      setIdle();
+
+      if (server_->addTask(task)) {
+        return;
+      }
 
-        // Set this connection idle so that libevent doesn't process more
-        // data on it while we're still waiting for the threadmanager to
-        // finish this task
-        setIdle();
+      // The ThreadManager is full, so shed the request here and now
+      server_->releaseRequest(inFlightBytes_);
+      inFlightBytes_ = 0;
+      if (!shedRequest("too many pending tasks",
+                       inputProtocol_.get(), outputProtocol_.get())) {
         return;
       }
     } else {
+      inFlightBytes_ = readBufferPos_;
       try {
         // Invoke the processor
         server_->getProcessor()->process(inputProtocol_, outputProtocol_);
@@ -282,9 +717,17 @@ void TConnection::transition() {
     // We have now finished processing a task and the result has been written
     // into the outputTransport_, so we grab its contents and place them into
     // the writeBuffer_ for actual writing by the libevent thread
+    server_->releaseRequest(inFlightBytes_);
+    inFlightBytes_ = 0;
+
+    if (closeAfterTask_) {
+      close();
+      return;
+    }
 
     // Get the result of the operation
     outputTransport_->getBuffer(&writeBuffer_, &writeBufferSize_);
+    countWriteBuffer();
 
     // If the function call generated return data, then move into the send
     // state and get going
@@ -345,6 +788,10 @@ void TConnection::transition() {
     writeBufferPos_ = 0;
     writeBufferSize_ = 0;
 
+    // Idle until the next request, so don't sit on big buffers
+    shrinkBuffers(server_->getIdleReadBufferLimit(),
+                  server_->getIdleWriteBufferLimit());
+
     // Set up read buffer for getting 4 bytes
     readBufferPos_ = 0;
     readWant_ = 4;
@@ -390,6 +837,17 @@ void TConnection::transition() {
   }
 }
 
+void TConnection::setPipelinedFlags() {
+  short flags = 0;
+  if (requestsInFlight_ < server_->getMaxPipelinedRequests()) {
+    flags |= EV_READ;
+  }
+  if (!responses_.empty()) {
+    flags |= EV_WRITE;
+  }
+  setFlags(flags != 0 ? (flags | EV_PERSIST) : 0);
+}
+
 void TConnection::setFlags(short eventFlags) {
   // Catch the do nothing case
   if (eventFlags_ == eventFlags) {
@@ -440,7 +898,7 @@ void TConnection::setFlags(short eventFlags) {
    * its own ev.
    */
   event_set(&event_, socket_, eventFlags_, TConnection::eventHandler, this);
-  event_base_set(server_->getEventBase(), &event_);
+  event_base_set(ioThread_->getEventBase(), &event_);
 
   // Add the event
   if (event_add(&event_, 0) == -1) {
@@ -457,25 +915,151 @@ void TConnection::close() {
     GlobalOutput("TConnection::close() event_del");
   }
 
+  // A request that failed in processing is no longer in flight
+  server_->releaseRequest(inFlightBytes_);
+  inFlightBytes_ = 0;
+
   // Close the socket
   if (socket_ > 0) {
     ::close(socket_);
   }
   socket_ = 0;
 
+  if (pipelined_) {
+    // Nobody is left to read these
+    while (!responses_.empty()) {
+      recycleRequest(responses_.front());
+      responses_.pop_front();
+    }
+
+    // Workers still hold requests and will hand them back here first
+    if (requestsRunning_ > 0) {
+      closing_ = true;
+      return;
+    }
+  }
+
+  finishClose();
+}
+
+void TConnection::finishClose() {
   // close any factory produced transports
   factoryInputTransport_->close();
   factoryOutputTransport_->close();
 
-  // Give this object back to the server that owns it
-  server_->returnConnection(this);
+  // Cached connections keep only the smallest buffers
+  shrinkBuffers(0, 0);
+
+  // Give this object back to the IO thread that owns it
+  ioThread_->returnConnection(this);
+}
+
+TNonblockingIOThread::TNonblockingIOThread(TNonblockingServer* server,
+                                           int number,
+                                           event_base* base) :
+  server_(server),
+  number_(number),
+  eventBase_(base),
+  listenSocket_(-1),
+  completed_(NULL),
+  numConnections_(0) {
+  notifyPipe_[0] = notifyPipe_[1] = -1;
+  completionPipe_[0] = completionPipe_[1] = -1;
+
+  if (server_->isThreadPoolProcessing()) {
+    // Workers must never block on a full pipe; one byte in it is enough
+    int flags;
+    if (pipe(completionPipe_) == -1 ||
+        (flags = fcntl(completionPipe_[0], F_GETFL, 0)) < 0 ||
+        fcntl(completionPipe_[0], F_SETFL, flags | O_NONBLOCK) < 0 ||
+        (flags = fcntl(completionPipe_[1], F_GETFL, 0)) < 0 ||
+        fcntl(completionPipe_[1], F_SETFL, flags | O_NONBLOCK) < 0) {
+      throw TException("TNonblockingIOThread: completion pipe failed");
+    }
+
+    event_set(&completionEvent_,
+              completionPipe_[0],
+              EV_READ | EV_PERSIST,
+              TNonblockingIOThread::completionHandler,
+              this);
+    event_base_set(eventBase_, &completionEvent_);
+    if (-1 == event_add(&completionEvent_, 0)) {
+      throw TException("TNonblockingIOThread: could not event_add completion pipe");
+    }
+  }
+
+  // The first IO thread accepts, so only the others ever get sockets
+  // handed over, and not when they accept their own
+  if (number_ == 0 ||
+      server_->getAcceptPolicy() == TNonblockingServer::ACCEPT_REUSEPORT) {
+    return;
+  }
+
+  if (pipe(notifyPipe_) == -1) {
+    throw TException("TNonblockingIOThread: pipe() failed");
+  }
+  int flags;
+  if ((flags = fcntl(notifyPipe_[0], F_GETFL, 0)) < 0 ||
+      fcntl(notifyPipe_[0], F_SETFL, flags | O_NONBLOCK) < 0) {
+    throw TException("TNonblockingIOThread: notify pipe O_NONBLOCK");
+  }
+
+  event_set(&notifyEvent_,
+            notifyPipe_[0],
+            EV_READ | EV_PERSIST,
+            TNonblockingIOThread::notifyHandler,
+            this);
+  event_base_set(eventBase_, &notifyEvent_);
+  if (-1 == event_add(&notifyEvent_, 0)) {
+    throw TException("TNonblockingIOThread: could not event_add notify pipe");
+  }
+}
+
+TNonblockingIOThread::~TNonblockingIOThread() {
+  if (notifyPipe_[0] != -1) {
+    event_del(&notifyEvent_);
+    ::close(notifyPipe_[0]);
+    ::close(notifyPipe_[1]);
+  }
+  if (completionPipe_[0] != -1) {
+    event_del(&completionEvent_);
+    ::close(completionPipe_[0]);
+    ::close(completionPipe_[1]);
+  }
+}
+
+void TNonblockingIOThread::registerListenSocket(int s) {
+  listenSocket_ = s;
+
+  // Register the server event
+  event_set(&listenEvent_,
+            listenSocket_,
+            EV_READ | EV_PERSIST,
+            TNonblockingIOThread::listenHandler,
+            this);
+  event_base_set(eventBase_, &listenEvent_);
+
+  // Add the event and start up the server
+  if (-1 == event_add(&listenEvent_, 0)) {
+    throw TException("TNonblockingServer::serve(): coult not event_add");
+  }
+}
+
+int TNonblockingIOThread::getNumConnections() const {
+  Guard g(connectionCountMutex_);
+  return numConnections_;
+}
+
+void TNonblockingIOThread::addConnectionCount() {
+  Guard g(connectionCountMutex_);
+  ++numConnections_;
 }
 
 /**
  * Creates a new connection either by reusing an object off the stack or
  * by allocating a new one entirely
  */
-TConnection* TNonblockingServer::createConnection(int socket, short flags) {
+TConnection* TNonblockingIOThread::createConnection(int socket, short flags) {
   // Check the stack
   if (connectionStack_.empty()) {
     return new TConnection(socket, flags, this);
@@ -488,23 +1072,200 @@ TConnection* TNonblockingServer::createConnection(int socket, short flags) {
 }
 
 /**
- * Returns a connection to the stack
+ * Returns a connection to the stack, or deletes it if the stack is full
+ */
+void TNonblockingIOThread::returnConnection(TConnection* connection) {
+  if (connectionStack_.size() < server_->getConnectionStackLimit()) {
+    connectionStack_.push(connection);
+  } else {
+    delete connection;
+  }
+
+  Guard g(connectionCountMutex_);
+  --numConnections_;
+}
+
+void TNonblockingIOThread::startConnection(int socket) {
+  // Create a new TConnection for this client socket.
+  TConnection* clientConnection =
+    createConnection(socket, EV_READ | EV_PERSIST);
+
+  // Fail fast if we could not create a TConnection object
+  if (clientConnection == NULL) {
+    fprintf(stderr, "thriftServerEventHandler: failed TConnection factory");
+    close(socket);
+    Guard g(connectionCountMutex_);
+    --numConnections_;
+    return;
+  }
+
+  // Put this client connection into the proper state
+  clientConnection->transition();
+}
+
+/**
+ * Writes of an int to a pipe are atomic, so the reading end always gets
+ * whole sockets.
  */
-void TNonblockingServer::returnConnection(TConnection* connection) {
-  connectionStack_.push(connection);
+void TNonblockingIOThread::notify(int socket) {
+  assert(notifyPipe_[1] != -1);
+  if (write(notifyPipe_[1], &socket, sizeof(socket)) != sizeof(socket)) {
+    GlobalOutput("TNonblockingIOThread::notify() write");
+    close(socket);
+    Guard g(connectionCountMutex_);
+    --numConnections_;
+  }
+}
+
+void TNonblockingIOThread::notifyHandler(int fd, short which, void* v) {
+  TNonblockingIOThread* ioThread = (TNonblockingIOThread*)v;
+  assert(fd == ioThread->notifyPipe_[0]);
+
+  // Take every socket waiting, not just the one libevent signaled
+  int socket;
+  ssize_t got;
+  while ((got = read(fd, &socket, sizeof(socket))) == sizeof(socket)) {
+    ioThread->startConnection(socket);
+  }
+  if (got == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    GlobalOutput("TNonblockingIOThread::notifyHandler() read");
+  }
+}
+
+/**
+ * Pushes onto completed_ from any thread.  Only the push that finds the list
+ * empty writes to the pipe: the loop drains the pipe before it takes the
+ * list, so a push it misses always finds the list empty and wakes it again.
+ * The list is only ever taken whole, so pushes can't suffer from ABA.
+ */
+void TNonblockingIOThread::taskCompleted(TConnection* connection) {
+  TConnection* head;
+  do {
+    head = completed_;
+    connection->nextCompleted_ = head;
+  } while (!__sync_bool_compare_and_swap(&completed_, head, connection));
+
+  if (head == NULL) {
+    uint8_t b = 0;
+    // A full pipe already has the loop on its way
+    if (write(completionPipe_[1], &b, sizeof(b)) == -1 && errno != EAGAIN) {
+      GlobalOutput("TNonblockingIOThread::taskCompleted() write");
+    }
+  }
+}
+
+void TNonblockingIOThread::completionHandler(int fd, short which, void* v) {
+  TNonblockingIOThread* ioThread = (TNonblockingIOThread*)v;
+  assert(fd == ioThread->completionPipe_[0]);
+
+  uint8_t buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) {}
+
+  TConnection* list =
+    __sync_lock_test_and_set(&ioThread->completed_, (TConnection*)NULL);
+
+  // Put the finished tasks back in the order they finished
+  TConnection* ordered = NULL;
+  while (list != NULL) {
+    TConnection* next = list->nextCompleted_;
+    list->nextCompleted_ = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  while (ordered != NULL) {
+    TConnection* next = ordered->nextCompleted_;
+    ordered->nextCompleted_ = NULL;
+    if (ordered->pipelined_) {
+      ordered->finishRequests();
+    } else {
+      ordered->transition();
+    }
+    ordered = next;
+  }
+}
+
+void TNonblockingIOThread::run() {
+  // Run libevent engine, never returns, invokes calls to eventHandler
+  event_base_loop(eventBase_, 0);
+}
+
+size_t TNonblockingServer::getNumConnections() const {
+  size_t count = 0;
+  for (size_t i = 0; i < ioThreads_.size(); ++i) {
+    count += ioThreads_[i]->getNumConnections();
+  }
+  return count;
+}
+
+bool TNonblockingServer::addTask(boost::shared_ptr<Runnable> task) {
+  try {
+    // Never wait for room; that would stall every connection on the loop
+    threadManager_->add(task, -1);
+  } catch (TooManyPendingTasksException&) {
+    __sync_add_and_fetch(&pendingTasksShed_, 1);
+    return false;
+  }
+  return true;
+}
+
+bool TNonblockingServer::admitRequest(uint32_t bytes, std::string& reason) {
+  if (maxPendingTasks_ > 0 && threadPoolProcessing_ &&
+      threadManager_->pendingTaskCount() >= maxPendingTasks_) {
+    __sync_add_and_fetch(&pendingTasksShed_, 1);
+    reason = "too many pending tasks";
+    return false;
+  }
+
+  int64_t inFlight = __sync_add_and_fetch(&inFlightBytes_, (int64_t)bytes);
+  if (maxInFlightBytes_ > 0 && inFlight > maxInFlightBytes_) {
+    __sync_sub_and_fetch(&inFlightBytes_, (int64_t)bytes);
+    __sync_add_and_fetch(&inFlightBytesShed_, 1);
+    reason = "too many bytes in flight";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Picks the IO thread to serve a connection that acceptor just accepted.
+ */
+TNonblockingIOThread* TNonblockingServer::selectIOThread(TNonblockingIOThread* acceptor) {
+  if (ioThreads_.size() == 1 || acceptPolicy_ == ACCEPT_REUSEPORT) {
+    return acceptor;
+  }
+
+  if (acceptPolicy_ == ACCEPT_LEAST_LOADED) {
+    TNonblockingIOThread* best = ioThreads_[0].get();
+    int bestCount = best->getNumConnections();
+    for (size_t i = 1; i < ioThreads_.size(); ++i) {
+      int count = ioThreads_[i]->getNumConnections();
+      if (count < bestCount) {
+        best = ioThreads_[i].get();
+        bestCount = count;
+      }
+    }
+    return best;
+  }
+
+  TNonblockingIOThread* next = ioThreads_[nextIOThread_].get();
+  nextIOThread_ = (nextIOThread_ + 1) % ioThreads_.size();
+  return next;
 }
 
 /**
  * Server socket had something happen.  We accept all waiting client
- * connections on fd and assign TConnection objects to handle those requests.
+ * connections on fd and assign TConnection objects to handle those requests,
+ * on this IO thread or another.
  */
-void TNonblockingServer::handleEvent(int fd, short which) {
+void TNonblockingServer::handleEvent(TNonblockingIOThread* acceptor, int fd, short which) {
   // Make sure that libevent didn't fuck up the socket handles
-  assert(fd == serverSocket_);
+  assert(fd == acceptor->getListenSocket());
 
-  // Server socket accepted a new connection
+  // Server socket accepted a new connection.  Big enough for an ipv6 peer,
+  // and reset before every accept(), which sets it to the peer's size.
   socklen_t addrLen;
-  struct sockaddr addr;
+  struct sockaddr_storage addr;
   addrLen = sizeof(addr);
 
   // Going to accept a new client socket
@@ -513,7 +1274,8 @@ void TNonblockingServer::handleEvent(int fd, short which) {
   // Accept as many new clients as possible, even though libevent signaled only
   // one, this helps us to avoid having to go back into the libevent engine so
   // many times
-  while ((clientSocket = accept(fd, &addr, &addrLen)) != -1) {
+  while ((clientSocket = accept(fd, (struct sockaddr*)&addr, &addrLen)) != -1) {
+    addrLen = sizeof(addr);
 
     // Explicitly set this socket to NONBLOCK mode
     int flags;
@@ -524,19 +1286,24 @@ void TNonblockingServer::handleEvent(int fd, short which) {
       return;
     }
 
-    // Create a new TConnection for this client socket.
-    TConnection* clientConnection =
-      createConnection(clientSocket, EV_READ | EV_PERSIST);
-
-    // Fail fast if we could not create a TConnection object
-    if (clientConnection == NULL) {
-      fprintf(stderr, "thriftServerEventHandler: failed TConnection factory");
+    // Over the limit there is nothing to do but hang up.  Count it first,
+    // so that whoever sees the hang-up also sees the count.
+    if (maxConnections_ > 0 && getNumConnections() >= maxConnections_) {
+      __sync_add_and_fetch(&connectionsShed_, 1);
       close(clientSocket);
-      return;
+      continue;
     }
 
-    // Put this client connection into the proper state
-    clientConnection->transition();
+    // Count the connection against its thread now, so that a burst of
+    // accepts doesn't all go to the same one
+    TNonblockingIOThread* ioThread = selectIOThread(acceptor);
+    ioThread->addConnectionCount();
+
+    if (ioThread == acceptor) {
+      ioThread->startConnection(clientSocket);
+    } else {
+      ioThread->notify(clientSocket);
+    }
   }
 
   // Done looping accept, now we have to make sure the error is due to
@@ -550,6 +1317,21 @@ void TNonblockingServer::handleEvent(int fd, short which) {
  * Creates a socket to listen on and binds it to the local port.
  */
 void TNonblockingServer::listenSocket() {
+  int s = bindSocket();
+  if (s == -1) {
+    return;
+  }
+
+  // Set up this file descriptor for listening
+  listenSocket(s);
+}
+
+/**
+ * Creates a socket and binds it to the local port, shared with the sockets
+ * of the other IO threads under ACCEPT_REUSEPORT.  Returns -1 if the port
+ * can't be resolved.
+ */
+int TNonblockingServer::bindSocket() {
   int s;
   struct addrinfo hints, *res, *res0;
   int error;
@@ -565,7 +1347,7 @@ void TNonblockingServer::listenSocket() {
   error = getaddrinfo(NULL, port, &hints, &res0);
   if (error) {
     GlobalOutput("TNonblockingServer::serve() getaddrinfo");
-    return;
+    return -1;
   }
 
   // Pick the ipv6 address first since ipv4 addresses can be mapped
@@ -587,6 +1369,16 @@ void TNonblockingServer::listenSocket() {
   // Set reuseaddr to avoid 2MSL delay on server restart
   setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
+  #ifdef SO_REUSEPORT
+  // Lets every IO thread bind its own socket to the port
+  if (acceptPolicy_ == ACCEPT_REUSEPORT &&
+      setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+    close(s);
+    freeaddrinfo(res0);
+    throw TException("TNonblockingServer::serve() SO_REUSEPORT");
+  }
+  #endif
+
   if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
     close(s);
     freeaddrinfo(res0);
@@ -596,8 +1388,7 @@ void TNonblockingServer::listenSocket() {
   // Done with the addr info
   freeaddrinfo(res0);
 
-  // Set up this file descriptor for listening
-  listenSocket(s);
+  return s;
 }
 
 /**
@@ -605,6 +1396,16 @@ void TNonblockingServer::listenSocket() {
  * to prepare for use in the server.
  */
 void TNonblockingServer::listenSocket(int s) {
+  prepareListenSocket(s);
+
+  // Cool, this socket is good to go, set it as the serverSocket_
+  serverSocket_ = s;
+}
+
+/**
+ * Sets the options of a bound socket and starts listening on it.
+ */
+void TNonblockingServer::prepareListenSocket(int s) {
   // Set socket to nonblocking mode
   int flags;
   if ((flags = fcntl(s, F_GETFL, 0)) < 0 ||
@@ -632,13 +1433,13 @@ void TNonblockingServer::listenSocket(int s) {
     close(s);
     throw TException("TNonblockingServer::serve() listen");
   }
-
-  // Cool, this socket is good to go, set it as the serverSocket_
-  serverSocket_ = s;
 }
 
 /**
- * Register the core libevent events onto the proper base.
+ * Register the core libevent events onto the proper base, which the first
+ * IO thread uses.  The others get bases of their own from event_base_new(),
+ * which unlike event_init() leaves libevent's current base alone, and are
+ * started here, so the caller only has to run the loop of this one.
  */
 void TNonblockingServer::registerEvents(event_base* base) {
   assert(serverSocket_ != -1);
@@ -651,17 +1452,33 @@ void TNonblockingServer::registerEvents(event_base* base) {
           event_get_version(),
           event_get_method());
 
-  // Register the server event
-  event_set(&serverEvent_,
-            serverSocket_,
-            EV_READ | EV_PERSIST,
-            TNonblockingServer::eventHandler,
-            this);
-  event_base_set(eventBase_, &serverEvent_);
+  for (int i = 0; i < numIOThreads_; ++i) {
+    event_base* ioBase = (i == 0) ? base : event_base_new();
+    if (ioBase == NULL) {
+      throw TException("TNonblockingServer::serve() event_base_new");
+    }
+    ioThreads_.push_back(boost::shared_ptr<TNonblockingIOThread>(
+      new TNonblockingIOThread(this, i, ioBase)));
+  }
 
-  // Add the event and start up the server
-  if (-1 == event_add(&serverEvent_, 0)) {
-    throw TException("TNonblockingServer::serve(): coult not event_add");
+  // The first IO thread accepts for all of them, unless each has a socket
+  ioThreads_[0]->registerListenSocket(serverSocket_);
+  if (acceptPolicy_ == ACCEPT_REUSEPORT) {
+    for (int i = 1; i < numIOThreads_; ++i) {
+      int s = bindSocket();
+      if (s == -1) {
+        throw TException("TNonblockingServer::serve() getaddrinfo");
+      }
+      prepareListenSocket(s);
+      ioThreads_[i]->registerListenSocket(s);
+    }
+  }
+
+  PosixThreadFactory threadFactory;
+  threadFactory.setDetached(false);
+  for (int i = 1; i < numIOThreads_; ++i) {
+    threads_.push_back(threadFactory.newThread(ioThreads_[i]));
+    threads_.back()->start();
   }
 }
 
@@ -681,8 +1498,12 @@ void TNonblockingServer::serve() {
     eventHandler_->preServe();
   }
 
-  // Run libevent engine, never returns, invokes calls to eventHandler
-  event_base_loop(eventBase_, 0);
+  // Run the first IO thread's loop here, the others already are
+  ioThreads_[0]->run();
+
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->join();
+  }
 }
 
 }}} // facebook::thrift::server
@@ -11,36 +11,91 @@
 #include <server/TServer.h>
 #include <transport/TTransportUtils.h>
 #include <concurrency/ThreadManager.h>
+#include <concurrency/Mutex.h>
+#include <deque>
 #include <stack>
+#include <vector>
 #include <cstdlib>
+#include <sys/socket.h>
 #include <event.h>
 
 namespace facebook { namespace thrift { namespace server {
 
 using facebook::thrift::transport::TMemoryBuffer;
+using facebook::thrift::transport::TBufferPool;
 using facebook::thrift::protocol::TProtocol;
 using facebook::thrift::concurrency::Runnable;
+using facebook::thrift::concurrency::Thread;
 using facebook::thrift::concurrency::ThreadManager;
+using facebook::thrift::concurrency::Mutex;
 
 // Forward declaration of class
 class TConnection;
+class TNonblockingIOThread;
 
 /**
  * This is a non-blocking server in C++ for high performance that operates a
- * single IO thread. It assumes that all incoming requests are framed with a
- * 4 byte length indicator and writes out responses using the same framing.
+ * set of IO threads, one by default. It assumes that all incoming requests
+ * are framed with a 4 byte length indicator and writes out responses using
+ * the same framing.
+ *
+ * Each IO thread runs its own libevent loop over its own connections.  The
+ * first one runs on the thread that calls serve(); the rest are started by
+ * the server.  How accepted connections are spread over the threads is set
+ * by the accept policy.
  *
  * It does not use the TServerTransport framework, but rather has socket
- * operations hardcoded for use with select.
+ * operations hardcoded for use with libevent.
  *
  * @author Mark Slee <mcslee@facebook.com>
  */
 class TNonblockingServer : public TServer {
+ public:
+
+  /**
+   * How accepted connections find their IO thread.
+   *
+   * ACCEPT_ROUND_ROBIN  The first IO thread accepts and hands connections to
+   *                     each thread in turn.
+   * ACCEPT_LEAST_LOADED The first IO thread accepts and hands each
+   *                     connection to the thread with the fewest open.
+   * ACCEPT_REUSEPORT    Every IO thread listens on its own SO_REUSEPORT
+   *                     socket and keeps what it accepts; the kernel does the
+   *                     spreading.  Only where SO_REUSEPORT exists.
+   */
+  enum AcceptPolicy {
+    ACCEPT_ROUND_ROBIN,
+    ACCEPT_LEAST_LOADED,
+    ACCEPT_REUSEPORT
+  };
+
+  /**
+   * What happens to a request turned away because the server is overloaded.
+   *
+   * OVERLOAD_REPLY             Answer it with a TApplicationException.  Not
+   *                            for services with async methods, whose
+   *                            clients aren't expecting an answer.
+   * OVERLOAD_CLOSE_CONNECTION  Close its connection.
+   *
+   * Connections over the connection limit are always closed straight away.
+   */
+  enum OverloadAction {
+    OVERLOAD_REPLY,
+    OVERLOAD_CLOSE_CONNECTION
+  };
+
  private:
 
+  friend class TNonblockingIOThread;
+
   // Listen backlog
   static const int LISTEN_BACKLOG = 1024;
 
+  // Default limits on what an idle connection holds on to
+  static const uint32_t IDLE_READ_BUFFER_LIMIT = 8192;
+  static const uint32_t IDLE_WRITE_BUFFER_LIMIT = 8192;
+  static const size_t CONNECTION_STACK_LIMIT = 1024;
+
   // Server socket file descriptor
   int serverSocket_;
 
@@ -56,21 +111,73 @@ class TNonblockingServer : public TServer {
   // Is thread pool processing?
   bool threadPoolProcessing_;
 
-  // The event base for libevent
+  // The event base for libevent, that of the first IO thread
   event_base* eventBase_;
 
-  // Event struct, for use with eventBase_
-  struct event serverEvent_;
+  // Number of IO threads to run
+  int numIOThreads_;
 
-  /**
-   * This is a stack of all the objects that have been created but that
-   * are NOT currently in use. When we close a connection, we place it on this
-   * stack so that the object can be reused later, rather than freeing the
-   * memory and reallocating a new object later.
-   */
-  std::stack<TConnection*> connectionStack_;
+  // How accepted connections are spread over the IO threads
+  AcceptPolicy acceptPolicy_;
+
+  // The IO threads, the first of which runs on the thread calling serve()
+  std::vector<boost::shared_ptr<TNonblockingIOThread> > ioThreads_;
+
+  // Threads hosting every IO thread but the first
+  std::vector<boost::shared_ptr<Thread> > threads_;
+
+  // Next IO thread for ACCEPT_ROUND_ROBIN, only touched by the acceptor
+  int nextIOThread_;
+
+  // Where connections get their read buffers and return them to
+  boost::shared_ptr<TBufferPool> bufferPool_;
+
+  // Buffers bigger than these are given back when a connection goes idle
+  uint32_t idleReadBufferLimit_;
+  uint32_t idleWriteBufferLimit_;
+
+  // Most closed connections each IO thread keeps for reuse
+  size_t connectionStackLimit_;
+
+  // Most requests from one connection processed at once
+  uint32_t maxPipelinedRequests_;
+
+  // Bytes of read and write buffers held by connections, open or cached.
+  // Updated with atomic adds from the IO threads.
+  volatile int64_t readBufferBytes_;
+  volatile int64_t writeBufferBytes_;
+
+  // Admission limits, 0 for none
+  size_t maxConnections_;
+  size_t maxPendingTasks_;
+  int64_t maxInFlightBytes_;
+
+  // Milliseconds a task may wait for a worker before it is dropped, 0 for
+  // no limit
+  int64_t taskExpireTime_;
+
+  // What to do with requests over the limits
+  OverloadAction overloadAction_;
+
+  // Bytes of requests admitted and not yet processed
+  volatile int64_t inFlightBytes_;
 
-  void handleEvent(int fd, short which);
+  // What has been shed, and why
+  volatile int64_t connectionsShed_;
+  volatile int64_t pendingTasksShed_;
+  volatile int64_t inFlightBytesShed_;
+  volatile int64_t tasksExpired_;
+
+  void handleEvent(TNonblockingIOThread* acceptor, int fd, short which);
+
+  // Picks the IO thread for a connection accepted by acceptor
+  TNonblockingIOThread* selectIOThread(TNonblockingIOThread* acceptor);
+
+  // Creates and binds a socket on port_, without listening on it yet
+  int bindSocket();
+
+  // Sets up a bound socket for accepting
+  void prepareListenSocket(int s);
 
  public:
   TNonblockingServer(boost::shared_ptr<TProcessor> processor,
@@ -80,7 +187,27 @@ class TNonblockingServer : public TServer {
     port_(port),
     frameResponses_(true),
     threadPoolProcessing_(false),
-    eventBase_(NULL) {}
+    eventBase_(NULL),
+    numIOThreads_(1),
+    acceptPolicy_(ACCEPT_ROUND_ROBIN),
+    nextIOThread_(0),
+    bufferPool_(TBufferPool::getDefault()),
+    idleReadBufferLimit_(IDLE_READ_BUFFER_LIMIT),
+    idleWriteBufferLimit_(IDLE_WRITE_BUFFER_LIMIT),
+    connectionStackLimit_(CONNECTION_STACK_LIMIT),
+    maxPipelinedRequests_(1),
+    readBufferBytes_(0),
+    writeBufferBytes_(0),
+    maxConnections_(0),
+    maxPendingTasks_(0),
+    maxInFlightBytes_(0),
+    taskExpireTime_(0),
+    overloadAction_(OVERLOAD_REPLY),
+    inFlightBytes_(0),
+    connectionsShed_(0),
+    pendingTasksShed_(0),
+    inFlightBytesShed_(0),
+    tasksExpired_(0) {}
 
   TNonblockingServer(boost::shared_ptr<TProcessor> processor,
                      boost::shared_ptr<TProtocolFactory> protocolFactory,
@@ -91,7 +218,27 @@ class TNonblockingServer : public TServer {
     port_(port),
     frameResponses_(true),
     threadManager_(threadManager),
-    eventBase_(NULL) {
+    eventBase_(NULL),
+    numIOThreads_(1),
+    acceptPolicy_(ACCEPT_ROUND_ROBIN),
+    nextIOThread_(0),
+    bufferPool_(TBufferPool::getDefault()),
+    idleReadBufferLimit_(IDLE_READ_BUFFER_LIMIT),
+    idleWriteBufferLimit_(IDLE_WRITE_BUFFER_LIMIT),
+    connectionStackLimit_(CONNECTION_STACK_LIMIT),
+    maxPipelinedRequests_(1),
+    readBufferBytes_(0),
+    writeBufferBytes_(0),
+    maxConnections_(0),
+    maxPendingTasks_(0),
+    maxInFlightBytes_(0),
+    taskExpireTime_(0),
+    overloadAction_(OVERLOAD_REPLY),
+    inFlightBytes_(0),
+    connectionsShed_(0),
+    pendingTasksShed_(0),
+    inFlightBytesShed_(0),
+    tasksExpired_(0) {
     setInputTransportFactory(boost::shared_ptr<TTransportFactory>(new TTransportFactory()));
     setOutputTransportFactory(boost::shared_ptr<TTransportFactory>(new TTransportFactory()));
     setInputProtocolFactory(protocolFactory);
@@ -111,7 +258,27 @@ class TNonblockingServer : public TServer {
     port_(port),
     frameResponses_(true),
     threadManager_(threadManager),
-    eventBase_(NULL) {
+    eventBase_(NULL),
+    numIOThreads_(1),
+    acceptPolicy_(ACCEPT_ROUND_ROBIN),
+    nextIOThread_(0),
+    bufferPool_(TBufferPool::getDefault()),
+    idleReadBufferLimit_(IDLE_READ_BUFFER_LIMIT),
+    idleWriteBufferLimit_(IDLE_WRITE_BUFFER_LIMIT),
+    connectionStackLimit_(CONNECTION_STACK_LIMIT),
+    maxPipelinedRequests_(1),
+    readBufferBytes_(0),
+    writeBufferBytes_(0),
+    maxConnections_(0),
+    maxPendingTasks_(0),
+    maxInFlightBytes_(0),
+    taskExpireTime_(0),
+    overloadAction_(OVERLOAD_REPLY),
+    inFlightBytes_(0),
+    connectionsShed_(0),
+    pendingTasksShed_(0),
+    inFlightBytesShed_(0),
+    tasksExpired_(0) {
     setInputTransportFactory(inputTransportFactory);
     setOutputTransportFactory(outputTransportFactory);
     setInputProtocolFactory(inputProtocolFactory);
@@ -130,9 +297,11 @@ class TNonblockingServer : public TServer {
     return threadPoolProcessing_;
   }
 
-  void addTask(boost::shared_ptr<Runnable> task) {
-    threadManager_->add(task);
-  }
+  /**
+   * Queues a task without waiting for room.  Returns false if the
+   * ThreadManager is at its pendingTaskCountMax.
+   */
+  bool addTask(boost::shared_ptr<Runnable> task);
 
   void setFrameResponses(bool frameResponses) {
     frameResponses_ = frameResponses;
@@ -142,16 +311,228 @@ class TNonblockingServer : public TServer {
     return frameResponses_;
   }
 
+  /**
+   * Sets the number of IO threads, each with its own libevent loop.  Must be
+   * called before serve().  One, the default, serves everything from the
+   * thread calling serve() as the server always has.
+   */
+  void setNumIOThreads(int numIOThreads) {
+    if (numIOThreads < 1) {
+      throw TException("TNonblockingServer: need at least one IO thread");
+    }
+    numIOThreads_ = numIOThreads;
+  }
+
+  int getNumIOThreads() const {
+    return numIOThreads_;
+  }
+
+  void setAcceptPolicy(AcceptPolicy acceptPolicy) {
+#ifndef SO_REUSEPORT
+    if (acceptPolicy == ACCEPT_REUSEPORT) {
+      throw TException("TNonblockingServer: SO_REUSEPORT not supported");
+    }
+#endif
+    acceptPolicy_ = acceptPolicy;
+  }
+
+  AcceptPolicy getAcceptPolicy() const {
+    return acceptPolicy_;
+  }
+
   event_base* getEventBase() const {
     return eventBase_;
   }
 
-  TConnection* createConnection(int socket, short flags);
+  /**
+   * Sets the pool read buffers come from.  Must be called before serve().
+   * Defaults to TBufferPool::getDefault().
+   */
+  void setBufferPool(boost::shared_ptr<TBufferPool> bufferPool) {
+    bufferPool_ = bufferPool;
+  }
 
-  void returnConnection(TConnection* connection);
+  boost::shared_ptr<TBufferPool> getBufferPool() const {
+    return bufferPool_;
+  }
 
-  static void eventHandler(int fd, short which, void* v) {
-    ((TNonblockingServer*)v)->handleEvent(fd, which);
+  /**
+   * When a connection has sent its response and waits for the next request,
+   * a read buffer bigger than this goes back to the pool and the connection
+   * starts over with a small one.  Keeps one big request from pinning its
+   * buffer for the life of an otherwise idle connection.
+   */
+  void setIdleReadBufferLimit(uint32_t limit) {
+    idleReadBufferLimit_ = limit;
+  }
+
+  uint32_t getIdleReadBufferLimit() const {
+    return idleReadBufferLimit_;
+  }
+
+  /**
+   * The same for the buffer responses are written to, which is freed.
+   */
+  void setIdleWriteBufferLimit(uint32_t limit) {
+    idleWriteBufferLimit_ = limit;
+  }
+
+  uint32_t getIdleWriteBufferLimit() const {
+    return idleWriteBufferLimit_;
+  }
+
+  /**
+   * Sets how many closed connections each IO thread keeps for reuse; the
+   * rest are deleted.  Cached ones are cut down to small buffers.
+   */
+  void setConnectionStackLimit(size_t limit) {
+    connectionStackLimit_ = limit;
+  }
+
+  size_t getConnectionStackLimit() const {
+    return connectionStackLimit_;
+  }
+
+  /**
+   * Sets how many requests from one connection may be with the ThreadManager
+   * or waiting to be written at once.  With more than one, the default, a
+   * connection keeps reading requests while earlier ones are processed and
+   * writes each response as soon as it is ready, so responses can come back
+   * out of order and clients must match them to calls by seqid.  Only with
+   * a ThreadManager, and must be set before serve().
+   */
+  void setMaxPipelinedRequests(uint32_t maxPipelinedRequests) {
+    if (maxPipelinedRequests == 0) {
+      throw TException("TNonblockingServer: need at least one request in flight");
+    }
+    maxPipelinedRequests_ = maxPipelinedRequests;
+  }
+
+  uint32_t getMaxPipelinedRequests() const {
+    return maxPipelinedRequests_;
+  }
+
+  /**
+   * Bytes of read buffers held by connections, open or cached.
+   */
+  int64_t getReadBufferBytes() {
+    return __sync_add_and_fetch(&readBufferBytes_, 0);
+  }
+
+  /**
+   * Bytes of response buffers held by connections, open or cached.
+   */
+  int64_t getWriteBufferBytes() {
+    return __sync_add_and_fetch(&writeBufferBytes_, 0);
+  }
+
+  void addReadBufferBytes(int64_t delta) {
+    __sync_add_and_fetch(&readBufferBytes_, delta);
+  }
+
+  void addWriteBufferBytes(int64_t delta) {
+    __sync_add_and_fetch(&writeBufferBytes_, delta);
+  }
+
+  /**
+   * Sets the most connections open at once; further ones are closed as
+   * soon as they are accepted.
+   */
+  void setMaxConnections(size_t maxConnections) {
+    maxConnections_ = maxConnections;
+  }
+
+  size_t getMaxConnections() const {
+    return maxConnections_;
+  }
+
+  /**
+   * Sets the most tasks that may wait for a worker.  Requests arriving past
+   * it are shed instead of queued.  A ThreadManager's own
+   * pendingTaskCountMax sheds the same way rather than blocking the loop.
+   */
+  void setMaxPendingTasks(size_t maxPendingTasks) {
+    maxPendingTasks_ = maxPendingTasks;
+  }
+
+  size_t getMaxPendingTasks() const {
+    return maxPendingTasks_;
+  }
+
+  /**
+   * Sets the most bytes of requests that may be read and not yet processed.
+   */
+  void setMaxInFlightBytes(int64_t maxInFlightBytes) {
+    maxInFlightBytes_ = maxInFlightBytes;
+  }
+
+  int64_t getMaxInFlightBytes() const {
+    return maxInFlightBytes_;
+  }
+
+  /**
+   * Sets how many milliseconds a task may wait for a worker.  One that
+   * waited longer is shed when a worker gets to it, since its client has
+   * probably given up.
+   */
+  void setTaskExpireTime(int64_t taskExpireTime) {
+    taskExpireTime_ = taskExpireTime;
+  }
+
+  int64_t getTaskExpireTime() const {
+    return taskExpireTime_;
+  }
+
+  void setOverloadAction(OverloadAction overloadAction) {
+    overloadAction_ = overloadAction;
+  }
+
+  OverloadAction getOverloadAction() const {
+    return overloadAction_;
+  }
+
+  /**
+   * Checks a request of the given size against the limits.  If it is
+   * admitted its bytes count as in flight until releaseRequest(); if not,
+   * the reason is counted and returned.
+   */
+  bool admitRequest(uint32_t bytes, std::string& reason);
+
+  void releaseRequest(uint32_t bytes) {
+    __sync_sub_and_fetch(&inFlightBytes_, (int64_t)bytes);
+  }
+
+  /**
+   * Connections open across all the IO threads.
+   */
+  size_t getNumConnections() const;
+
+  int64_t getInFlightBytes() {
+    return __sync_add_and_fetch(&inFlightBytes_, 0);
+  }
+
+  // Connections closed for being over the connection limit
+  int64_t getConnectionsShed() {
+    return __sync_add_and_fetch(&connectionsShed_, 0);
+  }
+
+  // Requests shed for too many pending tasks
+  int64_t getPendingTasksShed() {
+    return __sync_add_and_fetch(&pendingTasksShed_, 0);
+  }
+
+  // Requests shed for too many bytes in flight
+  int64_t getInFlightBytesShed() {
+    return __sync_add_and_fetch(&inFlightBytesShed_, 0);
+  }
+
+  // Tasks shed for waiting longer than the expire time
+  int64_t getTasksExpired() {
+    return __sync_add_and_fetch(&tasksExpired_, 0);
+  }
+
+  void addTaskExpired() {
+    __sync_add_and_fetch(&tasksExpired_, 1);
   }
 
   void listenSocket();
@@ -164,6 +545,126 @@ class TNonblockingServer : public TServer {
 
 };
 
+/**
+ * One libevent loop and the connections it serves.  Connections never move
+ * between IO threads, so nothing a TConnection touches needs a lock, apart
+ * from the count of them that the acceptor reads to balance the load.
+ */
+class TNonblockingIOThread : public Runnable {
+ public:
+  TNonblockingIOThread(TNonblockingServer* server,
+                       int number,
+                       event_base* base);
+
+  ~TNonblockingIOThread();
+
+  TNonblockingServer* getServer() const {
+    return server_;
+  }
+
+  int getNumber() const {
+    return number_;
+  }
+
+  event_base* getEventBase() const {
+    return eventBase_;
+  }
+
+  int getListenSocket() const {
+    return listenSocket_;
+  }
+
+  /**
+   * Makes this thread accept connections on s.
+   */
+  void registerListenSocket(int s);
+
+  /**
+   * Connections open on this thread, or promised to it by the acceptor.
+   */
+  int getNumConnections() const;
+
+  void addConnectionCount();
+
+  TConnection* createConnection(int socket, short flags);
+
+  void returnConnection(TConnection* connection);
+
+  /**
+   * Starts serving a client socket.  Only from this IO thread.
+   */
+  void startConnection(int socket);
+
+  /**
+   * Hands a client socket to this IO thread from another one.
+   */
+  void notify(int socket);
+
+  /**
+   * Queues a connection whose task has finished, from a worker thread, and
+   * wakes the loop if nothing else has since it last looked.
+   */
+  void taskCompleted(TConnection* connection);
+
+  /**
+   * Runs the event loop.
+   */
+  void run();
+
+  static void listenHandler(int fd, short which, void* v) {
+    TNonblockingIOThread* t = (TNonblockingIOThread*)v;
+    t->server_->handleEvent(t, fd, which);
+  }
+
+  static void notifyHandler(int fd, short which, void* v);
+
+  static void completionHandler(int fd, short which, void* v);
+
+ private:
+  // Server this thread belongs to
+  TNonblockingServer* server_;
+
+  // Index among the server's IO threads
+  int number_;
+
+  // The event base for this thread's loop
+  event_base* eventBase_;
+
+  // Socket this thread accepts on, or -1
+  int listenSocket_;
+
+  // Event for listenSocket_
+  struct event listenEvent_;
+
+  // Pipe carrying sockets handed over by the acceptor, read end first
+  int notifyPipe_[2];
+
+  // Event for the read end of notifyPipe_
+  struct event notifyEvent_;
+
+  // Connections whose tasks have finished, most recent first.  Workers
+  // push with compare and swap; the loop takes the whole list at once.
+  TConnection* volatile completed_;
+
+  // Pipe waking the loop when completed_ stops being empty
+  int completionPipe_[2];
+
+  // Event for the read end of completionPipe_
+  struct event completionEvent_;
+
+  // Open connections, guarded by connectionCountMutex_
+  int numConnections_;
+  Mutex connectionCountMutex_;
+
+  /**
+   * This is a stack of all the objects that have been created but that
+   * are NOT currently in use. When we close a connection, we place it on this
+   * stack so that the object can be reused later, rather than freeing the
+   * memory and reallocating a new object later.
+   */
+  std::stack<TConnection*> connectionStack_;
+};
+
 /**
  * Two states for sockets, recv and send mode
  */
@@ -196,10 +697,15 @@ class TConnection {
  private:
 
   class Task;
+  struct Request;
+  friend class TNonblockingIOThread;
 
   // Server handle
   TNonblockingServer* server_;
 
+  // IO thread whose loop serves this connection
+  TNonblockingIOThread* ioThread_;
+
   // Socket handle
   int socket_;
 
@@ -227,6 +733,15 @@ class TConnection {
   // Read buffer size
   uint32_t readBufferSize_;
 
+  // Capacity of outputTransport_ as last counted by the server
+  uint32_t writeBufferCounted_;
+
+  // Bytes of the request being processed that count as in flight
+  uint32_t inFlightBytes_;
+
+  // Close rather than answer once the task comes back
+  bool closeAfterTask_;
+
   // Write buffer
   uint8_t* writeBuffer_;
 
@@ -239,11 +754,8 @@ class TConnection {
   // Frame size
   int32_t frameSize_;
 
-  // Task handle
-  int taskHandle_;
-
-  // Task event
-  struct event taskEvent_;
+  // Next in the IO thread's list of finished tasks
+  TConnection* nextCompleted_;
 
   // Transport to read from
   boost::shared_ptr<TMemoryBuffer> inputTransport_;
@@ -261,6 +773,31 @@ class TConnection {
   // Protocol encoder
   boost::shared_ptr<TProtocol> outputProtocol_;
 
+  // Whether requests are pipelined, see setMaxPipelinedRequests()
+  bool pipelined_;
+
+  // Pipelined requests read and not yet answered
+  uint32_t requestsInFlight_;
+
+  // Of those, the ones given to the ThreadManager and not yet back
+  uint32_t requestsRunning_;
+
+  // Pipelined requests finished by workers, most recent first.  Pushed like
+  // the IO thread's completed list, and taken whole by the loop.
+  Request* volatile finished_;
+
+  // Responses waiting to be written; the front one is being written
+  std::deque<Request*> responses_;
+
+  // Requests kept for reuse, never more than the pipelining limit
+  std::stack<Request*> spareRequests_;
+
+  // Closed, but waiting for requests still with the ThreadManager
+  bool closing_;
+
+  // Read and write as the pipelined requests allow
+  void setPipelinedFlags();
+
   // Go into read mode
   void setRead() {
     setFlags(EV_READ | EV_PERSIST);
@@ -281,48 +818,76 @@ class TConnection {
 
   // Libevent handlers
   void workSocket();
+  void workPipelined(short which);
 
   // Close this client and reset
   void close();
 
+  // Give this connection back to its IO thread once nothing refers to it
+  void finishClose();
+
+  // Swap the read buffer for one from the pool of at least len bytes,
+  // keeping what has been read so far
+  void resizeReadBuffer(uint32_t len);
+
+  // Bring the server's count of write buffer bytes up to date
+  void countWriteBuffer();
+
+  // Give back buffers bigger than the limits
+  void shrinkBuffers(uint32_t readLimit, uint32_t writeLimit);
+
+  // Turn away the request on input, by answering it with an exception on
+  // output or closing.  Returns false if the connection is closed.
+  bool shedRequest(const std::string& reason,
+                   TProtocol* input, TProtocol* output);
+
+  // Hand the request just read to the ThreadManager and go on reading
+  void dispatchRequest();
+
+  // Queue a worker's finished request for the loop, from the worker
+  void requestFinished(Request* request);
+
+  // Take the requests workers have finished and queue their responses
+  void finishRequests();
+
+  // Queue the response to request for writing, or drop it if empty
+  void queueResponse(Request* request);
+
+  // Point the write buffer at the response at the front of the queue
+  void startResponse();
+
+  // Write responses until done or the socket is full.  Returns false if the
+  // connection is closed.
+  bool writeResponses();
+
+  Request* newRequest();
+
+  void recycleRequest(Request* request);
+
  public:
 
-  // Constructor
-  TConnection(int socket, short eventFlags, TNonblockingServer *s) {
-    readBuffer_ = (uint8_t*)std::malloc(1024);
-    if (readBuffer_ == NULL) {
-      throw new facebook::thrift::TException("Out of memory.");
-    }
-    readBufferSize_ = 1024;
+  // Initial size of the read buffer
+  static const uint32_t READ_BUFFER_SIZE = 1024;
 
-    // Allocate input and output tranpsorts
-    // these only need to be allocated once per TConnection (they don't need to be
-    // reallocated on init() call)
-    inputTransport_ = boost::shared_ptr<TMemoryBuffer>(new TMemoryBuffer(readBuffer_, readBufferSize_));
-    outputTransport_ = boost::shared_ptr<TMemoryBuffer>(new TMemoryBuffer());
+  TConnection(int socket, short eventFlags, TNonblockingIOThread* ioThread);
 
-    init(socket, eventFlags, s);
-  }
+  ~TConnection();
 
   // Initialize
-  void init(int socket, short eventFlags, TNonblockingServer *s);
+  void init(int socket, short eventFlags, TNonblockingIOThread* ioThread);
 
   // Transition into a new state
   void transition();
 
   // Handler wrapper
-  static void eventHandler(int fd, short /* which */, void* v) {
-    assert(fd == ((TConnection*)v)->socket_);
-    ((TConnection*)v)->workSocket();
-  }
-
-  // Handler wrapper for task block
-  static void taskHandler(int fd, short /* which */, void* v) {
-    assert(fd == ((TConnection*)v)->taskHandle_);
-    if (-1 == ::close(((TConnection*)v)->taskHandle_)) {
-      GlobalOutput("TConnection::taskHandler close handle failed, resource leak");
+  static void eventHandler(int fd, short which, void* v) {
+    TConnection* connection = (TConnection*)v;
+    assert(fd == connection->socket_);
+    if (connection->pipelined_) {
+      connection->workPipelined(which);
+    } else {
+      connection->workSocket();
     }
-    ((TConnection*)v)->transition();
   }
 
 };
@@ -0,0 +1,117 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#include <cstdlib>
+#include <transport/TBufferPool.h>
+#include <transport/TTransportException.h>
+
+namespace facebook { namespace thrift { namespace transport {
+
+using facebook::thrift::concurrency::Guard;
+
+TBufferPool::TBufferPool(uint32_t minSize, uint32_t maxSize, uint32_t maxPerClass) :
+  minSize_(minSize > 0 ? minSize : 1),
+  maxPerClass_(maxPerClass),
+  cachedBytes_(0),
+  acquiredBytes_(0) {
+  uint32_t classes = 1;
+  for (uint64_t sz = minSize_; sz < maxSize; sz *= 2) {
+    ++classes;
+  }
+  free_.resize(classes);
+}
+
+TBufferPool::~TBufferPool() {
+  trim();
+}
+
+int TBufferPool::sizeClass(uint32_t len) const {
+  uint64_t sz = minSize_;
+  for (int i = 0; i < (int)free_.size(); ++i, sz *= 2) {
+    if (len <= sz) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint8_t* TBufferPool::acquire(uint32_t len, uint32_t* size) {
+  // Anything too big to pool is handed straight out at the requested size
+  int cls = sizeClass(len);
+  *size = (cls < 0) ? len : (minSize_ << cls);
+
+  {
+    Guard g(mutex_);
+    acquiredBytes_ += *size;
+    if (cls >= 0 && !free_[cls].empty()) {
+      uint8_t* buf = free_[cls].back();
+      free_[cls].pop_back();
+      cachedBytes_ -= *size;
+      return buf;
+    }
+  }
+
+  uint8_t* buf = (uint8_t*)std::malloc(*size);
+  if (buf == NULL) {
+    Guard g(mutex_);
+    acquiredBytes_ -= *size;
+    throw TTransportException("Out of memory");
+  }
+  return buf;
+}
+
+void TBufferPool::release(uint8_t* buf, uint32_t size) {
+  if (buf == NULL) {
+    return;
+  }
+
+  {
+    Guard g(mutex_);
+    acquiredBytes_ -= size;
+
+    // Only cache buffers that exactly match a size class
+    int cls = sizeClass(size);
+    if (cls >= 0 && (minSize_ << cls) == size &&
+        free_[cls].size() < maxPerClass_) {
+      free_[cls].push_back(buf);
+      cachedBytes_ += size;
+      return;
+    }
+  }
+
+  std::free(buf);
+}
+
+void TBufferPool::trim() {
+  Guard g(mutex_);
+  for (size_t i = 0; i < free_.size(); ++i) {
+    for (size_t j = 0; j < free_[i].size(); ++j) {
+      std::free(free_[i][j]);
+    }
+    free_[i].clear();
+  }
+  cachedBytes_ = 0;
+}
+
+uint64_t TBufferPool::getCachedBytes() {
+  Guard g(mutex_);
+  return cachedBytes_;
+}
+
+uint64_t TBufferPool::getAcquiredBytes() {
+  Guard g(mutex_);
+  return acquiredBytes_;
+}
+
+boost::shared_ptr<TBufferPool> TBufferPool::getDefault() {
+  // Made on first use, so it exists whichever static initializer asks
+  // first, and never destroyed, so it outlives every static destructor
+  static boost::shared_ptr<TBufferPool>* pool =
+    new boost::shared_ptr<TBufferPool>(new TBufferPool());
+  return *pool;
+}
+
+}}} // facebook::thrift::transport
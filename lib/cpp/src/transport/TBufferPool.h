@@ -0,0 +1,87 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#ifndef _THRIFT_TRANSPORT_TBUFFERPOOL_H_
+#define _THRIFT_TRANSPORT_TBUFFERPOOL_H_ 1
+
+#include <vector>
+#include <Thrift.h>
+#include <boost/shared_ptr.hpp>
+#include <concurrency/Mutex.h>
+
+namespace facebook { namespace thrift { namespace transport {
+
+/**
+ * A thread-safe cache of malloc()ed byte buffers, bucketed into power-of-two
+ * size classes.  Transports that repeatedly need scratch or frame buffers
+ * can acquire() one of at least the size they need and release() it when
+ * they are done, instead of going back to the allocator for every message.
+ *
+ * Requests larger than the largest size class are satisfied directly from
+ * malloc() and freed on release, so a single giant message never ends up
+ * pinned in the pool.
+ */
+class TBufferPool {
+ public:
+  /**
+   * @param minSize        Capacity of the smallest size class
+   * @param maxSize        Capacity of the largest size class
+   * @param maxPerClass    How many free buffers to keep in each class
+   */
+  TBufferPool(uint32_t minSize = 512,
+              uint32_t maxSize = 1024 * 1024,
+              uint32_t maxPerClass = 64);
+
+  ~TBufferPool();
+
+  /**
+   * Returns a buffer of at least len bytes.  *size is set to its actual
+   * capacity, which must be passed back to release().
+   *
+   * @throws TTransportException if memory could not be allocated
+   */
+  uint8_t* acquire(uint32_t len, uint32_t* size);
+
+  /**
+   * Returns a buffer obtained from acquire() to the pool.
+   */
+  void release(uint8_t* buf, uint32_t size);
+
+  /**
+   * Frees every buffer currently cached in the pool.
+   */
+  void trim();
+
+  /**
+   * Total capacity of the buffers currently cached (not handed out).
+   */
+  uint64_t getCachedBytes();
+
+  /**
+   * Total capacity of the buffers currently handed out.
+   */
+  uint64_t getAcquiredBytes();
+
+  /**
+   * Process-wide pool shared by anyone who does not bring their own.
+   */
+  static boost::shared_ptr<TBufferPool> getDefault();
+
+ private:
+  // Index of the smallest class that holds len bytes, or -1 if none does
+  int sizeClass(uint32_t len) const;
+
+  uint32_t minSize_;
+  uint32_t maxPerClass_;
+  std::vector< std::vector<uint8_t*> > free_;
+  uint64_t cachedBytes_;
+  uint64_t acquiredBytes_;
+  facebook::thrift::concurrency::Mutex mutex_;
+};
+
+}}} // facebook::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TBUFFERPOOL_H_
@@ -0,0 +1,642 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <transport/TCompressedTransport.h>
+#include <transport/TZlibTransport.h>
+#include <zlib.h>
+
+using std::string;
+using std::vector;
+
+namespace facebook { namespace thrift { namespace transport {
+
+TZlibCodec::TZlibCodec(int level, const string& dictionary) :
+  level_(level),
+  dictionary_(dictionary),
+  dstream_(NULL),
+  istream_(NULL) {}
+
+TZlibCodec::~TZlibCodec() {
+  if (dstream_ != NULL) {
+    deflateEnd(dstream_);
+    delete dstream_;
+  }
+  if (istream_ != NULL) {
+    inflateEnd(istream_);
+    delete istream_;
+  }
+}
+
+uint32_t TZlibCodec::maxCompressedLength(uint32_t len) {
+  // A preset dictionary adds its id to the zlib header
+  return compressBound(len) + 4;
+}
+
+uint32_t TZlibCodec::compress(const uint8_t* in, uint32_t inLen,
+                              uint8_t* out, uint32_t outLen) {
+  int rv;
+  if (dstream_ == NULL) {
+    z_stream* stream = new z_stream;
+    std::memset(stream, 0, sizeof(*stream));
+    rv = deflateInit(stream, level_);
+    if (rv != Z_OK) {
+      delete stream;
+      throw TZlibTransportException(rv, NULL);
+    }
+    dstream_ = stream;
+  } else {
+    rv = deflateReset(dstream_);
+    if (rv != Z_OK) {
+      throw TZlibTransportException(rv, dstream_->msg);
+    }
+  }
+
+  if (!dictionary_.empty()) {
+    rv = deflateSetDictionary(dstream_, (const Bytef*)dictionary_.data(),
+                              dictionary_.size());
+    if (rv != Z_OK) {
+      throw TZlibTransportException(rv, dstream_->msg);
+    }
+  }
+
+  dstream_->next_in = (Bytef*)in;
+  dstream_->avail_in = inLen;
+  dstream_->next_out = out;
+  dstream_->avail_out = outLen;
+  rv = deflate(dstream_, Z_FINISH);
+  if (rv == Z_STREAM_END) {
+    return dstream_->total_out;
+  }
+  if (rv == Z_OK || rv == Z_BUF_ERROR) {
+    // Ran out of room
+    return 0;
+  }
+  throw TZlibTransportException(rv, dstream_->msg);
+}
+
+void TZlibCodec::decompress(const uint8_t* in, uint32_t inLen,
+                            uint8_t* out, uint32_t outLen) {
+  int rv;
+  if (istream_ == NULL) {
+    z_stream* stream = new z_stream;
+    std::memset(stream, 0, sizeof(*stream));
+    rv = inflateInit(stream);
+    if (rv != Z_OK) {
+      delete stream;
+      throw TZlibTransportException(rv, NULL);
+    }
+    istream_ = stream;
+  } else {
+    rv = inflateReset(istream_);
+    if (rv != Z_OK) {
+      throw TZlibTransportException(rv, istream_->msg);
+    }
+  }
+
+  istream_->next_in = (Bytef*)in;
+  istream_->avail_in = inLen;
+  istream_->next_out = out;
+  istream_->avail_out = outLen;
+  rv = inflate(istream_, Z_FINISH);
+  if (rv == Z_NEED_DICT) {
+    if (dictionary_.empty()) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Compressed frame needs a preset dictionary");
+    }
+    rv = inflateSetDictionary(istream_, (const Bytef*)dictionary_.data(),
+                              dictionary_.size());
+    if (rv != Z_OK) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Compressed frame uses a different dictionary");
+    }
+    rv = inflate(istream_, Z_FINISH);
+  }
+
+  if (rv != Z_STREAM_END || istream_->total_out != outLen ||
+      istream_->avail_in != 0) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Compressed frame has the wrong length");
+  }
+}
+
+boost::shared_ptr<TCodec> TZlibCodec::clone() const {
+  return boost::shared_ptr<TCodec>(new TZlibCodec(level_, dictionary_));
+}
+
+string TZlibCodec::trainDictionary(const vector<string>& samples, uint32_t maxSize) {
+  // Shortest run worth putting in the dictionary; deflate cannot use
+  // matches of fewer than three bytes, and short ones barely pay off
+  const uint32_t GRAM = 8;
+
+  // Count how many samples each 8 byte sequence appears in
+  std::map<uint64_t, uint32_t> counts;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const string& s = samples[i];
+    std::set<uint64_t> seen;
+    for (size_t pos = 0; pos + GRAM <= s.size(); ++pos) {
+      uint64_t gram;
+      std::memcpy(&gram, s.data() + pos, GRAM);
+      if (seen.insert(gram).second) {
+        ++counts[gram];
+      }
+    }
+  }
+
+  // Only sequences shared by a good fraction of the samples are worth
+  // the space
+  uint32_t threshold = std::max((uint32_t)2, (uint32_t)(samples.size() / 8));
+  if (samples.size() < 2) {
+    threshold = 1;
+  }
+
+  // Stitch overlapping common sequences back into the longer runs they
+  // came from, and score each run by the bytes it would have covered
+  std::map<string, uint64_t> scores;
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const string& s = samples[i];
+    size_t start = 0;
+    size_t end = 0;
+    for (size_t pos = 0; pos + GRAM <= s.size(); ++pos) {
+      uint64_t gram;
+      std::memcpy(&gram, s.data() + pos, GRAM);
+      if (counts[gram] >= threshold) {
+        if (pos >= end) {
+          if (end > start) {
+            scores[s.substr(start, end - start)] += end - start;
+          }
+          start = pos;
+        }
+        end = pos + GRAM;
+      }
+    }
+    if (end > start) {
+      scores[s.substr(start, end - start)] += end - start;
+    }
+  }
+
+  vector< std::pair<uint64_t, string> > ranked;
+  for (std::map<string, uint64_t>::iterator it = scores.begin(); it != scores.end(); ++it) {
+    if (it->first.size() <= maxSize) {
+      ranked.push_back(std::make_pair(it->second, it->first));
+    }
+  }
+  std::sort(ranked.begin(), ranked.end());
+
+  // Take runs best first, then lay them out with the best at the end
+  vector<const string*> chosen;
+  string taken;
+  for (size_t i = ranked.size(); i-- > 0; ) {
+    const string& run = ranked[i].second;
+    if (taken.size() + run.size() > maxSize) {
+      continue;
+    }
+    if (taken.find(run) != string::npos) {
+      continue;
+    }
+    taken += run;
+    chosen.push_back(&run);
+  }
+
+  string dictionary;
+  dictionary.reserve(taken.size());
+  for (size_t i = chosen.size(); i-- > 0; ) {
+    dictionary += *chosen[i];
+  }
+  return dictionary;
+}
+
+/**
+ * The LZ block format is a series of sequences, each a literal run
+ * followed by a back-reference.  A sequence starts with a token byte
+ * whose high nibble is the literal length and low nibble the match length
+ * minus four; a nibble of 15 means more length follows as bytes of 255
+ * ending with one that is smaller.  Then come the literals, the two byte
+ * little-endian match offset and any extra match length.  The last
+ * sequence has literals only and ends exactly at the end of the output.
+ */
+namespace {
+
+const uint32_t LZ_MIN_MATCH = 4;
+const uint32_t LZ_MAX_OFFSET = 0xffff;
+// Matches stop this far from the end, and none start in the last
+// LZ_MFLIMIT bytes, so the tail always goes out as literals
+const uint32_t LZ_LAST_LITERALS = 5;
+const uint32_t LZ_MFLIMIT = 12;
+
+inline uint32_t lzRead32(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint32_t lzHash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - TLZCodec::HASH_LOG);
+}
+
+inline uint8_t* lzWriteLength(uint8_t* op, uint32_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+// Emits one sequence, or returns NULL if it does not fit before oend.
+// A match length of zero means this is the final literal-only sequence.
+inline uint8_t* lzWriteSequence(uint8_t* op, uint8_t* oend,
+                                const uint8_t* literals, uint32_t litLen,
+                                uint32_t offset, uint32_t matchLen) {
+  uint32_t needed = 1 + litLen / 255 + 1 + litLen;
+  if (matchLen > 0) {
+    needed += 2 + (matchLen - LZ_MIN_MATCH) / 255 + 1;
+  }
+  if (needed > (uint32_t)(oend - op)) {
+    return NULL;
+  }
+
+  uint8_t* token = op++;
+  *token = (uint8_t)((litLen < 15 ? litLen : 15) << 4);
+  if (litLen >= 15) {
+    op = lzWriteLength(op, litLen - 15);
+  }
+  std::memcpy(op, literals, litLen);
+  op += litLen;
+
+  if (matchLen > 0) {
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    uint32_t ml = matchLen - LZ_MIN_MATCH;
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (ml >= 15) {
+      op = lzWriteLength(op, ml - 15);
+    }
+  }
+  return op;
+}
+
+inline void lzCorrupt() {
+  throw TTransportException(TTransportException::CORRUPTED_DATA,
+                            "Malformed LZ compressed frame");
+}
+
+}
+
+uint32_t TLZCodec::compress(const uint8_t* in, uint32_t inLen,
+                            uint8_t* out, uint32_t outLen) {
+  const uint8_t* ip = in;
+  const uint8_t* anchor = in;
+  const uint8_t* const iend = in + inLen;
+  uint8_t* op = out;
+  uint8_t* const oend = out + outLen;
+
+  if (inLen > LZ_MFLIMIT) {
+    const uint8_t* const mflimit = iend - LZ_MFLIMIT;
+    const uint8_t* const matchlimit = iend - LZ_LAST_LITERALS;
+    std::memset(table_, 0, sizeof(table_));
+
+    while (ip < mflimit) {
+      uint32_t h = lzHash(lzRead32(ip));
+      const uint8_t* ref = in + table_[h];
+      table_[h] = (uint32_t)(ip - in);
+
+      if (ref >= ip || (uint32_t)(ip - ref) > LZ_MAX_OFFSET ||
+          lzRead32(ref) != lzRead32(ip)) {
+        // Step faster through data that is not matching at all
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      // Grow the match backwards over pending literals, then forwards
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        --ip;
+        --ref;
+      }
+      const uint8_t* mp = ip + LZ_MIN_MATCH;
+      const uint8_t* rp = ref + LZ_MIN_MATCH;
+      while (mp < matchlimit && *mp == *rp) {
+        ++mp;
+        ++rp;
+      }
+
+      op = lzWriteSequence(op, oend, anchor, (uint32_t)(ip - anchor),
+                           (uint32_t)(ip - ref), (uint32_t)(mp - ip));
+      if (op == NULL) {
+        return 0;
+      }
+      ip = anchor = mp;
+
+      // Remember a position inside the match too, which helps with runs
+      if (ip < mflimit) {
+        table_[lzHash(lzRead32(ip - 2))] = (uint32_t)(ip - 2 - in);
+      }
+    }
+  }
+
+  op = lzWriteSequence(op, oend, anchor, (uint32_t)(iend - anchor), 0, 0);
+  if (op == NULL) {
+    return 0;
+  }
+  return (uint32_t)(op - out);
+}
+
+void TLZCodec::decompress(const uint8_t* in, uint32_t inLen,
+                          uint8_t* out, uint32_t outLen) {
+  const uint8_t* ip = in;
+  const uint8_t* const iend = in + inLen;
+  uint8_t* op = out;
+  uint8_t* const oend = out + outLen;
+
+  while (true) {
+    if (ip >= iend) {
+      lzCorrupt();
+    }
+    uint8_t token = *ip++;
+
+    uint32_t litLen = token >> 4;
+    if (litLen == 15) {
+      uint8_t b;
+      do {
+        if (ip >= iend) {
+          lzCorrupt();
+        }
+        b = *ip++;
+        litLen += b;
+      } while (b == 255 && litLen <= outLen);
+    }
+    if (litLen > (uint32_t)(iend - ip) || litLen > (uint32_t)(oend - op)) {
+      lzCorrupt();
+    }
+    std::memcpy(op, ip, litLen);
+    op += litLen;
+    ip += litLen;
+
+    if (op == oend) {
+      if (ip != iend) {
+        lzCorrupt();
+      }
+      return;
+    }
+
+    if (iend - ip < 2) {
+      lzCorrupt();
+    }
+    uint32_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (uint32_t)(op - out)) {
+      lzCorrupt();
+    }
+
+    uint32_t matchLen = token & 15;
+    if (matchLen == 15) {
+      uint8_t b;
+      do {
+        if (ip >= iend) {
+          lzCorrupt();
+        }
+        b = *ip++;
+        matchLen += b;
+      } while (b == 255 && matchLen <= outLen);
+    }
+    matchLen += LZ_MIN_MATCH;
+    if (matchLen > (uint32_t)(oend - op)) {
+      lzCorrupt();
+    }
+
+    // Overlapping matches repeat the bytes just written, so they have to
+    // be copied front to back one at a time
+    const uint8_t* ref = op - offset;
+    if (offset >= matchLen) {
+      std::memcpy(op, ref, matchLen);
+      op += matchLen;
+    } else {
+      for (uint32_t i = 0; i < matchLen; ++i) {
+        *op++ = *ref++;
+      }
+    }
+  }
+}
+
+TCompressedFramedTransport::TCompressedFramedTransport(boost::shared_ptr<TTransport> transport,
+                                                       boost::shared_ptr<TCodec> codec) :
+  transport_(transport),
+  decoders_(256),
+  minCompressSize_(DEFAULT_MIN_COMPRESS_SIZE),
+  maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+  rBuf_(NULL),
+  rBufSize_(0),
+  rPos_(0),
+  rLen_(0),
+  crBuf_(NULL),
+  crBufSize_(0),
+  wBuf_(NULL),
+  wBufSize_(512),
+  wLen_(0),
+  cwBuf_(NULL),
+  cwBufSize_(0) {
+  decoders_[TCodec::CODEC_ZLIB] = boost::shared_ptr<TCodec>(new TZlibCodec());
+  decoders_[TCodec::CODEC_LZ] = boost::shared_ptr<TCodec>(new TLZCodec());
+  setCodec(codec);
+
+  wBuf_ = (uint8_t*)std::malloc(wBufSize_);
+  if (wBuf_ == NULL) {
+    throw TTransportException("Out of memory");
+  }
+}
+
+TCompressedFramedTransport::~TCompressedFramedTransport() {
+  std::free(rBuf_);
+  std::free(crBuf_);
+  std::free(wBuf_);
+  std::free(cwBuf_);
+}
+
+void TCompressedFramedTransport::setCodec(boost::shared_ptr<TCodec> codec) {
+  codec_ = codec;
+  if (codec_.get() != NULL) {
+    addDecoder(codec_);
+  }
+}
+
+void TCompressedFramedTransport::addDecoder(boost::shared_ptr<TCodec> codec) {
+  if (codec->getId() == TCodec::CODEC_NONE) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "Codec id 0 is reserved for uncompressed frames");
+  }
+  decoders_[codec->getId()] = codec;
+}
+
+// Makes sure *buf holds at least need bytes, keeping what is already there
+static void growBuffer(uint8_t** buf, uint32_t* size, uint32_t need) {
+  if (need <= *size) {
+    return;
+  }
+  uint32_t newSize = (*size > 0) ? *size : 512;
+  while (newSize < need) {
+    newSize = (newSize > 0x7fffffff) ? need : newSize * 2;
+  }
+  uint8_t* newBuf = (uint8_t*)std::realloc(*buf, newSize);
+  if (newBuf == NULL) {
+    throw TTransportException("Out of memory");
+  }
+  *buf = newBuf;
+  *size = newSize;
+}
+
+uint32_t TCompressedFramedTransport::read(uint8_t* buf, uint32_t len) {
+  uint32_t need = len;
+
+  // We don't have enough data yet
+  if (rLen_ - rPos_ < need) {
+    // Copy out whatever we have
+    if (rLen_ - rPos_ > 0) {
+      memcpy(buf, rBuf_ + rPos_, rLen_ - rPos_);
+      need -= rLen_ - rPos_;
+      buf += rLen_ - rPos_;
+      rPos_ = rLen_;
+    }
+
+    // Read another frame, which may turn out to be empty
+    readFrame();
+    if (rLen_ == 0) {
+      return len - need;
+    }
+  }
+
+  // Hand over whatever we have
+  uint32_t give = need;
+  if (rLen_ - rPos_ < give) {
+    give = rLen_ - rPos_;
+  }
+  memcpy(buf, rBuf_ + rPos_, give);
+  rPos_ += give;
+  need -= give;
+  return (len - need);
+}
+
+void TCompressedFramedTransport::readFrame() {
+  uint8_t header[HEADER_SIZE];
+  transport_->readAll(header, HEADER_SIZE);
+
+  int32_t sz;
+  memcpy(&sz, header, 4);
+  sz = (int32_t)ntohl(sz);
+  uint8_t id = header[4];
+  int32_t usz;
+  memcpy(&usz, header + 5, 4);
+  usz = (int32_t)ntohl(usz);
+
+  if (sz < (int32_t)(HEADER_SIZE - 4) || usz < 0) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Frame size has invalid value");
+  }
+  uint32_t payload = (uint32_t)sz - (HEADER_SIZE - 4);
+  if (payload > maxFrameSize_ || (uint32_t)usz > maxFrameSize_) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Frame size exceeds maximum");
+  }
+
+  rPos_ = 0;
+  rLen_ = 0;
+
+  if (id == TCodec::CODEC_NONE) {
+    if (payload != (uint32_t)usz) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Uncompressed frame has the wrong length");
+    }
+    growBuffer(&rBuf_, &rBufSize_, payload);
+    transport_->readAll(rBuf_, payload);
+    rLen_ = payload;
+    return;
+  }
+
+  TCodec* decoder = decoders_[id].get();
+  if (decoder == NULL) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Frame uses an unknown codec");
+  }
+  growBuffer(&crBuf_, &crBufSize_, payload);
+  transport_->readAll(crBuf_, payload);
+  growBuffer(&rBuf_, &rBufSize_, usz);
+  decoder->decompress(crBuf_, payload, rBuf_, usz);
+  rLen_ = usz;
+}
+
+void TCompressedFramedTransport::write(const uint8_t* buf, uint32_t len) {
+  if (len == 0) {
+    return;
+  }
+  growBuffer(&wBuf_, &wBufSize_, wLen_ + len);
+  memcpy(wBuf_ + wLen_, buf, len);
+  wLen_ += len;
+}
+
+void TCompressedFramedTransport::flush() {
+  uint8_t header[HEADER_SIZE];
+  uint8_t id = TCodec::CODEC_NONE;
+  uint32_t clen = 0;
+
+  if (codec_.get() != NULL && wLen_ > 0 && wLen_ >= minCompressSize_) {
+    // Anything that does not come out smaller goes uncompressed
+    uint32_t limit = codec_->maxCompressedLength(wLen_);
+    growBuffer(&cwBuf_, &cwBufSize_, limit);
+    clen = codec_->compress(wBuf_, wLen_, cwBuf_, std::min(limit, wLen_ - 1));
+    if (clen > 0) {
+      id = codec_->getId();
+    }
+  }
+
+  int32_t sz;
+  int32_t usz = (int32_t)htonl(wLen_);
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = HEADER_SIZE;
+  if (id == TCodec::CODEC_NONE) {
+    sz = (int32_t)htonl(wLen_ + HEADER_SIZE - 4);
+    iov[1].iov_base = wBuf_;
+    iov[1].iov_len = wLen_;
+  } else {
+    sz = (int32_t)htonl(clen + HEADER_SIZE - 4);
+    iov[1].iov_base = cwBuf_;
+    iov[1].iov_len = clen;
+  }
+  memcpy(header, &sz, 4);
+  header[4] = id;
+  memcpy(header + 5, &usz, 4);
+
+  // Reset our pointer before writing, in case the write throws
+  wLen_ = 0;
+
+  transport_->writev(iov, 2);
+  transport_->flush();
+}
+
+const uint8_t* TCompressedFramedTransport::borrow(uint8_t* buf, uint32_t* len) {
+  // Don't try to be clever with shifting buffers.
+  // If we have enough data, give a pointer to it,
+  // otherwise let the protcol use its slow path.
+  if (rLen_ - rPos_ >= *len) {
+    *len = rLen_ - rPos_;
+    return rBuf_ + rPos_;
+  }
+  return NULL;
+}
+
+void TCompressedFramedTransport::consume(uint32_t len) {
+  if (rLen_ - rPos_ >= len) {
+    rPos_ += len;
+  } else {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "consume did not follow a borrow.");
+  }
+}
+
+}}} // facebook::thrift::transport
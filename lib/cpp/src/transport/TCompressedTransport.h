@@ -0,0 +1,330 @@
+// Copyright (c) 2006- Facebook
+// Distributed under the Thrift Software License
+//
+// See accompanying file LICENSE or visit the Thrift site at:
+// http://developers.facebook.com/thrift/
+
+#ifndef _THRIFT_TRANSPORT_TCOMPRESSEDTRANSPORT_H_
+#define _THRIFT_TRANSPORT_TCOMPRESSEDTRANSPORT_H_ 1
+
+#include <string>
+#include <vector>
+#include <transport/TTransport.h>
+
+struct z_stream_s;
+
+namespace facebook { namespace thrift { namespace transport {
+
+/**
+ * A block compressor used by TCompressedFramedTransport.  Each frame is
+ * compressed on its own, so a codec never has to keep history between
+ * calls, but it may keep scratch state around to avoid reallocating it.
+ * Codec objects are not thread-safe; every transport needs its own.
+ */
+class TCodec {
+ public:
+  virtual ~TCodec() {}
+
+  /**
+   * Identifies the codec on the wire.  Ids 0-127 are reserved for the
+   * codecs that ship with Thrift, the rest are free for applications.
+   */
+  virtual uint8_t getId() const = 0;
+
+  /**
+   * Upper bound on the compressed size of len bytes of input.
+   */
+  virtual uint32_t maxCompressedLength(uint32_t len) = 0;
+
+  /**
+   * Compresses inLen bytes from in into out.  Returns the compressed size,
+   * or 0 if it would not fit in outLen bytes.
+   */
+  virtual uint32_t compress(const uint8_t* in, uint32_t inLen,
+                            uint8_t* out, uint32_t outLen) = 0;
+
+  /**
+   * Decompresses in into exactly outLen bytes at out.
+   *
+   * @throws TTransportException if the input is malformed or does not
+   *         expand to outLen bytes
+   */
+  virtual void decompress(const uint8_t* in, uint32_t inLen,
+                          uint8_t* out, uint32_t outLen) = 0;
+
+  /**
+   * Returns a new codec with the same settings and fresh state.
+   */
+  virtual boost::shared_ptr<TCodec> clone() const = 0;
+
+  static const uint8_t CODEC_NONE = 0;
+  static const uint8_t CODEC_ZLIB = 1;
+  static const uint8_t CODEC_LZ = 2;
+};
+
+/**
+ * Deflate at a configurable level, optionally primed with a preset
+ * dictionary.  A dictionary built from typical messages lets even small
+ * frames compress well, since deflate can refer back into it from the
+ * first byte.  Both ends must be configured with the same dictionary;
+ * a frame that was written with one carries its Adler-32 checksum, and
+ * decoding it without a matching dictionary fails.
+ */
+class TZlibCodec : public TCodec {
+ public:
+  /**
+   * @param level       zlib compression level, 1 (fastest) to 9 (smallest),
+   *                    or -1 for zlib's default
+   * @param dictionary  Preset dictionary, empty for none
+   */
+  TZlibCodec(int level = -1, const std::string& dictionary = "");
+
+  virtual ~TZlibCodec();
+
+  uint8_t getId() const {
+    return CODEC_ZLIB;
+  }
+
+  int getLevel() const {
+    return level_;
+  }
+
+  const std::string& getDictionary() const {
+    return dictionary_;
+  }
+
+  uint32_t maxCompressedLength(uint32_t len);
+
+  uint32_t compress(const uint8_t* in, uint32_t inLen,
+                    uint8_t* out, uint32_t outLen);
+
+  void decompress(const uint8_t* in, uint32_t inLen,
+                  uint8_t* out, uint32_t outLen);
+
+  boost::shared_ptr<TCodec> clone() const;
+
+  /**
+   * Builds a preset dictionary of at most maxSize bytes from sample
+   * payloads.  Byte sequences that turn up in many samples are kept, and
+   * the most common ones go last, where deflate can reach them with the
+   * shortest distances.
+   */
+  static std::string trainDictionary(const std::vector<std::string>& samples,
+                                     uint32_t maxSize = 32 * 1024);
+
+ private:
+  int level_;
+  std::string dictionary_;
+
+  // Created on first use, then reset for every frame
+  struct z_stream_s* dstream_;
+  struct z_stream_s* istream_;
+};
+
+/**
+ * A fast byte-oriented LZ77 codec in the style of LZ4: no entropy coding,
+ * a single hash probe per position, and a decoder that is little more than
+ * a series of memcpy()s.  It gives up a good deal of ratio against zlib
+ * in exchange for several times the speed in both directions, which makes
+ * it the better choice when latency matters more than bandwidth.
+ */
+class TLZCodec : public TCodec {
+ public:
+  TLZCodec() {}
+
+  uint8_t getId() const {
+    return CODEC_LZ;
+  }
+
+  uint32_t maxCompressedLength(uint32_t len) {
+    return len + len / 255 + 16;
+  }
+
+  uint32_t compress(const uint8_t* in, uint32_t inLen,
+                    uint8_t* out, uint32_t outLen);
+
+  void decompress(const uint8_t* in, uint32_t inLen,
+                  uint8_t* out, uint32_t outLen);
+
+  boost::shared_ptr<TCodec> clone() const {
+    return boost::shared_ptr<TCodec>(new TLZCodec());
+  }
+
+  static const int HASH_LOG = 12;
+
+ private:
+  uint32_t table_[1 << HASH_LOG];
+};
+
+/**
+ * A framed transport that compresses each frame with a pluggable codec.
+ * On the wire every frame is a four byte length, a one byte codec id, the
+ * four byte uncompressed length and then the payload, all big-endian.
+ *
+ * Frames shorter than the minimum compress size, and frames the codec
+ * fails to shrink, are sent uncompressed with codec id 0, so small RPCs
+ * pay neither the CPU nor the header overhead of compressing them.  The
+ * codec can be changed between any two frames; the reader picks the
+ * decoder for each frame from its id.
+ */
+class TCompressedFramedTransport : public TTransport {
+ public:
+  static const uint32_t DEFAULT_MIN_COMPRESS_SIZE = 512;
+  static const uint32_t DEFAULT_MAX_FRAME_SIZE = 0x7fffffff;
+  static const uint32_t HEADER_SIZE = 9;
+
+  /**
+   * Frames are written with codec, or uncompressed if it is null.  Frames
+   * from the default zlib and LZ codecs can always be read.
+   */
+  TCompressedFramedTransport(boost::shared_ptr<TTransport> transport,
+                             boost::shared_ptr<TCodec> codec = boost::shared_ptr<TCodec>());
+
+  ~TCompressedFramedTransport();
+
+  /**
+   * Compresses the frames written from now on with codec, which also
+   * becomes the decoder for incoming frames with its id.  Null turns
+   * compression off.
+   */
+  void setCodec(boost::shared_ptr<TCodec> codec);
+
+  boost::shared_ptr<TCodec> getCodec() {
+    return codec_;
+  }
+
+  /**
+   * Decodes incoming frames with codec's id using codec, without using
+   * it for writing.
+   */
+  void addDecoder(boost::shared_ptr<TCodec> codec);
+
+  /**
+   * Frames shorter than this many bytes are sent uncompressed.
+   */
+  void setMinCompressSize(uint32_t minCompressSize) {
+    minCompressSize_ = minCompressSize;
+  }
+
+  uint32_t getMinCompressSize() {
+    return minCompressSize_;
+  }
+
+  /**
+   * Frames that are, or would expand to, more than this many bytes are
+   * rejected with a CORRUPTED_DATA exception before anything is allocated
+   * for them.
+   */
+  void setMaxFrameSize(uint32_t maxFrameSize) {
+    maxFrameSize_ = maxFrameSize;
+  }
+
+  uint32_t getMaxFrameSize() {
+    return maxFrameSize_;
+  }
+
+  void open() {
+    transport_->open();
+  }
+
+  bool isOpen() {
+    return transport_->isOpen();
+  }
+
+  bool peek() {
+    if (rPos_ < rLen_) {
+      return true;
+    }
+    return transport_->peek();
+  }
+
+  void close() {
+    if (wLen_ > 0) {
+      flush();
+    }
+    transport_->close();
+  }
+
+  uint32_t read(uint8_t* buf, uint32_t len);
+
+  void write(const uint8_t* buf, uint32_t len);
+
+  void flush();
+
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+
+  void consume(uint32_t len);
+
+  boost::shared_ptr<TTransport> getUnderlyingTransport() {
+    return transport_;
+  }
+
+ protected:
+  boost::shared_ptr<TTransport> transport_;
+  boost::shared_ptr<TCodec> codec_;
+  std::vector< boost::shared_ptr<TCodec> > decoders_;
+  uint32_t minCompressSize_;
+  uint32_t maxFrameSize_;
+
+  // Uncompressed frame being read, and scratch for its compressed form
+  uint8_t* rBuf_;
+  uint32_t rBufSize_;
+  uint32_t rPos_;
+  uint32_t rLen_;
+  uint8_t* crBuf_;
+  uint32_t crBufSize_;
+
+  // Uncompressed frame being written, and scratch for its compressed form
+  uint8_t* wBuf_;
+  uint32_t wBufSize_;
+  uint32_t wLen_;
+  uint8_t* cwBuf_;
+  uint32_t cwBufSize_;
+
+  /**
+   * Reads and decompresses a frame from the underlying stream.
+   */
+  void readFrame();
+};
+
+/**
+ * Wraps transports into compressed framed ones, each with its own copy of
+ * the given codec.
+ */
+class TCompressedFramedTransportFactory : public TTransportFactory {
+ public:
+  TCompressedFramedTransportFactory(boost::shared_ptr<TCodec> codec) :
+    codec_(codec),
+    minCompressSize_(TCompressedFramedTransport::DEFAULT_MIN_COMPRESS_SIZE),
+    maxFrameSize_(TCompressedFramedTransport::DEFAULT_MAX_FRAME_SIZE) {}
+
+  virtual ~TCompressedFramedTransportFactory() {}
+
+  void setMinCompressSize(uint32_t minCompressSize) {
+    minCompressSize_ = minCompressSize;
+  }
+
+  void setMaxFrameSize(uint32_t maxFrameSize) {
+    maxFrameSize_ = maxFrameSize;
+  }
+
+  virtual boost::shared_ptr<TTransport> getTransport(boost::shared_ptr<TTransport> trans) {
+    boost::shared_ptr<TCodec> codec;
+    if (codec_.get() != NULL) {
+      codec = codec_->clone();
+    }
+    TCompressedFramedTransport* framed = new TCompressedFramedTransport(trans, codec);
+    framed->setMinCompressSize(minCompressSize_);
+    framed->setMaxFrameSize(maxFrameSize_);
+    return boost::shared_ptr<TTransport>(framed);
+  }
+
+ private:
+  boost::shared_ptr<TCodec> codec_;
+  uint32_t minCompressSize_;
+  uint32_t maxFrameSize_;
+};
+
+}}} // facebook::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TCOMPRESSEDTRANSPORT_H_
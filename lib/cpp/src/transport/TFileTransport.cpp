@@ -20,12 +20,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/uio.h>
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
 #include <cstdlib>
 #include <iostream>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 namespace facebook { namespace thrift { namespace transport {
 
@@ -63,17 +66,25 @@ TFileTransport::TFileTransport(string path, bool readOnly)
   , readTimeout_(NO_TAIL_READ_TIMEOUT)
   , chunkSize_(DEFAULT_CHUNK_SIZE)
   , eventBufferSize_(DEFAULT_EVENT_BUFFER_SIZE)
+  , eventRingSize_(DEFAULT_EVENT_RING_SIZE)
   , flushMaxUs_(DEFAULT_FLUSH_MAX_US)
   , flushMaxBytes_(DEFAULT_FLUSH_MAX_BYTES)
+  , durabilityMode_(DURABILITY_PERIODIC)
+  , preallocateChunks_(false)
+  , preallocatedTo_(0)
   , maxEventSize_(DEFAULT_MAX_EVENT_SIZE)
   , maxCorruptedEvents_(DEFAULT_MAX_CORRUPTED_EVENTS)
   , eofSleepTime_(DEFAULT_EOF_SLEEP_TIME_US)
   , corruptedEventSleepTime_(DEFAULT_CORRUPTED_SLEEP_TIME_US)
   , writerThreadId_(0)
-  , dequeueBuffer_(NULL)
-  , enqueueBuffer_(NULL)
+  , ring_(NULL)
+  , queuedEvents_(0)
+  , waitingProducers_(0)
+  , writerSleeping_(false)
   , closing_(false)
   , forceFlush_(false)
+  , flushedPos_(0)
+  , flushedOffset_(0)
   , filename_(path)
   , fd_(0)
   , bufferAndThreadInitialized_(false)
@@ -81,6 +92,16 @@ TFileTransport::TFileTransport(string path, bool readOnly)
   , lastBadChunk_(0)
   , numCorruptedEventsInChunk_(0)
   , readOnly_(readOnly)
+  , mmapReads_(false)
+  , mapBase_(NULL)
+  , mapSize_(0)
+  , chunkBase_(NULL)
+  , mapChunk_(-1)
+  , mapPos_(0)
+  , mapAvail_(0)
+  , mapEvent_(NULL)
+  , mapEventSize_(0)
+  , mapEventPos_(0)
 {
   // initialize all the condition vars/mutexes
   pthread_mutex_init(&mutex_, NULL);
@@ -125,7 +146,11 @@ TFileTransport::~TFileTransport() {
     flush();
 
     // set state to closing
+    pthread_mutex_lock(&mutex_);
     closing_ = true;
+    pthread_cond_signal(&notEmpty_);
+    pthread_cond_broadcast(&notFull_);
+    pthread_mutex_unlock(&mutex_);
 
     // TODO: make sure event queue is empty
     // currently only the write buffer is flushed
@@ -136,14 +161,9 @@ TFileTransport::~TFileTransport() {
     writerThreadId_ = 0;
   }
 
-  if (dequeueBuffer_) {
-    delete dequeueBuffer_;
-    dequeueBuffer_ = NULL;
-  }
-
-  if (enqueueBuffer_) {
-    delete enqueueBuffer_;
-    enqueueBuffer_ = NULL;
+  if (ring_) {
+    delete ring_;
+    ring_ = NULL;
   }
 
   if (readBuff_) {
@@ -156,6 +176,8 @@ TFileTransport::~TFileTransport() {
     currentEvent_ = NULL;
   }
 
+  unmapChunk();
+
   // close logfile
   if (fd_ > 0) {
     if(-1 == ::close(fd_)) {
@@ -170,15 +192,21 @@ bool TFileTransport::initBufferAndWriteThread() {
     return false;
   }
 
+  // every event that fits in a chunk has to fit in the ring; eventSize
+  // already counts the length prefix, so the chunk size itself is enough
+  ring_ = new TFileTransportRing(max(eventRingSize_, chunkSize_));
+
   if (writerThreadId_ == 0) {
     if (pthread_create(&writerThreadId_, NULL, startWriterThread, (void *)this) != 0) {
       T_ERROR("Could not create writer thread");
+      delete ring_;
+      ring_ = NULL;
       return false;
     }
   }
 
-  dequeueBuffer_ = new TFileTransportBuffer(eventBufferSize_);
-  enqueueBuffer_ = new TFileTransportBuffer(eventBufferSize_);
+  // producers check this flag without the mutex
+  __sync_synchronize();
   bufferAndThreadInitialized_ = true;
 
   return true;
@@ -192,99 +220,237 @@ void TFileTransport::write(const uint8_t* buf, uint32_t len) {
   enqueueEvent(buf, len, false);
 }
 
-void TFileTransport::enqueueEvent(const uint8_t* buf, uint32_t eventLen, bool blockUntilFlush) {
+off_t TFileTransport::writeDurable(const uint8_t* buf, uint32_t len) {
+  if (readOnly_) {
+    throw TTransportException("TFileTransport: attempting to write to file opened readonly");
+  }
+
+  return enqueueEvent(buf, len, true);
+}
+
+off_t TFileTransport::enqueueEvent(const uint8_t* buf, uint32_t eventLen, bool blockUntilFlush) {
   // can't enqueue more events if file is going to close
   if (closing_) {
-    return;
+    return -1;
   }
 
   // make sure that event size is valid
   if ( (maxEventSize_ > 0) && (eventLen > maxEventSize_) ) {
     T_ERROR("msg size is greater than max event size: %u > %u\n", eventLen, maxEventSize_);
-    return;
+    return -1;
   }
 
   if (eventLen == 0) {
     T_ERROR("cannot enqueue an empty event");
-    return;
+    return -1;
   }
 
-  eventInfo* toEnqueue = new eventInfo();
-  toEnqueue->eventBuff_ = (uint8_t *)std::malloc((sizeof(uint8_t) * eventLen) + 4);
-  // first 4 bytes is the event length
-  memcpy(toEnqueue->eventBuff_, (void*)(&eventLen), 4);
-  // actual event contents
-  memcpy(toEnqueue->eventBuff_ + 4, buf, eventLen);
-  toEnqueue->eventSize_ = eventLen + 4;
-
-  // lock mutex
-  pthread_mutex_lock(&mutex_);
+  uint32_t eventSize = eventLen + 4;
+  if ((chunkSize_ != 0) && (eventSize > chunkSize_)) {
+    T_ERROR("TFileTransport: event size(%u) is greater than chunk size(%u): skipping event",
+            eventSize, chunkSize_);
+    return -1;
+  }
 
-  // make sure that enqueue buffer is initialized and writer thread is running
+  // make sure that the ring is initialized and writer thread is running
   if (!bufferAndThreadInitialized_) {
-    if (!initBufferAndWriteThread()) {
-      delete toEnqueue;
+    pthread_mutex_lock(&mutex_);
+    if (!bufferAndThreadInitialized_ && !initBufferAndWriteThread()) {
       pthread_mutex_unlock(&mutex_);
-      return;
+      return -1;
     }
+    pthread_mutex_unlock(&mutex_);
   }
 
-  // Can't enqueue while buffer is full
-  while (enqueueBuffer_->isFull()) {
-    pthread_cond_wait(&notFull_, &mutex_);
+  if (eventSize > ring_->getSize()) {
+    T_ERROR("TFileTransport: event size(%u) is greater than ring size(%u): skipping event",
+            eventSize, ring_->getSize());
+    return -1;
+  }
+
+  // Can't enqueue while too many events are waiting
+  while (true) {
+    uint32_t queued = queuedEvents_;
+    if (queued < eventBufferSize_) {
+      if (__sync_bool_compare_and_swap(&queuedEvents_, queued, queued + 1)) {
+        break;
+      }
+      continue;
+    }
+    if (closing_) {
+      return -1;
+    }
+    waitForSpace(0);
+  }
+
+  // Claim space in the ring, waiting for the writer if it is full
+  uint64_t pos;
+  while (!ring_->tryReserve(eventSize, &pos)) {
+    if (closing_) {
+      __sync_sub_and_fetch(&queuedEvents_, 1);
+      return -1;
+    }
+    waitForSpace(eventSize);
   }
 
-  // add to the buffer
-  if (!enqueueBuffer_->addEvent(toEnqueue)) {
-    delete toEnqueue;
+  // first 4 bytes is the event length, then the actual event contents
+  ring_->copyIn(pos, (const uint8_t*)&eventLen, 4);
+  ring_->copyIn(pos + 4, buf, eventLen);
+  ring_->commit(pos, eventSize);
+
+  // wake up the writer thread if it is waiting for events
+  __sync_synchronize();
+  if (writerSleeping_) {
+    pthread_mutex_lock(&mutex_);
+    pthread_cond_signal(&notEmpty_);
     pthread_mutex_unlock(&mutex_);
-    return;
   }
 
-  // signal anybody who's waiting for the buffer to be non-empty
-  pthread_cond_signal(&notEmpty_);
+  if (!blockUntilFlush) {
+    return 0;
+  }
 
-  if (blockUntilFlush) {
+  // Whoever is waiting when the writer thread finishes a sync is released
+  // by the same broadcast, so a burst of blocking writers costs one sync
+  off_t durable = -1;
+  pthread_mutex_lock(&mutex_);
+  while (flushedPos_ < pos + eventSize && !closing_) {
     pthread_cond_wait(&flushed_, &mutex_);
   }
+  if (flushedPos_ >= pos + eventSize) {
+    durable = flushedOffset_;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return durable;
+}
 
-  // this really should be a loop where it makes sure it got flushed
-  // because condition variables can get triggered by the os for no reason
-  // it is probably a non-factor for the time being
+void TFileTransport::waitForSpace(uint32_t len) {
+  pthread_mutex_lock(&mutex_);
+  __sync_add_and_fetch(&waitingProducers_, 1);
+
+  // len == 0 means waiting for the number of queued events to drop
+  while (!closing_ &&
+         ((len == 0) ? (queuedEvents_ >= eventBufferSize_) : !ring_->hasSpace(len))) {
+    pthread_cond_wait(&notFull_, &mutex_);
+  }
+
+  __sync_sub_and_fetch(&waitingProducers_, 1);
   pthread_mutex_unlock(&mutex_);
 }
 
-bool TFileTransport::swapEventBuffers(struct timespec* deadline) {
+void TFileTransport::waitForEvents(struct timespec* deadline) {
   pthread_mutex_lock(&mutex_);
-  if (deadline != NULL) {
-    // if we were handed a deadline time struct, do a timed wait
+  writerSleeping_ = true;
+  // pairs with the barrier producers issue between commit and checking
+  // writerSleeping_, so that either they see it or we see their event
+  __sync_synchronize();
+  if (ring_->isEmpty() && !forceFlush_ && !closing_) {
     pthread_cond_timedwait(&notEmpty_, &mutex_, deadline);
-  } else {
-    // just wait until the buffer gets an item
-    pthread_cond_wait(&notEmpty_, &mutex_);
   }
+  writerSleeping_ = false;
+  pthread_mutex_unlock(&mutex_);
+}
 
-  bool swapped = false;
+uint32_t TFileTransport::writeEvents(uint64_t from, uint64_t to) {
+  uint32_t written = 0;
+  uint32_t numEvents = 0;
+
+  // Write the region in as few contiguous runs as possible, only breaking
+  // it up where an event has to be moved to the start of the next chunk
+  uint64_t runStart = from;
+  uint64_t pos = from;
+  while (pos < to) {
+    uint32_t eventLen;
+    ring_->copyOut(pos, (uint8_t*)&eventLen, 4);
+    uint32_t eventSize = eventLen + 4;
+    numEvents++;
+
+    // If chunking is required, then make sure that msg does not cross chunk boundary
+    if (chunkSize_ != 0) {
+
+      // event size must be less than chunk size (the chunk size may have
+      // been lowered since the event was queued)
+      if (eventSize > chunkSize_) {
+        T_ERROR("TFileTransport: event size(%u) is greater than chunk size(%u): skipping event",
+                eventSize, chunkSize_);
+        written += writeRing(runStart, pos);
+        pos += eventSize;
+        runStart = pos;
+        continue;
+      }
 
-  // could be empty if we timed out
-  if (!enqueueBuffer_->isEmpty()) {
-    TFileTransportBuffer *temp = enqueueBuffer_;
-    enqueueBuffer_ = dequeueBuffer_;
-    dequeueBuffer_ = temp;
+      off_t eventOffset = offset_ + (off_t)(pos - runStart);
+      int64_t chunk1 = eventOffset/chunkSize_;
+      int64_t chunk2 = (eventOffset + eventSize - 1)/chunkSize_;
 
-    swapped = true;
+      // if adding this event will cross a chunk boundary, pad the chunk with zeros
+      if (chunk1 != chunk2) {
+        written += writeRing(runStart, pos);
+        runStart = pos;
+        written += padToChunkBoundary();
+      }
+    }
+
+    pos += eventSize;
   }
+  written += writeRing(runStart, to);
 
-  // unlock the mutex and signal if required
-  pthread_mutex_unlock(&mutex_);
+  __sync_sub_and_fetch(&queuedEvents_, numEvents);
+  return written;
+}
 
-  if (swapped) {
-    pthread_cond_signal(&notFull_);
+uint32_t TFileTransport::writeRing(uint64_t from, uint64_t to) {
+  if (from == to) {
+    return 0;
   }
 
-  return swapped;
+  struct iovec iov[2];
+  int iovcnt = ring_->getIovecs(from, to, iov);
+  struct iovec* vec = iov;
+  uint32_t total = (uint32_t)(to - from);
+  uint32_t left = total;
+
+  while (left > 0) {
+    ssize_t b = ::writev(fd_, vec, iovcnt);
+    if (b == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      GlobalOutput("TFileTransport: error while writing event");
+      throw TTransportException("TFileTransport: error while writing event");
+    }
+    left -= b;
+
+    // resume a partial write
+    while (iovcnt > 0 && (size_t)b >= vec->iov_len) {
+      b -= vec->iov_len;
+      ++vec;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      vec->iov_base = (uint8_t*)vec->iov_base + b;
+      vec->iov_len -= b;
+    }
+  }
+
+  offset_ += total;
+  return total;
 }
 
+uint32_t TFileTransport::padToChunkBoundary() {
+  // refetch the offset to keep in sync
+  offset_ = lseek(fd_, 0, SEEK_CUR);
+  int32_t padding = (int32_t)((offset_/chunkSize_ + 1)*chunkSize_ - offset_);
+
+  uint8_t zeros[padding];
+  bzero(zeros, padding);
+  if (-1 == ::write(fd_, zeros, padding)) {
+    GlobalOutput("TFileTransport: error while padding zeros");
+    throw TTransportException("TFileTransport: error while padding zeros");
+  }
+  offset_ += padding;
+  return padding;
+}
 
 void TFileTransport::writerThread() {
   // open file if it is not open
@@ -303,6 +469,12 @@ void TFileTransport::writerThread() {
   ftruncate(fd_, offset_);
   readState_.resetAllValues();
 
+  pthread_mutex_lock(&mutex_);
+  flushedOffset_ = offset_;
+  pthread_mutex_unlock(&mutex_);
+  preallocatedTo_ = offset_;
+  preallocate();
+
   // Figure out the next time by which a flush must take place
 
   struct timespec ts_next_flush;
@@ -312,76 +484,38 @@ void TFileTransport::writerThread() {
   while(1) {
     // this will only be true when the destructor is being invoked
     if(closing_) {
-      // empty out both the buffers
-      if (enqueueBuffer_->isEmpty() && dequeueBuffer_->isEmpty()) {
+      // empty out the ring
+      if (ring_->isEmpty()) {
+        // just be safe and sync to disk
+        fsync(fd_);
+        publishFlushed();
         if (-1 == ::close(fd_)) {
           GlobalOutput("TFileTransport: error in close");
           throw TTransportException("TFileTransport: error in file close");
         }
-        // just be safe and sync to disk
-        fsync(fd_);
         fd_ = 0;
         pthread_exit(NULL);
         return;
       }
     }
 
-    if (swapEventBuffers(&ts_next_flush)) {
-      eventInfo* outEvent;
-      while (NULL != (outEvent = dequeueBuffer_->getNext())) {
-        if (!outEvent) {
-          T_DEBUG_L(1, "Got an empty event");
-          return;
-        }
-
-        // sanity check on event
-        if ((maxEventSize_ > 0) && (outEvent->eventSize_ > maxEventSize_)) {
-          T_ERROR("msg size is greater than max event size: %u > %u\n", outEvent->eventSize_, maxEventSize_);
-          continue;
-        }
-
-        // If chunking is required, then make sure that msg does not cross chunk boundary
-        if ((outEvent->eventSize_ > 0) && (chunkSize_ != 0)) {
-
-          // event size must be less than chunk size
-          if(outEvent->eventSize_ > chunkSize_) {
-            T_ERROR("TFileTransport: event size(%u) is greater than chunk size(%u): skipping event",
-                  outEvent->eventSize_, chunkSize_);
-            continue;
-          }
-
-          int64_t chunk1 = offset_/chunkSize_;
-          int64_t chunk2 = (offset_ + outEvent->eventSize_ - 1)/chunkSize_;
-
-          // if adding this event will cross a chunk boundary, pad the chunk with zeros
-          if (chunk1 != chunk2) {
-            // refetch the offset to keep in sync
-            offset_ = lseek(fd_, 0, SEEK_CUR);
-            int32_t padding = (int32_t)((offset_/chunkSize_ + 1)*chunkSize_ - offset_);
-
-            uint8_t zeros[padding];
-            bzero(zeros, padding);
-            if (-1 == ::write(fd_, zeros, padding)) {
-              GlobalOutput("TFileTransport: error while padding zeros");
-              throw TTransportException("TFileTransport: error while padding zeros");
-            }
-            unflushed += padding;
-            offset_ += padding;
-          }
-        }
-
-        // write the dequeued event to the file
-        if (outEvent->eventSize_ > 0) {
-          if (-1 == ::write(fd_, outEvent->eventBuff_, outEvent->eventSize_)) {
-            GlobalOutput("TFileTransport: error while writing event");
-            throw TTransportException("TFileTransport: error while writing event");
-          }
-
-          unflushed += outEvent->eventSize_;
-          offset_ += outEvent->eventSize_;
-        }
+    waitForEvents(&ts_next_flush);
+
+    // write out everything producers have committed so far in one go
+    uint64_t head = ring_->getHead();
+    uint64_t tail = ring_->getCommitted();
+    if (head != tail) {
+      unflushed += writeEvents(head, tail);
+      ring_->release(tail);
+      preallocate();
+
+      // let producers waiting for space know about it
+      __sync_synchronize();
+      if (waitingProducers_ > 0) {
+        pthread_mutex_lock(&mutex_);
+        pthread_cond_broadcast(&notFull_);
+        pthread_mutex_unlock(&mutex_);
       }
-      dequeueBuffer_->reset();
     }
 
     bool flushTimeElapsed = false;
@@ -394,33 +528,97 @@ void TFileTransport::writerThread() {
       getNextFlushTime(&ts_next_flush);
     }
 
-    // couple of cases from which a flush could be triggered
-    if ((flushTimeElapsed && unflushed > 0) ||
-       unflushed > flushMaxBytes_ ||
-       forceFlush_) {
+    bool sync = false;
+    switch (durabilityMode_) {
+    case DURABILITY_NONE:
+      // the page cache is good enough, never sync
+      break;
+    case DURABILITY_GROUP_COMMIT:
+      // everything drained in this pass shares a single sync
+      sync = (unflushed > 0);
+      break;
+    case DURABILITY_PERIODIC:
+    default:
+      // couple of cases from which a flush could be triggered
+      sync = (flushTimeElapsed && unflushed > 0) ||
+             unflushed > flushMaxBytes_ ||
+             forceFlush_;
+      break;
+    }
 
-      // sync (force flush) file to disk
-      fsync(fd_);
+    if (sync) {
+      syncData();
       unflushed = 0;
+    }
 
-      // notify anybody waiting for flush completion
-      forceFlush_ = false;
-      pthread_cond_broadcast(&flushed_);
+    // notify anybody waiting for flush completion
+    if (sync || forceFlush_ ||
+        (durabilityMode_ == DURABILITY_NONE && flushedPos_ != ring_->getHead())) {
+      publishFlushed();
     }
   }
 }
 
+void TFileTransport::syncData() {
+#ifdef HAVE_FDATASYNC
+  fdatasync(fd_);
+#else
+  fsync(fd_);
+#endif
+}
+
+void TFileTransport::publishFlushed() {
+  pthread_mutex_lock(&mutex_);
+  flushedPos_ = ring_->getHead();
+  flushedOffset_ = offset_;
+  if (ring_->isEmpty()) {
+    forceFlush_ = false;
+  }
+  pthread_cond_broadcast(&flushed_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void TFileTransport::preallocate() {
+  if (!preallocateChunks_ || chunkSize_ == 0) {
+    return;
+  }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  // Keep the current and the next chunk allocated, so that appends do not
+  // have to allocate blocks.  The file size is left alone, so readers and
+  // recovery never see the reserved space as data.
+  off_t target = (offset_/chunkSize_ + 2) * (off_t)chunkSize_;
+  if (target <= preallocatedTo_) {
+    return;
+  }
+  off_t start = max(preallocatedTo_, offset_);
+  if (-1 == fallocate(fd_, FALLOC_FL_KEEP_SIZE, start, target - start)) {
+    // most likely the filesystem does not support it
+    T_ERROR("TFileTransport: fallocate failed (errno %d), disabling preallocation",
+            errno);
+    preallocateChunks_ = false;
+    return;
+  }
+  preallocatedTo_ = target;
+#else
+  preallocateChunks_ = false;
+#endif
+}
+
 void TFileTransport::flush() {
   // file must be open for writing for any flushing to take place
   if (writerThreadId_ <= 0) {
     return;
   }
-  // wait for flush to take place
+  // wait until everything committed so far has been written and synced
+  uint64_t target = ring_->getCommitted();
+
   pthread_mutex_lock(&mutex_);
 
   forceFlush_ = true;
+  pthread_cond_signal(&notEmpty_);
 
-  while (forceFlush_) {
+  while (flushedPos_ < target) {
     pthread_cond_wait(&flushed_, &mutex_);
   }
 
@@ -444,6 +642,19 @@ uint32_t TFileTransport::readAll(uint8_t* buf, uint32_t len) {
 }
 
 uint32_t TFileTransport::read(uint8_t* buf, uint32_t len) {
+  if (mmapReads_) {
+    if (!mapEvent_ && !mapNextEvent()) {
+      return 0;
+    }
+    uint32_t give = min(len, mapEventSize_ - mapEventPos_);
+    memcpy(buf, mapEvent_ + mapEventPos_, give);
+    mapEventPos_ += give;
+    if (mapEventPos_ == mapEventSize_) {
+      mapEvent_ = NULL;
+    }
+    return give;
+  }
+
   // check if there an event is ready to be read
   if (!currentEvent_) {
     currentEvent_ = readEvent();
@@ -475,6 +686,207 @@ uint32_t TFileTransport::read(uint8_t* buf, uint32_t len) {
   return len;
 }
 
+const uint8_t* TFileTransport::borrow(uint8_t* buf, uint32_t* len) {
+  if (mmapReads_) {
+    if (!mapEvent_ && !mapNextEvent()) {
+      return NULL;
+    }
+    uint32_t remaining = mapEventSize_ - mapEventPos_;
+    if (remaining < *len) {
+      return NULL;
+    }
+    *len = remaining;
+    return mapEvent_ + mapEventPos_;
+  }
+
+  if (!currentEvent_) {
+    currentEvent_ = readEvent();
+  }
+  if (!currentEvent_) {
+    return NULL;
+  }
+  uint32_t remaining = currentEvent_->eventSize_ - currentEvent_->eventBuffPos_;
+  if (remaining < *len) {
+    return NULL;
+  }
+  *len = remaining;
+  return currentEvent_->eventBuff_ + currentEvent_->eventBuffPos_;
+}
+
+void TFileTransport::consume(uint32_t len) {
+  if (mmapReads_) {
+    if (!mapEvent_ || mapEventSize_ - mapEventPos_ < len) {
+      throw TTransportException(TTransportException::BAD_ARGS,
+                                "consume did not follow a borrow.");
+    }
+    mapEventPos_ += len;
+    if (mapEventPos_ == mapEventSize_) {
+      mapEvent_ = NULL;
+    }
+    return;
+  }
+
+  if (!currentEvent_ ||
+      currentEvent_->eventSize_ - currentEvent_->eventBuffPos_ < len) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "consume did not follow a borrow.");
+  }
+  currentEvent_->eventBuffPos_ += len;
+  if (currentEvent_->eventBuffPos_ == currentEvent_->eventSize_) {
+    delete currentEvent_;
+    currentEvent_ = NULL;
+  }
+}
+
+void TFileTransport::setMmapReads(bool mmapReads) {
+  if (!readOnly_) {
+    GlobalOutput("TFileTransport: memory-mapped reads require a read-only file");
+    return;
+  }
+  if (mmapReads_ == mmapReads) {
+    return;
+  }
+
+  uint32_t chunk = getCurChunk();
+  unmapChunk();
+  mmapReads_ = mmapReads;
+  seekToChunk(chunk);
+}
+
+bool TFileTransport::mapNextEvent() {
+  int readTries = 0;
+
+  while (1) {
+    if (mapChunk_ < 0) {
+      mapChunk(offset_/chunkSize_);
+    }
+
+    // The writer never lets a size prefix straddle a chunk boundary
+    if (mapPos_ + 4 > chunkSize_) {
+      mapChunk(mapChunk_ + 1);
+      continue;
+    }
+
+    if (mapPos_ + 4 <= mapAvail_) {
+      uint32_t eventSize;
+      memcpy(&eventSize, chunkBase_ + mapPos_, 4);
+
+      // 0 length event indicates padding out to the end of the chunk
+      if (eventSize == 0) {
+        mapChunk(mapChunk_ + 1);
+        continue;
+      }
+
+      // an event can neither exceed the max size nor cross into the next
+      // chunk; if it does, give up on the rest of this chunk
+      if (((maxEventSize_ > 0) && (eventSize > maxEventSize_)) ||
+          (eventSize > chunkSize_ - mapPos_ - 4)) {
+        T_ERROR("Read corrupt event. Event size:%u  Offset:%ld",
+                eventSize, (long)(offset_ + mapPos_));
+        if ((uint32_t)mapChunk_ + 1 < getNumChunks()) {
+          mapChunk(mapChunk_ + 1);
+          continue;
+        } else if (readTimeout_ == TAIL_READ_TIMEOUT) {
+          // wait until the next chunk gets started
+          usleep(corruptedEventSleepTime_);
+          continue;
+        }
+        char errorMsg[1024];
+        sprintf(errorMsg, "TFileTransport: log file corrupted at offset: %lu",
+                (unsigned long)(offset_ + mapPos_));
+        GlobalOutput(errorMsg);
+        throw TTransportException(errorMsg);
+      }
+
+      if (mapPos_ + 4 + eventSize <= mapAvail_) {
+        mapEvent_ = chunkBase_ + mapPos_ + 4;
+        mapEventSize_ = eventSize;
+        mapEventPos_ = 0;
+        mapPos_ += 4 + eventSize;
+        return true;
+      }
+    }
+
+    // Not enough data mapped yet, see whether the file has grown
+    uint32_t oldAvail = mapAvail_;
+    refreshMapAvail();
+    if (mapAvail_ > oldAvail) {
+      continue;
+    }
+
+    // EOF
+    if (readTimeout_ == TAIL_READ_TIMEOUT) {
+      usleep(eofSleepTime_);
+    } else if (readTimeout_ > 0 && readTries == 0) {
+      usleep(readTimeout_ * 1000);
+      readTries++;
+    } else {
+      return false;
+    }
+  }
+}
+
+void TFileTransport::mapChunk(uint32_t chunk) {
+  unmapChunk();
+
+  // mmap offsets have to be page aligned, chunk sizes do not
+  off_t chunkStart = off_t(chunk) * chunkSize_;
+  off_t pageSize = sysconf(_SC_PAGESIZE);
+  off_t delta = chunkStart % pageSize;
+
+  // Map the whole chunk even if the file is shorter, so that a tailing
+  // reader can keep using the mapping as the file grows
+  mapSize_ = chunkSize_ + delta;
+  void* base = mmap(NULL, mapSize_, PROT_READ, MAP_SHARED, fd_, chunkStart - delta);
+  if (base == MAP_FAILED) {
+    mapSize_ = 0;
+    GlobalOutput("TFileTransport: mmap error in mapChunk");
+    throw TTransportException("TFileTransport: mmap error in mapChunk");
+  }
+  mapBase_ = (uint8_t*)base;
+  madvise(mapBase_, mapSize_, MADV_SEQUENTIAL);
+  madvise(mapBase_, mapSize_, MADV_WILLNEED);
+#ifdef POSIX_FADV_WILLNEED
+  // start reading ahead into the following chunk as well
+  posix_fadvise(fd_, chunkStart + chunkSize_, chunkSize_, POSIX_FADV_WILLNEED);
+#endif
+
+  chunkBase_ = mapBase_ + delta;
+  mapChunk_ = chunk;
+  mapPos_ = 0;
+  offset_ = chunkStart;
+  refreshMapAvail();
+}
+
+void TFileTransport::unmapChunk() {
+  if (mapBase_ != NULL) {
+    munmap(mapBase_, mapSize_);
+  }
+  mapBase_ = NULL;
+  mapSize_ = 0;
+  chunkBase_ = NULL;
+  mapChunk_ = -1;
+  mapPos_ = 0;
+  mapAvail_ = 0;
+  mapEvent_ = NULL;
+}
+
+void TFileTransport::refreshMapAvail() {
+  struct stat f_info;
+  if (fstat(fd_, &f_info) == -1) {
+    GlobalOutput("TFileTransport: fstat error while reading from file");
+    throw TTransportException("TFileTransport: fstat error while reading from file");
+  }
+  off_t chunkStart = off_t(mapChunk_) * chunkSize_;
+  if (f_info.st_size <= chunkStart) {
+    mapAvail_ = 0;
+  } else if (f_info.st_size - chunkStart >= chunkSize_) {
+    mapAvail_ = chunkSize_;
+  } else {
+    mapAvail_ = (uint32_t)(f_info.st_size - chunkStart);
+  }
+}
+
 eventInfo* TFileTransport::readEvent() {
   int readTries = 0;
 
@@ -695,6 +1107,28 @@ void TFileTransport::seekToChunk(int32_t chunk) {
     minEndOffset = lseek(fd_, 0, SEEK_END);
   }
 
+  if (mmapReads_) {
+    // No need to touch the file offset, just move the read pointer
+    if (mapChunk_ == chunk) {
+      mapPos_ = 0;
+      mapEvent_ = NULL;
+    } else {
+      mapChunk(chunk);
+    }
+
+    if (seekToEnd) {
+      int32_t oldReadTimeout = getReadTimeout();
+      setReadTimeout(NO_TAIL_READ_TIMEOUT);
+      while (((off_t(mapChunk_) * chunkSize_ + mapPos_) < minEndOffset) &&
+             mapNextEvent()) {
+        mapEvent_ = NULL;
+      }
+      mapEvent_ = NULL;
+      setReadTimeout(oldReadTimeout);
+    }
+    return;
+  }
+
   off_t newOffset = off_t(chunk) * chunkSize_;
   offset_ = lseek(fd_, newOffset, SEEK_SET);
   readState_.resetAllValues();
@@ -764,69 +1198,93 @@ void TFileTransport::getNextFlushTime(struct timespec* ts_next_flush) {
   ts_next_flush->tv_sec += flushMaxUs_ / 1000000;
 }
 
-TFileTransportBuffer::TFileTransportBuffer(uint32_t size)
-  : bufferMode_(WRITE)
-  , writePoint_(0)
-  , readPoint_(0)
-  , size_(size)
+TFileTransportRing::TFileTransportRing(uint32_t size)
+  : head_(0)
+  , reserved_(0)
+  , committed_(0)
 {
-  buffer_ = new eventInfo*[size];
+  // round up to a power of two so positions can be masked
+  size_ = 1;
+  while (size_ < size && size_ < (1U << 31)) {
+    size_ <<= 1;
+  }
+  mask_ = size_ - 1;
+  buffer_ = (uint8_t*)std::malloc(size_);
+  if (buffer_ == NULL) {
+    throw TTransportException("TFileTransport: out of memory allocating event ring");
+  }
+}
+
+TFileTransportRing::~TFileTransportRing() {
+  std::free(buffer_);
+}
+
+bool TFileTransportRing::hasSpace(uint32_t len) {
+  return reserved_ + len - head_ <= size_;
 }
 
-TFileTransportBuffer::~TFileTransportBuffer() {
-  if (buffer_) {
-    for (uint32_t i = 0; i < writePoint_; i++) {
-      delete buffer_[i];
+bool TFileTransportRing::tryReserve(uint32_t len, uint64_t* pos) {
+  while (true) {
+    uint64_t start = reserved_;
+    if (start + len - head_ > size_) {
+      return false;
+    }
+    if (__sync_bool_compare_and_swap(&reserved_, start, start + len)) {
+      *pos = start;
+      return true;
     }
-    delete[] buffer_;
-    buffer_ = NULL;
   }
 }
 
-bool TFileTransportBuffer::addEvent(eventInfo *event) {
-  if (bufferMode_ == READ) {
-    GlobalOutput("Trying to write to a buffer in read mode");
-  }
-  if (writePoint_ < size_) {
-    buffer_[writePoint_++] = event;
-    return true;
-  } else {
-    // buffer is full
-    return false;
+void TFileTransportRing::copyIn(uint64_t pos, const uint8_t* buf, uint32_t len) {
+  uint32_t off = (uint32_t)(pos & mask_);
+  uint32_t first = min(len, size_ - off);
+  memcpy(buffer_ + off, buf, first);
+  if (first < len) {
+    memcpy(buffer_, buf + first, len - first);
   }
 }
 
-eventInfo* TFileTransportBuffer::getNext() {
-  if (bufferMode_ == WRITE) {
-    bufferMode_ = READ;
-  }
-  if (readPoint_ < writePoint_) {
-    return buffer_[readPoint_++];
-  } else {
-    // no more entries
-    return NULL;
+void TFileTransportRing::commit(uint64_t pos, uint32_t len) {
+  // Publish in reservation order: wait for everyone who reserved before us.
+  // The window between reserving and committing is just a memcpy, so this
+  // rarely spins for long.
+  int spins = 0;
+  while (!__sync_bool_compare_and_swap(&committed_, pos, pos + len)) {
+    if (++spins > 100) {
+      sched_yield();
+      spins = 0;
+    }
   }
 }
 
-void TFileTransportBuffer::reset() {
-  if (bufferMode_ == WRITE || writePoint_ > readPoint_) {
-    T_DEBUG("Resetting a buffer with unread entries");
-  }
-  // Clean up the old entries
-  for (uint32_t i = 0; i < writePoint_; i++) {
-    delete buffer_[i];
+void TFileTransportRing::copyOut(uint64_t pos, uint8_t* buf, uint32_t len) {
+  uint32_t off = (uint32_t)(pos & mask_);
+  uint32_t first = min(len, size_ - off);
+  memcpy(buf, buffer_ + off, first);
+  if (first < len) {
+    memcpy(buf + first, buffer_, len - first);
   }
-  bufferMode_ = WRITE;
-  writePoint_ = 0;
-  readPoint_ = 0;
 }
 
-bool TFileTransportBuffer::isFull() {
-  return writePoint_ == size_;
+int TFileTransportRing::getIovecs(uint64_t from, uint64_t to, struct iovec* iov) {
+  uint32_t off = (uint32_t)(from & mask_);
+  uint32_t len = (uint32_t)(to - from);
+  uint32_t first = min(len, size_ - off);
+  iov[0].iov_base = buffer_ + off;
+  iov[0].iov_len = first;
+  if (first == len) {
+    return 1;
+  }
+  iov[1].iov_base = buffer_;
+  iov[1].iov_len = len - first;
+  return 2;
 }
 
-bool TFileTransportBuffer::isEmpty() {
-  return writePoint_ == 0;
+void TFileTransportRing::release(uint64_t pos) {
+  // make sure we are done reading the data before producers may reuse it
+  __sync_synchronize();
+  head_ = pos;
 }
 
 TFileProcessor::TFileProcessor(shared_ptr<TProcessor> processor,
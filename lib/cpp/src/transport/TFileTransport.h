@@ -13,6 +13,7 @@
 
 #include <string>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include <boost/shared_ptr.hpp>
 
@@ -81,44 +82,66 @@ typedef struct readState {
 } readState;
 
 /**
- * TFileTransportBuffer - buffer class used by TFileTransport for queueing up events
- * to be written to disk.  Should be used in the following way:
- *  1) Buffer created
- *  2) Buffer written to (addEvent)
- *  3) Buffer read from (getNext)
- *  4) Buffer reset (reset)
- *  5) Go back to 2, or destroy buffer
+ * TFileTransportRing - bounded multi-producer, single-consumer byte ring used
+ * by TFileTransport to queue events for the writer thread.  Should be used in
+ * the following way:
+ *  1) A producer reserves space for a framed event (tryReserve)
+ *  2) The producer copies the event into place (copyIn)
+ *  3) The producer publishes it (commit)
+ *  4) The consumer writes out everything between getHead() and
+ *     getCommitted() and then hands the space back (release)
  *
- * The buffer should never be written to after it is read from, unless it is reset first.
- * Note: The above rules are enforced mainly for debugging its sole client TFileTransport
- *       which uses the buffer in this way.
- *
- * @author James Wang <jwang@facebook.com>
+ * Reservation is a single compare-and-swap, so producers only take the
+ * mutex when the ring is full.  Commits are published in reservation order:
+ * commit() spins, yielding now and then, until every earlier reservation
+ * has been committed, so a producer that stalls between reserving and
+ * committing holds up the ones behind it.  In exchange the committed region
+ * is always a contiguous run of complete events that can be written to disk
+ * as is.
  */
-class TFileTransportBuffer {
+class TFileTransportRing {
   public:
-    TFileTransportBuffer(uint32_t size);
-    ~TFileTransportBuffer();
+    TFileTransportRing(uint32_t size);
+    ~TFileTransportRing();
+
+    // Producer side
+    bool hasSpace(uint32_t len);
+    bool tryReserve(uint32_t len, uint64_t* pos);
+    void copyIn(uint64_t pos, const uint8_t* buf, uint32_t len);
+    void commit(uint64_t pos, uint32_t len);
+
+    // Consumer side
+    uint64_t getHead() {
+      return head_;
+    }
+    uint64_t getCommitted() {
+      return committed_;
+    }
+    bool isEmpty() {
+      return committed_ == head_;
+    }
+    void copyOut(uint64_t pos, uint8_t* buf, uint32_t len);
+    int getIovecs(uint64_t from, uint64_t to, struct iovec* iov);
+    void release(uint64_t pos);
 
-    bool addEvent(eventInfo *event);
-    eventInfo* getNext();
-    void reset();
-    bool isFull();
-    bool isEmpty();
+    uint32_t getSize() {
+      return size_;
+    }
 
   private:
-    TFileTransportBuffer(); // should not be used
+    TFileTransportRing(); // should not be used
 
-    enum mode {
-      WRITE,
-      READ
-    };
-    mode bufferMode_;
-
-    uint32_t writePoint_;
-    uint32_t readPoint_;
+    uint8_t* buffer_;
     uint32_t size_;
-    eventInfo** buffer_;
+    uint32_t mask_;
+
+    // Positions only ever increase; the offset into buffer_ is pos & mask_.
+    // Keep the consumer's and producers' counters on separate cache lines.
+    volatile uint64_t head_;
+    char pad1_[64];
+    volatile uint64_t reserved_;
+    char pad2_[64];
+    volatile uint64_t committed_;
 };
 
 /**
@@ -165,9 +188,28 @@ class TFileTransport : public TFileReaderTransport,
   void write(const uint8_t* buf, uint32_t len);
   void flush();
 
+  /**
+   * Writes an event and blocks until the writer thread has made it durable
+   * according to the durability mode.  Concurrent callers are satisfied by
+   * the same sync in group-commit mode.
+   *
+   * @return the file offset up to which data was durable when the call was
+   *         released (at least the end of this event), or -1 if the event
+   *         was dropped
+   */
+  off_t writeDurable(const uint8_t* buf, uint32_t len);
+
   uint32_t readAll(uint8_t* buf, uint32_t len);
   uint32_t read(uint8_t* buf, uint32_t len);
 
+  /**
+   * Hands out the remainder of the current event without copying it.
+   * In memory-mapped mode the pointer refers directly into the mapped
+   * chunk and stays valid until the event has been consumed.
+   */
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+  void consume(uint32_t len);
+
   // log-file specific functions
   void seekToChunk(int32_t chunk);
   void seekToEnd();
@@ -205,6 +247,7 @@ class TFileTransport : public TFileReaderTransport,
     return chunkSize_;
   }
 
+  // maximum number of events that may be queued for the writer thread
   void setEventBufferSize(uint32_t bufferSize) {
     if (bufferAndThreadInitialized_) {
       GlobalOutput("Cannot change the buffer size after writer thread started");
@@ -217,6 +260,49 @@ class TFileTransport : public TFileReaderTransport,
     return eventBufferSize_;
   }
 
+  // bytes of queue space for events waiting for the writer thread, rounded
+  // up to a power of two.  Defaults to 4MB, and is raised to the chunk size
+  // when that is bigger so that any event that fits in a chunk can be queued.
+  void setEventRingSize(uint32_t ringSize) {
+    if (bufferAndThreadInitialized_) {
+      GlobalOutput("Cannot change the ring size after writer thread started");
+      return;
+    }
+    eventRingSize_ = ringSize;
+  }
+
+  uint32_t getEventRingSize() {
+    return eventRingSize_;
+  }
+
+  /**
+   * How the writer thread syncs events to disk.
+   */
+  enum DurabilityMode {
+    // never sync; flush() and writeDurable() only wait for the write()
+    DURABILITY_NONE,
+    // fdatasync after every batch the writer thread drains
+    DURABILITY_GROUP_COMMIT,
+    // fdatasync once flushMaxUs or flushMaxBytes is reached
+    DURABILITY_PERIODIC
+  };
+
+  void setDurabilityMode(DurabilityMode durabilityMode) {
+    durabilityMode_ = durabilityMode;
+  }
+  DurabilityMode getDurabilityMode() {
+    return durabilityMode_;
+  }
+
+  // allocate disk space for the current and next chunk ahead of the writes
+  // that fill them.  Only used when chunking is enabled.
+  void setPreallocateChunks(bool preallocateChunks) {
+    preallocateChunks_ = preallocateChunks;
+  }
+  bool getPreallocateChunks() {
+    return preallocateChunks_;
+  }
+
   void setFlushMaxUs(uint32_t flushMaxUs) {
     if (flushMaxUs) {
       flushMaxUs_ = flushMaxUs;
@@ -249,6 +335,18 @@ class TFileTransport : public TFileReaderTransport,
     return maxCorruptedEvents_;
   }
 
+  /**
+   * Reads events straight out of memory-mapped chunks of the file instead of
+   * copying them through a read buffer, and lets borrow() hand them out in
+   * place.  Each chunk is unmapped once reading moves past it.  Only
+   * available on transports opened read-only.  Switching modes rewinds
+   * reading to the start of the current chunk.
+   */
+  void setMmapReads(bool mmapReads);
+  bool getMmapReads() {
+    return mmapReads_;
+  }
+
   void setEofSleepTimeUs(uint32_t eofSleepTime) {
     if (eofSleepTime) {
       eofSleepTime_ = eofSleepTime;
@@ -260,8 +358,15 @@ class TFileTransport : public TFileReaderTransport,
 
  private:
   // helper functions for writing to a file
-  void enqueueEvent(const uint8_t* buf, uint32_t eventLen, bool blockUntilFlush);
-  bool swapEventBuffers(struct timespec* deadline);
+  off_t enqueueEvent(const uint8_t* buf, uint32_t eventLen, bool blockUntilFlush);
+  void waitForSpace(uint32_t len);
+  void waitForEvents(struct timespec* deadline);
+  uint32_t writeEvents(uint64_t from, uint64_t to);
+  uint32_t writeRing(uint64_t from, uint64_t to);
+  uint32_t padToChunkBoundary();
+  void syncData();
+  void publishFlushed();
+  void preallocate();
   bool initBufferAndWriteThread();
 
   // control for writer thread
@@ -274,6 +379,12 @@ class TFileTransport : public TFileReaderTransport,
   // helper functions for reading from a file
   eventInfo* readEvent();
 
+  // helper functions for memory-mapped reading
+  bool mapNextEvent();
+  void mapChunk(uint32_t chunk);
+  void unmapChunk();
+  void refreshMapAvail();
+
   // event corruption-related functions
   bool isEventCorrupted();
   void performRecovery();
@@ -297,10 +408,14 @@ class TFileTransport : public TFileReaderTransport,
   uint32_t chunkSize_;
   static const uint32_t DEFAULT_CHUNK_SIZE = 16 * 1024 * 1024;
 
-  // size of event buffers
+  // max number of queued events
   uint32_t eventBufferSize_;
   static const uint32_t DEFAULT_EVENT_BUFFER_SIZE = 10000;
 
+  // size of the event ring
+  uint32_t eventRingSize_;
+  static const uint32_t DEFAULT_EVENT_RING_SIZE = 4 * 1024 * 1024;
+
   // max number of microseconds that can pass without flushing
   uint32_t flushMaxUs_;
   static const uint32_t DEFAULT_FLUSH_MAX_US = 3000000;
@@ -309,6 +424,13 @@ class TFileTransport : public TFileReaderTransport,
   uint32_t flushMaxBytes_;
   static const uint32_t DEFAULT_FLUSH_MAX_BYTES = 1000 * 1024;
 
+  // when to sync written events to disk
+  DurabilityMode durabilityMode_;
+
+  // whether to preallocate chunks, and how far the file has been allocated
+  bool preallocateChunks_;
+  off_t preallocatedTo_;
+
   // max event size
   uint32_t maxEventSize_;
   static const uint32_t DEFAULT_MAX_EVENT_SIZE = 0;
@@ -328,20 +450,30 @@ class TFileTransport : public TFileReaderTransport,
   // writer thread id
   pthread_t writerThreadId_;
 
-  // buffers to hold data before it is flushed. Each element of the buffer stores a msg that
-  // needs to be written to the file.  The buffers are swapped by the writer thread.
-  TFileTransportBuffer *dequeueBuffer_;
-  TFileTransportBuffer *enqueueBuffer_;
+  // ring holding framed events (length + payload) that have not been written
+  // to the file yet.  Producers copy events into it without taking mutex_.
+  TFileTransportRing *ring_;
 
-  // conditions used to block when the buffer is full or empty
+  // number of events reserved in the ring but not yet written
+  volatile uint32_t queuedEvents_;
+
+  // conditions used to block when the ring is full or empty.  Producers only
+  // signal notEmpty_ when the writer thread is actually waiting on it, and the
+  // writer only broadcasts notFull_ when producers are waiting.
   pthread_cond_t notFull_, notEmpty_;
+  volatile uint32_t waitingProducers_;
+  volatile bool writerSleeping_;
   volatile bool closing_;
 
-  // To keep track of whether the buffer has been flushed
+  // To keep track of what has been flushed.  flushedPos_ is the ring
+  // position up to which events have been written and synced, and
+  // flushedOffset_ the matching offset in the file.
   pthread_cond_t flushed_;
   volatile bool forceFlush_;
+  volatile uint64_t flushedPos_;
+  off_t flushedOffset_;
 
-  // Mutex that is grabbed when enqueueing and swapping the read/write buffers
+  // Mutex that guards the condition variables above
   pthread_mutex_t mutex_;
 
   // File information
@@ -359,6 +491,22 @@ class TFileTransport : public TFileReaderTransport,
   uint32_t numCorruptedEventsInChunk_;
 
   bool readOnly_;
+
+  // memory-mapped read state
+  bool mmapReads_;
+  uint8_t* mapBase_;
+  size_t mapSize_;
+  // start of the current chunk within the mapping
+  const uint8_t* chunkBase_;
+  int32_t mapChunk_;
+  // read position within the current chunk
+  uint32_t mapPos_;
+  // how much of the current chunk is backed by the file
+  uint32_t mapAvail_;
+  // event being handed out of the mapping
+  const uint8_t* mapEvent_;
+  uint32_t mapEventSize_;
+  uint32_t mapEventPos_;
 };
 
 // Exception thrown when EOF is hit
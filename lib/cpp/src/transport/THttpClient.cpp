@@ -5,6 +5,8 @@
 // http://developers.facebook.com/thrift/
 
 #include <cstdlib>
+#include <cstdio>
+#include <strings.h>
 
 #include "THttpClient.h"
 #include "TSocket.h"
@@ -21,7 +23,6 @@ using namespace std;
 
 // Yeah, yeah, hacky to put these here, I know.
 static const char* CRLF = "\r\n";
-static const int CRLF_LEN = 2;
 
 THttpClient::THttpClient(boost::shared_ptr<TTransport> transport, string host, string path) :
   transport_(transport),
@@ -30,8 +31,12 @@ THttpClient::THttpClient(boost::shared_ptr<TTransport> transport, string host, s
   readHeaders_(true),
   chunked_(false),
   chunkedDone_(false),
+  chunkTrailer_(false),
+  connectionClose_(false),
+  reopen_(false),
   chunkSize_(0),
   contentLength_(0),
+  pending_(0),
   httpBuf_(NULL),
   httpPos_(0),
   httpBufLen_(0),
@@ -45,8 +50,12 @@ THttpClient::THttpClient(string host, int port, string path) :
   readHeaders_(true),
   chunked_(false),
   chunkedDone_(false),
+  chunkTrailer_(false),
+  connectionClose_(false),
+  reopen_(false),
   chunkSize_(0),
   contentLength_(0),
+  pending_(0),
   httpBuf_(NULL),
   httpPos_(0),
   httpBufLen_(0),
@@ -61,6 +70,15 @@ void THttpClient::init() {
     throw TTransportException("Out of memory.");
   }
   httpBuf_[httpBufLen_] = '\0';
+
+  // Only the length changes from one request to the next
+  requestHeader_ =
+    "POST " + path_ + " HTTP/1.1" + CRLF +
+    "Host: " + host_ + CRLF +
+    "Content-Type: application/x-thrift" + CRLF +
+    "Accept: application/x-thrift" + CRLF +
+    "User-Agent: C++/THttpClient" + CRLF +
+    "Content-Length: ";
 }
 
 THttpClient::~THttpClient() {
@@ -70,54 +88,115 @@ THttpClient::~THttpClient() {
 }
 
 uint32_t THttpClient::read(uint8_t* buf, uint32_t len) {
-  if (readBuffer_.available() == 0) {
-    readBuffer_.resetBuffer();
-    uint32_t got = readMoreData();
-    if (got == 0) {
-      return 0;
+  if (readHeaders_) {
+    readHeaders();
+  }
+  if (chunked_ && chunkSize_ == 0 && !chunkedDone_) {
+    readChunkHeader();
+  }
+
+  // Never read past the end of this response, the next one may follow
+  uint32_t remaining = bodyRemaining();
+  if (remaining == 0) {
+    return 0;
+  }
+  if (len > remaining) {
+    len = remaining;
+  }
+
+  uint32_t avail = httpBufLen_ - httpPos_;
+  if (avail == 0) {
+    if (len >= httpBufSize_) {
+      // Nothing buffered and a big read, so skip the copy
+      uint32_t got = transport_->read(buf, len);
+      if (got == 0) {
+        throw TTransportException("Could not refill buffer");
+      }
+      bodyConsumed(got);
+      return got;
     }
+    refill();
+    avail = httpBufLen_ - httpPos_;
+  }
+
+  uint32_t give = avail;
+  if (len < give) {
+    give = len;
   }
-  return readBuffer_.read(buf, len);
+  memcpy(buf, httpBuf_+httpPos_, give);
+  httpPos_ += give;
+  bodyConsumed(give);
+  return give;
 }
 
 void THttpClient::readEnd() {
-  // Read any pending chunked data (footers etc.)
-  if (chunked_) {
-    while (!chunkedDone_) {
-      readChunked();
+  // Nothing of this response has been read yet
+  if (readHeaders_) {
+    return;
+  }
+
+  // Skip over whatever the caller left of the body, including any
+  // remaining chunks and footers
+  while (true) {
+    if (chunked_ && chunkSize_ == 0 && !chunkedDone_) {
+      readChunkHeader();
     }
+    uint32_t remaining = bodyRemaining();
+    if (remaining == 0) {
+      break;
+    }
+    if (httpPos_ == httpBufLen_) {
+      refill();
+    }
+    uint32_t give = httpBufLen_ - httpPos_;
+    if (remaining < give) {
+      give = remaining;
+    }
+    httpPos_ += give;
+    bodyConsumed(give);
   }
+
+  finishResponse();
 }
 
-uint32_t THttpClient::readMoreData() {
-  // Get more data!
-  refill();
+void THttpClient::finishResponse() {
+  readHeaders_ = true;
+  if (pending_ > 0) {
+    --pending_;
+  }
 
-  if (readHeaders_) {
-    readHeaders();
+  if (connectionClose_) {
+    // Anything pipelined behind this response is lost with the connection
+    transport_->close();
+    httpPos_ = 0;
+    httpBufLen_ = 0;
+    pending_ = 0;
+    reopen_ = true;
   }
+}
 
+void THttpClient::bodyConsumed(uint32_t len) {
   if (chunked_) {
-    return readChunked();
+    chunkSize_ -= len;
   } else {
-    return readContent(contentLength_);
+    contentLength_ -= len;
   }
 }
 
-uint32_t THttpClient::readChunked() {
-  uint32_t length = 0;
+void THttpClient::readChunkHeader() {
+  // Every chunk's data is followed by a CRLF
+  if (chunkTrailer_) {
+    readLine();
+    chunkTrailer_ = false;
+  }
 
   char* line = readLine();
-  uint32_t chunkSize = parseChunkSize(line);
-  if (chunkSize == 0) {
+  chunkSize_ = parseChunkSize(line);
+  if (chunkSize_ == 0) {
     readChunkedFooters();
   } else {
-    // Read data content
-    length += readContent(chunkSize);
-    // Read trailing CRLF after content
-    readLine();
+    chunkTrailer_ = true;
   }
-  return length;
 }
 
 void THttpClient::readChunkedFooters() {
@@ -141,73 +220,53 @@ uint32_t THttpClient::parseChunkSize(char* line) {
   return (uint32_t)size;
 }
 
-uint32_t THttpClient::readContent(uint32_t size) {
-  uint32_t need = size;
-  while (need > 0) {
-    uint32_t avail = httpBufLen_ - httpPos_;
-    if (avail == 0) {
-      // We have given all the data, reset position to head of the buffer
-      httpPos_ = 0;
-      httpBufLen_ = 0;
-      refill();
-
-      // Now have available however much we read
-      avail = httpBufLen_;
-    }
-    uint32_t give = avail;
-    if (need < give) {
-      give = need;
-    }
-    readBuffer_.write((uint8_t*)(httpBuf_+httpPos_), give);
-    httpPos_ += give;
-    need -= give;
-  }
-  return size;
-}
-
 char* THttpClient::readLine() {
+  // Bytes already searched, so a refill only scans what it brought in
+  uint32_t scanned = 0;
   while (true) {
-    char* eol = NULL;
-
-    eol = strstr(httpBuf_+httpPos_, CRLF);
+    char* line = httpBuf_+httpPos_;
+    char* eol = (char*)memchr(line+scanned, '\n', httpBufLen_-httpPos_-scanned);
 
-    // No CRLF yet?
     if (eol == NULL) {
-      // Shift whatever we have now to front and refill
-      shift();
+      scanned = httpBufLen_ - httpPos_;
       refill();
     } else {
-      // Return pointer to next line
+      // Return pointer to next line, minus its CRLF
+      httpPos_ = (eol-httpBuf_) + 1;
+      if (eol > line && *(eol-1) == '\r') {
+        --eol;
+      }
       *eol = '\0';
-      char* line = httpBuf_+httpPos_;
-      httpPos_ = (eol-httpBuf_) + CRLF_LEN;
       return line;
     }
   }
-
 }
 
-void THttpClient::shift() {
-  if (httpBufLen_ > httpPos_) {
-    // Shift down remaining data and read more
+void THttpClient::refill() {
+  if (httpPos_ == httpBufLen_) {
+    // Everything has been used, start again at the head of the buffer
+    httpPos_ = 0;
+    httpBufLen_ = 0;
+  } else if (httpPos_ > 0 && httpBufSize_ - httpBufLen_ < httpBufSize_ / 4) {
+    // Running out of room, shift down whatever is left unread
     uint32_t length = httpBufLen_ - httpPos_;
     memmove(httpBuf_, httpBuf_+httpPos_, length);
+    httpPos_ = 0;
     httpBufLen_ = length;
-  } else {
-    httpBufLen_ = 0;
   }
-  httpPos_ = 0;
-  httpBuf_[httpBufLen_] = '\0';
-}
 
-void THttpClient::refill() {
-  uint32_t avail = httpBufSize_ - httpBufLen_;
-  if (avail <= (httpBufSize_ / 4)) {
+  if (httpBufLen_ == httpBufSize_) {
+    // Only a header line can fill the whole buffer
+    if (httpBufSize_ >= MAX_HEADER_SIZE) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "HTTP header too large");
+    }
     httpBufSize_ *= 2;
-    httpBuf_ = (char*)std::realloc(httpBuf_, httpBufSize_+1);
-    if (httpBuf_ == NULL) {
+    char* newBuf = (char*)std::realloc(httpBuf_, httpBufSize_+1);
+    if (newBuf == NULL) {
       throw TTransportException("Out of memory.");
     }
+    httpBuf_ = newBuf;
   }
 
   // Read more data
@@ -225,6 +284,8 @@ void THttpClient::readHeaders() {
   contentLength_ = 0;
   chunked_ = false;
   chunkedDone_ = false;
+  chunkTrailer_ = false;
+  connectionClose_ = false;
   chunkSize_ = 0;
 
   // Control state flow
@@ -271,6 +332,9 @@ bool THttpClient::parseStatusLine(char* status) {
   }
   *msg = '\0';
 
+  // HTTP/1.0 servers close the connection unless they say otherwise
+  connectionClose_ = (strcmp(http, "HTTP/1.0") == 0);
+
   if (strcmp(code, "200") == 0) {
     // HTTP 200 = OK, we got the response
     return true;
@@ -282,6 +346,11 @@ bool THttpClient::parseStatusLine(char* status) {
   }
 }
 
+// Header names are case-insensitive
+static bool headerIs(const char* header, uint32_t sz, const char* name) {
+  return sz == strlen(name) && strncasecmp(header, name, sz) == 0;
+}
+
 void THttpClient::parseHeader(char* header) {
   char* colon = strchr(header, ':');
   if (colon == NULL) {
@@ -290,14 +359,43 @@ void THttpClient::parseHeader(char* header) {
   uint32_t sz = colon - header;
   char* value = colon+1;
 
-  if (strncmp(header, "Transfer-Encoding", sz) == 0) {
+  if (headerIs(header, sz, "Transfer-Encoding")) {
     if (strstr(value, "chunked") != NULL) {
       chunked_ = true;
     }
-  } else if (strncmp(header, "Content-Length", sz) == 0) {
-    chunked_ = false;
-    contentLength_ = atoi(value);
+  } else if (headerIs(header, sz, "Content-Length")) {
+    contentLength_ = strtoul(value, NULL, 10);
+  } else if (headerIs(header, sz, "Connection")) {
+    if (strcasestr(value, "close") != NULL) {
+      connectionClose_ = true;
+    } else if (strcasestr(value, "keep-alive") != NULL) {
+      connectionClose_ = false;
+    }
+  }
+}
+
+const uint8_t* THttpClient::borrow(uint8_t* buf, uint32_t* len) {
+  if (readHeaders_) {
+    return NULL;
+  }
+  uint32_t avail = httpBufLen_ - httpPos_;
+  if (avail > bodyRemaining()) {
+    avail = bodyRemaining();
+  }
+  if (avail >= *len) {
+    *len = avail;
+    return (const uint8_t*)(httpBuf_+httpPos_);
   }
+  return NULL;
+}
+
+void THttpClient::consume(uint32_t len) {
+  if (readHeaders_ || httpBufLen_ - httpPos_ < len || bodyRemaining() < len) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "consume did not follow a borrow.");
+  }
+  httpPos_ += len;
+  bodyConsumed(len);
 }
 
 void THttpClient::write(const uint8_t* buf, uint32_t len) {
@@ -305,31 +403,43 @@ void THttpClient::write(const uint8_t* buf, uint32_t len) {
 }
 
 void THttpClient::flush() {
+  // A caller that read its response without calling readEnd() is done
+  // with it by the time it sends the next request
+  if (!readHeaders_) {
+    readEnd();
+  }
+
+  // The server closed the connection after the last response
+  if (reopen_) {
+    if (!transport_->isOpen()) {
+      transport_->open();
+    }
+    reopen_ = false;
+  }
+
   // Fetch the contents of the write buffer
   uint8_t* buf;
   uint32_t len;
   writeBuffer_.getBuffer(&buf, &len);
 
-  // Construct the HTTP header
-  std::ostringstream h;
-  h <<
-    "POST " << path_ << " HTTP/1.1" << CRLF <<
-    "Host: " << host_ << CRLF <<
-    "Content-Type: application/x-thrift" << CRLF <<
-    "Content-Length: " << len << CRLF <<
-    "Accept: application/x-thrift" << CRLF <<
-    "User-Agent: C++/THttpClient" << CRLF <<
-    CRLF;
-  string header = h.str();
-
-  // Write the header, then the data, then flush
-  transport_->write((const uint8_t*)header.c_str(), header.size());
-  transport_->write(buf, len);
+  // Finish off the HTTP header
+  char length[32];
+  int lengthLen = snprintf(length, sizeof(length), "%u%s%s", len, CRLF, CRLF);
+
+  // Write the header and the data together, then flush
+  struct iovec iov[3];
+  iov[0].iov_base = (void*)requestHeader_.data();
+  iov[0].iov_len = requestHeader_.size();
+  iov[1].iov_base = length;
+  iov[1].iov_len = lengthLen;
+  iov[2].iov_base = buf;
+  iov[2].iov_len = len;
+  transport_->writev(iov, 3);
   transport_->flush();
 
-  // Reset the buffer and header variables
+  // Reset the buffer, the response is now outstanding
   writeBuffer_.resetBuffer();
-  readHeaders_ = true;
+  ++pending_;
 }
 
 }}} // facebook::thrift::transport
@@ -18,6 +18,14 @@ namespace facebook { namespace thrift { namespace transport {
  * here is a VERY basic HTTP/1.1 client which supports HTTP 100 Continue,
  * chunked transfer encoding, keepalive, etc. Tested against Apache.
  *
+ * The connection is kept open between calls unless the server asks for it
+ * to be closed, in which case it is reopened for the next request.
+ * Requests may be pipelined: flush() sends a request without waiting for
+ * earlier responses, and each readEnd() moves on to the next response, so
+ * a client can send several calls and then receive their results in
+ * order.  Response bodies are read straight into the caller's buffer
+ * whenever nothing is left buffered and the read is large enough.
+ *
  * @author Mark Slee <mcslee@facebook.com>
  */
 class THttpClient : public TTransport {
@@ -37,6 +45,9 @@ class THttpClient : public TTransport {
   }
 
   bool peek() {
+    if (!readHeaders_ && httpPos_ < httpBufLen_ && bodyRemaining() > 0) {
+      return true;
+    }
     return transport_->peek();
   }
 
@@ -46,12 +57,36 @@ class THttpClient : public TTransport {
 
   uint32_t read(uint8_t* buf, uint32_t len);
 
+  /**
+   * Discards whatever is left of the current response, so that the next
+   * read starts on the response to the next outstanding request.
+   */
   void readEnd();
 
   void write(const uint8_t* buf, uint32_t len);
 
+  /**
+   * Sends the buffered request.  Responses to earlier requests that have
+   * not been read yet stay queued up on the connection.
+   */
   void flush();
 
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+
+  void consume(uint32_t len);
+
+  /**
+   * Number of requests sent whose responses have not been fully read.
+   */
+  uint32_t getPendingResponses() {
+    return pending_;
+  }
+
+  /**
+   * Response headers larger than this are rejected.
+   */
+  static const uint32_t MAX_HEADER_SIZE = 64 * 1024;
+
  private:
   void init();
 
@@ -60,37 +95,50 @@ class THttpClient : public TTransport {
   boost::shared_ptr<TTransport> transport_;
 
   TMemoryBuffer writeBuffer_;
-  TMemoryBuffer readBuffer_;
 
   std::string host_;
   std::string path_;
 
+  // Everything in the request header up to the value of Content-Length
+  std::string requestHeader_;
+
   bool readHeaders_;
   bool chunked_;
   bool chunkedDone_;
+  bool chunkTrailer_;
+  bool connectionClose_;
+  bool reopen_;
   uint32_t chunkSize_;
   uint32_t contentLength_;
+  uint32_t pending_;
 
   char* httpBuf_;
   uint32_t httpPos_;
   uint32_t httpBufLen_;
   uint32_t httpBufSize_;
 
-  uint32_t readMoreData();
   char* readLine();
 
   void readHeaders();
   void parseHeader(char* header);
   bool parseStatusLine(char* status);
 
-  uint32_t readChunked();
+  void readChunkHeader();
   void readChunkedFooters();
   uint32_t parseChunkSize(char* line);
 
-  uint32_t readContent(uint32_t size);
+  /**
+   * Bytes of the current chunk or Content-Length body not yet read.
+   */
+  uint32_t bodyRemaining() {
+    return chunked_ ? chunkSize_ : contentLength_;
+  }
+
+  void bodyConsumed(uint32_t len);
+
+  void finishResponse();
 
   void refill();
-  void shift();
 
 };
 
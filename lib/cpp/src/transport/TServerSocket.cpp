@@ -5,7 +5,7 @@
 // http://developers.facebook.com/thrift/
 
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/poll.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -222,18 +222,22 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
     throw TTransportException(TTransportException::NOT_OPEN, "TServerSocket not listening");
   }
 
-  fd_set fds;
+  struct pollfd fds[2];
 
   int maxEintrs = 5;
   int numEintrs = 0;
 
   while (true) {
-    FD_ZERO(&fds);
-    FD_SET(serverSocket_, &fds);
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = serverSocket_;
+    fds[0].events = POLLIN;
+    int nfds = 1;
     if (intSock2_ >= 0) {
-      FD_SET(intSock2_, &fds);
+      fds[1].fd = intSock2_;
+      fds[1].events = POLLIN;
+      nfds = 2;
     }
-    int ret = select(serverSocket_+1, &fds, NULL, NULL, NULL);
+    int ret = poll(fds, nfds, -1);
 
     if (ret < 0) {
       // error cases
@@ -242,11 +246,11 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
         // a certain number
         continue;
       }
-      GlobalOutput("TServerSocket::acceptImpl() select -1");
+      GlobalOutput("TServerSocket::acceptImpl() poll -1");
       throw TTransportException(TTransportException::UNKNOWN);
     } else if (ret > 0) {
       // Check for an interrupt signal
-      if (intSock2_ >= 0 && FD_ISSET(intSock2_, &fds)) {
+      if (nfds > 1 && fds[1].revents != 0) {
         int8_t buf;
         if (-1 == recv(intSock2_, &buf, sizeof(int8_t), 0)) {
           GlobalOutput("TServerSocket::acceptImpl() interrupt receive");
@@ -254,11 +258,11 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
         throw TTransportException(TTransportException::INTERRUPTED);
       }
       // Check for the actual server socket being ready
-      if (FD_ISSET(serverSocket_, &fds)) {
+      if (fds[0].revents != 0) {
         break;
       }
     } else {
-      GlobalOutput("TServerSocket::acceptImpl() select 0");
+      GlobalOutput("TServerSocket::acceptImpl() poll 0");
       throw TTransportException(TTransportException::UNKNOWN);
     }
   }
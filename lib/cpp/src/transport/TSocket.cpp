@@ -6,8 +6,10 @@
 
 #include <config.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/poll.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -15,6 +17,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "concurrency/Monitor.h"
 #include "TSocket.h"
@@ -142,10 +145,6 @@ void TSocket::openConnection(struct addrinfo *res) {
     }
   }
 
-  // Conn timeout
-  struct timeval c = {(int)(connTimeout_/1000),
-                      (int)((connTimeout_%1000)*1000)};
-
   // Connect the socket
   int ret = connect(socket_, res->ai_addr, res->ai_addrlen);
 
@@ -160,10 +159,11 @@ void TSocket::openConnection(struct addrinfo *res) {
     throw TTransportException(TTransportException::NOT_OPEN, "connect()", errno_copy);
   }
 
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(socket_, &fds);
-  ret = select(socket_+1, NULL, &fds, NULL, &c);
+  // Wait for the connect to finish, within the conn timeout
+  struct pollfd fds[1];
+  fds[0].fd = socket_;
+  fds[0].events = POLLOUT;
+  ret = poll(fds, 1, connTimeout_);
 
   if (ret > 0) {
     // Ensure connected
@@ -191,7 +191,7 @@ void TSocket::openConnection(struct addrinfo *res) {
     throw TTransportException(TTransportException::NOT_OPEN, "open()", errno_copy);
   } else {
     int errno_copy = errno;
-    string errStr = "TSocket::open() select error " + getSocketInfo();
+    string errStr = "TSocket::open() poll error " + getSocketInfo();
     GlobalOutput(errStr.c_str());
     throw TTransportException(TTransportException::NOT_OPEN, "open()", errno_copy);
   }
@@ -257,6 +257,37 @@ void TSocket::close() {
   socket_ = -1;
 }
 
+int TSocket::waitForRead(const struct timeval* deadline) {
+  while (true) {
+    // Work out what is left of the recv timeout
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t left = ((int64_t)(deadline->tv_sec - now.tv_sec) * 1000) +
+                   ((deadline->tv_usec - now.tv_usec) / 1000);
+    if (left <= 0) {
+      return 0;
+    }
+    int timeout = (int)left;
+
+    struct pollfd fds[1];
+    fds[0].fd = socket_;
+    fds[0].events = POLLIN;
+    int ret = poll(fds, 1, timeout);
+    ++g_socket_syscalls;
+
+    if (ret > 0) {
+      return 1;
+    }
+    if (ret == 0) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      // leave it to recv() to report what went wrong
+      return -1;
+    }
+  }
+}
+
 uint32_t TSocket::read(uint8_t* buf, uint32_t len) {
   if (socket_ < 0) {
     throw TTransportException(TTransportException::NOT_OPEN, "Called read on non-open socket");
@@ -264,45 +295,55 @@ uint32_t TSocket::read(uint8_t* buf, uint32_t len) {
 
   int32_t retries = 0;
 
-  // EAGAIN can be signalled both when a timeout has occurred and when
-  // the system is out of resources (an awesome undocumented feature).
-  // The following is an approximation of the time interval under which
-  // EAGAIN is taken to indicate an out of resources error.
-  uint32_t eagainThresholdMicros = 0;
-  if (recvTimeout_) {
-    // if a readTimeout is specified along with a max number of recv retries, then
-    // the threshold will ensure that the read timeout is not exceeded even in the
-    // case of resource errors
-    eagainThresholdMicros = (recvTimeout_*1000)/ ((maxRecvRetries_>0) ? maxRecvRetries_ : 2);
-  }
+  // With a recv timeout the socket is read without blocking, and we wait
+  // for it to become readable with poll() whenever it has nothing for us.
+  // Nothing depends on SO_RCVTIMEO, so an EAGAIN from recv() is never
+  // ambiguous between a timeout and a lack of resources.
+  int flags = (recvTimeout_ > 0) ? MSG_DONTWAIT : 0;
+  struct timeval deadline = {0, 0};
 
  try_again:
   // Read from the socket
-  struct timeval begin;
-  gettimeofday(&begin, NULL);
-  int got = recv(socket_, buf, len, 0);
-  struct timeval end;
-  gettimeofday(&end, NULL);
-  uint32_t readElapsedMicros =  (((end.tv_sec - begin.tv_sec) * 1000 * 1000)
-                                 + (((uint64_t)(end.tv_usec - begin.tv_usec))));
+  int got = recv(socket_, buf, len, flags);
   ++g_socket_syscalls;
 
   // Check for error on read
   if (got < 0) {
-    if (errno == EAGAIN) {
-      // check if this is the lack of resources or timeout case
-      if (!eagainThresholdMicros || (readElapsedMicros < eagainThresholdMicros)) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (recvTimeout_ <= 0) {
+        // No timeout to wait for, so the socket is short of resources or
+        // was made non-blocking behind our back: retry a few times, then
+        // give up rather than block forever
         if (retries++ < maxRecvRetries_) {
           usleep(50);
           goto try_again;
-        } else {
-          throw TTransportException(TTransportException::TIMED_OUT,
-                                    "EAGAIN (unavailable resources)");
         }
-      } else {
-        // infer that timeout has been hit
+        throw TTransportException(TTransportException::TIMED_OUT,
+                                  "EAGAIN (unavailable resources)");
+      }
+      if (deadline.tv_sec == 0 && deadline.tv_usec == 0) {
+        gettimeofday(&deadline, NULL);
+        deadline.tv_sec += recvTimeout_ / 1000;
+        deadline.tv_usec += (recvTimeout_ % 1000) * 1000;
+        if (deadline.tv_usec >= 1000000) {
+          deadline.tv_sec += 1;
+          deadline.tv_usec -= 1000000;
+        }
+      }
+      switch (waitForRead(&deadline)) {
+      case 1:
+        // Readable again.  If recv() keeps saying otherwise the system is
+        // out of resources.
+        if (retries++ < maxRecvRetries_) {
+          goto try_again;
+        }
+        throw TTransportException(TTransportException::TIMED_OUT,
+                                  "EAGAIN (unavailable resources)");
+      case 0:
         throw TTransportException(TTransportException::TIMED_OUT,
                                   "EAGAIN (timed out)");
+      default:
+        break;
       }
     }
 
@@ -387,6 +428,86 @@ void TSocket::write(const uint8_t* buf, uint32_t len) {
   }
 }
 
+void TSocket::writev(const struct iovec* iov, int iovcnt) {
+  if (socket_ < 0) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Called writev on non-open socket");
+  }
+
+  // Work on a private copy of the vector so that partial sends can be
+  // resumed by adjusting the entries in place.
+  struct iovec local[16];
+  std::vector<struct iovec> heap;
+  struct iovec* vec = local;
+  if (iovcnt > (int)(sizeof(local)/sizeof(local[0]))) {
+    heap.resize(iovcnt);
+    vec = &heap[0];
+  }
+
+  int count = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > 0) {
+      vec[count++] = iov[i];
+    }
+  }
+
+  #ifdef IOV_MAX
+  const int maxIov = IOV_MAX;
+  #else
+  const int maxIov = 16;
+  #endif
+
+  while (count > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = (count < maxIov) ? count : maxIov;
+
+    int flags = 0;
+    #ifdef MSG_NOSIGNAL
+    // See the comment in write() about MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+    #endif // ifdef MSG_NOSIGNAL
+
+    ssize_t b = sendmsg(socket_, &msg, flags);
+    ++g_socket_syscalls;
+
+    // Fail on a send error
+    if (b < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN) {
+        int errno_copy = errno;
+        close();
+        throw TTransportException(TTransportException::NOT_OPEN, "sendmsg()", errno_copy);
+      }
+
+      int errno_copy = errno;
+      string errStr = "TSocket::writev() sendmsg < 0 " + getSocketInfo();
+      GlobalOutput(errStr.c_str());
+      throw TTransportException(TTransportException::UNKNOWN, "sendmsg", errno_copy);
+    }
+
+    // Fail on blocked send
+    if (b == 0) {
+      throw TTransportException(TTransportException::NOT_OPEN, "Socket sendmsg returned 0.");
+    }
+
+    // Skip over whatever went out, trimming a partially sent entry
+    size_t sent = (size_t)b;
+    while (count > 0 && sent >= vec->iov_len) {
+      sent -= vec->iov_len;
+      ++vec;
+      --count;
+    }
+    if (count > 0) {
+      vec->iov_base = (uint8_t*)vec->iov_base + sent;
+      vec->iov_len -= sent;
+    }
+  }
+}
+
 std::string TSocket::getHost() {
   return host_;
 }
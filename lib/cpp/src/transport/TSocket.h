@@ -60,7 +60,7 @@ class TSocket : public TTransport {
   bool isOpen();
 
   /**
-   * Calls select on the socket to see if there is more data available.
+   * Checks whether there is more data available on the socket.
    */
   bool peek();
 
@@ -86,6 +86,12 @@ class TSocket : public TTransport {
    */
   void write(const uint8_t* buf, uint32_t len);
 
+  /**
+   * Writes a vector of buffers to the underlying socket, using as few
+   * sendmsg() calls as the kernel allows.
+   */
+  void writev(const struct iovec* iov, int iovcnt);
+
   /**
    * Get the host that the socket is connected to
    *
@@ -147,7 +153,7 @@ class TSocket : public TTransport {
 
   /**
    * Set the max number of recv retries in case of an EAGAIN
-   * error
+   * error, or EINTR
    */
   void setMaxRecvRetries(int maxRecvRetries);
 
@@ -182,6 +188,13 @@ class TSocket : public TTransport {
   /** connect, called by open */
   void openConnection(struct addrinfo *res);
 
+  /**
+   * Waits with poll() until the socket is readable or the recv timeout
+   * deadline passes.  Only used when a recv timeout is set.  Returns 1 if
+   * readable, 0 on timeout and -1 on error.
+   */
+  int waitForRead(const struct timeval* deadline);
+
   /** Host to connect to */
   std::string host_;
 
@@ -6,6 +6,10 @@
 
 #include <algorithm>
 #include <iostream>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "TSocketPool.h"
 
@@ -14,6 +18,28 @@ namespace facebook { namespace thrift { namespace transport {
 using namespace std;
 
 using boost::shared_ptr;
+using facebook::thrift::concurrency::Guard;
+
+// Weight given to each new sample in the latency moving averages
+static const double LATENCY_EWMA_WEIGHT = 0.2;
+
+// Latency assumed for a server until it answers, in microseconds
+static const double DEFAULT_INITIAL_LATENCY_US = 10 * 1000;
+
+static int64_t elapsedMicros(const struct timeval& start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return ((int64_t)(now.tv_sec - start.tv_sec) * 1000 * 1000) +
+    (now.tv_usec - start.tv_usec);
+}
+
+static void updateAverage(double& average, int64_t sample) {
+  if (average == 0) {
+    average = (double)sample;
+  } else {
+    average += ((double)sample - average) * LATENCY_EWMA_WEIGHT;
+  }
+}
 
 /**
  * TSocketPoolServer implementation
@@ -24,7 +50,11 @@ TSocketPoolServer::TSocketPoolServer()
   : host_(""),
     port_(0),
     lastFailTime_(0),
-    consecutiveFailures_(0) {}
+    consecutiveFailures_(0),
+    connectLatencyUs_(0),
+    rpcLatencyUs_(0),
+    initialLatencyUs_(DEFAULT_INITIAL_LATENCY_US),
+    outstanding_(0) {}
 
 /**
  * Constructor for TSocketPool server
@@ -33,7 +63,88 @@ TSocketPoolServer::TSocketPoolServer(const string &host, int port)
   : host_(host),
     port_(port),
     lastFailTime_(0),
-    consecutiveFailures_(0) {}
+    consecutiveFailures_(0),
+    connectLatencyUs_(0),
+    rpcLatencyUs_(0),
+    initialLatencyUs_(DEFAULT_INITIAL_LATENCY_US),
+    outstanding_(0) {}
+
+TSocketPoolServer::~TSocketPoolServer() {
+  for (size_t i = 0; i < idleSockets_.size(); ++i) {
+    ::close(idleSockets_[i].socket);
+  }
+}
+
+void TSocketPoolServer::recordConnect(int64_t micros) {
+  Guard g(mutex_);
+  updateAverage(connectLatencyUs_, micros);
+}
+
+void TSocketPoolServer::requestStarted() {
+  Guard g(mutex_);
+  ++outstanding_;
+}
+
+void TSocketPoolServer::requestFinished(int64_t micros) {
+  Guard g(mutex_);
+  if (outstanding_ > 0) {
+    --outstanding_;
+  }
+  if (micros >= 0) {
+    updateAverage(rpcLatencyUs_, micros);
+  }
+}
+
+double TSocketPoolServer::getLoadScore() {
+  Guard g(mutex_);
+  double latency = rpcLatencyUs_;
+  if (latency == 0) {
+    latency = max(initialLatencyUs_, connectLatencyUs_);
+  }
+  return latency * (outstanding_ + 1);
+}
+
+int TSocketPoolServer::takeIdleSocket(int maxIdleSecs) {
+  time_t now = time(NULL);
+  while (true) {
+    IdleSocket idle;
+    {
+      Guard g(mutex_);
+      if (idleSockets_.empty()) {
+        return -1;
+      }
+      idle = idleSockets_.back();
+      idleSockets_.pop_back();
+    }
+
+    // A healthy idle connection has nothing to read: no reply left over
+    // and no EOF from the server having closed it
+    uint8_t buf;
+    int r = recv(idle.socket, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
+    bool alive = (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    if (alive && (now - idle.since) <= maxIdleSecs) {
+      return idle.socket;
+    }
+    ::close(idle.socket);
+  }
+}
+
+bool TSocketPoolServer::putIdleSocket(int socket, int maxIdle) {
+  Guard g(mutex_);
+  if ((int)idleSockets_.size() >= maxIdle) {
+    return false;
+  }
+  IdleSocket idle;
+  idle.socket = socket;
+  idle.since = time(NULL);
+  idleSockets_.push_back(idle);
+  return true;
+}
+
+int TSocketPoolServer::getNumIdleSockets() {
+  Guard g(mutex_);
+  return idleSockets_.size();
+}
 
 /**
  * TSocketPool implementation.
@@ -46,7 +157,11 @@ TSocketPool::TSocketPool() : TSocket(),
   retryInterval_(60),
   maxConsecutiveFailures_(1),
   randomize_(true),
-  alwaysTryLast_(true) {
+  alwaysTryLast_(true),
+  powerOfTwoChoices_(false),
+  maxIdle_(0),
+  maxIdleSecs_(60),
+  inRequest_(false) {
 }
 
 TSocketPool::TSocketPool(const vector<string> &hosts,
@@ -55,7 +170,11 @@ TSocketPool::TSocketPool(const vector<string> &hosts,
   retryInterval_(60),
   maxConsecutiveFailures_(1),
   randomize_(true),
-  alwaysTryLast_(true)
+  alwaysTryLast_(true),
+  powerOfTwoChoices_(false),
+  maxIdle_(0),
+  maxIdleSecs_(60),
+  inRequest_(false)
 {
   if (hosts.size() != ports.size()) {
     GlobalOutput("TSocketPool::TSocketPool: hosts.size != ports.size");
@@ -72,7 +191,11 @@ TSocketPool::TSocketPool(const vector<pair<string, int> >& servers) : TSocket(),
   retryInterval_(60),
   maxConsecutiveFailures_(1),
   randomize_(true),
-  alwaysTryLast_(true)
+  alwaysTryLast_(true),
+  powerOfTwoChoices_(false),
+  maxIdle_(0),
+  maxIdleSecs_(60),
+  inRequest_(false)
 {
   for (unsigned i = 0; i < servers.size(); ++i) {
     addServer(servers[i].first, servers[i].second);
@@ -85,7 +208,11 @@ TSocketPool::TSocketPool(const vector< shared_ptr<TSocketPoolServer> >& servers)
   retryInterval_(60),
   maxConsecutiveFailures_(1),
   randomize_(true),
-  alwaysTryLast_(true)
+  alwaysTryLast_(true),
+  powerOfTwoChoices_(false),
+  maxIdle_(0),
+  maxIdleSecs_(60),
+  inRequest_(false)
 {
 }
 
@@ -94,7 +221,11 @@ TSocketPool::TSocketPool(const string& host, int port) : TSocket(),
   retryInterval_(60),
   maxConsecutiveFailures_(1),
   randomize_(true),
-  alwaysTryLast_(true)
+  alwaysTryLast_(true),
+  powerOfTwoChoices_(false),
+  maxIdle_(0),
+  maxIdleSecs_(60),
+  inRequest_(false)
 {
   addServer(host, port);
 }
@@ -136,8 +267,141 @@ void TSocketPool::setAlwaysTryLast(bool alwaysTryLast) {
   alwaysTryLast_ = alwaysTryLast;
 }
 
+void TSocketPool::setPowerOfTwoChoices(bool powerOfTwoChoices) {
+  powerOfTwoChoices_ = powerOfTwoChoices;
+}
+
+void TSocketPool::setKeepAlive(int maxIdle, int maxIdleSecs) {
+  maxIdle_ = maxIdle;
+  maxIdleSecs_ = maxIdleSecs;
+}
+
+void TSocketPool::warmConnections(int perServer) {
+  if (isOpen()) {
+    throw TTransportException(TTransportException::ALREADY_OPEN);
+  }
+
+  for (unsigned int i = 0; i < servers_.size(); ++i) {
+    host_ = servers_[i]->host_;
+    port_ = servers_[i]->port_;
+    while (servers_[i]->getNumIdleSockets() < perServer) {
+      try {
+        TSocket::open();
+      } catch (TException& e) {
+        break;
+      }
+      if (!servers_[i]->putIdleSocket(socket_, perServer)) {
+        TSocket::close();
+      }
+      socket_ = -1;
+    }
+  }
+}
+
+shared_ptr<TSocketPoolServer> TSocketPool::getCurrentServer() {
+  return currentServer_;
+}
+
+bool TSocketPool::openServer(const shared_ptr<TSocketPoolServer>& server) {
+  host_ = server->host_;
+  port_ = server->port_;
+
+  if (maxIdle_ > 0) {
+    int socket = server->takeIdleSocket(maxIdleSecs_);
+    if (socket >= 0) {
+      socket_ = socket;
+      peerHost_ = "";
+      peerAddress_ = "";
+      peerPort_ = 0;
+      currentServer_ = server;
+      return true;
+    }
+  }
+
+  for (int j = 0; j < numRetries_; ++j) {
+    try {
+      struct timeval start;
+      gettimeofday(&start, NULL);
+      TSocket::open();
+      server->recordConnect(elapsedMicros(start));
+
+      // reset lastFailTime_ is required
+      if (server->lastFailTime_) {
+        server->lastFailTime_ = 0;
+      }
+
+      // success
+      currentServer_ = server;
+      return true;
+    } catch (TException& e) {
+      // connection failed
+    }
+  }
+  return false;
+}
+
+void TSocketPool::markFailed(TSocketPoolServer& server) {
+  ++server.consecutiveFailures_;
+  if (server.consecutiveFailures_ > maxConsecutiveFailures_) {
+    // Mark server as down
+    server.consecutiveFailures_ = 0;
+    server.lastFailTime_ = time(NULL);
+  }
+}
+
+bool TSocketPool::isRetryIntervalPassed(TSocketPoolServer& server) {
+  if (server.lastFailTime_ == 0) {
+    return true;
+  }
+  // The server was marked as down, so check if enough time has elapsed to retry
+  int elapsedTime = time(NULL) - server.lastFailTime_;
+  return (elapsedTime > retryInterval_);
+}
+
+void TSocketPool::openPowerOfTwoChoices() {
+  vector< shared_ptr<TSocketPoolServer> > candidates;
+  for (unsigned int i = 0; i < servers_.size(); ++i) {
+    if (isRetryIntervalPassed(*servers_[i])) {
+      candidates.push_back(servers_[i]);
+    }
+  }
+
+  // Everything is marked down: try them all rather than fail outright
+  if (candidates.empty() && alwaysTryLast_) {
+    candidates = servers_;
+  }
+
+  while (!candidates.empty()) {
+    // Pick two distinct servers at random and go with the less loaded one
+    unsigned int pick = rand() % candidates.size();
+    if (candidates.size() > 1) {
+      unsigned int other = rand() % (candidates.size() - 1);
+      if (other >= pick) {
+        ++other;
+      }
+      if (candidates[other]->getLoadScore() < candidates[pick]->getLoadScore()) {
+        pick = other;
+      }
+    }
+
+    if (openServer(candidates[pick])) {
+      return;
+    }
+    markFailed(*candidates[pick]);
+    candidates.erase(candidates.begin() + pick);
+  }
+
+  GlobalOutput("TSocketPool::open: all connections failed");
+  throw TTransportException(TTransportException::NOT_OPEN);
+}
+
 /* TODO: without apc we ignore a lot of functionality from the php version */
 void TSocketPool::open() {
+  if (powerOfTwoChoices_) {
+    openPowerOfTwoChoices();
+    return;
+  }
+
   if (randomize_) {
     random_shuffle(servers_.begin(), servers_.end());
   }
@@ -146,43 +410,14 @@ void TSocketPool::open() {
   for (unsigned int i = 0; i < numServers; ++i) {
 
     TSocketPoolServer &server = *(servers_[i]);
-    bool retryIntervalPassed = (server.lastFailTime_ == 0);
+    bool retryIntervalPassed = isRetryIntervalPassed(server);
     bool isLastServer = alwaysTryLast_ ? (i == (numServers - 1)) : false;
 
-    host_ = server.host_;
-    port_ = server.port_;
-
-    if (server.lastFailTime_ > 0) {
-      // The server was marked as down, so check if enough time has elapsed to retry
-      int elapsedTime = time(NULL) - server.lastFailTime_;
-      if (elapsedTime > retryInterval_) {
-        retryIntervalPassed = true;
-      }
-    }
-
     if (retryIntervalPassed || isLastServer) {
-      for (int j = 0; j < numRetries_; ++j) {
-        try {
-          TSocket::open();
-
-          // reset lastFailTime_ is required
-          if (server.lastFailTime_) {
-            server.lastFailTime_ = 0;
-          }
-
-          // success
-          return;
-        } catch (TException e) {
-          // connection failed
-        }
-      }
-
-      ++server.consecutiveFailures_;
-      if (server.consecutiveFailures_ > maxConsecutiveFailures_) {
-        // Mark server as down
-        server.consecutiveFailures_ = 0;
-        server.lastFailTime_ = time(NULL);
+      if (openServer(servers_[i])) {
+        return;
       }
+      markFailed(server);
     }
   }
 
@@ -190,4 +425,64 @@ void TSocketPool::open() {
   throw TTransportException(TTransportException::NOT_OPEN);
 }
 
+void TSocketPool::close() {
+  // A connection can only be reused if no reply is on its way
+  bool reuse = (maxIdle_ > 0 && isOpen() && !inRequest_ &&
+                currentServer_.get() != NULL);
+  finishRequest(true);
+
+  if (reuse) {
+    uint8_t buf;
+    int r = recv(socket_, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        currentServer_->putIdleSocket(socket_, maxIdle_)) {
+      socket_ = -1;
+    }
+  }
+
+  TSocket::close();
+  currentServer_.reset();
+}
+
+void TSocketPool::finishRequest(bool abandoned) {
+  if (inRequest_) {
+    inRequest_ = false;
+    if (currentServer_.get() != NULL) {
+      currentServer_->requestFinished(abandoned ? -1 : elapsedMicros(requestStart_));
+    }
+  }
+}
+
+uint32_t TSocketPool::read(uint8_t* buf, uint32_t len) {
+  uint32_t got;
+  try {
+    got = TSocket::read(buf, len);
+  } catch (TTransportException& ttx) {
+    // No reply within the timeout: the server is at least this slow
+    finishRequest(false);
+    throw;
+  }
+  // The first byte of the reply, or the server hanging up, ends the request
+  finishRequest(false);
+  return got;
+}
+
+void TSocketPool::write(const uint8_t* buf, uint32_t len) {
+  if (!inRequest_ && currentServer_.get() != NULL) {
+    inRequest_ = true;
+    gettimeofday(&requestStart_, NULL);
+    currentServer_->requestStarted();
+  }
+  TSocket::write(buf, len);
+}
+
+void TSocketPool::writev(const struct iovec* iov, int iovcnt) {
+  if (!inRequest_ && currentServer_.get() != NULL) {
+    inRequest_ = true;
+    gettimeofday(&requestStart_, NULL);
+    currentServer_->requestStarted();
+  }
+  TSocket::writev(iov, iovcnt);
+}
+
 }}} // facebook::thrift::transport
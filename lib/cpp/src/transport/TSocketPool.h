@@ -9,6 +9,7 @@
 
 #include <vector>
 #include "TSocket.h"
+#include <concurrency/Mutex.h>
 
 namespace facebook { namespace thrift { namespace transport {
 
@@ -30,6 +31,51 @@ class TSocketPoolServer {
    */
   TSocketPoolServer(const std::string &host, int port);
 
+  /**
+   * Closes any idle connections still held for this server
+   */
+  ~TSocketPoolServer();
+
+  /**
+   * Folds a connect time into the connect latency average
+   */
+  void recordConnect(int64_t micros);
+
+  /**
+   * Marks the start and end of a request sent to this server.  The end
+   * folds the time taken into the RPC latency average, unless micros is
+   * negative (e.g. for a request abandoned before its reply).
+   */
+  void requestStarted();
+  void requestFinished(int64_t micros);
+
+  /**
+   * Expected cost of sending the next request here: the RPC latency
+   * average scaled by the number of requests already outstanding.  Until
+   * the server has answered, the average is taken to be initialLatencyUs_
+   * or the connect latency, whichever is higher, so that requests piling
+   * up on a server that never answers still drive its score up.
+   */
+  double getLoadScore();
+
+  /**
+   * Takes a healthy idle connection out of the keep-alive pool, or returns
+   * -1 if there is none.  Connections the peer has closed, or that have
+   * been idle longer than maxIdleSecs, are closed and skipped.
+   */
+  int takeIdleSocket(int maxIdleSecs);
+
+  /**
+   * Puts an open connection in the keep-alive pool.  Returns false, and
+   * leaves the socket alone, if the pool already holds maxIdle connections.
+   */
+  bool putIdleSocket(int socket, int maxIdle);
+
+  /**
+   * Number of connections currently in the keep-alive pool
+   */
+  int getNumIdleSockets();
+
   // Host name
   std::string host_;
 
@@ -41,6 +87,30 @@ class TSocketPoolServer {
 
   // Number of consecutive times connecting to this server failed
   int consecutiveFailures_;
+
+  // Moving averages of connect and request latency, in microseconds
+  double connectLatencyUs_;
+  double rpcLatencyUs_;
+
+  // Latency assumed for a server that has not answered a request yet, in
+  // microseconds
+  double initialLatencyUs_;
+
+  // Number of requests sent here that have not been answered yet
+  int outstanding_;
+
+ private:
+  struct IdleSocket {
+    int socket;
+    time_t since;
+  };
+
+  // Warm connections ready to be reused, most recently used last
+  std::vector<IdleSocket> idleSockets_;
+
+  // Guards the averages, the counters and idleSockets_, since servers can
+  // be shared between pools on different threads
+  facebook::thrift::concurrency::Mutex mutex_;
 };
 
 /**
@@ -133,12 +203,69 @@ class TSocketPool : public TSocket {
     */
    void setAlwaysTryLast(bool alwaysTryLast);
 
+   /**
+    * Chooses between two randomly picked live servers by their load score
+    * (see TSocketPoolServer::getLoadScore) instead of walking the list.
+    */
+   void setPowerOfTwoChoices(bool powerOfTwoChoices);
+
+   /**
+    * Keeps up to maxIdle connections per server open after close(), so
+    * that later opens can reuse them without a TCP handshake.  Idle
+    * connections older than maxIdleSecs are not reused.  Zero disables it.
+    */
+   void setKeepAlive(int maxIdle, int maxIdleSecs = 60);
+
+   /**
+    * Opens connections to every server until each holds perServer idle
+    * ones.  Only useful with keep-alive on.
+    */
+   void warmConnections(int perServer);
+
+   /**
+    * Server the socket is currently connected to, if any
+    */
+   boost::shared_ptr<TSocketPoolServer> getCurrentServer();
+
    /**
     * Creates and opens the UNIX socket.
     */
    void open();
 
+   /**
+    * Closes the socket, or hands it back to the server's keep-alive pool if
+    * it is idle and healthy.
+    */
+   void close();
+
+   /**
+    * Track requests (from the first write to the first byte of the reply)
+    * to keep the server's latency average and outstanding count current.
+    * A read that fails, e.g. on a receive timeout, counts the time waited
+    * so far as the request's latency.
+    */
+   uint32_t read(uint8_t* buf, uint32_t len);
+   void write(const uint8_t* buf, uint32_t len);
+   void writev(const struct iovec* iov, int iovcnt);
+
  protected:
+   /** Connects to server, using a warm connection if there is one */
+   bool openServer(const boost::shared_ptr<TSocketPoolServer>& server);
+
+   /** Records a failed connect to server, maybe marking it down */
+   void markFailed(TSocketPoolServer& server);
+
+   /** Whether a server marked down may be tried again */
+   bool isRetryIntervalPassed(TSocketPoolServer& server);
+
+   /** open() for the power of two choices policy */
+   void openPowerOfTwoChoices();
+
+   /**
+    * Ends the request in progress, if any.  Its time goes into the
+    * server's latency average unless it was abandoned.
+    */
+   void finishRequest(bool abandoned);
 
    /** List of servers to connect to */
   std::vector< boost::shared_ptr<TSocketPoolServer> > servers_;
@@ -159,6 +286,20 @@ class TSocketPool : public TSocket {
 
    /** Always try last host, even if marked down? */
    bool alwaysTryLast_;
+
+   /** Pick servers by power of two choices? */
+   bool powerOfTwoChoices_;
+
+   /** Idle connections to keep per server, and for how long */
+   int maxIdle_;
+   int maxIdleSecs_;
+
+   /** Server the socket is connected to */
+   boost::shared_ptr<TSocketPoolServer> currentServer_;
+
+   /** A request has been written but not answered; and when it started */
+   bool inRequest_;
+   struct timeval requestStart_;
 };
 
 }}} // facebook::thrift::transport
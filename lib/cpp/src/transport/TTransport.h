@@ -11,6 +11,7 @@
 #include <boost/shared_ptr.hpp>
 #include <transport/TTransportException.h>
 #include <string>
+#include <sys/uio.h>
 
 namespace facebook { namespace thrift { namespace transport {
 
@@ -119,6 +120,25 @@ class TTransport {
     throw TTransportException(TTransportException::NOT_OPEN, "Base TTransport cannot write.");
   }
 
+  /**
+   * Writes a sequence of buffers in their entirety, as if write() were
+   * called on each of them in order.  Transports that sit directly on a
+   * file descriptor should override this to hand the whole vector to the
+   * kernel at once (i.e. writev/sendmsg), so that a frame header and its
+   * payload can go out in a single system call.
+   *
+   * @param iov     Array of buffers to write
+   * @param iovcnt  Number of entries in iov
+   * @throws TTransportException if an error occurs
+   */
+  virtual void writev(const struct iovec* iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+      if (iov[i].iov_len > 0) {
+        write((const uint8_t*)iov[i].iov_base, (uint32_t)iov[i].iov_len);
+      }
+    }
+  }
+
   /**
    * Called when write is completed.
    * This can be over-ridden to perform a transport-specific action
@@ -150,7 +170,9 @@ class TTransport {
    *
    * @oaram buf  A buffer where the data can be stored if needed.
    *             If borrow doesn't return buf, then the contents of
-   *             buf after the call are undefined.
+   *             buf after the call are undefined.  May be NULL, for
+   *             requests too big to copy; then borrow must fail rather
+   *             than copy.
    * @param len  *len should initially contain the number of bytes to borrow.
    *             If borrow succeeds, *len will contain the number of bytes
    *             available in the returned pointer.  This will be at least
@@ -208,6 +230,51 @@ class TTransportFactory {
 
 };
 
+/**
+ * Calls a transport without going through the vtable, for code templated
+ * on the transport class it talks to (see TBinaryProtocolT).  This lets
+ * the compiler inline the transport's own fast path.  The object passed
+ * must be exactly a Transport_, since overrides in subclasses are bypassed.
+ * The TTransport version calls virtually.
+ */
+template <class Transport_>
+struct TTransportDirect {
+  static void write(Transport_* trans, const uint8_t* buf, uint32_t len) {
+    trans->Transport_::write(buf, len);
+  }
+
+  static uint32_t readAll(Transport_* trans, uint8_t* buf, uint32_t len) {
+    return trans->Transport_::readAll(buf, len);
+  }
+
+  static const uint8_t* borrow(Transport_* trans, uint8_t* buf, uint32_t* len) {
+    return trans->Transport_::borrow(buf, len);
+  }
+
+  static void consume(Transport_* trans, uint32_t len) {
+    trans->Transport_::consume(len);
+  }
+};
+
+template <>
+struct TTransportDirect<TTransport> {
+  static void write(TTransport* trans, const uint8_t* buf, uint32_t len) {
+    trans->write(buf, len);
+  }
+
+  static uint32_t readAll(TTransport* trans, uint8_t* buf, uint32_t len) {
+    return trans->readAll(buf, len);
+  }
+
+  static const uint8_t* borrow(TTransport* trans, uint8_t* buf, uint32_t* len) {
+    return trans->borrow(buf, len);
+  }
+
+  static void consume(TTransport* trans, uint32_t len) {
+    trans->consume(len);
+  }
+};
+
 }}} // facebook::thrift::transport
 
 #endif // #ifndef _THRIFT_TRANSPORT_TTRANSPORT_H_
@@ -21,9 +21,15 @@ uint32_t TBufferedTransport::read(uint8_t* buf, uint32_t len) {
       need -= rLen_-rPos_;
       buf += rLen_-rPos_;
     }
+    rPos_ = rLen_ = 0;
+
+    // Going through the buffer would only add a copy
+    if (need >= rBufSize_) {
+      return (len - need) + transport_->read(buf, need);
+    }
+
     // Get more from underlying transport up to buffer size
     rLen_ = transport_->read(rBuf_, rBufSize_);
-    rPos_ = 0;
   }
 
   // Hand over whatever we have
@@ -37,39 +43,34 @@ uint32_t TBufferedTransport::read(uint8_t* buf, uint32_t len) {
   return (len - need);
 }
 
-void TBufferedTransport::write(const uint8_t* buf, uint32_t len) {
+void TBufferedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
   if (len == 0) {
     return;
   }
 
-  uint32_t pos = 0;
-
-  while ((len-pos) + wLen_ >= wBufSize_) {
-    uint32_t copy = wBufSize_ - wLen_;
-    memcpy(wBuf_ + wLen_, buf + pos, copy);
-
-    transport_->write(wBuf_, wBufSize_);
-    pos += copy;
+  // If this write would fill the buffer, send whatever is buffered together
+  // with the new data in one vectored write rather than copying it through
+  // the buffer a chunk at a time.
+  if (len + wLen_ >= wBufSize_) {
+    struct iovec iov[2];
+    iov[0].iov_base = wBuf_;
+    iov[0].iov_len = wLen_;
+    iov[1].iov_base = (void*)buf;
+    iov[1].iov_len = len;
+    transport_->writev(iov, 2);
     wLen_ = 0;
+    return;
   }
 
-  if ((len - pos) > 0) {
-    memcpy(wBuf_ + wLen_, buf + pos, len - pos);
-    wLen_ += len - pos;
-  }
+  memcpy(wBuf_ + wLen_, buf, len);
+  wLen_ += len;
 }
 
-const uint8_t* TBufferedTransport::borrow(uint8_t* buf, uint32_t* len) {
+const uint8_t* TBufferedTransport::borrowSlow(uint8_t* buf, uint32_t* len) {
   // The number of additional bytes we need from the underlying transport.
-  // Could be zero or negative.
+  // borrow() has already handed out what is buffered if that was enough.
   uint32_t need = *len - (rLen_-rPos_);
 
-  // If we have enough data, just hand over a pointer.
-  if (need <= 0) {
-    *len = rLen_-rPos_;
-    return rBuf_+rPos_;
-  }
-
   // If the request is bigger than our buffer, we are hosed.
   if (*len > rBufSize_) {
     return NULL;
@@ -87,26 +88,17 @@ const uint8_t* TBufferedTransport::borrow(uint8_t* buf, uint32_t* len) {
   // First try to fill up the buffer.
   uint32_t got = transport_->read(rBuf_+rLen_, rBufSize_-rLen_);
   rLen_ += got;
-  need -= got;
 
-  // If that fails, readAll until we get what we need.
-  if (need > 0) {
-    rLen_ += transport_->readAll(rBuf_+rLen_, need);
+  // If that fails, readAll until we get what we need.  The read may well
+  // have brought in more than was needed.
+  if (got < need) {
+    rLen_ += transport_->readAll(rBuf_+rLen_, need - got);
   }
 
   *len = rLen_-rPos_;
   return rBuf_+rPos_;
 }
 
-void TBufferedTransport::consume(uint32_t len) {
-  if (rLen_-rPos_ >= len) {
-    rPos_ += len;
-  } else {
-    throw TTransportException(TTransportException::BAD_ARGS,
-                              "consume did not follow a borrow.");
-  }
-}
-
 void TBufferedTransport::flush()  {
   // Write out any data waiting in the write buffer
   if (wLen_ > 0) {
@@ -150,12 +142,6 @@ uint32_t TFramedTransport::read(uint8_t* buf, uint32_t len) {
 }
 
 void TFramedTransport::readFrame() {
-  // Get rid of the old frame
-  if (rBuf_ != NULL) {
-    delete [] rBuf_;
-    rBuf_ = NULL;
-  }
-
   // Read in the next chunk size
   int32_t sz;
   transport_->readAll((uint8_t*)&sz, 4);
@@ -165,14 +151,55 @@ void TFramedTransport::readFrame() {
     throw TTransportException("Frame size has negative value");
   }
 
+  if ((uint32_t)sz > maxFrameSize_) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Frame size exceeds maximum");
+  }
+
+  // Reuse the old buffer if the frame fits, unless it was only grown that
+  // big for an earlier oversized frame and this one is back to normal.
+  if ((uint32_t)sz > rBufSize_ ||
+      (rBufSize_ > shrinkSize_ && (uint32_t)sz <= shrinkSize_)) {
+    uint32_t want = (uint32_t)sz;
+    if (want < DEFAULT_READ_BUFFER_SIZE) {
+      want = DEFAULT_READ_BUFFER_SIZE;
+    }
+    allocReadBuffer(want);
+  }
+
   // Read the frame payload, reset markers
-  rBuf_ = new uint8_t[sz];
-  transport_->readAll(rBuf_, sz);
   rPos_ = 0;
+  rLen_ = 0;
+  transport_->readAll(rBuf_, sz);
   rLen_ = sz;
 }
 
-void TFramedTransport::write(const uint8_t* buf, uint32_t len) {
+void TFramedTransport::allocReadBuffer(uint32_t sz) {
+  releaseReadBuffer();
+  if (pool_.get() != NULL) {
+    rBuf_ = pool_->acquire(sz, &rBufSize_);
+  } else {
+    rBuf_ = (uint8_t*)std::malloc(sz);
+    if (rBuf_ == NULL) {
+      throw TTransportException("Out of memory");
+    }
+    rBufSize_ = sz;
+  }
+}
+
+void TFramedTransport::releaseReadBuffer() {
+  if (rBuf_ != NULL) {
+    if (pool_.get() != NULL) {
+      pool_->release(rBuf_, rBufSize_);
+    } else {
+      std::free(rBuf_);
+    }
+  }
+  rBuf_ = NULL;
+  rBufSize_ = 0;
+}
+
+void TFramedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
   if (len == 0) {
     return;
   }
@@ -213,16 +240,17 @@ void TFramedTransport::flush()  {
     return;
   }
 
-  // Write frame size
+  // Write frame size and body together, so that a transport with a native
+  // writev can send the whole frame in a single system call
   int32_t sz = wLen_;
   sz = (int32_t)htonl(sz);
 
-  transport_->write((const uint8_t*)&sz, 4);
-
-  // Write frame body
-  if (wLen_ > 0) {
-    transport_->write(wBuf_, wLen_);
-  }
+  struct iovec iov[2];
+  iov[0].iov_base = &sz;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = wBuf_;
+  iov[1].iov_len = wLen_;
+  transport_->writev(iov, 2);
 
   // All done
   wLen_ = 0;
@@ -231,26 +259,6 @@ void TFramedTransport::flush()  {
   transport_->flush();
 }
 
-const uint8_t* TFramedTransport::borrow(uint8_t* buf, uint32_t* len) {
-  // Don't try to be clever with shifting buffers.
-  // If we have enough data, give a pointer to it,
-  // otherwise let the protcol use its slow path.
-  if (read_ && (rLen_-rPos_ >= *len)) {
-    *len = rLen_-rPos_;
-    return rBuf_+rPos_;
-  }
-  return NULL;
-}
-
-void TFramedTransport::consume(uint32_t len) {
-  if (rLen_-rPos_ >= len) {
-    rPos_ += len;
-  } else {
-    throw TTransportException(TTransportException::BAD_ARGS,
-                              "consume did not follow a borrow.");
-  }
-}
-
 uint32_t TMemoryBuffer::read(uint8_t* buf, uint32_t len) {
   // Check avaible data for reading
   uint32_t avail = wPos_ - rPos_;
@@ -264,6 +272,20 @@ uint32_t TMemoryBuffer::read(uint8_t* buf, uint32_t len) {
     give = avail;
   }
 
+  if (segmented_) {
+    // Copy out segment by segment
+    uint32_t need = give;
+    while (need > 0) {
+      Segment& seg = segments_[rSeg_];
+      uint32_t n = std::min(need, seg.len - rOff_);
+      memcpy(buf, seg.buf + rOff_, n);
+      buf += n;
+      need -= n;
+      consume(n);
+    }
+    return give;
+  }
+
   // Copy into buffer and increment rPos_
   memcpy(buf, buffer_ + rPos_, give);
   rPos_ += give;
@@ -272,6 +294,20 @@ uint32_t TMemoryBuffer::read(uint8_t* buf, uint32_t len) {
 }
 
 uint32_t TMemoryBuffer::readAppendToString(std::string& str, uint32_t len) {
+  if (segmented_) {
+    uint32_t give = std::min(len, wPos_ - rPos_);
+    str.reserve(str.length() + give);
+    uint32_t need = give;
+    while (need > 0) {
+      Segment& seg = segments_[rSeg_];
+      uint32_t n = std::min(need, seg.len - rOff_);
+      str.append((char*)seg.buf + rOff_, n);
+      need -= n;
+      consume(n);
+    }
+    return give;
+  }
+
   // Don't get some stupid assertion failure.
   if (buffer_ == NULL) {
     return 0;
@@ -297,6 +333,104 @@ uint32_t TMemoryBuffer::readAppendToString(std::string& str, uint32_t len) {
   return give;
 }
 
+void TMemoryBuffer::appendBufferToString(std::string& str) {
+  if (segmented_) {
+    str.reserve(str.length() + wPos_);
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      str.append((char*)segments_[i].buf, segments_[i].len);
+    }
+    return;
+  }
+
+  if (buffer_ == NULL) {
+    return;
+  }
+  str.append((char*)buffer_, wPos_);
+}
+
+void TMemoryBuffer::getIovecs(const struct iovec** iov, int* iovcnt) {
+  iov_.clear();
+  if (segmented_) {
+    for (size_t i = rSeg_; i < segments_.size(); ++i) {
+      uint32_t off = (i == rSeg_) ? rOff_ : 0;
+      if (segments_[i].len > off) {
+        struct iovec v;
+        v.iov_base = segments_[i].buf + off;
+        v.iov_len = segments_[i].len - off;
+        iov_.push_back(v);
+      }
+    }
+  } else if (wPos_ > rPos_) {
+    struct iovec v;
+    v.iov_base = buffer_ + rPos_;
+    v.iov_len = wPos_ - rPos_;
+    iov_.push_back(v);
+  }
+
+  *iov = iov_.empty() ? NULL : &iov_[0];
+  *iovcnt = (int)iov_.size();
+}
+
+uint8_t* TMemoryBuffer::segmentWritePtr(uint32_t len) {
+  // Start a new segment if the write does not fit in the last one.  Writes
+  // bigger than a segment get a segment of their own.
+  if (segments_.empty() ||
+      segments_.back().size - segments_.back().len < len) {
+    Segment seg;
+    seg.buf = pool_->acquire(std::max(len, segmentSize_), &seg.size);
+    seg.len = 0;
+    segments_.push_back(seg);
+  }
+
+  // Any contiguous copy is out of date now
+  if (flat_ != NULL) {
+    std::free(flat_);
+    flat_ = NULL;
+  }
+
+  Segment& last = segments_.back();
+  return last.buf + last.len;
+}
+
+void TMemoryBuffer::flattenSegments(uint8_t** bufPtr, uint32_t* sz) {
+  *sz = wPos_;
+  if (segments_.empty()) {
+    *bufPtr = NULL;
+    return;
+  }
+  if (segments_.size() == 1) {
+    *bufPtr = segments_[0].buf;
+    return;
+  }
+
+  if (flat_ == NULL) {
+    flat_ = (uint8_t*)std::malloc(wPos_);
+    if (flat_ == NULL) {
+      throw TTransportException("Out of memory.");
+    }
+    uint32_t pos = 0;
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      memcpy(flat_ + pos, segments_[i].buf, segments_[i].len);
+      pos += segments_[i].len;
+    }
+  }
+  *bufPtr = flat_;
+}
+
+void TMemoryBuffer::releaseSegments() {
+  for (size_t i = 0; i < segments_.size(); ++i) {
+    pool_->release(segments_[i].buf, segments_[i].size);
+  }
+  segments_.clear();
+  iov_.clear();
+  rSeg_ = 0;
+  rOff_ = 0;
+  if (flat_ != NULL) {
+    std::free(flat_);
+    flat_ = NULL;
+  }
+}
+
 void TMemoryBuffer::ensureCanWrite(uint32_t len) {
   // Check available space
   uint32_t avail = bufferSize_ - wPos_;
@@ -319,7 +453,23 @@ void TMemoryBuffer::ensureCanWrite(uint32_t len) {
   }
 }
 
-void TMemoryBuffer::write(const uint8_t* buf, uint32_t len) {
+void TMemoryBuffer::writeSlow(const uint8_t* buf, uint32_t len) {
+  if (segmented_) {
+    // Fill up the last segment, then chain on new ones
+    while (len > 0) {
+      uint32_t n = std::min(len, segmentSize_);
+      if (!segments_.empty() && segments_.back().len < segments_.back().size) {
+        n = std::min(len, segments_.back().size - segments_.back().len);
+      }
+      memcpy(segmentWritePtr(n), buf, n);
+      segments_.back().len += n;
+      wPos_ += n;
+      buf += n;
+      len -= n;
+    }
+    return;
+  }
+
   ensureCanWrite(len);
 
   // Copy into the buffer and increment wPos_
@@ -328,6 +478,16 @@ void TMemoryBuffer::write(const uint8_t* buf, uint32_t len) {
 }
 
 void TMemoryBuffer::wroteBytes(uint32_t len) {
+  if (segmented_) {
+    if (segments_.empty() ||
+        len > segments_.back().size - segments_.back().len) {
+      throw TTransportException("Client wrote more bytes than size of buffer.");
+    }
+    segments_.back().len += len;
+    wPos_ += len;
+    return;
+  }
+
   uint32_t avail = bufferSize_ - wPos_;
   if (len > avail) {
     throw TTransportException("Client wrote more bytes than size of buffer.");
@@ -335,7 +495,20 @@ void TMemoryBuffer::wroteBytes(uint32_t len) {
   wPos_ += len;
 }
 
-const uint8_t* TMemoryBuffer::borrow(uint8_t* buf, uint32_t* len) {
+const uint8_t* TMemoryBuffer::borrowSlow(uint8_t* buf, uint32_t* len) {
+  if (segmented_) {
+    // Only what is left of the current segment can be lent out in place
+    consume(0);
+    if (rSeg_ < segments_.size()) {
+      Segment& seg = segments_[rSeg_];
+      if (seg.len - rOff_ >= *len && seg.len > rOff_) {
+        *len = seg.len - rOff_;
+        return seg.buf + rOff_;
+      }
+    }
+    return NULL;
+  }
+
   if (wPos_-rPos_ >= *len) {
     *len = wPos_-rPos_;
     return buffer_ + rPos_;
@@ -343,9 +516,26 @@ const uint8_t* TMemoryBuffer::borrow(uint8_t* buf, uint32_t* len) {
   return NULL;
 }
 
-void TMemoryBuffer::consume(uint32_t len) {
+void TMemoryBuffer::consumeSlow(uint32_t len) {
   if (wPos_-rPos_ >= len) {
     rPos_ += len;
+    if (segmented_ && !segments_.empty()) {
+      // Walk the reader forward, possibly across several segments, and
+      // never leave it at the end of one that has a successor
+      while (true) {
+        if (rOff_ == segments_[rSeg_].len && rSeg_ + 1 < segments_.size()) {
+          ++rSeg_;
+          rOff_ = 0;
+          continue;
+        }
+        if (len == 0) {
+          break;
+        }
+        uint32_t n = std::min(len, segments_[rSeg_].len - rOff_);
+        rOff_ += n;
+        len -= n;
+      }
+    }
   } else {
     throw TTransportException(TTransportException::BAD_ARGS,
                               "consume did not follow a borrow.");
@@ -8,9 +8,12 @@
 #define _THRIFT_TRANSPORT_TTRANSPORTUTILS_H_ 1
 
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <algorithm>
+#include <vector>
 #include <transport/TTransport.h>
+#include <transport/TBufferPool.h>
 #include <transport/TFileTransport.h>
 
 namespace facebook { namespace thrift { namespace transport {
@@ -103,7 +106,23 @@ class TBufferedTransport : public TTransport {
 
   uint32_t read(uint8_t* buf, uint32_t len);
 
-  void write(const uint8_t* buf, uint32_t len);
+  uint32_t readAll(uint8_t* buf, uint32_t len) {
+    if (rLen_-rPos_ >= len) {
+      memcpy(buf, rBuf_+rPos_, len);
+      rPos_ += len;
+      return len;
+    }
+    return TTransport::readAll(buf, len);
+  }
+
+  void write(const uint8_t* buf, uint32_t len) {
+    if (len + wLen_ < wBufSize_) {
+      memcpy(wBuf_ + wLen_, buf, len);
+      wLen_ += len;
+      return;
+    }
+    writeSlow(buf, len);
+  }
 
   void flush();
 
@@ -118,15 +137,39 @@ class TBufferedTransport : public TTransport {
    *    will ever have to be copied again.  For optimial performance,
    *    stay under this limit.
    */
-  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len) {
+    // If we have enough data, just hand over a pointer.
+    if (rLen_-rPos_ >= *len) {
+      *len = rLen_-rPos_;
+      return rBuf_+rPos_;
+    }
+    return borrowSlow(buf, len);
+  }
 
-  void consume(uint32_t len);
+  void consume(uint32_t len) {
+    if (rLen_-rPos_ >= len) {
+      rPos_ += len;
+    } else {
+      throw TTransportException(TTransportException::BAD_ARGS,
+                                "consume did not follow a borrow.");
+    }
+  }
 
   boost::shared_ptr<TTransport> getUnderlyingTransport() {
     return transport_;
   }
 
  protected:
+  /**
+   * Out of line part of write(), for when the data does not simply fit.
+   */
+  void writeSlow(const uint8_t* buf, uint32_t len);
+
+  /**
+   * Out of line part of borrow(), refills the read buffer.
+   */
+  const uint8_t* borrowSlow(uint8_t* buf, uint32_t* len);
+
   boost::shared_ptr<TTransport> transport_;
   uint8_t* rBuf_;
   uint32_t rBufSize_;
@@ -164,38 +207,52 @@ class TBufferedTransportFactory : public TTransportFactory {
  * binary chunk followed by the data payload. This allows the receiver on the
  * other end to always do fixed-length reads.
  *
+ * The read buffer is kept and reused from one frame to the next.  It only
+ * grows when a frame does not fit, and a buffer that was grown past the
+ * shrink size for one oversized frame is given back as soon as a normal
+ * sized frame arrives.  If a TBufferPool is supplied, read buffers are
+ * taken from and returned to it instead of the heap.
+ *
  * @author Mark Slee <mcslee@facebook.com>
  */
 class TFramedTransport : public TTransport {
  public:
+  static const uint32_t DEFAULT_READ_BUFFER_SIZE = 512;
+  static const uint32_t DEFAULT_SHRINK_SIZE = 64 * 1024;
+  static const uint32_t DEFAULT_MAX_FRAME_SIZE = 0x7fffffff;
+
   TFramedTransport(boost::shared_ptr<TTransport> transport) :
     transport_(transport),
+    rBuf_(NULL),
+    rBufSize_(0),
     rPos_(0),
     rLen_(0),
     read_(true),
+    maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+    shrinkSize_(DEFAULT_SHRINK_SIZE),
     wBufSize_(512),
     wLen_(0),
     write_(true) {
-    rBuf_ = NULL;
     wBuf_ = new uint8_t[wBufSize_];
   }
 
   TFramedTransport(boost::shared_ptr<TTransport> transport, uint32_t sz) :
     transport_(transport),
+    rBuf_(NULL),
+    rBufSize_(0),
     rPos_(0),
     rLen_(0),
     read_(true),
+    maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+    shrinkSize_(DEFAULT_SHRINK_SIZE),
     wBufSize_(sz),
     wLen_(0),
     write_(true) {
-    rBuf_ = NULL;
     wBuf_ = new uint8_t[wBufSize_];
   }
 
   ~TFramedTransport() {
-    if (rBuf_ != NULL) {
-      delete [] rBuf_;
-    }
+    releaseReadBuffer();
     if (wBuf_ != NULL) {
       delete [] wBuf_;
     }
@@ -209,6 +266,41 @@ class TFramedTransport : public TTransport {
     write_ = write;
   }
 
+  /**
+   * Frames whose length prefix exceeds this many bytes are rejected with a
+   * CORRUPTED_DATA exception before any memory is allocated for them.
+   */
+  void setMaxFrameSize(uint32_t maxFrameSize) {
+    maxFrameSize_ = maxFrameSize;
+  }
+
+  uint32_t getMaxFrameSize() {
+    return maxFrameSize_;
+  }
+
+  /**
+   * A read buffer larger than this is released again once a frame arrives
+   * that would fit in a buffer of this size.
+   */
+  void setShrinkSize(uint32_t shrinkSize) {
+    shrinkSize_ = shrinkSize;
+  }
+
+  /**
+   * Takes read buffers from the given pool rather than the heap.  Passing a
+   * null pointer goes back to plain allocation.
+   */
+  void setBufferPool(boost::shared_ptr<TBufferPool> pool) {
+    // Buffers must go back to wherever they came from
+    if (rPos_ < rLen_) {
+      throw TTransportException(TTransportException::BAD_ARGS,
+                                "Cannot change buffer pool in the middle of a frame.");
+    }
+    releaseReadBuffer();
+    rPos_ = rLen_ = 0;
+    pool_ = pool;
+  }
+
   void open() {
     transport_->open();
   }
@@ -233,24 +325,65 @@ class TFramedTransport : public TTransport {
 
   uint32_t read(uint8_t* buf, uint32_t len);
 
-  void write(const uint8_t* buf, uint32_t len);
+  uint32_t readAll(uint8_t* buf, uint32_t len) {
+    if (read_ && rLen_-rPos_ >= len) {
+      memcpy(buf, rBuf_+rPos_, len);
+      rPos_ += len;
+      return len;
+    }
+    return TTransport::readAll(buf, len);
+  }
+
+  void write(const uint8_t* buf, uint32_t len) {
+    if (write_ && len + wLen_ < wBufSize_) {
+      memcpy(wBuf_ + wLen_, buf, len);
+      wLen_ += len;
+      return;
+    }
+    writeSlow(buf, len);
+  }
 
   void flush();
 
-  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len) {
+    // Don't try to be clever with shifting buffers.
+    // If we have enough data, give a pointer to it,
+    // otherwise let the protcol use its slow path.
+    if (read_ && (rLen_-rPos_ >= *len)) {
+      *len = rLen_-rPos_;
+      return rBuf_+rPos_;
+    }
+    return NULL;
+  }
 
-  void consume(uint32_t len);
+  void consume(uint32_t len) {
+    if (rLen_-rPos_ >= len) {
+      rPos_ += len;
+    } else {
+      throw TTransportException(TTransportException::BAD_ARGS,
+                                "consume did not follow a borrow.");
+    }
+  }
 
   boost::shared_ptr<TTransport> getUnderlyingTransport() {
     return transport_;
   }
 
  protected:
+  /**
+   * Out of line part of write(), for when the data does not simply fit.
+   */
+  void writeSlow(const uint8_t* buf, uint32_t len);
+
   boost::shared_ptr<TTransport> transport_;
+  boost::shared_ptr<TBufferPool> pool_;
   uint8_t* rBuf_;
+  uint32_t rBufSize_;
   uint32_t rPos_;
   uint32_t rLen_;
   bool read_;
+  uint32_t maxFrameSize_;
+  uint32_t shrinkSize_;
 
   uint8_t* wBuf_;
   uint32_t wBufSize_;
@@ -261,6 +394,16 @@ class TFramedTransport : public TTransport {
    * Reads a frame of input from the underlying stream.
    */
   void readFrame();
+
+  /**
+   * Replaces the read buffer with one of at least sz bytes.
+   */
+  void allocReadBuffer(uint32_t sz);
+
+  /**
+   * Gives the read buffer back to the pool or the heap.
+   */
+  void releaseReadBuffer();
 };
 
 /**
@@ -270,17 +413,36 @@ class TFramedTransport : public TTransport {
  */
 class TFramedTransportFactory : public TTransportFactory {
  public:
-  TFramedTransportFactory() {}
+  TFramedTransportFactory() :
+    maxFrameSize_(TFramedTransport::DEFAULT_MAX_FRAME_SIZE) {}
+
+  /**
+   * All transports made by this factory draw their read buffers from pool,
+   * e.g. TBufferPool::getDefault() to share them process-wide.
+   */
+  TFramedTransportFactory(boost::shared_ptr<TBufferPool> pool) :
+    pool_(pool),
+    maxFrameSize_(TFramedTransport::DEFAULT_MAX_FRAME_SIZE) {}
 
   virtual ~TFramedTransportFactory() {}
 
+  void setMaxFrameSize(uint32_t maxFrameSize) {
+    maxFrameSize_ = maxFrameSize;
+  }
+
   /**
    * Wraps the transport into a framed one.
    */
   virtual boost::shared_ptr<TTransport> getTransport(boost::shared_ptr<TTransport> trans) {
-    return boost::shared_ptr<TTransport>(new TFramedTransport(trans));
+    TFramedTransport* framed = new TFramedTransport(trans);
+    framed->setBufferPool(pool_);
+    framed->setMaxFrameSize(maxFrameSize_);
+    return boost::shared_ptr<TTransport>(framed);
   }
 
+ protected:
+  boost::shared_ptr<TBufferPool> pool_;
+  uint32_t maxFrameSize_;
 };
 
 
@@ -313,13 +475,25 @@ class TMemoryBuffer : public TTransport {
     owner_ = owner;
     wPos_ = wPos;
     rPos_ = 0;
+
+    segmented_ = false;
+    segmentSize_ = 0;
+    rSeg_ = 0;
+    rOff_ = 0;
+    flat_ = NULL;
   }
 
   // make sure there's at least 'len' bytes available for writing
   void ensureCanWrite(uint32_t len);
 
+  // helpers for segmented mode
+  uint8_t* segmentWritePtr(uint32_t len);
+  void flattenSegments(uint8_t** bufPtr, uint32_t* sz);
+  void releaseSegments();
+
  public:
   static const uint32_t defaultSize = 1024;
+  static const uint32_t defaultSegmentSize = 64 * 1024;
 
   /**
    * This enum specifies how a TMemoryBuffer should treat
@@ -396,7 +570,29 @@ class TMemoryBuffer : public TTransport {
     }
   }
 
+  /**
+   * Construct a TMemoryBuffer in segmented mode.  Instead of growing one
+   * contiguous buffer, writes are appended to a chain of segments taken
+   * from pool, which go back to the pool on resetBuffer().  Large messages
+   * are therefore never copied to grow the buffer, and getIovecs() hands
+   * them out for a vectored send.  getBuffer() still works, but has to copy
+   * the data into one piece first when it spans more than one segment.
+   *
+   * @param pool         Where segments come from (NULL for the default pool)
+   * @param segmentSize  Capacity of each segment
+   */
+  TMemoryBuffer(boost::shared_ptr<TBufferPool> pool,
+                uint32_t segmentSize = defaultSegmentSize) {
+    initCommon(NULL, 0, true, 0);
+    segmented_ = true;
+    pool_ = (pool.get() != NULL) ? pool : TBufferPool::getDefault();
+    segmentSize_ = (segmentSize > 0) ? segmentSize : defaultSegmentSize;
+  }
+
   ~TMemoryBuffer() {
+    if (segmented_) {
+      releaseSegments();
+    }
     if (owner_) {
       std::free(buffer_);
       buffer_ = NULL;
@@ -417,25 +613,44 @@ class TMemoryBuffer : public TTransport {
 
   // TODO(dreiss): Make bufPtr const.
   void getBuffer(uint8_t** bufPtr, uint32_t* sz) {
+    if (segmented_) {
+      flattenSegments(bufPtr, sz);
+      return;
+    }
     *bufPtr = buffer_;
     *sz = wPos_;
   }
 
   std::string getBufferAsString() {
-    if (buffer_ == NULL) {
-      return "";
-    }
-    return std::string((char*)buffer_, (std::string::size_type)wPos_);
+    std::string str;
+    appendBufferToString(str);
+    return str;
   }
 
-  void appendBufferToString(std::string& str) {
-    if (buffer_ == NULL) {
-      return;
-    }
-    str.append((char*)buffer_, wPos_);
+  void appendBufferToString(std::string& str);
+
+  /**
+   * Points *iov at a list of *iovcnt iovecs covering the data that has not
+   * been read yet, suitable for TTransport::writev().  The list stays valid
+   * until the buffer is next modified.  After sending part of it, consume()
+   * the bytes that went out and ask again.
+   */
+  void getIovecs(const struct iovec** iov, int* iovcnt);
+
+  // whether this buffer was constructed in segmented mode
+  bool isSegmented() const {
+    return segmented_;
+  }
+
+  // capacity of the contiguous buffer, which may be more than is written
+  uint32_t getBufferSize() const {
+    return bufferSize_;
   }
 
   void resetBuffer() {
+    if (segmented_) {
+      releaseSegments();
+    }
     wPos_ = 0;
     rPos_ = 0;
     // It isn't safe to write into a buffer we don't own.
@@ -467,6 +682,15 @@ class TMemoryBuffer : public TTransport {
 
   uint32_t read(uint8_t* buf, uint32_t len);
 
+  uint32_t readAll(uint8_t* buf, uint32_t len) {
+    if (!segmented_ && wPos_-rPos_ >= len) {
+      memcpy(buf, buffer_ + rPos_, len);
+      rPos_ += len;
+      return len;
+    }
+    return TTransport::readAll(buf, len);
+  }
+
   std::string readAsString(uint32_t len) {
     std::string str;
     (void)readAppendToString(str, len);
@@ -481,22 +705,51 @@ class TMemoryBuffer : public TTransport {
     }
   }
 
-  void write(const uint8_t* buf, uint32_t len);
+  void write(const uint8_t* buf, uint32_t len) {
+    if (!segmented_ && bufferSize_-wPos_ >= len) {
+      memcpy(buffer_ + wPos_, buf, len);
+      wPos_ += len;
+      return;
+    }
+    writeSlow(buf, len);
+  }
 
   uint32_t available() const {
     return wPos_ - rPos_;
   }
 
-  const uint8_t* borrow(uint8_t* buf, uint32_t* len);
+  const uint8_t* borrow(uint8_t* buf, uint32_t* len) {
+    if (!segmented_ && wPos_-rPos_ >= *len) {
+      *len = wPos_-rPos_;
+      return buffer_ + rPos_;
+    }
+    return borrowSlow(buf, len);
+  }
 
-  void consume(uint32_t len);
+  void consume(uint32_t len) {
+    if (!segmented_ && wPos_-rPos_ >= len) {
+      rPos_ += len;
+      return;
+    }
+    consumeSlow(len);
+  }
 
   void swap(TMemoryBuffer& that) {
     using std::swap;
     swap(buffer_,     that.buffer_);
     swap(bufferSize_, that.bufferSize_);
     swap(wPos_,       that.wPos_);
+    swap(rPos_,       that.rPos_);
     swap(owner_,      that.owner_);
+
+    swap(segmented_,   that.segmented_);
+    swap(pool_,        that.pool_);
+    swap(segmentSize_, that.segmentSize_);
+    swap(segments_,    that.segments_);
+    swap(rSeg_,        that.rSeg_);
+    swap(rOff_,        that.rOff_);
+    swap(flat_,        that.flat_);
+    swap(iov_,         that.iov_);
   }
 
   // Returns a pointer to where the client can write data to append to
@@ -505,6 +758,9 @@ class TMemoryBuffer : public TTransport {
   // passing to read(), recv(), or similar. You must call wroteBytes() as soon
   // as data is written or the buffer will not be aware that data has changed.
   uint8_t* getWritePtr(uint32_t len) {
+    if (segmented_) {
+      return segmentWritePtr(len);
+    }
     ensureCanWrite(len);
     return buffer_ + wPos_;
   }
@@ -514,6 +770,17 @@ class TMemoryBuffer : public TTransport {
   void wroteBytes(uint32_t len);
 
  private:
+  /**
+   * Out of line part of write(), for when the data does not simply fit.
+   */
+  void writeSlow(const uint8_t* buf, uint32_t len);
+
+  /**
+   * Out of line parts of borrow() and consume(), for segmented buffers.
+   */
+  const uint8_t* borrowSlow(uint8_t* buf, uint32_t* len);
+  void consumeSlow(uint32_t len);
+
   // Data buffer
   uint8_t* buffer_;
 
@@ -529,6 +796,30 @@ class TMemoryBuffer : public TTransport {
   // Is this object the owner of the buffer?
   bool owner_;
 
+  // A piece of a segmented buffer
+  struct Segment {
+    uint8_t* buf;
+    uint32_t size;
+    uint32_t len;
+  };
+
+  // Segmented mode: the data lives in segments_ rather than buffer_, and
+  // wPos_ and rPos_ count bytes across all of them
+  bool segmented_;
+  boost::shared_ptr<TBufferPool> pool_;
+  uint32_t segmentSize_;
+  std::vector<Segment> segments_;
+
+  // Segment the reader is in, and its offset within it
+  uint32_t rSeg_;
+  uint32_t rOff_;
+
+  // Contiguous copy made by getBuffer(), if the data spans segments
+  uint8_t* flat_;
+
+  // Scratch list returned by getIovecs()
+  std::vector<struct iovec> iov_;
+
   // Don't forget to update constrctors, initCommon, and swap if
   // you add new members.
 };
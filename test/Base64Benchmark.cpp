@@ -0,0 +1,187 @@
+/*
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  Base64Benchmark.cpp ../lib/cpp/.libs/libthrift.a -o Base64Benchmark
+./Base64Benchmark
+*/
+
+// Base64-encodes and decodes blobs of 1KB to 10MB, 3 bytes at a time with
+// base64_encode() and base64_decode() the way TJSONProtocol used to, and in
+// bulk, and times TJSONProtocol writing and reading them as binary fields.
+// Prints MB/s of raw bytes for each.  First checks that the bulk functions
+// and TBase64Encoder agree with the 3 byte functions on every length up to
+// a few hundred bytes, and on input that isn't all base64.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sys/time.h>
+#include <protocol/TBase64Utils.h>
+#include <protocol/TJSONProtocol.h>
+#include <transport/TTransportUtils.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+static const uint32_t SIZES[] = {
+  1024, 16 * 1024, 256 * 1024, 1024 * 1024, 10 * 1024 * 1024
+};
+static const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+static const uint64_t BYTES_PER_ROW = 256 * 1024 * 1024;
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static uint32_t randomState = 2463534242U;
+static uint8_t randomByte() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return (uint8_t)(randomState >> 7);
+}
+
+static string encodeByGroups(const string& in) {
+  string out;
+  uint8_t b[4];
+  for (uint32_t i = 0; i < in.size(); i += 3) {
+    uint32_t len = (in.size() - i < 3 ? in.size() - i : 3);
+    base64_encode((const uint8_t*)in.data() + i, len, b);
+    out.append((const char*)b, len + 1);
+  }
+  return out;
+}
+
+static string decodeByGroups(const string& in) {
+  string out;
+  uint8_t b[4];
+  for (uint32_t i = 0; i + 1 < in.size(); i += 4) {
+    uint32_t len = (in.size() - i < 4 ? in.size() - i : 4);
+    memcpy(b, in.data() + i, len);
+    base64_decode(b, len);
+    out.append((const char*)b, len - 1);
+  }
+  return out;
+}
+
+static string encodeBulk(const string& in) {
+  string out(base64_encoded_size(in.size()), '\0');
+  uint32_t len = base64_encode_bulk((const uint8_t*)in.data(), in.size(),
+                                    (uint8_t*)&out[0]);
+  assert(len == out.size());
+  return out;
+}
+
+static string decodeBulk(string in) {
+  in.resize(base64_decode_bulk((uint8_t*)&in[0], in.size()));
+  return in;
+}
+
+static void checkAgreement() {
+  for (uint32_t len = 0; len < 400; ++len) {
+    string raw;
+    for (uint32_t i = 0; i < len; ++i) {
+      raw += (char)randomByte();
+    }
+    string encoded = encodeByGroups(raw);
+    assert(encodeBulk(raw) == encoded);
+    assert(decodeBulk(encoded) == raw);
+
+    // Fed to the encoder in uneven pieces
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    TBase64Encoder encoder(buf.get());
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < len; ) {
+      uint32_t piece = randomByte() % 7;
+      piece = (piece > len - i ? len - i : piece);
+      written += encoder.write((const uint8_t*)raw.data() + i, piece);
+      i += piece;
+    }
+    written += encoder.finish();
+    assert(buf->getBufferAsString() == encoded);
+    assert(written == encoded.size());
+
+    // Not base64 at all in places, which has to decode to the same junk
+    string junk = encoded;
+    for (uint32_t i = 0; i < junk.size(); ++i) {
+      if (randomByte() < 4) {
+        junk[i] = (char)randomByte();
+      }
+    }
+    assert(decodeBulk(junk) == decodeByGroups(junk));
+  }
+}
+
+int main() {
+  checkAgreement();
+
+  cout << "bulk implementation: " << base64_implementation() << endl;
+  cout << setw(10) << "size" << setw(10) << "enc/3"
+       << setw(10) << "enc" << setw(10) << "dec/4" << setw(10) << "dec"
+       << setw(10) << "json enc" << setw(10) << "json dec" << endl;
+  for (int s = 0; s < NUM_SIZES; ++s) {
+    string blob;
+    for (uint32_t i = 0; i < SIZES[s]; ++i) {
+      blob += (char)randomByte();
+    }
+    int iterations = (int)(BYTES_PER_ROW / blob.size());
+    double mb = (double)iterations * blob.size() / (1024 * 1024);
+    string encoded = encodeBulk(blob);
+    string scratch;
+
+    double start = nowUsec();
+    for (int i = 0; i < iterations; ++i) {
+      scratch = encodeByGroups(blob);
+    }
+    double groupEnc = mb * 1000000.0 / (nowUsec() - start);
+
+    start = nowUsec();
+    for (int i = 0; i < iterations; ++i) {
+      scratch = encodeBulk(blob);
+    }
+    double bulkEnc = mb * 1000000.0 / (nowUsec() - start);
+
+    start = nowUsec();
+    for (int i = 0; i < iterations; ++i) {
+      scratch = decodeByGroups(encoded);
+    }
+    double groupDec = mb * 1000000.0 / (nowUsec() - start);
+
+    start = nowUsec();
+    for (int i = 0; i < iterations; ++i) {
+      scratch = decodeBulk(encoded);
+    }
+    double bulkDec = mb * 1000000.0 / (nowUsec() - start);
+    assert(scratch == blob);
+
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    TJSONProtocol proto(buf);
+    start = nowUsec();
+    for (int i = 0; i < iterations; ++i) {
+      buf->resetBuffer();
+      proto.writeBinary(blob);
+    }
+    double jsonEnc = mb * 1000000.0 / (nowUsec() - start);
+
+    string json = buf->getBufferAsString();
+    start = nowUsec();
+    for (int i = 0; i < iterations; ++i) {
+      buf->resetBuffer((uint8_t*)json.data(), json.size());
+      proto.readBinary(scratch);
+    }
+    double jsonDec = mb * 1000000.0 / (nowUsec() - start);
+    assert(scratch == blob);
+
+    cout << setw(10) << SIZES[s] << fixed << setprecision(0)
+         << setw(10) << groupEnc << setw(10) << bulkEnc
+         << setw(10) << groupDec << setw(10) << bulkDec
+         << setw(10) << jsonEnc << setw(10) << jsonDec << endl;
+  }
+  return 0;
+}
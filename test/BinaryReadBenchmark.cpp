@@ -0,0 +1,102 @@
+/*
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  BinaryReadBenchmark.cpp ../lib/cpp/.libs/libthrift.a -o BinaryReadBenchmark
+./BinaryReadBenchmark
+*/
+
+// Reads binary fields of 1KB to 16MB with TBinaryProtocol and
+// TCompactProtocol, from a TMemoryBuffer directly and through
+// TFramedTransport and TBufferedTransport, and prints the throughput of
+// readBinary() for each.  Every blob is checked to come back intact.
+
+#undef NDEBUG
+#include <cassert>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sys/time.h>
+#include <protocol/TBinaryProtocol.h>
+#include <protocol/TCompactProtocol.h>
+#include <transport/TTransportUtils.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+static const uint32_t SIZES[] = {
+  1024, 16 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024
+};
+static const int NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+static const uint64_t BYTES_PER_ROW = 512 * 1024 * 1024;
+
+static const char* TRANSPORTS[] = { "memory", "framed", "buffered" };
+static const int NUM_TRANSPORTS = 3;
+static const char* PROTOCOLS[] = { "binary", "compact" };
+static const int NUM_PROTOCOLS = 2;
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static shared_ptr<TTransport> makeTransport(int kind, shared_ptr<TMemoryBuffer> buf) {
+  switch (kind) {
+    case 0:
+      return buf;
+    case 1:
+      return shared_ptr<TTransport>(new TFramedTransport(buf));
+    default:
+      return shared_ptr<TTransport>(new TBufferedTransport(buf, 4096));
+  }
+}
+
+static shared_ptr<TProtocol> makeProtocol(int kind, shared_ptr<TTransport> trans) {
+  if (kind == 0) {
+    return shared_ptr<TProtocol>(new TBinaryProtocol(trans));
+  }
+  return shared_ptr<TProtocol>(new TCompactProtocol(trans));
+}
+
+int main() {
+  cout << setw(10) << "size" << setw(10) << "transport" << setw(10) << "protocol"
+       << setw(12) << "MB/s" << endl;
+  for (int s = 0; s < NUM_SIZES; ++s) {
+    string blob(SIZES[s], '\0');
+    for (uint32_t i = 0; i < blob.size(); ++i) {
+      blob[i] = (char)(i * 131 + (i >> 11));
+    }
+    int iterations = (int)(BYTES_PER_ROW / blob.size());
+
+    for (int transKind = 0; transKind < NUM_TRANSPORTS; ++transKind) {
+      for (int protoKind = 0; protoKind < NUM_PROTOCOLS; ++protoKind) {
+        shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+        shared_ptr<TTransport> trans = makeTransport(transKind, buf);
+        shared_ptr<TProtocol> proto = makeProtocol(protoKind, trans);
+        proto->writeBinary(blob);
+        trans->flush();
+        string encoded = buf->getBufferAsString();
+
+        string copy;
+        buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+        proto->readBinary(copy);
+        assert(copy == blob);
+        assert(buf->available() == 0);
+
+        double start = nowUsec();
+        for (int i = 0; i < iterations; ++i) {
+          buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+          proto->readBinary(copy);
+        }
+        double secs = (nowUsec() - start) / 1000000.0;
+
+        cout << setw(10) << SIZES[s] << setw(10) << TRANSPORTS[transKind]
+             << setw(10) << PROTOCOLS[protoKind]
+             << setw(12) << fixed << setprecision(0)
+             << (double)iterations * blob.size() / (1024 * 1024) / secs << endl;
+      }
+    }
+  }
+  return 0;
+}
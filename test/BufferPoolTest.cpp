@@ -0,0 +1,160 @@
+/*
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  BufferPoolTest.cpp ../lib/cpp/.libs/libthrift.a -lpthread \
+  -o BufferPoolTest
+./BufferPoolTest
+*/
+
+// Checks that TBufferPool hands back buffers of the right size class,
+// reuses released ones up to its per-class limit and never caches
+// oversized ones.  Then that TFramedTransport takes its read buffers from
+// a pool and gives them back, and that setMaxFrameSize() rejects a frame
+// whose length prefix is too big, or negative, before taking any memory.
+
+#undef NDEBUG
+#include <cassert>
+#include <iostream>
+#include <arpa/inet.h>
+#include <transport/TBufferPool.h>
+#include <transport/TTransportUtils.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::transport;
+
+// Writes a frame with the given length prefix and len bytes of payload
+static void writeFrame(shared_ptr<TMemoryBuffer> buf, int32_t prefix,
+                       uint32_t len) {
+  int32_t sz = (int32_t)htonl(prefix);
+  buf->write((uint8_t*)&sz, 4);
+  for (uint32_t i = 0; i < len; ++i) {
+    uint8_t b = (uint8_t)i;
+    buf->write(&b, 1);
+  }
+}
+
+static void expectCorrupt(TFramedTransport& framed) {
+  uint8_t b;
+  try {
+    framed.read(&b, 1);
+    assert(false);
+  } catch (TTransportException& ttx) {
+    assert(ttx.getType() == TTransportException::CORRUPTED_DATA);
+  }
+}
+
+int main() {
+  // Size classes of 512, 1024, 2048 and 4096, two cached of each
+  TBufferPool pool(512, 4096, 2);
+  uint32_t size;
+
+  uint8_t* a = pool.acquire(100, &size);
+  assert(size == 512);
+  assert(pool.getAcquiredBytes() == 512);
+  pool.release(a, size);
+  assert(pool.getAcquiredBytes() == 0);
+  assert(pool.getCachedBytes() == 512);
+
+  // Anything up to the class size comes back out of the cache
+  uint8_t* b = pool.acquire(512, &size);
+  assert(b == a && size == 512);
+  assert(pool.getCachedBytes() == 0);
+
+  // The next class up is a different buffer
+  uint8_t* c = pool.acquire(513, &size);
+  assert(size == 1024);
+  pool.release(c, size);
+  uint8_t* d = pool.acquire(1000, &size);
+  assert(d == c && size == 1024);
+  pool.release(d, size);
+
+  // Only two are kept per class
+  uint8_t* e = pool.acquire(1, &size);
+  uint8_t* f = pool.acquire(1, &size);
+  pool.release(b, 512);
+  pool.release(e, 512);
+  pool.release(f, 512);
+  assert(pool.getCachedBytes() == 2 * 512 + 1024);
+
+  // Oversized buffers are exactly as big as asked for and never cached
+  uint8_t* big = pool.acquire(5000, &size);
+  assert(size == 5000);
+  assert(pool.getAcquiredBytes() == 5000);
+  pool.release(big, size);
+  assert(pool.getAcquiredBytes() == 0);
+  assert(pool.getCachedBytes() == 2 * 512 + 1024);
+
+  pool.trim();
+  assert(pool.getCachedBytes() == 0);
+
+  assert(TBufferPool::getDefault().get() != NULL);
+  assert(TBufferPool::getDefault() == TBufferPool::getDefault());
+
+  // Framed reads borrow their buffer from the pool and give it back
+  shared_ptr<TBufferPool> framePool(new TBufferPool(512, 4096, 2));
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  {
+    TFramedTransport framed(buf);
+    framed.setBufferPool(framePool);
+    writeFrame(buf, 100, 100);
+    writeFrame(buf, 2000, 2000);
+    uint8_t payload[2000];
+    framed.readAll(payload, 100);
+    assert(payload[99] == 99);
+    assert(framePool->getAcquiredBytes() == 512);
+    framed.readAll(payload, 2000);
+    assert(payload[1999] == (uint8_t)1999);
+    assert(framePool->getAcquiredBytes() == 2048);
+    assert(framePool->getCachedBytes() == 512);
+  }
+  assert(framePool->getAcquiredBytes() == 0);
+  assert(framePool->getCachedBytes() == 512 + 2048);
+
+  // A length prefix over the limit is rejected before anything is taken
+  framePool->trim();
+  buf->resetBuffer();
+  {
+    TFramedTransport framed(buf);
+    framed.setBufferPool(framePool);
+    framed.setMaxFrameSize(1000);
+    writeFrame(buf, 1001, 0);
+    expectCorrupt(framed);
+    assert(framePool->getAcquiredBytes() == 0);
+  }
+
+  // A huge one is rejected the same way, so no giant allocation happens,
+  // and the limit carries over from the factory
+  buf->resetBuffer();
+  {
+    TFramedTransportFactory factory(framePool);
+    factory.setMaxFrameSize(1000);
+    shared_ptr<TTransport> framed = factory.getTransport(buf);
+    writeFrame(buf, 0x7ffffff0, 0);
+    uint8_t b;
+    try {
+      framed->read(&b, 1);
+      assert(false);
+    } catch (TTransportException& ttx) {
+      assert(ttx.getType() == TTransportException::CORRUPTED_DATA);
+    }
+    assert(framePool->getAcquiredBytes() == 0);
+  }
+
+  // Negative lengths never get that far
+  buf->resetBuffer();
+  {
+    TFramedTransport framed(buf);
+    framed.setBufferPool(framePool);
+    writeFrame(buf, -5, 0);
+    uint8_t b;
+    try {
+      framed.read(&b, 1);
+      assert(false);
+    } catch (TTransportException& ttx) {
+    }
+    assert(framePool->getAcquiredBytes() == 0);
+  }
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
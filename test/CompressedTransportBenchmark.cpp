@@ -0,0 +1,193 @@
+/*
+thrift -cpp ThriftTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  CompressedTransportBenchmark.cpp gen-cpp/ThriftTest_types.cpp \
+  ../lib/cpp/.libs/libthriftz.a ../lib/cpp/.libs/libthrift.a \
+  -lz -o CompressedTransportBenchmark
+./CompressedTransportBenchmark
+*/
+
+// Compresses a stream of ThriftTest Insanity messages one at a time, the
+// way an RPC transport sees them, and compares TZlibTransport with the
+// codecs of TCompressedFramedTransport.  Messages are a mix of small and
+// large so that the small frame threshold has something to do.  Every
+// message is decoded again and checked against the original.
+
+#include <cassert>
+#include <ctime>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <protocol/TBinaryProtocol.h>
+#include <transport/TTransportUtils.h>
+#include <transport/TZlibTransport.h>
+#include <transport/TCompressedTransport.h>
+#include "gen-cpp/ThriftTest_types.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+static const int NUM_MESSAGES = 20000;
+static const int NUM_SAMPLES = 500;
+
+static const char* WORDS[] = {
+  "thrift", "frame", "socket", "server", "client", "buffer", "protocol",
+  "compact", "dense", "binary", "zlib", "request", "response", "timeout",
+  "user", "photo", "album", "comment", "status", "update", "feed", "story",
+};
+static const int NUM_WORDS = sizeof(WORDS) / sizeof(WORDS[0]);
+
+static string makeMessage() {
+  Insanity insane;
+  int numMap = rand() % 4;
+  for (int i = 0; i < numMap; ++i) {
+    insane.userMap[(Numberz)(1 + rand() % 8)] = rand() % 100000;
+  }
+
+  // Mostly small messages with the occasional big one
+  int numXtructs = (rand() % 4 == 0) ? 10 + rand() % 40 : 1 + rand() % 3;
+  for (int i = 0; i < numXtructs; ++i) {
+    Xtruct x;
+    int numWords = 1 + rand() % 6;
+    for (int j = 0; j < numWords; ++j) {
+      if (j > 0) {
+        x.string_thing += ' ';
+      }
+      x.string_thing += WORDS[rand() % NUM_WORDS];
+    }
+    x.byte_thing = rand() % 4;
+    x.i32_thing = rand() % 1000;
+    x.i64_thing = (int64_t)(rand() % 1000) * 1000000;
+    insane.xtructs.push_back(x);
+  }
+
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  TBinaryProtocol proto(buf);
+  insane.write(&proto);
+  return buf->getBufferAsString();
+}
+
+struct Result {
+  uint64_t compressed;
+  double encodeSecs;
+  double decodeSecs;
+};
+
+static double cpuSecs() {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static Result runZlibTransport(const vector<string>& messages) {
+  Result r;
+  vector<string> compressed(messages.size());
+
+  double start = cpuSecs();
+  for (size_t i = 0; i < messages.size(); ++i) {
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    TZlibTransport zlib(buf, false);
+    zlib.write((const uint8_t*)messages[i].data(), messages[i].size());
+    zlib.flush();
+    compressed[i] = buf->getBufferAsString();
+  }
+  r.encodeSecs = cpuSecs() - start;
+
+  r.compressed = 0;
+  vector<uint8_t> out;
+  start = cpuSecs();
+  for (size_t i = 0; i < messages.size(); ++i) {
+    r.compressed += compressed[i].size();
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer(
+      (uint8_t*)compressed[i].data(), compressed[i].size()));
+    TZlibTransport zlib(buf, false);
+    out.resize(messages[i].size());
+    zlib.readAll(&out[0], out.size());
+    zlib.verifyChecksum();
+    assert(memcmp(&out[0], messages[i].data(), out.size()) == 0);
+  }
+  r.decodeSecs = cpuSecs() - start;
+  return r;
+}
+
+static Result runFramed(const vector<string>& messages,
+                        shared_ptr<TCodec> codec,
+                        uint32_t minCompressSize) {
+  Result r;
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+
+  double start = cpuSecs();
+  TCompressedFramedTransport writer(buf, codec);
+  writer.setMinCompressSize(minCompressSize);
+  for (size_t i = 0; i < messages.size(); ++i) {
+    writer.write((const uint8_t*)messages[i].data(), messages[i].size());
+    writer.flush();
+  }
+  r.encodeSecs = cpuSecs() - start;
+  r.compressed = buf->available();
+
+  vector<uint8_t> out;
+  start = cpuSecs();
+  TCompressedFramedTransport reader(buf, codec.get() ? codec->clone() : codec);
+  for (size_t i = 0; i < messages.size(); ++i) {
+    out.resize(messages[i].size());
+    reader.readAll(&out[0], out.size());
+    assert(memcmp(&out[0], messages[i].data(), out.size()) == 0);
+  }
+  r.decodeSecs = cpuSecs() - start;
+  assert(buf->available() == 0);
+  return r;
+}
+
+static void print(const char* name, const Result& r, uint64_t raw) {
+  double mb = raw / (1024.0 * 1024.0);
+  cout << setw(22) << name
+       << setw(10) << fixed << setprecision(3) << (double)r.compressed / raw
+       << setw(12) << setprecision(1) << mb / r.encodeSecs
+       << setw(12) << mb / r.decodeSecs
+       << setw(12) << setprecision(2) << (r.encodeSecs * 1e6) / NUM_MESSAGES
+       << setw(12) << (r.decodeSecs * 1e6) / NUM_MESSAGES
+       << endl;
+}
+
+int main() {
+  srand(12345);
+  vector<string> samples;
+  for (int i = 0; i < NUM_SAMPLES; ++i) {
+    samples.push_back(makeMessage());
+  }
+  string dictionary = TZlibCodec::trainDictionary(samples, 8 * 1024);
+
+  vector<string> messages;
+  uint64_t raw = 0;
+  uint32_t small = 0;
+  for (int i = 0; i < NUM_MESSAGES; ++i) {
+    messages.push_back(makeMessage());
+    raw += messages.back().size();
+    if (messages.back().size() < TCompressedFramedTransport::DEFAULT_MIN_COMPRESS_SIZE) {
+      ++small;
+    }
+  }
+
+  cout << NUM_MESSAGES << " messages, " << raw / NUM_MESSAGES << " bytes average, "
+       << small << " below " << TCompressedFramedTransport::DEFAULT_MIN_COMPRESS_SIZE
+       << " bytes; " << dictionary.size() << " byte dictionary" << endl;
+  cout << setw(22) << "transport" << setw(10) << "ratio" << setw(12) << "enc MB/s"
+       << setw(12) << "dec MB/s" << setw(12) << "enc us/msg" << setw(12) << "dec us/msg"
+       << endl;
+
+  print("TZlibTransport", runZlibTransport(messages), raw);
+  print("framed, none", runFramed(messages, shared_ptr<TCodec>(), 0), raw);
+  print("framed, zlib-1", runFramed(messages, shared_ptr<TCodec>(new TZlibCodec(1)), 0), raw);
+  print("framed, zlib-6", runFramed(messages, shared_ptr<TCodec>(new TZlibCodec(6)), 0), raw);
+  print("framed, zlib-6+dict", runFramed(messages, shared_ptr<TCodec>(new TZlibCodec(6, dictionary)), 0), raw);
+  print("framed, lz", runFramed(messages, shared_ptr<TCodec>(new TLZCodec()), 0), raw);
+  print("framed, zlib-6 >=512", runFramed(messages, shared_ptr<TCodec>(new TZlibCodec(6)),
+                                          TCompressedFramedTransport::DEFAULT_MIN_COMPRESS_SIZE), raw);
+  print("framed, lz >=512", runFramed(messages, shared_ptr<TCodec>(new TLZCodec()),
+                                      TCompressedFramedTransport::DEFAULT_MIN_COMPRESS_SIZE), raw);
+  return 0;
+}
@@ -65,6 +65,14 @@ struct RandomStuff {
   8: double triple,
 }
 
+struct PrimitiveLists {
+  1: list<byte> bytes,
+  2: list<i16> i16s,
+  3: list<i32> i32s,
+  4: list<i64> i64s,
+  5: list<double> doubles,
+}
+
 struct Base64 {
   1: i32 a,
   2: binary b1,
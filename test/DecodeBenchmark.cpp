@@ -0,0 +1,151 @@
+/*
+thrift -cpp -dense DebugProtoTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  DecodeBenchmark.cpp gen-cpp/DebugProtoTest_types.cpp \
+  ../lib/cpp/.libs/libthrift.a -o DecodeBenchmark
+./DecodeBenchmark
+*/
+
+// Decodes a stream of DebugProtoTest OneOfEach and Nesting structures
+// back to back, the way a server reads requests, and prints the time per
+// structure.  The stream is read from a TMemoryBuffer directly and through
+// TBufferedTransport and TFramedTransport, with TBinaryProtocol, the
+// binary protocol TBinaryProtocolFactory picks for the transport, and
+// TDenseProtocol.  Every decoded structure is checked against the original
+// before anything is timed.
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <sys/time.h>
+#include <protocol/TBinaryProtocol.h>
+#include <protocol/TDenseProtocol.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/DebugProtoTest_types.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+typedef facebook::thrift::reflection::local::TypeSpec TypeSpec;
+
+static const int STRUCTS_PER_STREAM = 1000;
+static const int STRUCTS_PER_FRAME = 50;
+static const int PASSES = 200;
+
+static const char* TRANSPORTS[] = { "memory", "buffered", "framed" };
+static const int NUM_TRANSPORTS = 3;
+static const char* PROTOCOLS[] = { "binary", "binary/fac", "dense" };
+static const int NUM_PROTOCOLS = 3;
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static shared_ptr<TProtocol> makeProtocol(int kind,
+                                          shared_ptr<TTransport> trans,
+                                          TypeSpec* spec) {
+  switch (kind) {
+    case 0:
+      return shared_ptr<TProtocol>(new TBinaryProtocol(trans));
+    case 1:
+      return TBinaryProtocolFactory().getProtocol(trans);
+    default:
+      return shared_ptr<TProtocol>(new TDenseProtocol(trans, spec));
+  }
+}
+
+static shared_ptr<TTransport> makeTransport(int kind, shared_ptr<TMemoryBuffer> buf) {
+  switch (kind) {
+    case 0:
+      return buf;
+    case 1:
+      return shared_ptr<TTransport>(new TBufferedTransport(buf, 4096));
+    default:
+      return shared_ptr<TTransport>(new TFramedTransport(buf));
+  }
+}
+
+// Encodes the stream the given transport expects to read
+template <class Struct>
+static string encode(int transKind, int protoKind, const Struct& obj, TypeSpec* spec) {
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  shared_ptr<TTransport> trans = makeTransport(transKind, buf);
+  shared_ptr<TProtocol> proto = makeProtocol(protoKind, trans, spec);
+  for (int i = 0; i < STRUCTS_PER_STREAM; ++i) {
+    obj.write(proto.get());
+    if ((i + 1) % STRUCTS_PER_FRAME == 0 || i + 1 == STRUCTS_PER_STREAM) {
+      trans->flush();
+    }
+  }
+  return buf->getBufferAsString();
+}
+
+template <class Struct>
+static void bench(const char* name, const Struct& obj, TypeSpec* spec) {
+  for (int transKind = 0; transKind < NUM_TRANSPORTS; ++transKind) {
+    for (int protoKind = 0; protoKind < NUM_PROTOCOLS; ++protoKind) {
+      string encoded = encode(transKind, protoKind, obj, spec);
+      shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+      shared_ptr<TTransport> trans = makeTransport(transKind, buf);
+      shared_ptr<TProtocol> proto = makeProtocol(protoKind, trans, spec);
+
+      Struct copy;
+      buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+      for (int i = 0; i < STRUCTS_PER_STREAM; ++i) {
+        copy = Struct();
+        copy.read(proto.get());
+        assert(copy == obj);
+      }
+      assert(buf->available() == 0);
+
+      double start = nowUsec();
+      for (int pass = 0; pass < PASSES; ++pass) {
+        buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+        for (int i = 0; i < STRUCTS_PER_STREAM; ++i) {
+          copy.read(proto.get());
+        }
+      }
+      double ns = (nowUsec() - start) * 1000.0 / (PASSES * STRUCTS_PER_STREAM);
+
+      cout << setw(12) << name << setw(10) << TRANSPORTS[transKind]
+           << setw(12) << PROTOCOLS[protoKind]
+           << setw(12) << fixed << setprecision(1) << ns << endl;
+    }
+  }
+}
+
+int main() {
+  OneOfEach ooe;
+  ooe.im_true   = true;
+  ooe.im_false  = false;
+  ooe.a_bite    = 0xd6;
+  ooe.integer16 = 27000;
+  ooe.integer32 = 1<<24;
+  ooe.integer64 = (uint64_t)6000 * 1000 * 1000;
+  ooe.double_precision = M_PI;
+  ooe.some_characters  = "Debug THIS!";
+  ooe.zomg_unicode     = "\xd7\n\a\t";
+
+  Nesting n;
+  n.my_ooe = ooe;
+  n.my_ooe.integer16 = 16;
+  n.my_ooe.integer32 = 32;
+  n.my_ooe.integer64 = 64;
+  n.my_ooe.double_precision = (std::sqrt(5.0)+1)/2;
+  n.my_ooe.some_characters  = ":R (me going \"rrrr\")";
+  n.my_bonk.type    = 31337;
+  n.my_bonk.message = "I am a bonk... xor!";
+
+  cout << setw(12) << "struct" << setw(10) << "transport" << setw(12) << "protocol"
+       << setw(12) << "dec ns" << endl;
+  bench("OneOfEach", ooe, OneOfEach::local_reflection);
+  bench("Nesting", n, Nesting::local_reflection);
+  return 0;
+}
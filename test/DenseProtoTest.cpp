@@ -167,6 +167,25 @@ int main() {
   checkout(0x7FFFFFFFFFFFFFFFull, "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x7F");
   checkout(0xFFFFFFFFFFFFFFFFull, "\x81\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x7F");
 
+  // Now with more data behind them, so the fast path sees eight bytes.
+  for (int bits = 0; bits <= 64; bits++) {
+    uint64_t top = (bits == 64) ? 0 : (1ull << bits);
+    uint64_t vals[] = { top, top - 1, (top - 1) & 0x5555555555555555ull };
+    for (int v = 0; v < 3; v++) {
+      buffer->resetBuffer();
+      proto->vlqWrite(vals[v]);
+      proto->vlqWrite(0x3FFF);
+      proto->vlqWrite(0xFFFFFFFFFFFFFFFFull);
+      proto->vlqRead(vlq);
+      assert(vlq == vals[v]);
+      proto->vlqRead(vlq);
+      assert(vlq == 0x3FFF);
+      proto->vlqRead(vlq);
+      assert(vlq == 0xFFFFFFFFFFFFFFFFull);
+      assert(buffer->available() == 0);
+    }
+  }
+
   // Test out the slow path with a TBufferedTransport.
   shared_ptr<TBufferedTransport> buff_trans(new TBufferedTransport(buffer, 3));
   proto.reset(new TDenseProtocol(buff_trans));
@@ -0,0 +1,146 @@
+/*
+../compiler/cpp/thrift -cpp -dense DebugProtoTest.thrift
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  gen-cpp/DebugProtoTest_types.cpp gen-cpp/Srv.cpp \
+  gen-cpp/PartiallyReflectable.cpp \
+  DenseRpcTest.cpp ../lib/cpp/.libs/libthrift.a -o DenseRpcTest
+./DenseRpcTest
+*/
+
+// Makes calls through the Srv and PartiallyReflectable services with
+// TDenseProtocol on both ends, over a pair of TMemoryBuffers, and checks
+// that arguments and results come through, as does the
+// TApplicationException sent back when the handler throws something the
+// method doesn't declare.  Also checks that a call to a method the processor
+// doesn't know fails rather than being skipped, and that standalone
+// instances still refuse messages.
+
+#undef NDEBUG
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+#include <protocol/TDenseProtocol.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/Srv.h"
+#include "gen-cpp/PartiallyReflectable.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+class Handler : public SrvIf, public PartiallyReflectableIf {
+ public:
+  int32_t Janky(const int32_t arg) {
+    return arg * 2;
+  }
+
+  void returnNotReflectable(map<int32_t, map<int32_t, int32_t> >& _return,
+                            const int32_t hello) {
+    _return[hello][-hello] = hello * hello;
+  }
+
+  void argNotReflectable(const vector<set<int32_t> >& arg) {}
+
+  void arg2NotReflectable(const int32_t arg1,
+                          const vector<set<int32_t> >& argNotReflectable) {}
+
+  void withMap(const map<int32_t, string>& amap) {
+    throw runtime_error("withMap got " + amap.begin()->second);
+  }
+
+  void refl1(OneOfEach& _return, const vector<Bonk>& arg1) {}
+
+  void refl2(OneOfEach& _return, const vector<string>& arg1,
+             const Bonk& arg2) {
+    _return.integer32 = arg2.type;
+    _return.integer64 = -(int64_t)arg1.size() << 40;
+    _return.some_characters = arg2.message;
+    _return.zomg_unicode = arg1.back();
+  }
+};
+
+int main() {
+  shared_ptr<TMemoryBuffer> requests(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> responses(new TMemoryBuffer());
+  TDenseProtocolFactory factory;
+  shared_ptr<TProtocol> clientOut = factory.getProtocol(requests);
+  shared_ptr<TProtocol> clientIn = factory.getProtocol(responses);
+  shared_ptr<TProtocol> serverIn = factory.getProtocol(requests);
+  shared_ptr<TProtocol> serverOut = factory.getProtocol(responses);
+
+  shared_ptr<Handler> handler(new Handler());
+  SrvClient srv(clientIn, clientOut);
+  SrvProcessor srvProcessor(handler);
+  PartiallyReflectableClient pr(clientIn, clientOut);
+  PartiallyReflectableProcessor prProcessor(handler);
+
+  // Small and negative numbers
+  for (int32_t arg = -3; arg <= 3; arg++) {
+    srv.send_Janky(arg * 1000000);
+    assert(srvProcessor.process(serverIn, serverOut));
+    assert(srv.recv_Janky() == arg * 2000000);
+  }
+
+  // Containers and structs, both ways
+  pr.send_returnNotReflectable(7);
+  assert(prProcessor.process(serverIn, serverOut));
+  map<int32_t, map<int32_t, int32_t> > nested;
+  pr.recv_returnNotReflectable(nested);
+  assert(nested.size() == 1 && nested[7].size() == 1 && nested[7][-7] == 49);
+
+  vector<string> strings;
+  strings.push_back("first");
+  strings.push_back("\xd7\n\a\t");
+  Bonk bonk;
+  bonk.type = 31337;
+  bonk.message = "I am a bonk... xor!";
+  pr.send_refl2(strings, bonk);
+  assert(prProcessor.process(serverIn, serverOut));
+  OneOfEach ooe;
+  pr.recv_refl2(ooe);
+  assert(ooe.integer32 == 31337);
+  assert(ooe.integer64 == -((int64_t)2 << 40));
+  assert(ooe.some_characters == bonk.message);
+  assert(ooe.zomg_unicode == strings[1]);
+
+  // The handler's runtime_error comes back as a TApplicationException
+  map<int32_t, string> amap;
+  amap[1] = "one";
+  pr.send_withMap(amap);
+  assert(prProcessor.process(serverIn, serverOut));
+  try {
+    pr.recv_withMap();
+    assert(false);
+  } catch (TApplicationException& e) {
+    assert(string(e.what()) == "withMap got one");
+  }
+
+  // Still in step after the exception
+  srv.send_Janky(21);
+  assert(srvProcessor.process(serverIn, serverOut));
+  assert(srv.recv_Janky() == 42);
+  assert(requests->available() == 0 && responses->available() == 0);
+
+  // Without a TypeSpec there is no way past the arguments
+  srv.send_Janky(1);
+  try {
+    prProcessor.process(serverIn, serverOut);
+    assert(false);
+  } catch (TException& e) {
+  }
+
+  // Standalone instances don't do messages
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TDenseProtocol standalone(buffer, Bonk::local_reflection);
+  try {
+    standalone.writeMessageBegin("Janky", T_CALL, 0);
+    assert(false);
+  } catch (TApplicationException& e) {
+  }
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  FileTransportDurabilityTest.cpp ../lib/cpp/.libs/libthrift.a -lpthread -lrt \
+  -o FileTransportDurabilityTest
+./FileTransportDurabilityTest
+*/
+
+// Writes events to a TFileTransport with writeDurable() in each durability
+// mode, mixed with plain write()s, and checks that every call returns the
+// offset just past its own event, padding included, and that the file is
+// at least that long when it returns.  Then turns on chunk preallocation
+// and checks that the disk space is reserved without changing the file
+// size, so the file still reads back as nothing but the events.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <transport/TFileTransport.h>
+
+using namespace std;
+using namespace facebook::thrift::transport;
+
+static const uint32_t CHUNK_SIZE = 4096;
+static const int NUM_EVENTS = 100;
+static const uint32_t PREALLOC_CHUNK_SIZE = 256 * 1024;
+
+static uint32_t eventLen(int i) {
+  return 10 + (i * 53) % 700;
+}
+
+// Where the file ends after an event of len bytes is written at offset
+static off_t place(off_t offset, uint32_t len, uint32_t chunkSize) {
+  uint32_t size = len + 4;
+  if (offset / chunkSize != (offset + size - 1) / chunkSize) {
+    offset = (offset / chunkSize + 1) * chunkSize;
+  }
+  return offset + size;
+}
+
+static off_t fileSize(const char* path) {
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  return st.st_size;
+}
+
+static void testMode(const char* path, TFileTransport::DurabilityMode mode) {
+  truncate(path, 0);
+  TFileTransport out(path);
+  out.setChunkSize(CHUNK_SIZE);
+  out.setDurabilityMode(mode);
+  assert(out.getDurabilityMode() == mode);
+  // so the periodic mode does not take seconds per call
+  out.setFlushMaxUs(10000);
+
+  vector<uint8_t> event(1024, 'x');
+  off_t end = 0;
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    end = place(end, eventLen(i), CHUNK_SIZE);
+    if (i % 3 != 2) {
+      out.write(&event[0], eventLen(i));
+      continue;
+    }
+    // covers the plain writes queued before it as well
+    off_t offset = out.writeDurable(&event[0], eventLen(i));
+    assert(offset == end);
+    assert(fileSize(path) >= offset);
+  }
+  assert(end > 5 * CHUNK_SIZE);
+
+  // Refused events say so
+  assert(out.writeDurable(&event[0], 0) == -1);
+  assert(out.writeDurable(&event[0], CHUNK_SIZE) == -1);
+}
+
+static void testPreallocate(const char* path) {
+  truncate(path, 0);
+  vector<uint8_t> event(1000, 'y');
+  int written = 0;
+  off_t end = 0;
+  {
+    TFileTransport out(path);
+    out.setChunkSize(PREALLOC_CHUNK_SIZE);
+    out.setPreallocateChunks(true);
+    out.setDurabilityMode(TFileTransport::DURABILITY_GROUP_COMMIT);
+
+    end = place(end, event.size(), PREALLOC_CHUNK_SIZE);
+    assert(out.writeDurable(&event[0], event.size()) == end);
+    written++;
+    if (!out.getPreallocateChunks()) {
+      cout << "fallocate not supported here, skipping preallocation checks"
+           << endl;
+      return;
+    }
+
+    // Two chunks are reserved, but the size only covers the event
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    assert(st.st_size == end);
+    assert((off_t)st.st_blocks * 512 >= 2 * (off_t)PREALLOC_CHUNK_SIZE);
+
+    // Moving into the second chunk reserves the third
+    while (end < (off_t)PREALLOC_CHUNK_SIZE) {
+      end = place(end, event.size(), PREALLOC_CHUNK_SIZE);
+      assert(out.writeDurable(&event[0], event.size()) == end);
+      written++;
+    }
+    assert(stat(path, &st) == 0);
+    assert(st.st_size == end);
+    assert((off_t)st.st_blocks * 512 >= 3 * (off_t)PREALLOC_CHUNK_SIZE);
+  }
+  assert(fileSize(path) == end);
+
+  // A reader sees the events and then EOF, not the reserved space
+  TFileTransport in(path, true);
+  in.setChunkSize(PREALLOC_CHUNK_SIZE);
+  uint8_t buf[2000];
+  for (int i = 0; i < written; ++i) {
+    assert(in.read(buf, sizeof(buf)) == event.size());
+    assert(memcmp(buf, &event[0], event.size()) == 0);
+  }
+  assert(in.read(buf, sizeof(buf)) == 0);
+}
+
+int main() {
+  char path[] = "/tmp/FileTransportDurabilityTest.XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  testMode(path, TFileTransport::DURABILITY_NONE);
+  testMode(path, TFileTransport::DURABILITY_GROUP_COMMIT);
+  testMode(path, TFileTransport::DURABILITY_PERIODIC);
+  testPreallocate(path);
+
+  unlink(path);
+  cout << "All tests passed." << endl;
+  return 0;
+}
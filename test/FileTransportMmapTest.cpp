@@ -0,0 +1,195 @@
+/*
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  FileTransportMmapTest.cpp ../lib/cpp/.libs/libthrift.a -lpthread -lrt \
+  -o FileTransportMmapTest
+./FileTransportMmapTest
+*/
+
+// Writes events of assorted sizes to a TFileTransport with a small chunk
+// size that is not a multiple of the page size, so that events get pushed
+// past chunk boundaries and the last chunk is only partly filled.  Then
+// replays the file through read() and through borrow()/consume(), copying
+// through the read buffer and with memory-mapped chunks, and checks every
+// event and where it starts.  Also seeks to a chunk, forwards and from the
+// end, and appends to the file after the readers hit EOF to check they
+// pick up the new events in the partial last chunk.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <transport/TFileTransport.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::transport;
+
+// Not a multiple of the page size, so chunks are mapped from an offset
+static const uint32_t CHUNK_SIZE = 10000;
+static const int NUM_EVENTS = 200;
+static const int NUM_APPENDED = 3;
+
+static uint32_t eventLen(int i) {
+  return (i < NUM_EVENTS) ? 50 + (i * 37) % 900 : 20;
+}
+
+// The first four bytes of each event are its number
+static void makeEvent(int i, vector<uint8_t>* event) {
+  event->resize(eventLen(i));
+  for (uint32_t j = 0; j < event->size(); ++j) {
+    (*event)[j] = (uint8_t)(i + j);
+  }
+  memcpy(&(*event)[0], &i, 4);
+}
+
+static void checkEvent(int i, const uint8_t* buf, uint32_t len) {
+  vector<uint8_t> event;
+  makeEvent(i, &event);
+  assert(len == event.size());
+  assert(memcmp(buf, &event[0], len) == 0);
+}
+
+static void writeEvents(const char* path, int from, int to) {
+  TFileTransport out(path);
+  out.setChunkSize(CHUNK_SIZE);
+  vector<uint8_t> event;
+  for (int i = from; i < to; ++i) {
+    makeEvent(i, &event);
+    out.write(&event[0], event.size());
+  }
+  out.flush();
+}
+
+// Where each event's size prefix lands: an event that would cross a chunk
+// boundary is moved to the start of the next chunk
+static off_t layout(int num, vector<off_t>* starts) {
+  off_t offset = 0;
+  for (int i = 0; i < num; ++i) {
+    uint32_t size = eventLen(i) + 4;
+    if (offset / CHUNK_SIZE != (offset + size - 1) / CHUNK_SIZE) {
+      offset = (offset / CHUNK_SIZE + 1) * CHUNK_SIZE;
+    }
+    starts->push_back(offset);
+    offset += size;
+  }
+  return offset;
+}
+
+// The first event whose size prefix is in the given chunk
+static int firstInChunk(const vector<off_t>& starts, uint32_t chunk) {
+  for (size_t i = 0; i < starts.size(); ++i) {
+    if (starts[i] >= (off_t)chunk * CHUNK_SIZE) {
+      return i;
+    }
+  }
+  return starts.size();
+}
+
+static shared_ptr<TFileTransport> openReader(const char* path, bool mmap) {
+  shared_ptr<TFileTransport> in(new TFileTransport(path, true));
+  in->setChunkSize(CHUNK_SIZE);
+  in->setMmapReads(mmap);
+  assert(in->getMmapReads() == mmap);
+  return in;
+}
+
+// Reads events from..to-1, either whole with read() or by reading the event
+// number and borrowing the rest
+static void replay(TFileTransport& in, int from, int to, bool borrow) {
+  uint8_t buf[1024];
+  for (int i = from; i < to; ++i) {
+    if (!borrow) {
+      uint32_t got = in.read(buf, sizeof(buf));
+      checkEvent(i, buf, got);
+      continue;
+    }
+    in.readAll(buf, 4);
+    uint32_t len = 1;
+    const uint8_t* rest = in.borrow(NULL, &len);
+    assert(rest != NULL);
+    assert(len == eventLen(i) - 4);
+    memcpy(buf + 4, rest, len);
+    in.consume(len);
+    checkEvent(i, buf, len + 4);
+  }
+}
+
+static void checkEof(TFileTransport& in) {
+  uint8_t buf[1];
+  assert(in.read(buf, 1) == 0);
+  uint32_t len = 1;
+  assert(in.borrow(NULL, &len) == NULL);
+}
+
+int main() {
+  char path[] = "/tmp/FileTransportMmapTest.XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  vector<off_t> starts;
+  off_t end = layout(NUM_EVENTS, &starts);
+  writeEvents(path, 0, NUM_EVENTS);
+
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  assert(st.st_size == end);
+  uint32_t numChunks = end / CHUNK_SIZE + 1;
+  assert(numChunks > 5);
+  assert(end % CHUNK_SIZE != 0);
+  assert(firstInChunk(starts, numChunks - 1) < NUM_EVENTS);
+
+  for (int mmap = 0; mmap <= 1; ++mmap) {
+    for (int borrow = 0; borrow <= 1; ++borrow) {
+      shared_ptr<TFileTransport> in = openReader(path, mmap);
+      assert(in->getNumChunks() == numChunks);
+      replay(*in, 0, NUM_EVENTS, borrow);
+      checkEof(*in);
+
+      // Back to the start of a chunk in the middle
+      in->seekToChunk(3);
+      assert(in->getCurChunk() == 3);
+      replay(*in, firstInChunk(starts, 3), NUM_EVENTS, borrow);
+      checkEof(*in);
+
+      // And to the partial last chunk, counting from the end
+      in->seekToChunk(-1);
+      replay(*in, firstInChunk(starts, numChunks - 1), NUM_EVENTS, borrow);
+      checkEof(*in);
+    }
+
+    // Seeking past the end leaves the reader at EOF
+    shared_ptr<TFileTransport> in = openReader(path, mmap);
+    in->seekToChunk(numChunks + 10);
+    checkEof(*in);
+  }
+
+  // Readers at EOF see events appended to the last chunk afterwards
+  shared_ptr<TFileTransport> copied = openReader(path, false);
+  shared_ptr<TFileTransport> mapped = openReader(path, true);
+  replay(*copied, 0, NUM_EVENTS, false);
+  replay(*mapped, 0, NUM_EVENTS, true);
+  checkEof(*copied);
+  checkEof(*mapped);
+
+  assert(end + NUM_APPENDED * (eventLen(NUM_EVENTS) + 4) < numChunks * CHUNK_SIZE);
+  writeEvents(path, NUM_EVENTS, NUM_EVENTS + NUM_APPENDED);
+  replay(*copied, NUM_EVENTS, NUM_EVENTS + NUM_APPENDED, true);
+  replay(*mapped, NUM_EVENTS, NUM_EVENTS + NUM_APPENDED, false);
+  checkEof(*copied);
+  checkEof(*mapped);
+
+  // Switching modes rewinds to the start of the current chunk
+  mapped->setMmapReads(false);
+  replay(*mapped, firstInChunk(starts, numChunks - 1),
+         NUM_EVENTS + NUM_APPENDED, false);
+  checkEof(*mapped);
+
+  unlink(path);
+  cout << "All tests passed." << endl;
+  return 0;
+}
@@ -0,0 +1,287 @@
+/*
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  FileTransportRingTest.cpp ../lib/cpp/.libs/libthrift.a -lpthread -lrt \
+  -o FileTransportRingTest
+./FileTransportRingTest
+*/
+
+// Has several producer threads push numbered records through a small
+// TFileTransportRing while the main thread drains it, and checks that
+// every record comes out whole, once, and in order for its producer, even
+// when the ring wraps.  Then does the same through a TFileTransport with a
+// small ring and chunks of the same size, with some of the events written by
+// writeDurable(): the file read back must hold every event in producer
+// order, and each writeDurable() must only return once its event is in the
+// file.  Finally writes an event bigger than the default ring but smaller
+// than the default chunk, which the ring has to grow to take.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <transport/TFileTransport.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::transport;
+
+static const int NUM_PRODUCERS = 4;
+static const int NUM_RECORDS = 2000;
+static const uint32_t RING_SIZE = 256;
+
+static const int NUM_EVENTS = 500;
+static const int DURABLE_EVERY = 10;
+static const uint32_t EVENT_RING_SIZE = 4096;
+static const uint32_t CHUNK_SIZE = 4096;
+
+static const uint32_t BIG_EVENT_SIZE = 5 * 1024 * 1024;
+
+// Records are the producer, the sequence number and filler derived from both
+static uint32_t recordLen(int producer, int seq) {
+  return 8 + (seq * 13 + producer * 7) % 60;
+}
+
+static void makeRecord(int producer, int seq, vector<uint8_t>* rec) {
+  rec->resize(recordLen(producer, seq));
+  for (uint32_t i = 8; i < rec->size(); ++i) {
+    (*rec)[i] = (uint8_t)(producer * 31 + seq + i);
+  }
+  memcpy(&(*rec)[0], &producer, 4);
+  memcpy(&(*rec)[4], &seq, 4);
+}
+
+// Checks a record against what its producer must have sent next, and
+// returns the producer
+static int checkRecord(const uint8_t* buf, uint32_t len, int* next) {
+  int producer, seq;
+  assert(len >= 8);
+  memcpy(&producer, buf, 4);
+  memcpy(&seq, buf + 4, 4);
+  assert(producer >= 0 && producer < NUM_PRODUCERS);
+  assert(seq == next[producer]);
+  next[producer]++;
+
+  vector<uint8_t> rec;
+  makeRecord(producer, seq, &rec);
+  assert(len == rec.size());
+  assert(memcmp(buf, &rec[0], len) == 0);
+  return producer;
+}
+
+class RingProducer : public Runnable {
+ public:
+  RingProducer(TFileTransportRing* ring, int producer)
+    : ring_(ring), producer_(producer) {}
+
+  void run() {
+    vector<uint8_t> rec;
+    for (int seq = 0; seq < NUM_RECORDS; ++seq) {
+      makeRecord(producer_, seq, &rec);
+      uint32_t len = rec.size();
+      uint64_t pos;
+      while (!ring_->tryReserve(len + 4, &pos)) {
+        sched_yield();
+      }
+      ring_->copyIn(pos, (const uint8_t*)&len, 4);
+      ring_->copyIn(pos + 4, &rec[0], len);
+      ring_->commit(pos, len + 4);
+    }
+  }
+
+ private:
+  TFileTransportRing* ring_;
+  int producer_;
+};
+
+static void testRing() {
+  TFileTransportRing ring(RING_SIZE - 1);
+  assert(ring.getSize() == RING_SIZE);
+  assert(ring.isEmpty());
+
+  PosixThreadFactory threadFactory;
+  threadFactory.setDetached(false);
+  vector<shared_ptr<Thread> > threads;
+  for (int i = 0; i < NUM_PRODUCERS; ++i) {
+    threads.push_back(threadFactory.newThread(
+      shared_ptr<Runnable>(new RingProducer(&ring, i))));
+    threads.back()->start();
+  }
+
+  int next[NUM_PRODUCERS] = { 0 };
+  int received = 0;
+  bool wrapped = false;
+  uint8_t buf[RING_SIZE];
+  while (received < NUM_PRODUCERS * NUM_RECORDS) {
+    uint64_t head = ring.getHead();
+    uint64_t committed = ring.getCommitted();
+    if (head == committed) {
+      sched_yield();
+      continue;
+    }
+    assert(committed - head <= RING_SIZE);
+
+    // The committed region is one contiguous run of whole records
+    struct iovec iov[2];
+    int iovcnt = ring.getIovecs(head, committed, iov);
+    wrapped = wrapped || (iovcnt == 2);
+    uint32_t gathered = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      memcpy(buf + gathered, iov[i].iov_base, iov[i].iov_len);
+      gathered += iov[i].iov_len;
+    }
+    assert(gathered == committed - head);
+
+    uint64_t pos = head;
+    while (pos < committed) {
+      uint32_t len;
+      ring.copyOut(pos, (uint8_t*)&len, 4);
+      assert(pos + 4 + len <= committed);
+      uint8_t rec[RING_SIZE];
+      ring.copyOut(pos + 4, rec, len);
+      assert(memcmp(rec, buf + (pos + 4 - head), len) == 0);
+      checkRecord(rec, len, next);
+      pos += 4 + len;
+      received++;
+    }
+    ring.release(committed);
+  }
+
+  for (int i = 0; i < NUM_PRODUCERS; ++i) {
+    threads[i]->join();
+    assert(next[i] == NUM_RECORDS);
+  }
+  assert(ring.isEmpty());
+  assert(wrapped);
+}
+
+class FileProducer : public Runnable {
+ public:
+  FileProducer(TFileTransport* out, const char* path, int producer,
+               off_t* durable)
+    : out_(out), path_(path), producer_(producer), durable_(durable) {}
+
+  void run() {
+    vector<uint8_t> rec;
+    off_t last = 0;
+    for (int seq = 0; seq < NUM_EVENTS; ++seq) {
+      makeRecord(producer_, seq, &rec);
+      if (seq % DURABLE_EVERY != 0) {
+        out_->write(&rec[0], rec.size());
+        continue;
+      }
+
+      // Durable up to some point no earlier than last time, and all of that
+      // is in the file already
+      off_t offset = out_->writeDurable(&rec[0], rec.size());
+      assert(offset >= last);
+      struct stat st;
+      assert(stat(path_, &st) == 0);
+      assert(offset <= st.st_size);
+      durable_[seq / DURABLE_EVERY] = offset;
+      last = offset;
+    }
+  }
+
+ private:
+  TFileTransport* out_;
+  const char* path_;
+  int producer_;
+  off_t* durable_;
+};
+
+static void testFileTransport() {
+  char path[] = "/tmp/FileTransportRingTest.XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  off_t durable[NUM_PRODUCERS][NUM_EVENTS / DURABLE_EVERY];
+  {
+    TFileTransport out(path);
+    out.setChunkSize(CHUNK_SIZE);
+    out.setEventRingSize(EVENT_RING_SIZE);
+    out.setDurabilityMode(TFileTransport::DURABILITY_GROUP_COMMIT);
+
+    PosixThreadFactory threadFactory;
+    threadFactory.setDetached(false);
+    vector<shared_ptr<Thread> > threads;
+    for (int i = 0; i < NUM_PRODUCERS; ++i) {
+      threads.push_back(threadFactory.newThread(
+        shared_ptr<Runnable>(new FileProducer(&out, path, i, durable[i]))));
+      threads.back()->start();
+    }
+    for (int i = 0; i < NUM_PRODUCERS; ++i) {
+      threads[i]->join();
+    }
+  }
+
+  // Read everything back, working out where each event ends in the file
+  TFileTransport in(path, true);
+  in.setChunkSize(CHUNK_SIZE);
+  int next[NUM_PRODUCERS] = { 0 };
+  off_t offset = 0;
+  uint8_t buf[1024];
+  uint32_t len;
+  while ((len = in.read(buf, sizeof(buf))) > 0) {
+    if (offset / CHUNK_SIZE != (offset + len + 3) / CHUNK_SIZE) {
+      offset = (offset / CHUNK_SIZE + 1) * CHUNK_SIZE;
+    }
+    offset += len + 4;
+    int producer = checkRecord(buf, len, next);
+    int seq = next[producer] - 1;
+    if (seq % DURABLE_EVERY == 0) {
+      assert(durable[producer][seq / DURABLE_EVERY] >= offset);
+    }
+  }
+  for (int i = 0; i < NUM_PRODUCERS; ++i) {
+    assert(next[i] == NUM_EVENTS);
+  }
+
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  assert(st.st_size == offset);
+  unlink(path);
+}
+
+// With the default sizes an event of 5MB is bigger than the 4MB ring asked
+// for but fits in a 16MB chunk, so it must be written, not dropped
+static void testBigEvent() {
+  char path[] = "/tmp/FileTransportRingTest.XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+
+  vector<uint8_t> big(BIG_EVENT_SIZE);
+  for (uint32_t i = 0; i < big.size(); ++i) {
+    big[i] = (uint8_t)(i * 7 + i / 4096);
+  }
+  {
+    TFileTransport out(path);
+    assert(out.getEventRingSize() < BIG_EVENT_SIZE);
+    assert(out.getChunkSize() > BIG_EVENT_SIZE + 4);
+    assert(out.writeDurable(&big[0], big.size()) == BIG_EVENT_SIZE + 4);
+  }
+
+  TFileTransport in(path, true);
+  vector<uint8_t> buf(BIG_EVENT_SIZE + 1);
+  assert(in.read(&buf[0], buf.size()) == BIG_EVENT_SIZE);
+  assert(memcmp(&buf[0], &big[0], big.size()) == 0);
+  assert(in.read(&buf[0], buf.size()) == 0);
+  unlink(path);
+}
+
+int main() {
+  testRing();
+  testFileTransport();
+  testBigEvent();
+  cout << "All tests passed." << endl;
+  return 0;
+}
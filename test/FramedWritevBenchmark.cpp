@@ -0,0 +1,141 @@
+/*
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  FramedWritevBenchmark.cpp ../lib/cpp/.libs/libthrift.a -lpthread \
+  -o FramedWritevBenchmark
+./FramedWritevBenchmark [port]
+*/
+
+// Compares the cost of flushing a TFramedTransport over a TSocket when the
+// frame header and body are sent with two write() calls (the old behavior)
+// against a single vectored writev().  A second thread drains the other end
+// of a loopback connection so that the writer never blocks for long.  The
+// drainer reads its end with plain recv() calls, so that g_socket_syscalls
+// only counts the writer's sends and is only touched by one thread.
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <transport/TSocket.h>
+#include <transport/TTransportUtils.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::transport;
+
+namespace facebook { namespace thrift { namespace transport {
+extern uint32_t g_socket_syscalls;
+}}}
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/**
+ * Accepts one connection on port and reads and discards everything until
+ * the peer closes it.
+ */
+class Drainer : public Runnable {
+ public:
+  Drainer(int port) {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listener_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listener_, 1) != 0) {
+      perror("FramedWritevBenchmark: listen");
+      exit(1);
+    }
+  }
+
+  void run() {
+    int fd = accept(listener_, NULL, NULL);
+    uint8_t buf[65536];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) {}
+    ::close(fd);
+    ::close(listener_);
+  }
+
+ private:
+  int listener_;
+};
+
+/**
+ * Writes a frame the way TFramedTransport::flush used to: the length and the
+ * payload as two separate writes on the underlying transport.
+ */
+void twoWriteFlush(TTransport* trans, const uint8_t* buf, uint32_t len) {
+  int32_t sz = (int32_t)htonl(len);
+  trans->write((const uint8_t*)&sz, 4);
+  trans->write(buf, len);
+  trans->flush();
+}
+
+int main(int argc, char** argv) {
+  int port = (argc > 1) ? atoi(argv[1]) : 9190;
+
+  PosixThreadFactory threadFactory;
+  threadFactory.setDetached(false);
+  shared_ptr<Thread> drainer =
+    threadFactory.newThread(shared_ptr<Runnable>(new Drainer(port)));
+  drainer->start();
+
+  shared_ptr<TSocket> client(new TSocket("127.0.0.1", port));
+  client->setLinger(false, 0);
+  client->open();
+
+  TFramedTransport framed(client);
+
+  cout << setw(8) << "frame" << setw(10) << "mode"
+       << setw(12) << "syscalls" << setw(12) << "ms"
+       << setw(12) << "MB/s" << endl;
+
+  for (uint32_t size = 64; size <= 65536; size *= 4) {
+    uint32_t iters = (64 * 1024 * 1024) / size;
+    if (iters > 200000) {
+      iters = 200000;
+    }
+    uint8_t* payload = new uint8_t[size];
+    memset(payload, 'x', size);
+
+    for (int mode = 0; mode < 2; ++mode) {
+      uint32_t startCalls = g_socket_syscalls;
+      double start = nowUsec();
+      for (uint32_t i = 0; i < iters; ++i) {
+        if (mode == 0) {
+          twoWriteFlush(client.get(), payload, size);
+        } else {
+          framed.write(payload, size);
+          framed.flush();
+        }
+      }
+      double elapsed = (nowUsec() - start) / 1000;
+      double mb = ((double)(size + 4) * iters) / (1024 * 1024);
+      cout << setw(8) << size << setw(10) << (mode == 0 ? "write" : "writev")
+           << setw(12) << (g_socket_syscalls - startCalls)
+           << setw(12) << fixed << setprecision(1) << elapsed
+           << setw(12) << (mb * 1000 / elapsed)
+           << endl;
+    }
+
+    delete [] payload;
+  }
+
+  client->close();
+  drainer->join();
+  return 0;
+}
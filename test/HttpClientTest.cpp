@@ -0,0 +1,268 @@
+/*
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  HttpClientTest.cpp ../lib/cpp/.libs/libthrift.a -lpthread \
+  -o HttpClientTest
+./HttpClientTest [port] 2> /dev/null
+*/
+
+// Runs THttpClient against a stub HTTP server that answers each POST with
+// the number of the connection it came in on followed by the request body.
+// The body also tells the stub how to answer: hold the response back and
+// send it together with the next one, send the body in chunks, put a 100
+// Continue in front, or ask for the connection to be closed.  Checks two
+// pipelined calls whose responses arrive in one segment, a chunked
+// response read whole, in pieces and abandoned half way, and a Connection:
+// close after which the client reopens on a new connection.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <concurrency/Mutex.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <transport/THttpClient.h>
+#include <transport/TServerSocket.h>
+#include <transport/TTransportUtils.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::transport;
+
+static const string PATH = "/stub";
+
+static PosixThreadFactory threadFactory;
+static Mutex statsMutex;
+static int accepted = 0;
+
+static bool startsWith(const string& s, const string& prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+/**
+ * Serves the requests on one connection.
+ */
+class Handler : public Runnable {
+ public:
+  Handler(shared_ptr<TTransport> trans, int id)
+    : trans_(new TBufferedTransport(trans)), id_(id) {}
+
+  void run() {
+    try {
+      string held;
+      while (true) {
+        string body = readRequest();
+        ostringstream content;
+        content << id_ << " " << body;
+        string response = makeResponse(body, content.str());
+
+        // Held responses go out together with the next one
+        held += response;
+        if (startsWith(body, "hold")) {
+          continue;
+        }
+        trans_->write((const uint8_t*)held.data(), held.size());
+        trans_->flush();
+        held.clear();
+        if (startsWith(body, "close")) {
+          break;
+        }
+      }
+    } catch (TTransportException& ttx) {
+    }
+    trans_->close();
+  }
+
+ private:
+  string readLine() {
+    string line;
+    uint8_t c;
+    while (true) {
+      trans_->readAll(&c, 1);
+      if (c == '\n') {
+        break;
+      }
+      line += (char)c;
+    }
+    assert(!line.empty() && line[line.size() - 1] == '\r');
+    return line.substr(0, line.size() - 1);
+  }
+
+  string readRequest() {
+    assert(readLine() == "POST " + PATH + " HTTP/1.1");
+    uint32_t length = 0;
+    bool host = false;
+    while (true) {
+      string line = readLine();
+      if (line.empty()) {
+        break;
+      }
+      if (startsWith(line, "Content-Length: ")) {
+        length = atoi(line.c_str() + 16);
+      }
+      host = host || (line == "Host: localhost");
+    }
+    assert(host);
+    string body(length, '\0');
+    trans_->readAll((uint8_t*)&body[0], length);
+    return body;
+  }
+
+  string makeResponse(const string& body, const string& content) {
+    string response;
+    if (startsWith(body, "continue")) {
+      response += "HTTP/1.1 100 Continue\r\n\r\n";
+    }
+    response += "HTTP/1.1 200 OK\r\nContent-Type: application/x-thrift\r\n";
+    if (startsWith(body, "close")) {
+      response += "Connection: close\r\n";
+    }
+
+    if (!startsWith(body, "chunked")) {
+      char length[32];
+      sprintf(length, "%u", (uint32_t)content.size());
+      return response + "Content-Length: " + length + "\r\n\r\n" + content;
+    }
+
+    // Chunks of growing size, the first with an extension, then a footer
+    response += "transfer-encoding: chunked\r\n\r\n";
+    size_t pos = 0;
+    size_t size = 3;
+    while (pos < content.size()) {
+      size_t len = min(size, content.size() - pos);
+      char header[32];
+      sprintf(header, pos == 0 ? "%x;name=value\r\n" : "%X\r\n",
+              (uint32_t)len);
+      response += header + content.substr(pos, len) + "\r\n";
+      pos += len;
+      size *= 4;
+    }
+    return response + "0\r\nX-Footer: done\r\n\r\n";
+  }
+
+  shared_ptr<TTransport> trans_;
+  int id_;
+};
+
+// Never stops
+class Acceptor : public Runnable {
+ public:
+  Acceptor(shared_ptr<TServerSocket> server) : server_(server) {}
+
+  void run() {
+    while (true) {
+      shared_ptr<TTransport> trans = server_->accept();
+      int id;
+      {
+        Guard g(statsMutex);
+        id = ++accepted;
+      }
+      threadFactory.newThread(
+        shared_ptr<Runnable>(new Handler(trans, id)))->start();
+    }
+  }
+
+ private:
+  shared_ptr<TServerSocket> server_;
+};
+
+static void send(THttpClient& client, const string& body) {
+  client.write((const uint8_t*)body.data(), body.size());
+  client.flush();
+}
+
+// Reads a whole response, in pieces of at most piece bytes, and returns
+// the connection number; the rest must be the request body
+static int recv(THttpClient& client, const string& body, uint32_t piece = 65536) {
+  string content;
+  uint8_t buf[65536];
+  uint32_t got;
+  while ((got = client.read(buf, min(piece, (uint32_t)sizeof(buf)))) > 0) {
+    content.append((char*)buf, got);
+  }
+  client.readEnd();
+
+  size_t space = content.find(' ');
+  assert(space != string::npos);
+  assert(content.substr(space + 1) == body);
+  return atoi(content.c_str());
+}
+
+static int call(THttpClient& client, const string& body) {
+  send(client, body);
+  return recv(client, body);
+}
+
+int main(int argc, char** argv) {
+  int port = (argc > 1) ? atoi(argv[1]) : 9890;
+  shared_ptr<TServerSocket> serverSocket(new TServerSocket(port));
+  serverSocket->listen();
+  threadFactory.newThread(
+    shared_ptr<Runnable>(new Acceptor(serverSocket)))->start();
+
+  THttpClient client("localhost", port, PATH);
+  client.open();
+  int conn = call(client, "plain");
+
+  // Two pipelined calls, the first answer held back so that both arrive
+  // in one segment
+  send(client, "hold first");
+  send(client, "second");
+  assert(client.getPendingResponses() == 2);
+  assert(recv(client, "hold first") == conn);
+  assert(client.getPendingResponses() == 1);
+  assert(recv(client, "second") == conn);
+  assert(client.getPendingResponses() == 0);
+
+  // A chunked response, read whole, big enough to need several refills
+  // and a read straight into the caller's buffer
+  string big = "chunked " + string(5000, 'x');
+  assert(call(client, big) == conn);
+
+  // The same in small pieces that straddle the chunk boundaries
+  send(client, big);
+  assert(recv(client, big, 7) == conn);
+
+  // Abandoned after a few bytes: readEnd() skips the other chunks and the
+  // footer, and the connection carries on
+  send(client, "chunked abandoned" + string(3000, 'y'));
+  uint8_t buf[10];
+  client.readAll(buf, sizeof(buf));
+  client.readEnd();
+  assert(call(client, "continue after chunks") == conn);
+
+  // A chunked response pipelined behind a plain one
+  send(client, "hold plain");
+  send(client, big);
+  assert(recv(client, "hold plain") == conn);
+  assert(recv(client, big) == conn);
+
+  // The server closes after this answer; the client closes too and the
+  // next call goes out on a new connection
+  assert(call(client, "close please") == conn);
+  assert(!client.isOpen());
+  int reopened = call(client, "reopened");
+  assert(reopened != conn);
+  assert(client.isOpen());
+
+  // Reading a response without readEnd() is fine too, flush() finishes it
+  send(client, "no readEnd");
+  string content;
+  uint32_t got;
+  while ((got = client.read(buf, sizeof(buf))) > 0) {
+    content.append((char*)buf, got);
+  }
+  assert(atoi(content.c_str()) == reopened);
+  assert(call(client, "after") == reopened);
+  assert(client.getPendingResponses() == 0);
+
+  {
+    Guard g(statsMutex);
+    assert(accepted == 2);
+  }
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
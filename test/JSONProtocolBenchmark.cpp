@@ -0,0 +1,175 @@
+/*
+thrift -cpp DebugProtoTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  JSONProtocolBenchmark.cpp gen-cpp/DebugProtoTest_types.cpp \
+  ../lib/cpp/.libs/libthrift.a -o JSONProtocolBenchmark
+./JSONProtocolBenchmark
+*/
+
+// Encodes and decodes nested DebugProtoTest structures, a struct of long
+// strings and one of lists of numbers with TJSONProtocol over a
+// TMemoryBuffer and prints the throughput of each.  Before timing,
+// checks that the structures round trip, and that lists nested deeper than
+// the protocol keeps room for without allocating do too.
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <sys/time.h>
+#include <protocol/TJSONProtocol.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/DebugProtoTest_types.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+static const int ITERATIONS = 20000;
+static const int DEEP_NESTING = 200;
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+template <class Struct>
+static void bench(const char* name, const Struct& obj) {
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  TJSONProtocol proto(buf);
+
+  obj.write(&proto);
+  string encoded = buf->getBufferAsString();
+  Struct copy;
+  copy.read(&proto);
+  assert(copy == obj);
+
+  double start = nowUsec();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    buf->resetBuffer();
+    obj.write(&proto);
+  }
+  double encodeSecs = (nowUsec() - start) / 1000000.0;
+
+  start = nowUsec();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+    copy.read(&proto);
+  }
+  double decodeSecs = (nowUsec() - start) / 1000000.0;
+
+  double mb = (double)encoded.size() * ITERATIONS / (1024 * 1024);
+  cout << setw(12) << name << setw(8) << encoded.size()
+       << setw(12) << fixed << setprecision(1) << mb / encodeSecs
+       << setw(12) << mb / decodeSecs << endl;
+}
+
+// Lists of lists, DEEP_NESTING levels down, with an i32 at the bottom
+static void checkDeepNesting() {
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  TJSONProtocol proto(buf);
+  for (int i = 0; i < DEEP_NESTING; ++i) {
+    proto.writeListBegin(T_LIST, 1);
+  }
+  proto.writeListBegin(T_I32, 2);
+  proto.writeI32(-1);
+  proto.writeI32(DEEP_NESTING);
+  proto.writeListEnd();
+  for (int i = 0; i < DEEP_NESTING; ++i) {
+    proto.writeListEnd();
+  }
+
+  TType type;
+  uint32_t size;
+  for (int i = 0; i < DEEP_NESTING; ++i) {
+    proto.readListBegin(type, size);
+    assert(type == T_LIST && size == 1);
+  }
+  proto.readListBegin(type, size);
+  assert(type == T_I32 && size == 2);
+  int32_t value;
+  proto.readI32(value);
+  assert(value == -1);
+  proto.readI32(value);
+  assert(value == DEEP_NESTING);
+  proto.readListEnd();
+  for (int i = 0; i < DEEP_NESTING; ++i) {
+    proto.readListEnd();
+  }
+  assert(buf->available() == 0);
+}
+
+int main() {
+  checkDeepNesting();
+
+  OneOfEach ooe;
+  ooe.im_true   = true;
+  ooe.im_false  = false;
+  ooe.a_bite    = 0xd6;
+  ooe.integer16 = 27000;
+  ooe.integer32 = 1<<24;
+  ooe.integer64 = (uint64_t)6000 * 1000 * 1000;
+  ooe.double_precision = M_PI;
+  ooe.some_characters  = "JSON THIS! \"\1";
+  ooe.zomg_unicode     = "\xd7\n\a\t";
+  ooe.base64 = "\1\2\3\255";
+
+  Nesting n;
+  n.my_ooe = ooe;
+  n.my_ooe.integer16 = 16;
+  n.my_ooe.integer32 = 32;
+  n.my_ooe.integer64 = 64;
+  n.my_ooe.double_precision = (std::sqrt(5.0)+1)/2;
+  n.my_ooe.some_characters  = ":R (me going \"rrrr\")";
+  n.my_bonk.type    = 31337;
+  n.my_bonk.message = "I am a bonk... xor!";
+
+  HolyMoley hm;
+  hm.big.push_back(ooe);
+  hm.big.push_back(n.my_ooe);
+  vector<string> stage1;
+  stage1.push_back("and a one");
+  stage1.push_back("and a two");
+  hm.contain.insert(stage1);
+  stage1.clear();
+  stage1.push_back("then a one, two");
+  stage1.push_back("three!");
+  stage1.push_back("FOUR!!");
+  hm.contain.insert(stage1);
+  vector<Bonk> stage2;
+  for (int i = 0; i < 10; ++i) {
+    stage2.push_back(n.my_bonk);
+    stage2.back().type = i;
+  }
+  hm.bonks["poe"] = stage2;
+  hm.bonks["nothing"] = vector<Bonk>();
+
+  // Mostly plain text, with the odd character that has to be escaped
+  Nesting text = n;
+  text.my_bonk.message.clear();
+  for (int i = 0; i < 64; ++i) {
+    text.my_bonk.message += "The quick brown fox jumps over the lazy dog.\n";
+  }
+  text.my_ooe.some_characters = text.my_bonk.message + "\"\\\t";
+
+  PrimitiveLists numbers;
+  for (int i = 0; i < 256; ++i) {
+    numbers.i32s.push_back(i * 100003 - 12800000);
+    numbers.i64s.push_back((int64_t)i << 40);
+    numbers.doubles.push_back(std::sin(i / 100.0));
+    numbers.doubles.push_back(i * 0.25);
+  }
+
+  cout << setw(12) << "struct" << setw(8) << "bytes"
+       << setw(12) << "enc MB/s" << setw(12) << "dec MB/s" << endl;
+  bench("OneOfEach", ooe);
+  bench("Nesting", n);
+  bench("HolyMoley", hm);
+  bench("Text", text);
+  bench("Numbers", numbers);
+  return 0;
+}
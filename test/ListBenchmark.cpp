@@ -0,0 +1,162 @@
+/*
+thrift -cpp -dense DebugProtoTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  ListBenchmark.cpp gen-cpp/DebugProtoTest_types.cpp \
+  ../lib/cpp/.libs/libthrift.a -o ListBenchmark
+./ListBenchmark
+*/
+
+// Encodes and decodes a DebugProtoTest PrimitiveLists holding a feature
+// vector of doubles and a list of i32s, the case the bulk list functions
+// of TProtocol are for.  "binary" writes the lists in bulk, "binary/elem"
+// is the same protocol made to go element by element the way every
+// protocol used to.  Every protocol is first checked to round trip lists
+// of every width, including empty ones.
+
+#undef NDEBUG
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <sys/time.h>
+#include <protocol/TBinaryProtocol.h>
+#include <protocol/TCompactProtocol.h>
+#include <protocol/TDenseProtocol.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/DebugProtoTest_types.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+static const int FEATURES = 16384;
+static const int ITERATIONS = 2000;
+static const char* PROTOCOLS[] = { "binary", "binary/elem", "dense", "compact" };
+static const int NUM_PROTOCOLS = 4;
+
+// The binary protocol with the element by element fallbacks of TProtocol
+class ElementwiseBinaryProtocol : public TBinaryProtocol {
+ public:
+  ElementwiseBinaryProtocol(shared_ptr<TTransport> trans) :
+    TBinaryProtocol(trans) {}
+
+  uint32_t writeI32Array(const int32_t* arr, const uint32_t size) {
+    return TProtocol::writeI32Array(arr, size);
+  }
+
+  uint32_t writeDoubleArray(const double* arr, const uint32_t size) {
+    return TProtocol::writeDoubleArray(arr, size);
+  }
+
+  uint32_t readI32Array(int32_t* arr, const uint32_t size) {
+    return TProtocol::readI32Array(arr, size);
+  }
+
+  uint32_t readDoubleArray(double* arr, const uint32_t size) {
+    return TProtocol::readDoubleArray(arr, size);
+  }
+};
+
+static shared_ptr<TProtocol> makeProtocol(int kind, shared_ptr<TTransport> trans) {
+  switch (kind) {
+    case 0:
+      return shared_ptr<TProtocol>(new TBinaryProtocol(trans));
+    case 1:
+      return shared_ptr<TProtocol>(new ElementwiseBinaryProtocol(trans));
+    case 2:
+      return shared_ptr<TProtocol>(new TDenseProtocol(trans, PrimitiveLists::local_reflection));
+    default:
+      return shared_ptr<TProtocol>(new TCompactProtocol(trans));
+  }
+}
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void checkRoundTrip(const PrimitiveLists& lists) {
+  for (int kind = 0; kind < NUM_PROTOCOLS; ++kind) {
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    shared_ptr<TProtocol> proto = makeProtocol(kind, buf);
+    lists.write(proto.get());
+    PrimitiveLists copy;
+    copy.read(proto.get());
+    assert(copy == lists);
+    assert(buf->available() == 0);
+  }
+}
+
+int main() {
+  PrimitiveLists edges;
+  checkRoundTrip(edges);
+  edges.bytes.push_back(0);
+  edges.bytes.push_back(-128);
+  edges.bytes.push_back(127);
+  edges.i16s.push_back(SHRT_MIN);
+  edges.i16s.push_back(SHRT_MAX);
+  edges.i16s.push_back(-1);
+  edges.i32s.push_back(INT_MIN);
+  edges.i32s.push_back(INT_MAX);
+  edges.i32s.push_back(0x01020304);
+  edges.i64s.push_back(LLONG_MIN);
+  edges.i64s.push_back(LLONG_MAX);
+  edges.i64s.push_back(0x0102030405060708LL);
+  edges.doubles.push_back(-0.0);
+  edges.doubles.push_back(M_PI);
+  edges.doubles.push_back(1e308);
+  checkRoundTrip(edges);
+
+  // Odd sizes that leave part of a chunk over
+  PrimitiveLists odd;
+  for (int i = 0; i < 1000 + 7; ++i) {
+    odd.bytes.push_back(i);
+    odd.i16s.push_back(i * 31);
+    odd.i32s.push_back(i * 100003);
+    odd.i64s.push_back((int64_t)i << 40);
+    odd.doubles.push_back(i / 7.0);
+  }
+  checkRoundTrip(odd);
+
+  PrimitiveLists features;
+  for (int i = 0; i < FEATURES; ++i) {
+    features.i32s.push_back(i * 17);
+    features.doubles.push_back(std::sin(i / 100.0));
+  }
+
+  cout << setw(12) << "protocol" << setw(10) << "bytes"
+       << setw(12) << "enc us" << setw(12) << "dec us" << endl;
+  for (int kind = 0; kind < NUM_PROTOCOLS; ++kind) {
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    shared_ptr<TProtocol> proto = makeProtocol(kind, buf);
+
+    features.write(proto.get());
+    string encoded = buf->getBufferAsString();
+    PrimitiveLists copy;
+    copy.read(proto.get());
+    assert(copy == features);
+
+    double start = nowUsec();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      buf->resetBuffer();
+      features.write(proto.get());
+    }
+    double encodeUs = (nowUsec() - start) / ITERATIONS;
+
+    start = nowUsec();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+      copy.read(proto.get());
+    }
+    double decodeUs = (nowUsec() - start) / ITERATIONS;
+
+    cout << setw(12) << PROTOCOLS[kind] << setw(10) << encoded.size()
+         << setw(12) << fixed << setprecision(1) << encodeUs
+         << setw(12) << decodeUs << endl;
+  }
+  return 0;
+}
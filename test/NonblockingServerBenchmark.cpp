@@ -0,0 +1,189 @@
+/*
+thrift -cpp DebugProtoTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  NonblockingServerBenchmark.cpp gen-cpp/Srv.cpp \
+  gen-cpp/DebugProtoTest_types.cpp ../lib/cpp/.libs/libthriftnb.a \
+  ../lib/cpp/.libs/libthrift.a -levent -lpthread \
+  -o NonblockingServerBenchmark
+./NonblockingServerBenchmark [base port] 2> /dev/null
+*/
+
+// Measures how the requests per second of a TNonblockingServer scale with
+// its number of IO threads.  Clients in this process, each on a connection
+// of its own, call Srv.Janky as fast as it answers.  The handler does next
+// to nothing, so without a thread pool the server's cost is all reading,
+// dispatching and writing on the IO threads.  Every row runs a new server on
+// a port of its own, for each accept policy, and once more round robin with
+// a ThreadManager doing the processing, which adds the cost of handing each
+// request to a worker and back.  Clients share the machine with the server,
+// so the numbers flatten out before the cores do.
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <unistd.h>
+#include <sys/time.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <concurrency/ThreadManager.h>
+#include <protocol/TBinaryProtocol.h>
+#include <server/TNonblockingServer.h>
+#include <transport/TSocket.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/Srv.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::server;
+using namespace facebook::thrift::transport;
+
+static const int NUM_CLIENTS = 64;
+static const int WARMUP_MS = 500;
+static const int MEASURE_MS = 2000;
+static const int NUM_WORKERS = 8;
+
+static volatile bool measuring;
+static volatile bool stopping;
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+class Handler : public SrvIf {
+ public:
+  int32_t Janky(const int32_t arg) {
+    return arg * 2;
+  }
+};
+
+/**
+ * Calls Janky over one connection until told to stop, counting the calls
+ * made while measuring.
+ */
+class Client : public Runnable {
+ public:
+  Client(int port) : port_(port), calls_(0) {}
+
+  void run() {
+    shared_ptr<TSocket> socket(new TSocket("localhost", port_));
+    shared_ptr<TTransport> transport(new TFramedTransport(socket));
+    shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport));
+    SrvClient client(protocol);
+
+    // The server may still be coming up
+    while (true) {
+      try {
+        transport->open();
+        break;
+      } catch (TTransportException& ttx) {
+        usleep(10000);
+      }
+    }
+
+    for (int32_t i = 0; !stopping; ++i) {
+      client.Janky(i);
+      if (measuring) {
+        ++calls_;
+      }
+    }
+    transport->close();
+  }
+
+  int calls() const {
+    return calls_;
+  }
+
+ private:
+  int port_;
+  int calls_;
+};
+
+static double run(int port, int numIOThreads,
+                  TNonblockingServer::AcceptPolicy policy, bool threadPool) {
+  shared_ptr<TProcessor> processor(new SrvProcessor(shared_ptr<Handler>(new Handler())));
+  shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  shared_ptr<ThreadManager> threadManager;
+  if (threadPool) {
+    threadManager = ThreadManager::newSimpleThreadManager(NUM_WORKERS);
+    threadManager->threadFactory(
+      shared_ptr<PosixThreadFactory>(new PosixThreadFactory()));
+    threadManager->start();
+  }
+  shared_ptr<TNonblockingServer> server(
+    new TNonblockingServer(processor, protocolFactory, port, threadManager));
+  server->setNumIOThreads(numIOThreads);
+  server->setAcceptPolicy(policy);
+
+  // Never stops; each run gets a port of its own instead
+  PosixThreadFactory detached;
+  detached.newThread(server)->start();
+
+  PosixThreadFactory joinable;
+  joinable.setDetached(false);
+  measuring = false;
+  stopping = false;
+  vector< shared_ptr<Client> > clients;
+  vector< shared_ptr<Thread> > threads;
+  for (int i = 0; i < NUM_CLIENTS; ++i) {
+    clients.push_back(shared_ptr<Client>(new Client(port)));
+    threads.push_back(joinable.newThread(clients.back()));
+    threads.back()->start();
+  }
+
+  usleep(WARMUP_MS * 1000);
+  double start = nowUsec();
+  measuring = true;
+  usleep(MEASURE_MS * 1000);
+  measuring = false;
+  double elapsed = nowUsec() - start;
+  stopping = true;
+
+  long calls = 0;
+  for (int i = 0; i < NUM_CLIENTS; ++i) {
+    threads[i]->join();
+    calls += clients[i]->calls();
+  }
+  return calls * 1000000.0 / elapsed;
+}
+
+static void quietOutput(const char* /* msg */) {}
+
+int main(int argc, char** argv) {
+  int port = (argc > 1) ? atoi(argv[1]) : 9390;
+
+  // Connections reset by clients going away are expected here
+  GlobalOutput.setOutputFunction(quietOutput);
+
+  const char* names[] = { "round robin", "least loaded", "reuseport" };
+  vector<TNonblockingServer::AcceptPolicy> policies;
+  policies.push_back(TNonblockingServer::ACCEPT_ROUND_ROBIN);
+  policies.push_back(TNonblockingServer::ACCEPT_LEAST_LOADED);
+#ifdef SO_REUSEPORT
+  policies.push_back(TNonblockingServer::ACCEPT_REUSEPORT);
+#endif
+
+  cout << setw(10) << "threads";
+  for (size_t p = 0; p < policies.size(); ++p) {
+    cout << setw(14) << names[policies[p]];
+  }
+  cout << setw(14) << "rr + pool";
+  cout << "  (req/s, " << NUM_CLIENTS << " clients)" << endl;
+
+  for (int numIOThreads = 1; numIOThreads <= 8; numIOThreads *= 2) {
+    cout << setw(10) << numIOThreads;
+    for (size_t p = 0; p < policies.size(); ++p) {
+      cout << setw(14) << fixed << setprecision(0)
+           << run(port++, numIOThreads, policies[p], false) << flush;
+    }
+    cout << setw(14) << run(port++, numIOThreads,
+                            TNonblockingServer::ACCEPT_ROUND_ROBIN, true);
+    cout << endl;
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+thrift -cpp DebugProtoTest.thrift
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  NonblockingServerMemoryTest.cpp gen-cpp/PartiallyReflectable.cpp \
+  gen-cpp/DebugProtoTest_types.cpp ../lib/cpp/.libs/libthriftnb.a \
+  ../lib/cpp/.libs/libthrift.a -levent -lpthread \
+  -o NonblockingServerMemoryTest
+./NonblockingServerMemoryTest [base port] 2> /dev/null
+*/
+
+// Opens a set of connections to a TNonblockingServer, makes one big call on
+// each and leaves them idle.  With the default limits every connection
+// gives its big buffers back and holds only the small ones, and the
+// server's byte counters say so; with the limits lifted they keep them.
+// Then closes every connection and checks that only as many as the
+// connection stack limit are cached, with small buffers, and that the big
+// read buffers went back to the server's pool.
+
+#undef NDEBUG
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <protocol/TBinaryProtocol.h>
+#include <server/TNonblockingServer.h>
+#include <transport/TSocket.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/PartiallyReflectable.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::server;
+using namespace facebook::thrift::transport;
+
+static const int NUM_CONNECTIONS = 20;
+static const size_t STACK_LIMIT = 4;
+static const uint32_t BIG = 256 * 1024;
+
+class Handler : public PartiallyReflectableIf {
+ public:
+  void returnNotReflectable(map<int32_t, map<int32_t, int32_t> >& _return,
+                            const int32_t hello) {}
+  void argNotReflectable(const vector<set<int32_t> >& arg) {}
+  void arg2NotReflectable(const int32_t arg1,
+                          const vector<set<int32_t> >& argNotReflectable) {}
+  void withMap(const map<int32_t, string>& amap) {}
+  void refl1(OneOfEach& _return, const vector<Bonk>& arg1) {}
+
+  // Sends the big string back
+  void refl2(OneOfEach& _return, const vector<string>& arg1,
+             const Bonk& arg2) {
+    _return.zomg_unicode = arg1.back();
+  }
+};
+
+struct Connection {
+  shared_ptr<TTransport> transport;
+  shared_ptr<PartiallyReflectableClient> client;
+};
+
+static shared_ptr<TNonblockingServer> startServer(int port,
+                                                  shared_ptr<TBufferPool> pool,
+                                                  uint32_t idleLimit) {
+  shared_ptr<TProcessor> processor(
+    new PartiallyReflectableProcessor(shared_ptr<Handler>(new Handler())));
+  shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  shared_ptr<TNonblockingServer> server(
+    new TNonblockingServer(processor, protocolFactory, port));
+  server->setBufferPool(pool);
+  server->setConnectionStackLimit(STACK_LIMIT);
+  if (idleLimit > 0) {
+    server->setIdleReadBufferLimit(idleLimit);
+    server->setIdleWriteBufferLimit(idleLimit);
+  }
+
+  PosixThreadFactory threadFactory;
+  threadFactory.newThread(server)->start();
+  return server;
+}
+
+// Opens the connections and makes one big call on each
+static vector<Connection> bigCalls(int port) {
+  vector<string> strings(1, string(BIG, 'x'));
+  vector<Connection> connections;
+  for (int i = 0; i < NUM_CONNECTIONS; ++i) {
+    Connection c;
+    shared_ptr<TSocket> socket(new TSocket("localhost", port));
+    c.transport = shared_ptr<TTransport>(new TFramedTransport(socket));
+    c.client = shared_ptr<PartiallyReflectableClient>(
+      new PartiallyReflectableClient(
+        shared_ptr<TProtocol>(new TBinaryProtocol(c.transport))));
+
+    // The server may still be coming up
+    for (int tries = 0; ; ++tries) {
+      try {
+        c.transport->open();
+        break;
+      } catch (TTransportException& ttx) {
+        assert(tries < 500);
+        usleep(10000);
+      }
+    }
+
+    OneOfEach ooe;
+    c.client->refl2(ooe, strings, Bonk());
+    assert(ooe.zomg_unicode.size() == BIG);
+    connections.push_back(c);
+  }
+  return connections;
+}
+
+// The server finishes with a connection just after its client hears back
+static void waitFor(shared_ptr<TNonblockingServer> server,
+                    int64_t readBytes, int64_t writeBytes) {
+  for (int tries = 0; tries < 500; ++tries) {
+    if (server->getReadBufferBytes() == readBytes &&
+        server->getWriteBufferBytes() == writeBytes) {
+      return;
+    }
+    usleep(10000);
+  }
+  cerr << "read " << server->getReadBufferBytes() << " want " << readBytes
+       << ", write " << server->getWriteBufferBytes() << " want "
+       << writeBytes << endl;
+  assert(false);
+}
+
+int main(int argc, char** argv) {
+  int port = (argc > 1) ? atoi(argv[1]) : 9490;
+  const int64_t readSmall = TConnection::READ_BUFFER_SIZE;
+  const int64_t writeSmall = TMemoryBuffer::defaultSize;
+
+  // Idle connections hold small buffers only
+  shared_ptr<TBufferPool> pool(new TBufferPool(512, 1024 * 1024, 64));
+  shared_ptr<TNonblockingServer> server = startServer(port, pool, 0);
+  vector<Connection> connections = bigCalls(port);
+  waitFor(server, NUM_CONNECTIONS * readSmall, NUM_CONNECTIONS * writeSmall);
+  assert(pool->getCachedBytes() >= BIG);
+
+  // Without the limits they keep the big ones
+  shared_ptr<TNonblockingServer> keeper =
+    startServer(port + 1, shared_ptr<TBufferPool>(new TBufferPool()), 0xffffffff);
+  vector<Connection> kept = bigCalls(port + 1);
+  usleep(100000);
+  assert(keeper->getReadBufferBytes() >= NUM_CONNECTIONS * (int64_t)BIG);
+  assert(keeper->getWriteBufferBytes() >= NUM_CONNECTIONS * (int64_t)BIG);
+
+  // Closed connections beyond the stack limit are deleted; the rest are
+  // cached with small buffers
+  for (int i = 0; i < NUM_CONNECTIONS; ++i) {
+    connections[i].transport->close();
+    kept[i].transport->close();
+  }
+  waitFor(server, STACK_LIMIT * readSmall, STACK_LIMIT * writeSmall);
+  waitFor(keeper, STACK_LIMIT * readSmall, STACK_LIMIT * writeSmall);
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
@@ -0,0 +1,270 @@
+/*
+thrift -cpp DebugProtoTest.thrift
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  NonblockingServerOverloadTest.cpp gen-cpp/Srv.cpp \
+  gen-cpp/DebugProtoTest_types.cpp ../lib/cpp/.libs/libthriftnb.a \
+  ../lib/cpp/.libs/libthrift.a -levent -lpthread \
+  -o NonblockingServerOverloadTest
+./NonblockingServerOverloadTest 2> /dev/null
+*/
+
+// Overloads TNonblockingServers with a single worker, whose Srv.Janky
+// sleeps for arg milliseconds, and checks each of the limits: too many
+// pending tasks, a task that waited past the expire time, too many bytes in
+// flight and too many connections.  Shed requests come back as
+// TApplicationExceptions without waiting for the worker, or as a closed
+// connection when asked for, and each is counted.  The test waits on the
+// server's own state, polled with a bound, rather than sleeping, and every
+// server listens on a port the kernel picked as free.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <concurrency/ThreadManager.h>
+#include <protocol/TBinaryProtocol.h>
+#include <server/TNonblockingServer.h>
+#include <transport/TSocket.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/Srv.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::server;
+using namespace facebook::thrift::transport;
+
+// Long enough for the other calls to arrive while it runs
+static const int32_t SLOW_MS = 300;
+
+// Number of calls the handler has started on
+static volatile int32_t started = 0;
+
+class Handler : public SrvIf {
+ public:
+  int32_t Janky(const int32_t arg) {
+    __sync_add_and_fetch(&started, 1);
+    usleep(arg * 1000);
+    return arg;
+  }
+};
+
+struct Client {
+  shared_ptr<TTransport> transport;
+  shared_ptr<SrvClient> srv;
+};
+
+struct Server {
+  int port;
+  shared_ptr<ThreadManager> threadManager;
+  shared_ptr<TNonblockingServer> server;
+};
+
+// A port nothing is listening on right now
+static int freePort() {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  assert(s != -1);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  assert(bind(s, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  socklen_t len = sizeof(addr);
+  assert(getsockname(s, (struct sockaddr*)&addr, &len) == 0);
+  close(s);
+  return ntohs(addr.sin_port);
+}
+
+static Server makeServer(bool threadPool) {
+  Server s;
+  s.port = freePort();
+  shared_ptr<TProcessor> processor(new SrvProcessor(shared_ptr<Handler>(new Handler())));
+  shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  if (threadPool) {
+    s.threadManager = ThreadManager::newSimpleThreadManager(1);
+    s.threadManager->threadFactory(
+      shared_ptr<PosixThreadFactory>(new PosixThreadFactory()));
+    s.threadManager->start();
+  }
+  s.server = shared_ptr<TNonblockingServer>(
+    new TNonblockingServer(processor, protocolFactory, s.port, s.threadManager));
+  return s;
+}
+
+// Never stops; each test uses a server of its own instead
+static void start(Server& s) {
+  PosixThreadFactory threadFactory;
+  threadFactory.newThread(s.server)->start();
+}
+
+// Polls for a condition on the server's state, giving up after five seconds
+#define WAIT_FOR(cond)                          \
+  for (int tries = 0; !(cond); ++tries) {       \
+    assert(tries < 500);                        \
+    usleep(10000);                              \
+  }
+
+static Client connect(int port) {
+  Client c;
+  shared_ptr<TSocket> socket(new TSocket("localhost", port));
+  c.transport = shared_ptr<TTransport>(new TFramedTransport(socket));
+  c.srv = shared_ptr<SrvClient>(
+    new SrvClient(shared_ptr<TProtocol>(new TBinaryProtocol(c.transport))));
+
+  // The server may still be coming up
+  for (int tries = 0; ; ++tries) {
+    try {
+      c.transport->open();
+      return c;
+    } catch (TTransportException& ttx) {
+      assert(tries < 500);
+      usleep(10000);
+    }
+  }
+}
+
+static bool answeredOverloaded(Client& c) {
+  try {
+    c.srv->recv_Janky();
+  } catch (TApplicationException& x) {
+    return string(x.what()).find("overloaded") != string::npos;
+  }
+  return false;
+}
+
+static bool closed(Client& c) {
+  try {
+    c.srv->recv_Janky();
+  } catch (TTransportException& ttx) {
+    return true;
+  }
+  return false;
+}
+
+// Sends a slow call and waits for the worker to be busy with it
+static void occupyWorker(Client& a) {
+  int32_t before = started;
+  a.srv->send_Janky(SLOW_MS);
+  WAIT_FOR(started > before);
+}
+
+// Keeps the worker busy, queues one task behind it, then sends a third
+static void fillQueue(Server& s, Client& a, Client& b, Client& c) {
+  occupyWorker(a);
+  b.srv->send_Janky(0);
+  WAIT_FOR(s.threadManager->pendingTaskCount() == 1);
+  c.srv->send_Janky(0);
+}
+
+static int64_t nowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int main() {
+  // Too many pending tasks: answered at once, not after the worker
+  {
+    Server s = makeServer(true);
+    shared_ptr<TNonblockingServer> server = s.server;
+    int port = s.port;
+    server->setMaxPendingTasks(1);
+    start(s);
+    Client a = connect(port), b = connect(port), c = connect(port);
+    fillQueue(s, a, b, c);
+    int64_t before = nowMs();
+    assert(answeredOverloaded(c));
+    assert(nowMs() - before < SLOW_MS / 2);
+    assert(a.srv->recv_Janky() == SLOW_MS);
+    assert(b.srv->recv_Janky() == 0);
+    assert(c.srv->Janky(0) == 0);
+    assert(server->getPendingTasksShed() == 1);
+  }
+
+  // The same, closing the connection instead
+  {
+    Server s = makeServer(true);
+    shared_ptr<TNonblockingServer> server = s.server;
+    int port = s.port;
+    server->setMaxPendingTasks(1);
+    server->setOverloadAction(TNonblockingServer::OVERLOAD_CLOSE_CONNECTION);
+    start(s);
+    Client a = connect(port), b = connect(port), c = connect(port);
+    fillQueue(s, a, b, c);
+    assert(closed(c));
+    assert(a.srv->recv_Janky() == SLOW_MS);
+    assert(b.srv->recv_Janky() == 0);
+    assert(server->getPendingTasksShed() == 1);
+  }
+
+  // A task that waited past the expire time is shed by the worker
+  {
+    Server s = makeServer(true);
+    shared_ptr<TNonblockingServer> server = s.server;
+    int port = s.port;
+    server->setTaskExpireTime(SLOW_MS / 3);
+    start(s);
+    Client a = connect(port), b = connect(port);
+    occupyWorker(a);
+    b.srv->send_Janky(0);
+    assert(a.srv->recv_Janky() == SLOW_MS);
+    assert(answeredOverloaded(b));
+    assert(b.srv->Janky(0) == 0);
+    assert(server->getTasksExpired() == 1);
+  }
+
+  // Too many bytes in flight: room for one Janky call but not two
+  {
+    Server s = makeServer(true);
+    shared_ptr<TNonblockingServer> server = s.server;
+    int port = s.port;
+    server->setMaxInFlightBytes(40);
+    start(s);
+    Client a = connect(port), b = connect(port);
+    a.srv->send_Janky(SLOW_MS);
+    WAIT_FOR(server->getInFlightBytes() > 0);
+    b.srv->send_Janky(0);
+    assert(answeredOverloaded(b));
+    assert(a.srv->recv_Janky() == SLOW_MS);
+    assert(server->getInFlightBytes() == 0);
+    assert(b.srv->Janky(0) == 0);
+    assert(server->getInFlightBytesShed() == 1);
+  }
+
+  // Too many connections: the extra one is closed until another goes
+  {
+    Server s = makeServer(false);
+    shared_ptr<TNonblockingServer> server = s.server;
+    int port = s.port;
+    server->setMaxConnections(2);
+    start(s);
+    Client a = connect(port), b = connect(port);
+    assert(a.srv->Janky(0) == 0);
+    assert(b.srv->Janky(0) == 0);
+    Client c = connect(port);
+    try {
+      c.srv->Janky(0);
+      assert(false);
+    } catch (TTransportException& ttx) {
+    }
+    // Counted before the hang-up, so no need to wait for it
+    assert(server->getConnectionsShed() == 1);
+
+    a.transport->close();
+    WAIT_FOR(server->getNumConnections() <= 1);
+    Client d = connect(port);
+    assert(d.srv->Janky(0) == 0);
+  }
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
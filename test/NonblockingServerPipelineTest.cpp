@@ -0,0 +1,213 @@
+/*
+thrift -cpp DebugProtoTest.thrift
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  NonblockingServerPipelineTest.cpp gen-cpp/Srv.cpp \
+  gen-cpp/DebugProtoTest_types.cpp ../lib/cpp/.libs/libthriftnb.a \
+  ../lib/cpp/.libs/libthrift.a -levent -lpthread \
+  -o NonblockingServerPipelineTest
+./NonblockingServerPipelineTest [base port] 2> /dev/null
+*/
+
+// Pipelines calls to Srv.Janky, which sleeps for arg milliseconds, on one
+// connection to a TNonblockingServer with a few workers.  With pipelining
+// the calls run at once and are answered in the order they finish, which
+// the seqids show; up to the limit, after which the next call waits for an
+// answer to go out.  Without it they are answered one after another.  Also
+// closes a connection with calls still running, and checks the server
+// lets go of them and keeps serving, and that a limit of zero is refused.
+// SrvClient always sends seqid 0, so the calls are written by hand.
+
+#undef NDEBUG
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <sys/time.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <concurrency/ThreadManager.h>
+#include <protocol/TBinaryProtocol.h>
+#include <server/TNonblockingServer.h>
+#include <transport/TSocket.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/Srv.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::server;
+using namespace facebook::thrift::transport;
+
+static const int NUM_WORKERS = 4;
+static const int32_t SLOW_MS = 300;
+
+class Handler : public SrvIf {
+ public:
+  int32_t Janky(const int32_t arg) {
+    usleep(arg * 1000);
+    return arg;
+  }
+};
+
+// Never stops; each test uses a port of its own instead
+static shared_ptr<TNonblockingServer> startServer(int port,
+                                                  uint32_t maxPipelined) {
+  shared_ptr<TProcessor> processor(new SrvProcessor(shared_ptr<Handler>(new Handler())));
+  shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  shared_ptr<ThreadManager> threadManager =
+    ThreadManager::newSimpleThreadManager(NUM_WORKERS);
+  threadManager->threadFactory(
+    shared_ptr<PosixThreadFactory>(new PosixThreadFactory()));
+  threadManager->start();
+  shared_ptr<TNonblockingServer> server(
+    new TNonblockingServer(processor, protocolFactory, port, threadManager));
+  server->setMaxPipelinedRequests(maxPipelined);
+
+  PosixThreadFactory threadFactory;
+  threadFactory.newThread(server)->start();
+  return server;
+}
+
+class Connection {
+ public:
+  Connection(int port) {
+    shared_ptr<TSocket> socket(new TSocket("localhost", port));
+    transport_ = shared_ptr<TTransport>(new TFramedTransport(socket));
+    protocol_ = shared_ptr<TProtocol>(new TBinaryProtocol(transport_));
+
+    // The server may still be coming up
+    for (int tries = 0; ; ++tries) {
+      try {
+        transport_->open();
+        return;
+      } catch (TTransportException& ttx) {
+        assert(tries < 500);
+        usleep(10000);
+      }
+    }
+  }
+
+  void send(int32_t seqid, int32_t arg) {
+    protocol_->writeMessageBegin("Janky", T_CALL, seqid);
+    Srv_Janky_pargs args;
+    args.arg = &arg;
+    args.write(protocol_.get());
+    protocol_->writeMessageEnd();
+    transport_->flush();
+  }
+
+  // Returns the seqid of the next answer, which must be arg
+  int32_t recv(int32_t* arg) {
+    string fname;
+    TMessageType mtype;
+    int32_t seqid;
+    protocol_->readMessageBegin(fname, mtype, seqid);
+    assert(mtype == T_REPLY);
+    Srv_Janky_presult result;
+    result.success = arg;
+    result.read(protocol_.get());
+    protocol_->readMessageEnd();
+    transport_->readEnd();
+    assert(result.__isset.success);
+    return seqid;
+  }
+
+  void close() {
+    transport_->close();
+  }
+
+ private:
+  shared_ptr<TTransport> transport_;
+  shared_ptr<TProtocol> protocol_;
+};
+
+static int64_t nowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Sends one call per arg, seqids from 1, and returns the seqids of the
+// answers in the order they came, with when each came
+static vector<int32_t> pipeline(int port, const vector<int32_t>& args,
+                                vector<int64_t>* times) {
+  Connection c(port);
+  int64_t start = nowMs();
+  for (size_t i = 0; i < args.size(); ++i) {
+    c.send(i + 1, args[i]);
+  }
+  vector<int32_t> seqids;
+  for (size_t i = 0; i < args.size(); ++i) {
+    int32_t arg;
+    seqids.push_back(c.recv(&arg));
+    assert(arg == args[seqids.back() - 1]);
+    times->push_back(nowMs() - start);
+  }
+  c.close();
+  return seqids;
+}
+
+int main(int argc, char** argv) {
+  int port = (argc > 1) ? atoi(argv[1]) : 9690;
+  vector<int32_t> args;
+  vector<int32_t> seqids;
+  vector<int64_t> times;
+
+  // Answered as they finish, quickest first
+  args.push_back(SLOW_MS);
+  args.push_back(SLOW_MS / 3);
+  args.push_back(0);
+  shared_ptr<TNonblockingServer> server = startServer(port, 3);
+  try {
+    server->setMaxPipelinedRequests(0);
+    assert(false);
+  } catch (TException& x) {
+  }
+  assert(server->getMaxPipelinedRequests() == 3);
+  seqids = pipeline(port, args, &times);
+  assert(seqids[0] == 3 && seqids[1] == 2 && seqids[2] == 1);
+  assert(times[2] < SLOW_MS + SLOW_MS / 3);
+
+  // Without pipelining, one after another
+  times.clear();
+  startServer(port + 1, 1);
+  seqids = pipeline(port + 1, args, &times);
+  assert(seqids[0] == 1 && seqids[1] == 2 && seqids[2] == 3);
+  assert(times[0] >= SLOW_MS);
+
+  // Two at a time: the quick one waits to be read until a slow one is done
+  args.clear();
+  args.push_back(SLOW_MS);
+  args.push_back(SLOW_MS);
+  args.push_back(0);
+  times.clear();
+  startServer(port + 2, 2);
+  seqids = pipeline(port + 2, args, &times);
+  assert(seqids[2] == 3);
+  assert(times[2] >= SLOW_MS);
+  assert(times[2] < 2 * SLOW_MS);
+
+  // Hang up with calls still running; the server finishes them and lets
+  // the connection go
+  {
+    Connection c(port);
+    for (int32_t i = 1; i <= 3; ++i) {
+      c.send(i, SLOW_MS / 3);
+    }
+    usleep(10000);
+    c.close();
+  }
+  for (int tries = 0; server->getNumConnections() > 0; ++tries) {
+    assert(tries < 500);
+    usleep(10000);
+  }
+  assert(server->getInFlightBytes() == 0);
+  times.clear();
+  seqids = pipeline(port, args, &times);
+  assert(seqids[0] == 3);
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
@@ -0,0 +1,259 @@
+/*
+thrift -cpp -dense DebugProtoTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  ProtocolBenchmark.cpp gen-cpp/DebugProtoTest_types.cpp \
+  ../lib/cpp/.libs/libthrift.a -o ProtocolBenchmark
+./ProtocolBenchmark
+*/
+
+// Encodes and decodes DebugProtoTest structures with TBinaryProtocol,
+// TDenseProtocol and TCompactProtocol over a TMemoryBuffer, and prints the
+// encoded size and the time per encode and decode for each.  "binary/mb"
+// is TBinaryProtocolT<TMemoryBuffer>, which calls the buffer directly.  Every
+// structure is checked to survive the round trip with every protocol
+// before it is timed, and to decode through a small TBufferedTransport,
+// which must never be asked for bytes past the end of the input.
+
+#undef NDEBUG
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <sys/time.h>
+#include <protocol/TBinaryProtocol.h>
+#include <protocol/TCompactProtocol.h>
+#include <protocol/TDenseProtocol.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/DebugProtoTest_types.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+typedef facebook::thrift::reflection::local::TypeSpec TypeSpec;
+
+static const int ITERATIONS = 200000;
+static const char* PROTOCOLS[] = { "binary", "binary/mb", "dense", "compact" };
+static const int NUM_PROTOCOLS = 4;
+
+static shared_ptr<TProtocol> makeProtocol(int kind,
+                                          shared_ptr<TMemoryBuffer> trans,
+                                          TypeSpec* spec) {
+  switch (kind) {
+    case 0:
+      return shared_ptr<TProtocol>(new TBinaryProtocol(trans));
+    case 1:
+      return shared_ptr<TProtocol>(new TBinaryProtocolT<TMemoryBuffer>(trans));
+    case 2:
+      return shared_ptr<TProtocol>(new TDenseProtocol(trans, spec));
+    default:
+      return shared_ptr<TProtocol>(new TCompactProtocol(trans));
+  }
+}
+
+// The same protocols over any transport, except binary/mb
+static shared_ptr<TProtocol> makeProtocol(int kind,
+                                          shared_ptr<TTransport> trans,
+                                          TypeSpec* spec) {
+  switch (kind) {
+    case 2:
+      return shared_ptr<TProtocol>(new TDenseProtocol(trans, spec));
+    case 3:
+      return shared_ptr<TProtocol>(new TCompactProtocol(trans));
+    default:
+      return shared_ptr<TProtocol>(new TBinaryProtocol(trans));
+  }
+}
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+template <class Struct>
+static void bench(const char* name, const Struct& obj, TypeSpec* spec) {
+  for (int kind = 0; kind < NUM_PROTOCOLS; ++kind) {
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    shared_ptr<TProtocol> proto = makeProtocol(kind, buf, spec);
+
+    obj.write(proto.get());
+    string encoded = buf->getBufferAsString();
+    Struct copy;
+    copy.read(proto.get());
+    assert(copy == obj);
+
+    double start = nowUsec();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      buf->resetBuffer();
+      obj.write(proto.get());
+    }
+    double encodeNs = (nowUsec() - start) * 1000.0 / ITERATIONS;
+
+    start = nowUsec();
+    for (int i = 0; i < ITERATIONS; ++i) {
+      buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+      copy.read(proto.get());
+    }
+    double decodeNs = (nowUsec() - start) * 1000.0 / ITERATIONS;
+
+    cout << setw(12) << name << setw(10) << PROTOCOLS[kind]
+         << setw(8) << encoded.size()
+         << setw(12) << fixed << setprecision(1) << encodeNs
+         << setw(12) << decodeNs << endl;
+  }
+}
+
+// Writes obj into a TMemoryBuffer and reads it back through a
+// TBufferedTransport small enough that values straddle its refills
+template <class Struct>
+static void checkBuffered(const Struct& obj, TypeSpec* spec) {
+  for (int kind = 0; kind < NUM_PROTOCOLS; ++kind) {
+    if (kind == 1) {
+      continue;
+    }
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    obj.write(makeProtocol(kind, buf, spec).get());
+    shared_ptr<TTransport> buffered(new TBufferedTransport(buf, 16));
+    Struct copy;
+    copy.read(makeProtocol(kind, buffered, spec).get());
+    assert(copy == obj);
+    assert(buf->available() == 0);
+  }
+}
+
+// A compact varint that ends the input has to decode through a
+// TBufferedTransport without it trying to read ahead
+static void checkBufferedVarints() {
+  int64_t values[] = { 5, -1, 300, LLONG_MIN, LLONG_MAX };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    TCompactProtocol out(buf);
+    out.writeI32((int32_t)values[i]);
+    out.writeI64(values[i]);
+
+    shared_ptr<TTransport> buffered(new TBufferedTransport(buf));
+    TCompactProtocol in(buffered);
+    int32_t i32;
+    int64_t i64;
+    in.readI32(i32);
+    in.readI64(i64);
+    assert(i32 == (int32_t)values[i] && i64 == values[i]);
+    assert(buf->available() == 0);
+  }
+}
+
+// Checks that an RPC message envelope survives the compact protocol
+static void checkMessage(const string& name, TMessageType type, int32_t seqid) {
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  TCompactProtocol proto(buf);
+  Bonk args;
+  args.type = seqid;
+  args.message = name;
+
+  proto.writeMessageBegin(name, type, seqid);
+  args.write(&proto);
+  proto.writeMessageEnd();
+
+  string rname;
+  TMessageType rtype;
+  int32_t rseqid;
+  Bonk rargs;
+  proto.readMessageBegin(rname, rtype, rseqid);
+  rargs.read(&proto);
+  proto.readMessageEnd();
+  assert(rname == name && rtype == type && rseqid == seqid && rargs == args);
+  assert(buf->available() == 0);
+}
+
+int main() {
+  OneOfEach ooe;
+  ooe.im_true   = true;
+  ooe.im_false  = false;
+  ooe.a_bite    = 0xd6;
+  ooe.integer16 = 27000;
+  ooe.integer32 = 1<<24;
+  ooe.integer64 = (uint64_t)6000 * 1000 * 1000;
+  ooe.double_precision = M_PI;
+  ooe.some_characters  = "Debug THIS!";
+  ooe.zomg_unicode     = "\xd7\n\a\t";
+
+  Nesting n;
+  n.my_ooe = ooe;
+  n.my_ooe.integer16 = 16;
+  n.my_ooe.integer32 = 32;
+  n.my_ooe.integer64 = 64;
+  n.my_ooe.double_precision = (std::sqrt(5.0)+1)/2;
+  n.my_ooe.some_characters  = ":R (me going \"rrrr\")";
+  n.my_bonk.type    = 31337;
+  n.my_bonk.message = "I am a bonk... xor!";
+
+  HolyMoley hm;
+  hm.big.push_back(ooe);
+  hm.big.push_back(n.my_ooe);
+  vector<string> stage1;
+  stage1.push_back("and a one");
+  stage1.push_back("and a two");
+  hm.contain.insert(stage1);
+  vector<Bonk> stage2;
+  for (int i = 0; i < 20; ++i) {
+    stage2.push_back(n.my_bonk);
+    stage2.back().type = i;
+  }
+  hm.bonks["poe"] = stage2;
+
+  // Small ints and a sparse struct, the case the compact protocol is for
+  RandomStuff rs;
+  rs.a = 1;
+  rs.b = -2;
+  rs.c = 300;
+  rs.d = 0;
+  for (int i = 0; i < 50; ++i) {
+    rs.myintlist.push_back(i * 7 - 100);
+  }
+  rs.maps[5] = Wrapper();
+  rs.bigint = -1;
+  rs.triple = 0.5;
+
+  // Extremes, descending field ids and an empty struct only have to round trip
+  OneOfEach extreme = ooe;
+  extreme.integer16 = SHRT_MIN;
+  extreme.integer32 = INT_MIN;
+  extreme.integer64 = LLONG_MIN;
+  Backwards backwards;
+  backwards.first_tag2 = INT_MAX;
+  backwards.second_tag1 = -1;
+  for (int kind = 0; kind < NUM_PROTOCOLS; ++kind) {
+    shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+    shared_ptr<TProtocol> proto = makeProtocol(kind, buf, OneOfEach::local_reflection);
+    OneOfEach ooe2;
+    extreme.write(proto.get());
+    ooe2.read(proto.get());
+    assert(ooe2 == extreme);
+
+    proto = makeProtocol(kind, buf, Backwards::local_reflection);
+    Backwards backwards2;
+    backwards.write(proto.get());
+    backwards2.read(proto.get());
+    assert(backwards2 == backwards);
+  }
+  checkMessage("Janky", T_CALL, 0);
+  checkMessage("Janky", T_REPLY, INT_MAX);
+  checkMessage("", T_EXCEPTION, -1);
+  checkBufferedVarints();
+  checkBuffered(ooe, OneOfEach::local_reflection);
+  checkBuffered(extreme, OneOfEach::local_reflection);
+  checkBuffered(hm, HolyMoley::local_reflection);
+  checkBuffered(rs, RandomStuff::local_reflection);
+
+  cout << setw(12) << "struct" << setw(10) << "protocol" << setw(8) << "bytes"
+       << setw(12) << "enc ns" << setw(12) << "dec ns" << endl;
+  bench("OneOfEach", ooe, OneOfEach::local_reflection);
+  bench("Nesting", n, Nesting::local_reflection);
+  bench("HolyMoley", hm, HolyMoley::local_reflection);
+  bench("RandomStuff", rs, RandomStuff::local_reflection);
+  return 0;
+}
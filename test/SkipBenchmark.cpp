@@ -0,0 +1,183 @@
+/*
+thrift -cpp DebugProtoTest.thrift
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  SkipBenchmark.cpp gen-cpp/DebugProtoTest_types.cpp \
+  ../lib/cpp/.libs/libthrift.a -o SkipBenchmark
+./SkipBenchmark
+*/
+
+// Skips whole DebugProtoTest structures written with TBinaryProtocol: a
+// HolyMoley, a PrimitiveLists of long lists and a Base64 of big binaries.
+// Prints MB/s for reading them into the struct, for the generic
+// TProtocol::skip() that reads every value into a temporary, and for
+// TBinaryProtocol's own skip().  First checks that both skips come out
+// after exactly the struct, with the byte count of it, straight from a
+// TMemoryBuffer, through a TBufferedTransport smaller than the strings,
+// and through a TFramedTransport, which doesn't lend its bytes between
+// frames.
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <sys/time.h>
+#include <protocol/TBinaryProtocol.h>
+#include <transport/TTransportUtils.h>
+#include "gen-cpp/DebugProtoTest_types.h"
+
+using namespace std;
+using namespace boost;
+using namespace thrift::test;
+using namespace facebook::thrift::protocol;
+using namespace facebook::thrift::transport;
+
+static const uint64_t BYTES_PER_ROW = 512 * 1024 * 1024;
+static const int32_t SENTINEL = 0x5ca1ab1e;
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+// Skips the way every protocol did before they could override it
+class GenericSkipProtocol : public TBinaryProtocol {
+ public:
+  GenericSkipProtocol(shared_ptr<TTransport> trans) :
+    TBinaryProtocol(trans) {}
+
+  uint32_t skip(TType type) {
+    return TProtocol::skip(type);
+  }
+};
+
+// Writes obj and a sentinel through trans, then skips obj with each protocol
+// and checks the sentinel comes next
+template <class Struct>
+static void checkSkip(const Struct& obj, shared_ptr<TMemoryBuffer> buf,
+                      shared_ptr<TTransport> trans) {
+  TBinaryProtocol writer(trans);
+  TBinaryProtocol fast(trans);
+  GenericSkipProtocol generic(trans);
+  TProtocol* skippers[] = { &fast, &generic };
+
+  for (int i = 0; i < 2; ++i) {
+    buf->resetBuffer();
+    uint32_t size = obj.write(&writer);
+    writer.writeI32(SENTINEL);
+    trans->flush();
+
+    assert(skippers[i]->skip(T_STRUCT) == size);
+    int32_t sentinel;
+    skippers[i]->readI32(sentinel);
+    assert(sentinel == SENTINEL);
+    assert(buf->available() == 0);
+  }
+}
+
+template <class Struct>
+static void check(const Struct& obj) {
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  checkSkip(obj, buf, buf);
+  checkSkip(obj, buf, shared_ptr<TTransport>(new TBufferedTransport(buf, 100)));
+  checkSkip(obj, buf, shared_ptr<TTransport>(new TFramedTransport(buf)));
+}
+
+template <class Struct>
+static void bench(const char* name, const Struct& obj) {
+  check(obj);
+
+  shared_ptr<TMemoryBuffer> buf(new TMemoryBuffer());
+  TBinaryProtocol proto(buf);
+  GenericSkipProtocol generic(buf);
+  obj.write(&proto);
+  string encoded = buf->getBufferAsString();
+  int iterations = (int)(BYTES_PER_ROW / encoded.size()) + 1;
+  double mb = (double)iterations * encoded.size() / (1024 * 1024);
+
+  Struct copy;
+  double start = nowUsec();
+  for (int i = 0; i < iterations; ++i) {
+    buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+    copy.read(&proto);
+  }
+  double readSpeed = mb * 1000000.0 / (nowUsec() - start);
+
+  start = nowUsec();
+  for (int i = 0; i < iterations; ++i) {
+    buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+    generic.skip(T_STRUCT);
+  }
+  double genericSpeed = mb * 1000000.0 / (nowUsec() - start);
+
+  start = nowUsec();
+  for (int i = 0; i < iterations; ++i) {
+    buf->resetBuffer((uint8_t*)encoded.data(), encoded.size());
+    proto.skip(T_STRUCT);
+  }
+  double fastSpeed = mb * 1000000.0 / (nowUsec() - start);
+
+  cout << setw(12) << name << setw(10) << encoded.size()
+       << fixed << setprecision(0) << setw(10) << readSpeed
+       << setw(10) << genericSpeed << setw(10) << fastSpeed << endl;
+}
+
+int main() {
+  OneOfEach ooe;
+  ooe.im_true   = true;
+  ooe.im_false  = false;
+  ooe.a_bite    = 0xd6;
+  ooe.integer16 = 27000;
+  ooe.integer32 = 1<<24;
+  ooe.integer64 = (uint64_t)6000 * 1000 * 1000;
+  ooe.double_precision = M_PI;
+  ooe.some_characters  = "Debug THIS!";
+  ooe.zomg_unicode     = "\xd7\n\a\t";
+  ooe.base64 = "\1\2\3\255";
+
+  HolyMoley hm;
+  for (int i = 0; i < 20; ++i) {
+    hm.big.push_back(ooe);
+    hm.big.back().integer32 = i;
+  }
+  vector<string> stage1;
+  stage1.push_back("and a one");
+  stage1.push_back("and a two");
+  hm.contain.insert(stage1);
+  stage1.push_back("then a one, two");
+  hm.contain.insert(stage1);
+  vector<Bonk> stage2;
+  for (int i = 0; i < 10; ++i) {
+    stage2.push_back(Bonk());
+    stage2.back().type = i;
+    stage2.back().message = "quoth the raven";
+  }
+  hm.bonks["poe"] = stage2;
+  hm.bonks["nothing"] = vector<Bonk>();
+
+  PrimitiveLists numbers;
+  for (int i = 0; i < 65536; ++i) {
+    numbers.bytes.push_back((int8_t)i);
+    numbers.i16s.push_back((int16_t)i);
+    numbers.i32s.push_back(i * 10007);
+    numbers.i64s.push_back((int64_t)i << 40);
+    numbers.doubles.push_back(i * 0.25);
+  }
+
+  Base64 blobs;
+  blobs.a = 1;
+  blobs.b1 = string(256 * 1024, 'x');
+  blobs.b2 = string(256 * 1024, 'y');
+  blobs.b3 = string(256 * 1024, 'z');
+  blobs.b4 = "short";
+  blobs.b5 = string(1024, '\0');
+  blobs.b6 = string(256 * 1024, '\377');
+
+  cout << setw(12) << "struct" << setw(10) << "bytes" << setw(10) << "read"
+       << setw(10) << "generic" << setw(10) << "skip" << endl;
+  bench("HolyMoley", hm);
+  bench("Numbers", numbers);
+  bench("Blobs", blobs);
+  return 0;
+}
@@ -0,0 +1,226 @@
+/*
+g++ -Wall -O2 -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  SocketPoolBenchmark.cpp ../lib/cpp/.libs/libthrift.a -lpthread \
+  -o SocketPoolBenchmark
+./SocketPoolBenchmark [base port]
+*/
+
+// Simulates a client tier talking to a set of backends of uneven speed
+// through TSocketPool.  Each stand-in backend answers a 4 byte request
+// after an injected delay, and one of them is much slower than the rest.
+// Several client threads share one list of TSocketPoolServers, open the
+// pool, make a call and close it again, the way a per-request client
+// would.  The table compares the old random ordering with power of two
+// choices, with and without the keep-alive pool.
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/time.h>
+#include <concurrency/Mutex.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <transport/TServerSocket.h>
+#include <transport/TSocketPool.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::transport;
+
+static const int NUM_SERVERS = 4;
+static const int SERVER_DELAY_US[NUM_SERVERS] = { 1000, 1500, 2000, 20000 };
+static const int NUM_CLIENTS = 8;
+static const int REQUESTS_PER_CLIENT = 250;
+
+static PosixThreadFactory threadFactory;
+static Mutex statsMutex;
+static int accepts[NUM_SERVERS];
+static int served[NUM_SERVERS];
+
+static double nowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/**
+ * Answers requests on one connection after the server's injected delay.
+ */
+class Handler : public Runnable {
+ public:
+  Handler(shared_ptr<TTransport> trans, int server)
+    : trans_(trans), server_(server) {}
+
+  void run() {
+    uint8_t buf[4];
+    try {
+      while (true) {
+        trans_->readAll(buf, sizeof(buf));
+        usleep(SERVER_DELAY_US[server_]);
+        trans_->write(buf, sizeof(buf));
+        trans_->flush();
+        Guard g(statsMutex);
+        ++served[server_];
+      }
+    } catch (TTransportException& ttx) {}
+    trans_->close();
+  }
+
+ private:
+  shared_ptr<TTransport> trans_;
+  int server_;
+};
+
+/**
+ * Accepts connections for one stand-in backend.
+ */
+class Acceptor : public Runnable {
+ public:
+  Acceptor(shared_ptr<TServerSocket> server, int index)
+    : server_(server), index_(index) {}
+
+  void run() {
+    while (true) {
+      shared_ptr<TTransport> client = server_->accept();
+      {
+        Guard g(statsMutex);
+        ++accepts[index_];
+      }
+      threadFactory.newThread(
+        shared_ptr<Runnable>(new Handler(client, index_)))->start();
+    }
+  }
+
+ private:
+  shared_ptr<TServerSocket> server_;
+  int index_;
+};
+
+/**
+ * Makes a series of calls, opening and closing the pool for each one.
+ */
+class Client : public Runnable {
+ public:
+  Client(const vector< shared_ptr<TSocketPoolServer> >& servers,
+         bool p2c, bool keepAlive)
+    : servers_(servers), p2c_(p2c), keepAlive_(keepAlive) {}
+
+  void run() {
+    TSocketPool pool(servers_);
+    pool.setPowerOfTwoChoices(p2c_);
+    if (keepAlive_) {
+      pool.setKeepAlive(NUM_CLIENTS);
+    }
+
+    uint8_t buf[4] = { 'p', 'i', 'n', 'g' };
+    for (int i = 0; i < REQUESTS_PER_CLIENT; ++i) {
+      double start = nowUsec();
+      pool.open();
+      pool.write(buf, sizeof(buf));
+      pool.readAll(buf, sizeof(buf));
+      pool.close();
+      latencies_.push_back((nowUsec() - start) / 1000);
+    }
+  }
+
+  // in milliseconds
+  vector<double> latencies_;
+
+ private:
+  vector< shared_ptr<TSocketPoolServer> > servers_;
+  bool p2c_;
+  bool keepAlive_;
+};
+
+static void quietOutput(const char* /* msg */) {}
+
+int main(int argc, char** argv) {
+  int basePort = (argc > 1) ? atoi(argv[1]) : 9290;
+
+  // Handlers see their connections reset when clients close without
+  // lingering; that is expected here and not worth printing
+  facebook::thrift::GlobalOutput.setOutputFunction(quietOutput);
+
+  for (int i = 0; i < NUM_SERVERS; ++i) {
+    shared_ptr<TServerSocket> server(new TServerSocket(basePort + i));
+    server->listen();
+    threadFactory.newThread(
+      shared_ptr<Runnable>(new Acceptor(server, i)))->start();
+  }
+
+  cout << setw(16) << "policy" << setw(10) << "mean ms" << setw(10) << "p99 ms"
+       << setw(10) << "req/s" << setw(10) << "connects";
+  for (int i = 0; i < NUM_SERVERS; ++i) {
+    cout << setw(7) << "s" << i << "(" << (SERVER_DELAY_US[i] / 1000.0) << ")";
+  }
+  cout << endl;
+
+  PosixThreadFactory joinable;
+  joinable.setDetached(false);
+
+  for (int mode = 0; mode < 3; ++mode) {
+    bool p2c = (mode > 0);
+    bool keepAlive = (mode > 1);
+
+    // Every mode starts out knowing nothing about the servers
+    vector< shared_ptr<TSocketPoolServer> > servers;
+    for (int i = 0; i < NUM_SERVERS; ++i) {
+      servers.push_back(shared_ptr<TSocketPoolServer>(
+        new TSocketPoolServer("localhost", basePort + i)));
+    }
+    {
+      Guard g(statsMutex);
+      fill(accepts, accepts + NUM_SERVERS, 0);
+      fill(served, served + NUM_SERVERS, 0);
+    }
+
+    vector< shared_ptr<Client> > clients;
+    vector< shared_ptr<Thread> > threads;
+    double start = nowUsec();
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+      clients.push_back(shared_ptr<Client>(new Client(servers, p2c, keepAlive)));
+      threads.push_back(joinable.newThread(clients.back()));
+      threads.back()->start();
+    }
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+      threads[i]->join();
+    }
+    double elapsed = nowUsec() - start;
+
+    vector<double> all;
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+      all.insert(all.end(), clients[i]->latencies_.begin(), clients[i]->latencies_.end());
+    }
+    sort(all.begin(), all.end());
+    double mean = 0;
+    for (size_t i = 0; i < all.size(); ++i) {
+      mean += all[i];
+    }
+    mean /= all.size();
+
+    // Let the handlers of closed connections account for their last call
+    usleep(50 * 1000);
+
+    Guard g(statsMutex);
+    int connects = 0;
+    for (int i = 0; i < NUM_SERVERS; ++i) {
+      connects += accepts[i];
+    }
+    const char* name = (mode == 0) ? "random" : (mode == 1) ? "p2c" : "p2c+keepalive";
+    cout << setw(16) << name
+         << setw(10) << fixed << setprecision(2) << mean
+         << setw(10) << all[(all.size() * 99) / 100]
+         << setw(10) << (int)((all.size() * 1000000) / elapsed)
+         << setw(10) << connects;
+    for (int i = 0; i < NUM_SERVERS; ++i) {
+      cout << setw(12) << served[i];
+    }
+    cout << endl;
+  }
+
+  // The stand-in servers never shut down, so just leave
+  exit(0);
+}
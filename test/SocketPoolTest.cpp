@@ -0,0 +1,296 @@
+/*
+g++ -Wall -g -I../lib/cpp/src -I/usr/local/include/boost-1_33_1 \
+  SocketPoolTest.cpp ../lib/cpp/.libs/libthrift.a -lpthread \
+  -o SocketPoolTest
+./SocketPoolTest [port] 2> /dev/null
+*/
+
+// Checks TSocketPool's keep-alive pool against a local server that
+// answers each one byte request with the number of the connection it came
+// in on, so the client can tell which connection it is talking to.  A
+// connection closed with nothing in flight goes back to the pool and the
+// next open() reuses it; one the server has hung up on meanwhile is thrown
+// away and replaced; one closed with a reply still due, or beyond the
+// per-server limit, is really closed.  Also checks warmConnections(), and
+// that power of two choices steers away from a second server that accepts
+// connections but never answers.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <concurrency/Monitor.h>
+#include <concurrency/PosixThreadFactory.h>
+#include <transport/TServerSocket.h>
+#include <transport/TSocketPool.h>
+
+using namespace std;
+using namespace boost;
+using namespace facebook::thrift::concurrency;
+using namespace facebook::thrift::transport;
+
+// Requests: answer, or answer and hang up once the test says so
+static const uint8_t CALL = 'c';
+static const uint8_t CALL_THEN_HANG_UP = 'q';
+
+static PosixThreadFactory threadFactory;
+static Monitor monitor;
+static int accepted = 0;
+static int closed = 0;
+static bool hangUp = false;
+
+class Handler : public Runnable {
+ public:
+  Handler(shared_ptr<TTransport> trans, int32_t id)
+    : trans_(trans), id_(id) {}
+
+  void run() {
+    try {
+      while (true) {
+        uint8_t request;
+        trans_->readAll(&request, 1);
+        trans_->write((uint8_t*)&id_, 4);
+        trans_->flush();
+        if (request == CALL_THEN_HANG_UP) {
+          Synchronized s(monitor);
+          while (!hangUp) {
+            monitor.wait();
+          }
+          hangUp = false;
+          break;
+        }
+      }
+    } catch (TTransportException& ttx) {
+    }
+    trans_->close();
+    Synchronized s(monitor);
+    ++closed;
+    monitor.notifyAll();
+  }
+
+ private:
+  shared_ptr<TTransport> trans_;
+  int32_t id_;
+};
+
+// Never stops
+class Acceptor : public Runnable {
+ public:
+  Acceptor(shared_ptr<TServerSocket> server) : server_(server) {}
+
+  void run() {
+    while (true) {
+      shared_ptr<TTransport> trans = server_->accept();
+      int32_t id;
+      {
+        Synchronized s(monitor);
+        id = ++accepted;
+      }
+      threadFactory.newThread(
+        shared_ptr<Runnable>(new Handler(trans, id)))->start();
+    }
+  }
+
+ private:
+  shared_ptr<TServerSocket> server_;
+};
+
+// Accepts connections and never answers on them; never stops
+class BlackHole : public Runnable {
+ public:
+  BlackHole(shared_ptr<TServerSocket> server) : server_(server) {}
+
+  void run() {
+    vector<shared_ptr<TTransport> > held;
+    while (true) {
+      held.push_back(server_->accept());
+    }
+  }
+
+ private:
+  shared_ptr<TServerSocket> server_;
+};
+
+static int getAccepted() {
+  Synchronized s(monitor);
+  return accepted;
+}
+
+static int getClosed() {
+  Synchronized s(monitor);
+  return closed;
+}
+
+// Waits for the server to have accepted n connections
+static void waitForAccepted(int n) {
+  for (int tries = 0; getAccepted() < n; ++tries) {
+    assert(tries < 500);
+    usleep(10000);
+  }
+}
+
+// Waits for the server to have seen n connections close
+static void waitForClosed(int n) {
+  for (int tries = 0; getClosed() < n; ++tries) {
+    assert(tries < 500);
+    usleep(10000);
+  }
+}
+
+static int32_t call(TSocketPool& pool, uint8_t request = CALL) {
+  pool.write(&request, 1);
+  int32_t id;
+  pool.readAll((uint8_t*)&id, 4);
+  return id;
+}
+
+int main(int argc, char** argv) {
+  int port = (argc > 1) ? atoi(argv[1]) : 9790;
+  shared_ptr<TServerSocket> serverSocket(new TServerSocket(port));
+  serverSocket->listen();
+  threadFactory.newThread(
+    shared_ptr<Runnable>(new Acceptor(serverSocket)))->start();
+
+  vector<shared_ptr<TSocketPoolServer> > servers;
+  servers.push_back(shared_ptr<TSocketPoolServer>(
+    new TSocketPoolServer("localhost", port)));
+  shared_ptr<TSocketPoolServer> server = servers[0];
+
+  // Without keep-alive every open() is a new connection
+  {
+    TSocketPool pool(servers);
+    pool.open();
+    int32_t first = call(pool);
+    pool.close();
+    assert(server->getNumIdleSockets() == 0);
+    waitForClosed(1);
+    pool.open();
+    assert(call(pool) != first);
+    pool.close();
+    waitForClosed(2);
+  }
+
+  // With it, the connection is parked on close() and used again
+  TSocketPool pool(servers);
+  pool.setKeepAlive(2);
+  pool.open();
+  int32_t id = call(pool);
+  pool.close();
+  assert(!pool.isOpen());
+  assert(server->getNumIdleSockets() == 1);
+  int before = getAccepted();
+  pool.open();
+  assert(server->getNumIdleSockets() == 0);
+  assert(call(pool) == id);
+  assert(getAccepted() == before);
+
+  // The server hangs up on the parked connection; the next open() notices,
+  // drops it and connects again
+  assert(call(pool, CALL_THEN_HANG_UP) == id);
+  pool.close();
+  assert(server->getNumIdleSockets() == 1);
+  {
+    Synchronized s(monitor);
+    hangUp = true;
+    monitor.notifyAll();
+  }
+  waitForClosed(3);
+  pool.open();
+  assert(server->getNumIdleSockets() == 0);
+  int32_t replacement = call(pool);
+  assert(replacement != id);
+  assert(getAccepted() == before + 1);
+
+  // A connection with a reply still on the way is not parked
+  uint8_t request = CALL;
+  pool.write(&request, 1);
+  pool.close();
+  assert(server->getNumIdleSockets() == 0);
+  waitForClosed(4);
+
+  // warmConnections() fills the pool up front, and opens use what it made
+  before = getAccepted();
+  pool.warmConnections(2);
+  assert(server->getNumIdleSockets() == 2);
+  waitForAccepted(before + 2);
+  pool.open();
+  int32_t warmed = call(pool);
+  assert(warmed > before && warmed <= before + 2);
+  assert(getAccepted() == before + 2);
+
+  // Only two are kept: a third connection closed on top of them goes away
+  TSocketPool other(servers);
+  other.setKeepAlive(2);
+  TSocketPool third(servers);
+  third.setKeepAlive(2);
+  other.open();
+  third.open();
+  call(other);
+  call(third);
+  pool.close();
+  other.close();
+  assert(server->getNumIdleSockets() == 2);
+  third.close();
+  assert(server->getNumIdleSockets() == 2);
+  waitForClosed(5);
+
+  // A server that never answers: requests waiting on it raise its score
+  // even though it has no latency average yet
+  shared_ptr<TServerSocket> blackHoleSocket(new TServerSocket(port + 1));
+  blackHoleSocket->listen();
+  threadFactory.newThread(
+    shared_ptr<Runnable>(new BlackHole(blackHoleSocket)))->start();
+  shared_ptr<TSocketPoolServer> blackHole(
+    new TSocketPoolServer("localhost", port + 1));
+  vector<shared_ptr<TSocketPoolServer> > blackHoleOnly(1, blackHole);
+
+  double idleScore = blackHole->getLoadScore();
+  assert(idleScore > 0);
+  TSocketPool waiting1(blackHoleOnly);
+  TSocketPool waiting2(blackHoleOnly);
+  waiting1.open();
+  waiting2.open();
+  waiting1.write(&request, 1);
+  double score1 = blackHole->getLoadScore();
+  assert(score1 > idleScore);
+  waiting2.write(&request, 1);
+  assert(blackHole->getLoadScore() > score1);
+
+  // So picking between it and the server that answers goes to the latter
+  servers.push_back(blackHole);
+  assert(blackHole->getLoadScore() > server->getLoadScore());
+  for (int i = 0; i < 20; ++i) {
+    TSocketPool chooser(servers);
+    chooser.setPowerOfTwoChoices(true);
+    chooser.setRecvTimeout(1000);
+    chooser.open();
+    assert(chooser.getCurrentServer() == server);
+    call(chooser);
+    chooser.close();
+  }
+
+  // A request that times out counts the time waited as its latency, so the
+  // score stays high once nothing is outstanding any more
+  waiting1.setRecvTimeout(100);
+  waiting2.setRecvTimeout(100);
+  int32_t unused;
+  try {
+    waiting1.readAll((uint8_t*)&unused, 4);
+    assert(false);
+  } catch (TTransportException& ttx) {
+  }
+  try {
+    waiting2.readAll((uint8_t*)&unused, 4);
+    assert(false);
+  } catch (TTransportException& ttx) {
+  }
+  waiting1.close();
+  waiting2.close();
+  assert(blackHole->getLoadScore() >= 100 * 1000);
+  assert(blackHole->getLoadScore() > server->getLoadScore());
+
+  cout << "All tests passed." << endl;
+  return 0;
+}
@@ -90,5 +90,77 @@ int main(int argc, char** argv) {
     }
   }
 
+  {
+    using facebook::thrift::transport::TMemoryBuffer;
+    using facebook::thrift::transport::TBufferPool;
+    using facebook::thrift::protocol::TBinaryProtocol;
+    using boost::shared_ptr;
+    using std::string;
+
+    // Segmented buffers must look exactly like contiguous ones.  Segments
+    // of 16 bytes split the struct, and its string, many times over.
+    shared_ptr<TBufferPool> pool(new TBufferPool(16, 1024, 64));
+    shared_ptr<TMemoryBuffer> segBuffer(new TMemoryBuffer(pool, 16));
+    shared_ptr<TBinaryProtocol> segProtocol(new TBinaryProtocol(segBuffer));
+    assert(segBuffer->isSegmented());
+
+    thrift::test::Xtruct a;
+    a.i32_thing = 10;
+    a.i64_thing = 30;
+    for (int i = 0; i < 2000; ++i) {
+      a.string_thing += (char)('a' + i % 26);
+    }
+
+    uint32_t size = a.write(segProtocol.get());
+    assert(pool->getAcquiredBytes() >= size);
+
+    const struct iovec* iov;
+    int iovcnt;
+    segBuffer->getIovecs(&iov, &iovcnt);
+    assert(iovcnt == (int)((size + 15) / 16));
+    string gathered;
+    for (int i = 0; i < iovcnt; ++i) {
+      assert(iov[i].iov_len <= 16);
+      gathered.append((char*)iov[i].iov_base, iov[i].iov_len);
+    }
+
+    uint8_t* flat;
+    uint32_t flatLen;
+    segBuffer->getBuffer(&flat, &flatLen);
+    assert(flatLen == size);
+    assert(gathered == string((char*)flat, flatLen));
+    assert(gathered == segBuffer->getBufferAsString());
+
+    // The same bytes as a contiguous buffer gets
+    shared_ptr<TMemoryBuffer> contBuffer(new TMemoryBuffer());
+    TBinaryProtocol contProtocol(contBuffer);
+    a.write(&contProtocol);
+    assert(gathered == contBuffer->getBufferAsString());
+
+    // After part of it is read, the iovecs cover just the rest, starting
+    // in the middle of a segment
+    uint8_t head[21];
+    segBuffer->read(head, sizeof(head));
+    assert(string((char*)head, sizeof(head)) == gathered.substr(0, sizeof(head)));
+    segBuffer->getIovecs(&iov, &iovcnt);
+    string rest;
+    for (int i = 0; i < iovcnt; ++i) {
+      rest.append((char*)iov[i].iov_base, iov[i].iov_len);
+    }
+    assert(iov[0].iov_len == 16 - sizeof(head) % 16);
+    assert(rest == gathered.substr(sizeof(head)));
+
+    segBuffer->resetBuffer();
+    a.write(segProtocol.get());
+    thrift::test::Xtruct a2;
+    a2.read(segProtocol.get());
+    assert(a == a2);
+
+    // Reading everything hands the segments back to the pool
+    segBuffer->readEnd();
+    assert(pool->getAcquiredBytes() == 0);
+    assert(pool->getCachedBytes() > 0);
+  }
+
 
 }